@@ -6,19 +6,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+#include "tls.h"
 
 #define BUFF_SIZE 256
 
 static unsigned short port = 55555;
 
-void interact_with_server(int sfd)
+void interact_with_server(int sfd, SSL *ssl)
 {
 	char buffer[BUFF_SIZE] = {0};
+	char *password;
 	/* Wait til receiving "You are now connected.\nEnter username:" */
-	read(sfd, buffer, sizeof buffer);
+	conn_read(sfd, ssl, buffer, sizeof buffer - 1);
 	/* clear buffer */
 	memset(buffer, 0, sizeof buffer);
 
@@ -28,19 +33,82 @@ void interact_with_server(int sfd)
 	buffer[strlen(buffer) - 1] = '\0';
 
 	/* send username to server*/
-	write(sfd, buffer, strlen(buffer));
+	conn_write(sfd, ssl, buffer, strlen(buffer));
 
 	/* clear buffer */
 	memset(buffer, 0, sizeof buffer);
 	/* Wait til receiving server's response to username */
-	read(sfd, buffer, sizeof buffer);
+	conn_read(sfd, ssl, buffer, sizeof buffer - 1);
+
+	/* a server with a user db (-u) asks for the password as well */
+	if(strcmp(buffer, "Enter password:") == 0) {
+		/* read it without echoing it */
+		password = getpass("Enter your password: ");
+		conn_write(sfd, ssl, password, strlen(password));
+		memset(password, 0, strlen(password));
+		memset(buffer, 0, sizeof buffer);
+		conn_read(sfd, ssl, buffer, sizeof buffer - 1);
+	}
 	printf("%s\n", buffer);
 	return;
 }
 
-int main(void)
+/*
+* the session saved in @path for @host, or NULL. One saved for some
+* other host is no good: resuming, nobody looks at a certificate again,
+* so the one the session was made with has to be for @host
+*/
+static SSL_SESSION *load_session(const char *path, const char *host)
+{
+	SSL_SESSION *sess;
+	X509 *peer;
+	FILE *fp = fopen(path, "r");
+
+	if(fp == NULL)
+		return NULL;
+	sess = PEM_read_SSL_SESSION(fp, NULL, NULL, NULL);
+	fclose(fp);
+	if(sess == NULL)
+		return NULL;
+	peer = SSL_SESSION_get0_peer(sess);
+	if(peer == NULL || X509_check_host(peer, host, 0, 0, NULL) != 1) {
+		SSL_SESSION_free(sess);
+		return NULL;
+	}
+	return sess;
+}
+
+/* saves the session of @ssl in @path, readable by us alone: it holds its keys */
+static void save_session(SSL *ssl, const char *path)
+{
+	SSL_SESSION *sess = SSL_get1_session(ssl);
+	FILE *fp;
+	int fd;
+
+	if(sess == NULL)
+		return;
+	if(SSL_SESSION_is_resumable(sess)
+		&& (fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) != -1) {
+		if((fp = fdopen(fd, "w")) != NULL) {
+			PEM_write_SSL_SESSION(fp, sess);
+			fclose(fp);
+		} else {
+			close(fd);
+		}
+	}
+	SSL_SESSION_free(sess);
+}
+
+int main(int argc, char *argv[])
 {
 	int sockfd;
+	/* with -T <cert pem>, talk TLS to a server with that certificate */
+	SSL_CTX *ctx = NULL;
+	SSL *ssl = NULL;
+	SSL_SESSION *sess;
+	/* the name the certificate has to be for, and where to keep the ticket */
+	const char *host = "localhost", *session_file = NULL;
+	int opt;
 
 	/*
 	* struct sockaddr defines a socket address.
@@ -57,6 +125,30 @@ int main(void)
 	* of type stream. 0 indicates to system to choose appropriate
 	* protocol (eg: TCP)
 	*/
+	while((opt = getopt(argc, argv, "T:H:S:")) != -1) {
+		switch(opt) {
+		case 'T':
+			ctx = tls_client_ctx(optarg);
+			if(ctx == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		case 'H':
+			host = optarg;
+			break;
+		case 'S':
+			session_file = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-T cert pem [-H host] [-S session file]]\n",
+				argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if(optind != argc) {
+		fprintf(stderr, "usage: %s [-T cert pem [-H host] [-S session file]]\n",
+			argv[0]);
+		exit(EXIT_FAILURE);
+	}
 	sockfd = socket(AF_INET, SOCK_STREAM, 0);
 
 	/*
@@ -110,9 +202,34 @@ int main(void)
 	/* makes connection per the socket address */
 	connect(sockfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr));
 
-	interact_with_server(sockfd);
+	/* the handshake, the server's certificate has to check out */
+	if(ctx) {
+		ssl = tls_client(ctx, sockfd, host);
+		if(ssl == NULL) {
+			fprintf(stderr, "%s\n", "bad host name");
+			exit(EXIT_FAILURE);
+		}
+		/* with -S, resume the session of the last run */
+		if(session_file && (sess = load_session(session_file, host)) != NULL) {
+			SSL_set_session(ssl, sess);
+			SSL_SESSION_free(sess);
+		}
+		if(SSL_connect(ssl) != 1) {
+			fprintf(stderr, "%s\n", "TLS handshake failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	interact_with_server(sockfd, ssl);
 
 	/* close socket since we are done */
+	if(ssl) {
+		/* the ticket came in along with the prompt, keep it for next run */
+		if(session_file)
+			save_session(ssl, session_file);
+		SSL_shutdown(ssl);
+		SSL_free(ssl);
+	}
 	close(sockfd);
 
 	return 0;
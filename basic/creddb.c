@@ -0,0 +1,176 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include "creddb.h"
+
+/*
+* FNV-1a of the name. The file is sorted and indexed by it, so it is
+* part of the format: mkcreddb and the server must hash names alike
+*/
+unsigned int cred_hash(const char *name)
+{
+	unsigned int h = 2166136261U;
+
+	while(*name) {
+		h ^= (unsigned char)*name++;
+		h *= 16777619U;
+	}
+	return h;
+}
+
+void cred_derive(const char *secret, const unsigned char *salt,
+	unsigned int iterations, unsigned char *key)
+{
+	PKCS5_PBKDF2_HMAC(secret, strlen(secret), salt, CRED_SALT_LEN,
+		iterations, EVP_sha256(), CRED_KEY_LEN, key);
+}
+
+/*
+* a derived key against the one kept for the user, all CRED_KEY_LEN
+* bytes of it every time: a login fails no sooner for a first byte off
+*/
+static int same_key(const unsigned char *a, const unsigned char *b)
+{
+	unsigned char diff = 0;
+	int i;
+
+	for(i = 0; i < CRED_KEY_LEN; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+struct creddb *creddb_open(const char *path)
+{
+	struct creddb *db;
+	struct stat st;
+	size_t slots, i;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	db = calloc(1, sizeof *db);
+	fstat(fd, &st);
+	db->size = st.st_size;
+	if(db->size < sizeof *db->hdr
+		|| (db->map = mmap(NULL, db->size, PROT_READ, MAP_SHARED, fd, 0))
+			== MAP_FAILED) {
+		fprintf(stderr, "%s: no user database\n", path);
+		close(fd);
+		free(db);
+		return NULL;
+	}
+	/* the mapping stays when the file is closed */
+	close(fd);
+	db->hdr = db->map;
+	slots = ((size_t)1 << db->hdr->index_bits) + 1;
+	if(memcmp(db->hdr->magic, CRED_MAGIC, sizeof db->hdr->magic)
+		|| db->hdr->index_bits > 31
+		|| db->size != sizeof *db->hdr + slots * sizeof *db->index
+			+ (size_t)db->hdr->nr_users * sizeof *db->recs) {
+		fprintf(stderr, "%s: no user database\n", path);
+		creddb_close(db);
+		return NULL;
+	}
+	db->index = (const unsigned int *)(db->hdr + 1);
+	db->recs = (const struct cred *)(db->index + slots);
+	/*
+	* a lookup reads the records from one slot to the next as they say:
+	* slots out of order, or past the records, would have it read past
+	* the end of the mapping
+	*/
+	for(i = 0; i + 1 < slots && db->index[i] <= db->index[i + 1]; i++)
+		;
+	if(i + 1 < slots || db->index[slots - 1] != db->hdr->nr_users) {
+		fprintf(stderr, "%s: a broken user database\n", path);
+		creddb_close(db);
+		return NULL;
+	}
+	/*
+	* a login reads a page or two, anywhere in the file: reading
+	* ahead of it would only read pages nobody asked for
+	*/
+	madvise(db->map, db->size, MADV_RANDOM);
+
+	RAND_bytes(db->dummy.salt, CRED_SALT_LEN);
+	RAND_bytes(db->dummy.key, CRED_KEY_LEN);
+	RAND_bytes(db->pepper, CRED_SALT_LEN);
+	db->md = EVP_MD_CTX_new();
+	return db;
+}
+
+void creddb_close(struct creddb *db)
+{
+	EVP_MD_CTX_free(db->md);
+	munmap(db->map, db->size);
+	free(db);
+}
+
+const struct cred *creddb_find(const struct creddb *db, const char *name)
+{
+	unsigned int h, slot, i, end;
+
+	if(strlen(name) >= CRED_NAME_MAX)
+		return NULL;
+	h = cred_hash(name);
+	/* a shift by 32 is undefined, an index of one slot takes all */
+	slot = db->hdr->index_bits ? h >> (32 - db->hdr->index_bits) : 0;
+	end = db->index[slot + 1];
+	for(i = db->index[slot]; i < end; i++)
+		if(db->recs[i].hash == h
+			&& strncmp(db->recs[i].name, name, CRED_NAME_MAX) == 0)
+			return &db->recs[i];
+	return NULL;
+}
+
+/* the cheap hash of @secret the hot cache keeps */
+static void fast_hash(struct creddb *db, const char *secret,
+	unsigned char *out)
+{
+	EVP_DigestInit_ex(db->md, EVP_sha256(), NULL);
+	EVP_DigestUpdate(db->md, db->pepper, CRED_SALT_LEN);
+	EVP_DigestUpdate(db->md, secret, strlen(secret));
+	EVP_DigestFinal_ex(db->md, out, NULL);
+}
+
+int creddb_check(struct creddb *db, const char *name, const char *secret)
+{
+	const struct cred *rec = creddb_find(db, name);
+	unsigned char key[CRED_KEY_LEN], fast[CRED_KEY_LEN];
+	struct cred_cached *c = NULL;
+	int ok;
+
+	if(rec) {
+		c = &db->cache[rec->hash % CRED_CACHE_SLOTS];
+		if(c->rec == rec) {
+			fast_hash(db, secret, fast);
+			if(same_key(fast, c->fast)) {
+				db->hits++;
+				return 1;
+			}
+		}
+	}
+	db->misses++;
+
+	cred_derive(secret, rec ? rec->salt : db->dummy.salt,
+		db->hdr->iterations, key);
+	ok = same_key(key, rec ? rec->key : db->dummy.key) && rec;
+	if(!ok)
+		return 0;
+	/* in with it, over whoever had the slot */
+	c->rec = rec;
+	fast_hash(db, secret, c->fast);
+	return 1;
+}
@@ -0,0 +1,106 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef CREDDB_H
+#define CREDDB_H
+
+#include <stddef.h>
+#include <openssl/evp.h>
+
+/*
+* The users the server lets in, and their secrets.
+*
+* A user database is a file made beforehand by mkcreddb, laid out the
+* way the server looks things up in it, so that all the server does at
+* start is map it and check that its index stays within it: no parsing,
+* no building of anything, be it a thousand users or ten million. The mapping is made before any worker is forked
+* and is read-only, so every worker looks in the same pages of the page
+* cache, and only the pages some login actually touched are ever read.
+*
+* The file is a header, an index and the records:
+* - a record is a name, a salt and a key, the secret run through
+*   PBKDF2-HMAC-SHA256 with the salt that many iterations. The secret
+*   itself is in no file, a stolen copy is good for guessing only,
+*   guess by costly guess.
+* - the records are sorted by a hash of the name. The index has a slot
+*   for every value of the top @index_bits bits of the hash, with the
+*   first record whose hash starts with them: the records of a name are
+*   from its slot to the next, one or two of them with about as many
+*   slots as users. A lookup reads two slots and a record or so, a page
+*   or two of the file however big it is.
+* Numbers are in the byte order of the host that made the file.
+*
+* Checking a secret derives a key the way mkcreddb did and compares the
+* two in constant time. A name nobody has is checked all the same,
+* against a made-up record, so a login takes as long whether the name
+* is somebody's or not.
+*
+* The hot cache: every process has a small table of the users that got
+* in lately, with a cheap hash of the secret they got in with, salted
+* with a pepper made up at random when the file was mapped. A user
+* coming back with that same secret costs one SHA-256 instead of the
+* whole PBKDF2. A wrong secret is never in the cache, and always costs
+* the whole of it. The cache is the process's own: a worker of -w or -P
+* keeps it from login to login, a child forked for one login does not.
+*/
+
+#define CRED_MAGIC "creddb1\n"
+/* names are '\0' padded to this, the '\0' included */
+#define CRED_NAME_MAX 28
+#define CRED_SALT_LEN 16
+#define CRED_KEY_LEN 32
+/* users in the hot cache of every process */
+#define CRED_CACHE_SLOTS 4096
+
+struct cred_header {
+	char magic[8];
+	unsigned int nr_users;
+	unsigned int iterations;
+	unsigned int index_bits;
+	unsigned int unused;
+};
+
+struct cred {
+	unsigned int hash;
+	char name[CRED_NAME_MAX];
+	unsigned char salt[CRED_SALT_LEN];
+	unsigned char key[CRED_KEY_LEN];
+};
+
+struct cred_cached {
+	/* the record of the user, NULL for a free slot */
+	const struct cred *rec;
+	unsigned char fast[CRED_KEY_LEN];
+};
+
+struct creddb {
+	void *map;
+	size_t size;
+	const struct cred_header *hdr;
+	/* (1 << index_bits) + 1 slots, the last one is @nr_users */
+	const unsigned int *index;
+	const struct cred *recs;
+	/* what a name nobody has is checked against */
+	struct cred dummy;
+	unsigned char pepper[CRED_SALT_LEN];
+	EVP_MD_CTX *md;
+	struct cred_cached cache[CRED_CACHE_SLOTS];
+	unsigned long hits, misses;
+};
+
+/* the hash records are sorted by, of the '\0' ended @name */
+unsigned int cred_hash(const char *name);
+/* derive the key of @secret with @salt, @iterations times over */
+void cred_derive(const char *secret, const unsigned char *salt,
+	unsigned int iterations, unsigned char *key);
+
+/* map the user database at @path. returns NULL if it is none */
+struct creddb *creddb_open(const char *path);
+void creddb_close(struct creddb *db);
+/* the record of @name, NULL if nobody has that name */
+const struct cred *creddb_find(const struct creddb *db, const char *name);
+/* is @secret that of @name. returns 1 if it is, 0 if not or no such user */
+int creddb_check(struct creddb *db, const char *name, const char *secret);
+
+#endif
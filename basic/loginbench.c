@@ -0,0 +1,268 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "tls.h"
+
+/*
+* loginbench hammers the server with logins.
+* -c threads each connect, wait for the prompt, send a username, wait
+* for the verdict and hang up, over and over for -d secs, the way a crowd
+* of clients reconnecting all at once would. It prints logins per second
+* and how long a login took, from connect() to the verdict.
+* With -T the logins are over TLS, handshake included. Every thread keeps
+* the session ticket of its last login and resumes with it, the way a
+* client coming back would, unless -F has every handshake be a full one.
+* Against a server with a user db (-u), every login answers the password
+* prompt too: with -s for the one -u user, or, with -n, each login is one
+* of the first that many users mkcreddb -n made up, picked at random.
+*/
+
+#define BUFF_SIZE 256
+
+static unsigned short port = 55555;
+static int nr_threads = 16;
+static double duration = 5;
+static const char *username = "arjun024";
+static const char *secret = "";
+static unsigned int nr_users = 0;
+static SSL_CTX *ctx = NULL;
+static int full_handshakes = 0;
+
+static unsigned long stop_ns;
+
+struct worker {
+	pthread_t thread;
+	/* how long each login took, in ns */
+	unsigned long *lat;
+	size_t nr, size;
+	unsigned long failed;
+	/* with -T: the ticket to resume with, and how many logins did */
+	SSL_SESSION *ticket;
+	unsigned long resumed;
+	/* with -n, picks who logs in next */
+	unsigned int seed;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* the TLS end of @sockfd, connected and resuming when it can */
+static SSL *handshake(struct worker *w, int sockfd)
+{
+	/* it logs in on this machine, the certificate has to be for it */
+	SSL *ssl = tls_client(ctx, sockfd, "localhost");
+
+	if(ssl == NULL)
+		return NULL;
+	if(w->ticket)
+		SSL_set_session(ssl, w->ticket);
+	if(SSL_connect(ssl) != 1) {
+		SSL_free(ssl);
+		return NULL;
+	}
+	if(SSL_session_reused(ssl))
+		w->resumed++;
+	return ssl;
+}
+
+/* one login, returns 0 if the server said yes */
+static int login(struct worker *w)
+{
+	struct sockaddr_in serv_addr;
+	struct linger lg;
+	char buffer[BUFF_SIZE], name[32], pass[32];
+	const char *user = username, *password = secret;
+	int sockfd, one = 1, ret = -1;
+	ssize_t n = 0;
+	SSL *ssl = NULL;
+
+	if(nr_users) {
+		/* RAND_MAX is 2^31 - 1 on glibc, more users than anybody makes */
+		sprintf(name, "user%u", rand_r(&w->seed) % nr_users);
+		sprintf(pass, "secret%s", name + 4);
+		user = name;
+		password = pass;
+	}
+
+	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	memset(&serv_addr, 0, sizeof serv_addr);
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(port);
+	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+	if(connect(sockfd, (struct sockaddr *)&serv_addr, sizeof serv_addr) == 0
+		&& (ctx == NULL || (ssl = handshake(w, sockfd)) != NULL)
+		&& conn_read(sockfd, ssl, buffer, sizeof buffer) > 0
+		&& conn_write(sockfd, ssl, user, strlen(user)) > 0)
+		n = conn_read(sockfd, ssl, buffer, sizeof buffer);
+	/* a server with a user db asks for the password before it tells */
+	if(n == 15 && strncmp(buffer, "Enter password:", 15) == 0
+		&& conn_write(sockfd, ssl, password, strlen(password)) > 0)
+		n = conn_read(sockfd, ssl, buffer, sizeof buffer);
+	if(n >= 22 && strncmp(buffer, "Authentication success", 22) == 0)
+		ret = 0;
+
+	if(ssl) {
+		/* the ticket came in along with the prompt, keep it for next time */
+		if(ret == 0 && !full_handshakes) {
+			if(w->ticket)
+				SSL_SESSION_free(w->ticket);
+			w->ticket = SSL_get1_session(ssl);
+		}
+		/*
+		* no close_notify before the RST. Told it was sent all the same,
+		* OpenSSL does not take the session for a broken one, and the
+		* ticket stays good.
+		*/
+		SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+		SSL_free(ssl);
+	}
+
+	/*
+	* hang up with a RST rather than a FIN: no TIME_WAIT is left
+	* behind, which would run us out of local ports in seconds
+	*/
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(sockfd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+	close(sockfd);
+	return ret;
+}
+
+void *login_loop(void *arg)
+{
+	struct worker *w = (struct worker *)arg;
+	unsigned long start;
+
+	while((start = now_ns()) < stop_ns) {
+		if(login(w) < 0) {
+			w->failed++;
+			continue;
+		}
+		if(w->nr == w->size) {
+			w->size = w->size ? 2 * w->size : 1024;
+			w->lat = realloc(w->lat, w->size * sizeof *w->lat);
+		}
+		w->lat[w->nr++] = now_ns() - start;
+	}
+	return NULL;
+}
+
+static int cmp_ulong(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* the @p th percentile of the @n sorted latencies, in usecs */
+static double percentile(unsigned long *lat, size_t n, double p)
+{
+	size_t i = n * p / 100;
+
+	if(i >= n)
+		i = n - 1;
+	return lat[i] / 1e3;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-c threads] [-d secs] [-u username [-s secret]"
+		" | -n users] [-p port] [-T cert pem [-F]]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	unsigned long *lat, failed = 0, resumed = 0;
+	size_t n = 0;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "c:d:u:s:n:p:T:F")) != -1) {
+		switch(opt) {
+		case 'c':
+			nr_threads = atoi(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'u':
+			username = optarg;
+			break;
+		case 's':
+			secret = optarg;
+			break;
+		case 'n':
+			nr_users = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'T':
+			ctx = tls_client_ctx(optarg);
+			if(ctx == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		case 'F':
+			full_handshakes = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(nr_threads < 1 || duration <= 0)
+		usage(argv[0]);
+
+	workers = calloc(nr_threads, sizeof *workers);
+	stop_ns = now_ns() + duration * 1e9;
+	for(i = 0; i < nr_threads; i++) {
+		workers[i].seed = i * 2654435761U + time(NULL);
+		pthread_create(&workers[i].thread, NULL, login_loop, &workers[i]);
+	}
+	for(i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		n += workers[i].nr;
+		failed += workers[i].failed;
+		resumed += workers[i].resumed;
+	}
+
+	/* all the latencies in one sorted array */
+	lat = malloc((n + 1) * sizeof *lat);
+	for(n = 0, i = 0; i < nr_threads; i++) {
+		memcpy(lat + n, workers[i].lat, workers[i].nr * sizeof *lat);
+		n += workers[i].nr;
+	}
+	qsort(lat, n, sizeof *lat, cmp_ulong);
+
+	printf("%d threads, %.0fs", nr_threads, duration);
+	if(nr_users)
+		printf(", as any of %u users", nr_users);
+	printf("\n");
+	printf("logins %lu (%.0f/sec), %lu failed\n", (unsigned long)n,
+		n / duration, failed);
+	if(ctx)
+		printf("TLS handshakes: %lu resumed, %lu full\n", resumed,
+			n + failed - resumed);
+	if(n == 0)
+		return 0;
+	printf("usecs  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+		percentile(lat, n, 50), percentile(lat, n, 90),
+		percentile(lat, n, 99), percentile(lat, n, 99.9), lat[n - 1] / 1e3);
+	return 0;
+}
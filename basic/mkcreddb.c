@@ -0,0 +1,229 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <openssl/rand.h>
+#include "creddb.h"
+
+/*
+* mkcreddb makes the user database the server maps with -u (see creddb.h)
+* out of a file of "name:secret" lines, or, with -n, out of that many
+* made-up users user0, user1, ... with the secrets secret0, secret1, ...
+* for loginbench to log in as. Deriving the keys is nearly all of the
+* work, it is shared out among threads, all cores at once.
+*/
+
+/* records a thread takes at a time, a few ms of deriving at least */
+#define DERIVE_BATCH 64
+
+struct derive_job {
+	struct cred *recs;
+	/* the secret of every record, NULL with -n */
+	char **secrets;
+	unsigned int nr, iterations;
+	unsigned int next;
+};
+
+static void *derive_worker(void *arg)
+{
+	struct derive_job *job = arg;
+	char made_up[32];
+	const char *secret;
+	unsigned int i, end;
+
+	while((i = __sync_fetch_and_add(&job->next, DERIVE_BATCH)) < job->nr) {
+		end = i + DERIVE_BATCH < job->nr ? i + DERIVE_BATCH : job->nr;
+		for(; i < end; i++) {
+			if(job->secrets) {
+				secret = job->secrets[i];
+			} else {
+				sprintf(made_up, "secret%u", i);
+				secret = made_up;
+			}
+			RAND_bytes(job->recs[i].salt, CRED_SALT_LEN);
+			cred_derive(secret, job->recs[i].salt, job->iterations,
+				job->recs[i].key);
+		}
+	}
+	return NULL;
+}
+
+static void derive_all(struct derive_job *job, int threads)
+{
+	pthread_t *tids;
+	int i;
+
+	tids = malloc(threads * sizeof *tids);
+	/* the calling thread is one of them */
+	for(i = 1; i < threads; i++)
+		pthread_create(&tids[i], NULL, derive_worker, job);
+	derive_worker(job);
+	for(i = 1; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+}
+
+static int cmp_cred(const void *a, const void *b)
+{
+	const struct cred *x = a, *y = b;
+
+	if(x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return strncmp(x->name, y->name, CRED_NAME_MAX);
+}
+
+/* read the "name:secret" lines of @path. returns how many, or -1 */
+static int read_users(const char *path, struct derive_job *job)
+{
+	char line[512], *colon;
+	unsigned int size = 0;
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL) {
+		perror(path);
+		return -1;
+	}
+	job->nr = 0;
+	while(fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\r\n")] = '\0';
+		colon = strchr(line, ':');
+		if(colon == NULL || colon - line >= CRED_NAME_MAX || colon == line) {
+			fprintf(stderr, "%s: not a name of 1 to %d chars and a secret: %s\n",
+				path, CRED_NAME_MAX - 1, line);
+			fclose(f);
+			return -1;
+		}
+		*colon = '\0';
+		if(job->nr == size) {
+			size = size ? 2 * size : 1024;
+			job->recs = realloc(job->recs, size * sizeof *job->recs);
+			job->secrets = realloc(job->secrets, size * sizeof *job->secrets);
+		}
+		memset(&job->recs[job->nr], 0, sizeof *job->recs);
+		strcpy(job->recs[job->nr].name, line);
+		job->secrets[job->nr] = strdup(colon + 1);
+		job->nr++;
+	}
+	fclose(f);
+	return job->nr;
+}
+
+/* the header, the index and the records, sorted, into @path */
+static int write_db(const char *path, const struct derive_job *job)
+{
+	struct cred_header hdr;
+	unsigned int *index, slot, bits = 0, i;
+	FILE *f;
+
+	/* about as many slots as users, one or two records a slot */
+	while(bits < 31 && (1U << bits) < job->nr)
+		bits++;
+	index = malloc((((size_t)1 << bits) + 1) * sizeof *index);
+	for(slot = 0, i = 0; slot <= (1U << bits); slot++) {
+		while(i < job->nr && bits
+			&& job->recs[i].hash >> (32 - bits) < slot)
+			i++;
+		index[slot] = slot == (1U << bits) ? job->nr : i;
+	}
+
+	memset(&hdr, 0, sizeof hdr);
+	memcpy(hdr.magic, CRED_MAGIC, sizeof hdr.magic);
+	hdr.nr_users = job->nr;
+	hdr.iterations = job->iterations;
+	hdr.index_bits = bits;
+
+	f = fopen(path, "w");
+	if(f == NULL
+		|| fwrite(&hdr, sizeof hdr, 1, f) != 1
+		|| fwrite(index, sizeof *index, ((size_t)1 << bits) + 1, f)
+			!= ((size_t)1 << bits) + 1
+		|| fwrite(job->recs, sizeof *job->recs, job->nr, f) != job->nr
+		|| fclose(f) != 0) {
+		free(index);
+		return -1;
+	}
+	free(index);
+	return 0;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [-t threads] [-o user db]"
+		" users file | -n users\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct derive_job job;
+	struct timespec t0, t1;
+	const char *db_path = "users.db";
+	long made_up = -1;
+	unsigned int i;
+	int opt, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double secs;
+
+	memset(&job, 0, sizeof job);
+	job.iterations = 1000;
+	while((opt = getopt(argc, argv, "i:t:o:n:")) != -1) {
+		switch(opt) {
+		case 'i':
+			job.iterations = atoi(optarg);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			db_path = optarg;
+			break;
+		case 'n':
+			made_up = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if((made_up < 0) == (optind == argc) || optind < argc - 1
+		|| threads < 1 || job.iterations < 1 || made_up > 100000000)
+		usage(argv[0]);
+
+	if(made_up >= 0) {
+		job.nr = made_up;
+		job.recs = calloc(job.nr + 1, sizeof *job.recs);
+		for(i = 0; i < job.nr; i++)
+			sprintf(job.recs[i].name, "user%u", i);
+	} else if(read_users(argv[optind], &job) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	derive_all(&job, threads);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	/* the secrets go by the index of their record: sort only now */
+	for(i = 0; i < job.nr; i++)
+		job.recs[i].hash = cred_hash(job.recs[i].name);
+	qsort(job.recs, job.nr, sizeof *job.recs, cmp_cred);
+	for(i = 1; i < job.nr; i++) {
+		if(cmp_cred(&job.recs[i - 1], &job.recs[i]) == 0) {
+			fprintf(stderr, "%s is in there twice\n", job.recs[i].name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(write_db(db_path, &job) < 0) {
+		perror(db_path);
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: %u users, %u iterations\n", db_path, job.nr, job.iterations);
+	printf("derived the keys in %.3f s with %d threads, %.0f users/sec\n",
+		secs, threads, secs > 0 ? job.nr / secs : 0.0);
+	return 0;
+}
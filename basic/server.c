@@ -8,33 +8,177 @@
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "tls.h"
+#include "creddb.h"
 
 #define BUFF_SIZE 256
+/* how many clients a worker is logging in at the same time at most */
+#define WORKER_CLIENTS 1024
+/* the first slot of a worker's poll set that is a client, see worker() */
+#define FIRST_CLIENT 2
+/* how long a worker waits for a client to say its next thing before giving up */
+#define LOGIN_TIMEOUT 5
 
 static unsigned short port = 55555;
 
+/*
+* @listen_backlog - how many connections the kernel holds for us until we
+*                   accept() them, SYNs beyond that are dropped
+* @defer_accept   - with TCP_DEFER_ACCEPT set to this many secs, a connection
+*                   is only handed to us once the client has sent something.
+*                   Here the server speaks first, so that only happens when
+*                   the secs are up: it is for trying out, not for speed.
+* @nr_workers     - 0 for the classic single listener forking for each client,
+*                   else as many long-lived worker processes
+* @prefork        - 0: (-w) each worker has a listener of its own bound to the
+*                   same port with SO_REUSEPORT. The kernel spreads connections
+*                   among them, and each worker serves those it accepted itself.
+*                   1: (-P) the workers are pre-forked off one listener and all
+*                   accept() from it, serving one client at a time each.
+*/
+static int listen_backlog = SOMAXCONN;
+static int defer_accept = 0;
+static int nr_workers = 0;
+static int prefork = 0;
+
+/* with -T, every client talks TLS, see tls.h */
+static SSL_CTX *ctx = NULL;
+/*
+* with -u, the users and their secrets, see creddb.h.
+* Without, the one user there is is arjun024, and no secret is asked for.
+*/
+static struct creddb *db = NULL;
+
+/* what a client is told: the prompts, and whether it got in */
+#define GREETING "You are now connected.\nEnter username:"
+#define ASK_SECRET "Enter password:"
+#define AUTH_OK "Authentication success"
+#define AUTH_FAILED "Authentication failed"
+
+/* prompt a freshly connected client for its username */
+void greet_client(int cfd, SSL *ssl)
+{
+	conn_write(cfd, ssl, GREETING, strlen(GREETING));
+}
+
+/* and, with -u, for its secret once it said its name */
+void ask_secret(int cfd, SSL *ssl)
+{
+	conn_write(cfd, ssl, ASK_SECRET, strlen(ASK_SECRET));
+}
+
+/* read a reply of the client into @buffer. returns 0, or -1 if none came */
+int read_reply(int cfd, SSL *ssl, char *buffer)
+{
+	ssize_t n = conn_read(cfd, ssl, buffer, BUFF_SIZE - 1);
+
+	if(n <= 0)
+		return -1;
+	buffer[n] = '\0';
+	return 0;
+}
+
+/* @name gave @secret, NULL without -u: returns what it is told */
+const char *verdict(const char *name, const char *secret)
+{
+	int ok;
+
+	if(db)
+		ok = creddb_check(db, name, secret);
+	else
+		ok = strcmp(name, "arjun024") == 0;
+	if(!ok) {
+		printf("A user tried to login using: %s\n", name);
+		return AUTH_FAILED;
+	}
+	printf("%s has logged in.\n", name);
+	return AUTH_OK;
+}
+
+/* let @name in, or not, and tell it */
+void judge_client(int cfd, SSL *ssl, const char *name, const char *secret)
+{
+	const char *reply = verdict(name, secret);
+
+	conn_write(cfd, ssl, reply, strlen(reply));
+}
+
+/* read the username the client replied with, and its secret with -u */
+void login_client(int cfd, SSL *ssl)
+{
+	char name[BUFF_SIZE], secret[BUFF_SIZE];
+
+	if(read_reply(cfd, ssl, name) < 0)
+		return;
+	if(db == NULL) {
+		judge_client(cfd, ssl, name, NULL);
+		return;
+	}
+	ask_secret(cfd, ssl);
+	if(read_reply(cfd, ssl, secret) < 0)
+		return;
+	judge_client(cfd, ssl, name, secret);
+	/* a secret is not left lying around on the stack */
+	memset(secret, 0, sizeof secret);
+}
+
+/*
+* new_tls() - the TLS end of @cfd, NULL without -T.
+* end_tls() - say goodbye over it, and free it
+*/
+SSL *new_tls(int cfd)
+{
+	SSL *ssl;
+	int one = 1;
+
+	if(ctx == NULL)
+		return NULL;
+	/*
+	* the session ticket and the prompt are written one after the other,
+	* Nagle would hold the prompt back until the client acks the ticket
+	*/
+	setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, cfd);
+	return ssl;
+}
+
+void end_tls(SSL *ssl)
+{
+	if(ssl == NULL)
+		return;
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+}
+
 void serve_client(int cfd)
 {
-	char buffer[BUFF_SIZE] = {0};
-	write(cfd, "You are now connected.\nEnter username:", 38);
-	/* wait for username */
-	read(cfd, buffer, BUFF_SIZE);
+	SSL *ssl = new_tls(cfd);
 
-	if(strcmp(buffer, "arjun024")) {
-		write(cfd, "Authentication failed", 21);
-		printf("A user tried to login using: %s\n", buffer);
+	/* a blocking socket, the handshake is done in one go */
+	if(ssl && SSL_accept(ssl) != 1) {
+		SSL_free(ssl);
 		return;
 	}
-	write(cfd, "Authentication success", 22);
-	printf("%s has logged in.\n", buffer);
-	return;
+	greet_client(cfd, ssl);
+	login_client(cfd, ssl);
+	end_tls(ssl);
 }
 
-int main(void)
+/* open a socket listening on @port, one per worker with -w */
+int open_listener(void)
 {
-	int sockfd, client_sockfd;
-	pid_t pid;
+	int sockfd, one = 1;
 
 	/*
 	* struct sockaddr defines a socket address.
@@ -44,9 +188,7 @@ int main(void)
 	* just a wrapper around struct sockaddr.
 	* Funtions like bind() etc are only aware of struct sockaddr.
 	*/
-	struct sockaddr_in serv_addr, client_addr;
-	unsigned int supplied_len;
-	unsigned int *ip_suppliedlen_op_storedlen;
+	struct sockaddr_in serv_addr;
 
 	/*
 	* creates a socket of family Internet sockets (AF_INET) and
@@ -88,14 +230,466 @@ int main(void)
 		memcpy(&serv_addr, filler, sizeof(serv_addr));
 	*/
 
+	/*
+	* let a restarted server bind the port right away, and
+	* with -w let every worker bind it too
+	*/
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if(nr_workers && !prefork)
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+
 	/* binds a socket to an address */
-	bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
+	if(bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+
+	if(defer_accept)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			&defer_accept, sizeof defer_accept);
 
 	/*
 	* allows the process to listen on the socket for given
 	* max number of connections
 	*/
-	listen(sockfd, 5);
+	listen(sockfd, listen_backlog);
+	return sockfd;
+}
+
+/* a client a worker of -w is logging in */
+struct login {
+	SSL *ssl;
+	/* with -u, its name once it said it, while its secret is awaited */
+	char name[BUFF_SIZE];
+	/* when its time for the step it is at is up */
+	time_t deadline;
+	/* what it is being told, how much of that went out already */
+	const char *out;
+	size_t outoff;
+	/* it is hung up on once that went out */
+	int last;
+	/* with -u, its secret while the checker has it, NULL otherwise */
+	struct check *check;
+};
+
+/*
+* say the rest of what @c is being told, as much as its socket @pfd
+* takes now. returns 1 once all of it went out, and it is to be read
+* from again; 0 if the rest waits for the socket, polled for that;
+* -1 if the connection is no good, or @c is done with
+*/
+int say_more(struct pollfd *pfd, struct login *c)
+{
+	size_t len = strlen(c->out);
+	ssize_t n;
+
+	while(c->outoff < len) {
+		n = conn_write_some(pfd->fd, c->ssl, c->out + c->outoff,
+			len - c->outoff, &pfd->events);
+		if(n == 0)
+			return 0;
+		if(n < 0)
+			return -1;
+		c->outoff += n;
+	}
+	c->out = NULL;
+	pfd->events = POLLIN;
+	return c->last ? -1 : 1;
+}
+
+/* start telling @c @text, @last for the last thing it is told */
+int say(struct pollfd *pfd, struct login *c, const char *text, int last)
+{
+	c->out = text;
+	c->outoff = 0;
+	c->last = last;
+	/* its time starts once it was asked, the telling included */
+	c->deadline = time(NULL) + LOGIN_TIMEOUT;
+	return say_more(pfd, c);
+}
+
+/*
+* A secret a worker of -w hands its checker thread. PBKDF2 takes as long
+* as it was made to: done in the poll() loop, it would keep every other
+* client of the worker waiting through it, login after login.
+*/
+struct check {
+	char name[BUFF_SIZE], secret[BUFF_SIZE];
+	/* what the client is told, once checked */
+	const char *reply;
+};
+
+/* a worker's checks on their way to its checker, and back */
+static int check_fds[2], checked_fds[2];
+
+/*
+* The checker thread of a worker: it alone looks in the user database,
+* hot cache and all, one check at a time. A check is a pointer down a
+* pipe, written in one go however many there are
+*/
+void *checker(void *arg)
+{
+	struct check *ck;
+
+	while(read(check_fds[0], &ck, sizeof ck) == sizeof ck) {
+		ck->reply = verdict(ck->name, ck->secret);
+		memset(ck->secret, 0, sizeof ck->secret);
+		write(checked_fds[1], &ck, sizeof ck);
+	}
+	return NULL;
+}
+
+/* hang up on client @i of the @nfds in the table, the last one takes its place */
+void drop_login(struct pollfd *pfds, struct login *logins, int i, int *nfds)
+{
+	end_tls(logins[i].ssl);
+	close(pfds[i].fd);
+	--*nfds;
+	pfds[i] = pfds[*nfds];
+	logins[i] = logins[*nfds];
+}
+
+/*
+* the checks the checker is done with: tell each client what became of it.
+* While checked, a client's fd was flipped to ~fd, which poll() passes over
+*/
+void checks_done(struct pollfd *pfds, struct login *logins, int *nfds)
+{
+	struct check *ck;
+	int i;
+
+	while(read(checked_fds[0], &ck, sizeof ck) == sizeof ck) {
+		for(i = FIRST_CLIENT; i < *nfds && logins[i].check != ck; i++)
+			;
+		pfds[i].fd = ~pfds[i].fd;
+		logins[i].check = NULL;
+		if(say(&pfds[i], &logins[i], ck->reply, 1) < 0)
+			drop_login(pfds, logins, i, nfds);
+		free(ck);
+	}
+}
+
+/*
+* A worker process of -w.
+* It accepts on a listener of its own and logs in every client it
+* accepted itself, from a poll() loop over all of them, rather than
+* forking for each: a login is one read away, a fork costs far more.
+* With -T a client is greeted once its handshake is done, which takes
+* a few trips through the loop. With -u the name and the secret come
+* in one after the other, and the secret goes to the checker thread of
+* the worker, for the poll() loop to go on meanwhile: pfds[1] is where
+* the checked ones come back. Whatever a client is told goes out as its
+* socket takes it, a full socket or TLS wanting to write leaves the
+* rest to go out once poll() says it may: a client is only closed on
+* once it was told all. @logins has where each client is at.
+* A client has LOGIN_TIMEOUT secs for each of those steps: one that
+* connects and says nothing must not sit in the table for good, a
+* table full of them takes nobody in.
+*/
+void worker(void)
+{
+	struct pollfd pfds[WORKER_CLIENTS + FIRST_CLIENT];
+	static struct login logins[WORKER_CLIENTS + FIRST_CLIENT];
+	struct login *c;
+	char buffer[BUFF_SIZE];
+	time_t now, first;
+	pthread_t thread;
+	int listenfd, client_sockfd, nfds = FIRST_CLIENT, i, ret, timeout;
+
+	listenfd = open_listener();
+	/* so that taking in everybody waiting stops once there is nobody */
+	fcntl(listenfd, F_SETFL, O_NONBLOCK);
+	pfds[0].fd = listenfd;
+	pfds[0].events = POLLIN;
+	/*
+	* A client has one check out at most, and the table holds far fewer
+	* clients than a pipe does pointers: neither end ever blocks writing
+	*/
+	pfds[1].fd = -1;
+	pfds[1].events = POLLIN;
+	if(db) {
+		pipe2(check_fds, O_CLOEXEC);
+		pipe2(checked_fds, O_CLOEXEC | O_NONBLOCK);
+		pfds[1].fd = checked_fds[0];
+		pthread_create(&thread, NULL, checker, NULL);
+	}
+
+	while(1) {
+		/*
+		* with the table full the listener stays readable, poll() would
+		* come back at once for somebody who cannot be taken in anyway
+		*/
+		pfds[0].events = nfds < WORKER_CLIENTS + FIRST_CLIENT ? POLLIN : 0;
+		/* wake up for the first client whose time is up */
+		for(first = 0, i = FIRST_CLIENT; i < nfds; i++)
+			if(!logins[i].check && (first == 0 || logins[i].deadline < first))
+				first = logins[i].deadline;
+		now = time(NULL);
+		timeout = first == 0 ? -1 : first > now ? (first - now) * 1000 : 0;
+		if(poll(pfds, nfds, timeout) < 0)
+			continue;
+
+		if(pfds[1].revents & POLLIN)
+			checks_done(pfds, logins, &nfds);
+		/* clients that said something, back to front as we go */
+		now = time(NULL);
+		for(i = nfds - 1; i >= FIRST_CLIENT; i--) {
+			c = &logins[i];
+			ret = -1;
+			if(pfds[i].revents == 0) {
+				/*
+				* one that said nothing in time makes room for others.
+				* One being checked waits for us, not we for it
+				*/
+				if(now < c->deadline || c->check)
+					continue;
+			} else if(c->out) {
+				ret = say_more(&pfds[i], c);
+			} else if(c->ssl && !SSL_is_init_finished(c->ssl)) {
+				ret = tls_accept(c->ssl, &pfds[i].events);
+				if(ret > 0)
+					ret = say(&pfds[i], c, GREETING, 0);
+			} else if(read_reply(pfds[i].fd, c->ssl, buffer) < 0) {
+				/* it hung up, or had nothing to say after all */
+			} else if(db == NULL) {
+				ret = say(&pfds[i], c, verdict(buffer, NULL), 1);
+			} else if(c->name[0] == '\0') {
+				strcpy(c->name, buffer);
+				if(c->name[0] != '\0')
+					ret = say(&pfds[i], c, ASK_SECRET, 0);
+			} else {
+				c->check = malloc(sizeof *c->check);
+				strcpy(c->check->name, c->name);
+				strcpy(c->check->secret, buffer);
+				memset(buffer, 0, sizeof buffer);
+				write(check_fds[1], &c->check, sizeof c->check);
+				pfds[i].fd = ~pfds[i].fd;
+				continue;
+			}
+			if(ret >= 0)
+				continue;
+			drop_login(pfds, logins, i, &nfds);
+		}
+
+		if(!(pfds[0].revents & POLLIN))
+			continue;
+		/* take in everybody waiting, as far as there is room */
+		while(nfds < WORKER_CLIENTS + FIRST_CLIENT) {
+			client_sockfd = accept4(listenfd, NULL, NULL,
+				SOCK_NONBLOCK | SOCK_CLOEXEC);
+			if(client_sockfd < 0)
+				break;
+			pfds[nfds].fd = client_sockfd;
+			pfds[nfds].events = POLLIN;
+			pfds[nfds].revents = 0;
+			c = &logins[nfds];
+			memset(c, 0, sizeof *c);
+			/* the client speaks first in TLS, its ClientHello */
+			c->ssl = new_tls(client_sockfd);
+			c->deadline = now + LOGIN_TIMEOUT;
+			if(c->ssl == NULL && say(&pfds[nfds], c, GREETING, 0) < 0) {
+				close(client_sockfd);
+				continue;
+			}
+			nfds++;
+		}
+	}
+}
+
+/*
+* A worker process of -P.
+* All of them block in accept() on the one listener they inherited from
+* the supervisor and the kernel hands each connection to one of them.
+* The worker serves that client and comes back for the next one, so a
+* login costs no fork at all, only the worker's turn.
+*/
+void prefork_worker(int sockfd)
+{
+	struct timeval tv;
+	int client_sockfd;
+
+	/*
+	* a worker serves one client at a time: one that never says its
+	* name must not keep the worker from everybody else forever
+	*/
+	tv.tv_sec = LOGIN_TIMEOUT;
+	tv.tv_usec = 0;
+
+	while(1) {
+		client_sockfd = accept(sockfd, NULL, NULL);
+		if(client_sockfd < 0)
+			continue;
+		setsockopt(client_sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+		serve_client(client_sockfd);
+		close(client_sockfd);
+	}
+}
+
+/* fork a worker of the kind asked for, serving from @sockfd with -P */
+pid_t spawn_worker(int sockfd)
+{
+	pid_t pid;
+
+	pid = fork();
+	if(pid != 0)
+		return pid;
+	/* child: don't outlive the supervisor, the port would stay taken */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+	if(getppid() == 1)
+		exit(EXIT_SUCCESS);
+	if(prefork)
+		prefork_worker(sockfd);
+	else
+		worker();
+	exit(EXIT_SUCCESS);
+}
+
+/*
+* Start @nr_workers workers and keep them going:
+* one that dies, be it a crash or a kill, is replaced by a fresh one.
+* A worker that dies within a second of being started is probably going
+* to do it again, so wait a bit before trying once more.
+*/
+void supervise(int sockfd)
+{
+	pid_t *pids, pid;
+	time_t *started;
+	int i, status;
+
+	pids = calloc(nr_workers, sizeof *pids);
+	started = calloc(nr_workers, sizeof *started);
+	/* whatever is buffered would be printed by every worker */
+	fflush(stdout);
+	for(i = 0; i < nr_workers; i++) {
+		pids[i] = spawn_worker(sockfd);
+		started[i] = time(NULL);
+	}
+
+	while(1) {
+		pid = wait(&status);
+		if(pid < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		for(i = 0; i < nr_workers && pids[i] != pid; i++)
+			;
+		if(i == nr_workers)
+			continue;
+
+		if(WIFSIGNALED(status))
+			fprintf(stderr, "worker %d killed by signal %d, restarting it\n",
+				(int)pid, WTERMSIG(status));
+		else
+			fprintf(stderr, "worker %d exited with %d, restarting it\n",
+				(int)pid, WEXITSTATUS(status));
+		if(time(NULL) - started[i] < 1)
+			sleep(1);
+		pids[i] = spawn_worker(sockfd);
+		started[i] = time(NULL);
+	}
+}
+
+/*
+* In fork mode, every child that is done with its client is left a zombie
+* until somebody wait()s for it. Reap them as they finish.
+*/
+void reap_children(int sig)
+{
+	int saved_errno = errno;
+
+	while(waitpid(-1, NULL, WNOHANG) > 0)
+		;
+	errno = saved_errno;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-w workers | -P workers] [-b listen backlog]"
+		" [-D defer accept secs] [-p port] [-T cert and key pem]"
+		" [-u user db]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int sockfd, client_sockfd, opt;
+	pid_t pid;
+	struct sigaction sa;
+	struct timespec t0, t1;
+	struct sockaddr_in client_addr;
+	unsigned int supplied_len;
+	unsigned int *ip_suppliedlen_op_storedlen;
+
+	while((opt = getopt(argc, argv, "w:P:b:D:p:T:u:")) != -1) {
+		switch(opt) {
+		case 'w':
+			nr_workers = atoi(optarg);
+			prefork = 0;
+			break;
+		case 'P':
+			nr_workers = atoi(optarg);
+			prefork = 1;
+			break;
+		case 'b':
+			listen_backlog = atoi(optarg);
+			break;
+		case 'D':
+			defer_accept = atoi(optarg);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'T':
+			ctx = tls_server_ctx(optarg);
+			if(ctx == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		case 'u':
+			/*
+			* mapped before anything is forked, every process
+			* looks in the same pages
+			*/
+			clock_gettime(CLOCK_MONOTONIC, &t0);
+			db = creddb_open(optarg);
+			if(db == NULL)
+				exit(EXIT_FAILURE);
+			clock_gettime(CLOCK_MONOTONIC, &t1);
+			fprintf(stderr, "%s: %u users, %.1f MB mapped in %.0f usecs\n",
+				optarg, db->hdr->nr_users, db->size / 1e6,
+				(t1.tv_sec - t0.tv_sec) * 1e6 + (t1.tv_nsec - t0.tv_nsec) / 1e3);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(nr_workers < 0)
+		usage(argv[0]);
+	/*
+	* a client that hung up before our close_notify went out
+	* must not take the process down with SIGPIPE
+	*/
+	if(ctx)
+		signal(SIGPIPE, SIG_IGN);
+
+	/* -w workers open their own listeners, the others share this one */
+	sockfd = -1;
+	if(!nr_workers || prefork)
+		sockfd = open_listener();
+
+	if(nr_workers) {
+		supervise(sockfd);
+		return 0;
+	}
+
+	/*
+	* SA_RESTART: accept() carries on by itself
+	* rather than failing with EINTR whenever a child is reaped
+	*/
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = reap_children;
+	sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+	sigaction(SIGCHLD, &sa, NULL);
 
 	/*
 	* This ptr on input specifies the length of the supplied sockaddr,
@@ -117,6 +711,8 @@ int main(void)
 		*/
 		client_sockfd = accept(sockfd, (struct sockaddr*) &client_addr,
 							ip_suppliedlen_op_storedlen);
+		if(client_sockfd < 0)
+			continue;
 
 		pid = fork();
 
@@ -0,0 +1,119 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+SSL_CTX *tls_server_ctx(const char *pem)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if(SSL_CTX_use_certificate_chain_file(ctx, pem) != 1
+		|| SSL_CTX_use_PrivateKey_file(ctx, pem, SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	/* tickets only, there is no cache on the server to share among workers */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	/* a client logs in once per connection, one ticket will do */
+	SSL_CTX_set_num_tickets(ctx, 1);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	return ctx;
+}
+
+SSL_CTX *tls_client_ctx(const char *ca)
+{
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	if(SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) {
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	return ctx;
+}
+
+SSL *tls_client(SSL_CTX *ctx, int fd, const char *host)
+{
+	SSL *ssl = SSL_new(ctx);
+
+	SSL_set_fd(ssl, fd);
+	/* SNI, and the name the certificate has to be for */
+	if(SSL_set_tlsext_host_name(ssl, host) != 1
+		|| SSL_set1_host(ssl, host) != 1) {
+		SSL_free(ssl);
+		return NULL;
+	}
+	return ssl;
+}
+
+int tls_accept(SSL *ssl, short *events)
+{
+	int ret = SSL_accept(ssl);
+
+	if(ret == 1)
+		return 1;
+	switch(SSL_get_error(ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		*events = POLLIN;
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		*events = POLLOUT;
+		return 0;
+	}
+	return -1;
+}
+
+ssize_t conn_read(int fd, SSL *ssl, void *buf, size_t len)
+{
+	if(ssl == NULL)
+		return read(fd, buf, len);
+	return SSL_read(ssl, buf, len);
+}
+
+ssize_t conn_write(int fd, SSL *ssl, const void *buf, size_t len)
+{
+	if(ssl == NULL)
+		return write(fd, buf, len);
+	return SSL_write(ssl, buf, len);
+}
+
+ssize_t conn_write_some(int fd, SSL *ssl, const void *buf, size_t len,
+	short *events)
+{
+	ssize_t n;
+	int ret;
+
+	if(ssl == NULL) {
+		/* a client that hung up must not take the worker down with SIGPIPE */
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+			*events = POLLOUT;
+			return 0;
+		}
+		return n;
+	}
+	ret = SSL_write(ssl, buf, len);
+	if(ret > 0)
+		return ret;
+	switch(SSL_get_error(ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		*events = POLLIN;
+		return 0;
+	case SSL_ERROR_WANT_WRITE:
+		*events = POLLOUT;
+		return 0;
+	}
+	return -1;
+}
@@ -0,0 +1,55 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+/*
+* TLS for the server and its clients, on top of OpenSSL.
+*
+* The server has its certificate and key in one PEM file, a client
+* trusts the certificate in a PEM file of its own: for a self-signed
+* one, that is the server's certificate itself.
+*
+* Session tickets: once a client is in, the server hands it a ticket,
+* the secrets of the session sealed with a key only the server knows.
+* A client that comes back with it resumes the session, with no
+* certificate and no signature, which is most of what a handshake costs.
+* The server keeps nothing for that. The key is made along with the
+* context, before any worker is forked, so every process of the server
+* takes the tickets of every other.
+*
+* kTLS: once the handshake is done, OpenSSL hands the keys to the
+* kernel where it can (the tls module is loaded), and the kernel does
+* the encrypting and decrypting right in the socket. SSL_read() and
+* SSL_write() then come down to a read() and a write().
+*/
+
+SSL_CTX *tls_server_ctx(const char *pem);
+SSL_CTX *tls_client_ctx(const char *ca);
+/*
+* a client end on @fd, not yet connected. Trusting the CA is not
+* enough, the certificate has to be for @host as well
+*/
+SSL *tls_client(SSL_CTX *ctx, int fd, const char *host);
+/*
+* a step of the handshake of @ssl, without blocking.
+* returns 1 once it is done, -1 if it failed, 0 if it waits for the
+* socket, with what to poll() for in @events
+*/
+int tls_accept(SSL *ssl, short *events);
+/* read() and write() on @fd, or through @ssl unless it is NULL */
+ssize_t conn_read(int fd, SSL *ssl, void *buf, size_t len);
+ssize_t conn_write(int fd, SSL *ssl, const void *buf, size_t len);
+/*
+* conn_write() for a non-blocking @fd. returns how much went out, 0 if
+* nothing could yet, with what to poll() for in @events, -1 on an error
+*/
+ssize_t conn_write_some(int fd, SSL *ssl, const void *buf, size_t len,
+	short *events);
+
+#endif
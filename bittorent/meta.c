@@ -0,0 +1,200 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <openssl/evp.h>
+#include "meta.h"
+
+/*
+* Pieces are hashed by several threads at once, each taking the next
+* piece nobody took yet off a shared counter, until there are none left.
+* A piece is a few hundred KB: one atomic add per piece is nothing.
+*/
+struct hash_job {
+	const struct meta *m;
+	const unsigned char *data;
+	/* the digest of piece i goes to out + i * hash_len */
+	unsigned char *out;
+	volatile unsigned int next;
+};
+
+static const EVP_MD *algo_md(enum hash_algo algo)
+{
+	return algo == HASH_SHA256 ? EVP_sha256() : EVP_sha1();
+}
+
+size_t piece_len(const struct meta *m, unsigned int i)
+{
+	unsigned long long start = (unsigned long long)i * m->piece_size;
+
+	return m->length - start < m->piece_size ? m->length - start : m->piece_size;
+}
+
+static void hash_piece(EVP_MD_CTX *ctx, const struct meta *m,
+	const unsigned char *data, unsigned int i, unsigned char *md)
+{
+	EVP_DigestInit_ex(ctx, algo_md(m->algo), NULL);
+	EVP_DigestUpdate(ctx, data + (unsigned long long)i * m->piece_size,
+		piece_len(m, i));
+	EVP_DigestFinal_ex(ctx, md, NULL);
+}
+
+static void *hash_worker(void *arg)
+{
+	struct hash_job *job = arg;
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	unsigned int i;
+
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->m->nr_pieces)
+		hash_piece(ctx, job->m, job->data, i, job->out + i * job->m->hash_len);
+	EVP_MD_CTX_free(ctx);
+	return NULL;
+}
+
+/* hash every piece of @data into @out, @threads at once */
+static void hash_pieces(const struct meta *m, const unsigned char *data,
+	unsigned char *out, int threads)
+{
+	struct hash_job job;
+	pthread_t *tids;
+	int i;
+
+	job.m = m;
+	job.data = data;
+	job.out = out;
+	job.next = 0;
+	if(threads < 1)
+		threads = 1;
+	tids = malloc(threads * sizeof *tids);
+	/* the calling thread is one of them */
+	for(i = 1; i < threads; i++)
+		pthread_create(&tids[i], NULL, hash_worker, &job);
+	hash_worker(&job);
+	for(i = 1; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+}
+
+/* the info hash names the content: the SHA-1 of all the piece hashes */
+static void info_hash(struct meta *m)
+{
+	EVP_Digest(m->hashes, (size_t)m->nr_pieces * m->hash_len, m->info_hash,
+		NULL, EVP_sha1(), NULL);
+}
+
+static int meta_init(struct meta *m, const char *name, unsigned long long length,
+	unsigned int piece_size, enum hash_algo algo)
+{
+	if(piece_size == 0 || piece_size % BLOCK_SIZE)
+		return -1;
+	memset(m, 0, sizeof *m);
+	strncpy(m->name, name, sizeof m->name - 1);
+	m->length = length;
+	m->piece_size = piece_size;
+	m->nr_pieces = (length + piece_size - 1) / piece_size;
+	m->algo = algo;
+	m->hash_len = EVP_MD_size(algo_md(algo));
+	m->hashes = malloc((size_t)m->nr_pieces * m->hash_len + 1);
+	return 0;
+}
+
+int meta_create(struct meta *m, const char *name, const unsigned char *data,
+	unsigned long long length, unsigned int piece_size, enum hash_algo algo,
+	int threads)
+{
+	if(meta_init(m, name, length, piece_size, algo) < 0)
+		return -1;
+	hash_pieces(m, data, m->hashes, threads);
+	info_hash(m);
+	return 0;
+}
+
+int meta_write(const struct meta *m, const char *path)
+{
+	FILE *f = fopen(path, "w");
+	int ret;
+
+	if(f == NULL)
+		return -1;
+	fprintf(f, "swarm-meta 1 %s %u %llu %s\n",
+		m->algo == HASH_SHA256 ? "sha256" : "sha1",
+		m->piece_size, m->length, m->name);
+	fwrite(m->hashes, m->hash_len, m->nr_pieces, f);
+	ret = ferror(f) ? -1 : 0;
+	if(fclose(f) != 0)
+		ret = -1;
+	return ret;
+}
+
+int meta_read(struct meta *m, const char *path)
+{
+	char line[64 + META_NAME_MAX], algo[16], *name;
+	unsigned long long length;
+	unsigned int piece_size;
+	int version, i;
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL)
+		return -1;
+	if(fgets(line, sizeof line, f) == NULL
+		|| sscanf(line, "swarm-meta %d %15s %u %llu", &version, algo,
+			&piece_size, &length) != 4 || version != 1
+		|| (strcmp(algo, "sha1") && strcmp(algo, "sha256"))) {
+		fclose(f);
+		return -1;
+	}
+	/* the name is the rest of the line, spaces and all */
+	name = line;
+	for(i = 0; i < 5 && name; i++)
+		name = strchr(name + 1, ' ');
+	if(name == NULL || meta_init(m, name + 1, length, piece_size,
+		strcmp(algo, "sha256") == 0 ? HASH_SHA256 : HASH_SHA1) < 0) {
+		fclose(f);
+		return -1;
+	}
+	m->name[strcspn(m->name, "\n")] = '\0';
+	if(fread(m->hashes, m->hash_len, m->nr_pieces, f) != m->nr_pieces) {
+		meta_free(m);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	info_hash(m);
+	return 0;
+}
+
+void meta_free(struct meta *m)
+{
+	free(m->hashes);
+	m->hashes = NULL;
+}
+
+int piece_ok(const struct meta *m, const unsigned char *data, unsigned int i)
+{
+	unsigned char md[HASH_MAX_LEN];
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+
+	hash_piece(ctx, m, data, i, md);
+	EVP_MD_CTX_free(ctx);
+	return memcmp(md, m->hashes + i * m->hash_len, m->hash_len) == 0;
+}
+
+unsigned int meta_check(const struct meta *m, const unsigned char *data,
+	unsigned char *have, int threads)
+{
+	unsigned char *mds = malloc((size_t)m->nr_pieces * m->hash_len + 1);
+	unsigned int i, good = 0;
+
+	hash_pieces(m, data, mds, threads);
+	for(i = 0; i < m->nr_pieces; i++) {
+		have[i] = memcmp(mds + i * m->hash_len, m->hashes + i * m->hash_len,
+			m->hash_len) == 0;
+		good += have[i];
+	}
+	free(mds);
+	return good;
+}
@@ -0,0 +1,65 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef META_H
+#define META_H
+
+#include <stddef.h>
+
+/*
+* What a peer needs to know of the content before it has any of it: its
+* name and length, how it is split into pieces, and the hash of every
+* piece, to tell a good piece from a bad one as soon as it is in.
+* It lives in a file of its own, made by mkmeta: a line of text
+*   swarm-meta 1 <sha1|sha256> <piece size> <length> <name>
+* and the hashes right after it, one after the other.
+* The info hash, the SHA-1 of all the piece hashes, names the content:
+* peers only talk about content they both have the same info hash of.
+*/
+
+#define META_NAME_MAX 256
+/* pieces are sent in blocks of this much, a piece is a whole number of them */
+#define BLOCK_SIZE (16 * 1024)
+#define HASH_MAX_LEN 32
+#define INFO_HASH_LEN 20
+
+enum hash_algo { HASH_SHA1, HASH_SHA256 };
+
+struct meta {
+	char name[META_NAME_MAX];
+	unsigned long long length;
+	unsigned int piece_size;
+	unsigned int nr_pieces;
+	enum hash_algo algo;
+	int hash_len;
+	/* @nr_pieces hashes of @hash_len bytes */
+	unsigned char *hashes;
+	unsigned char info_hash[INFO_HASH_LEN];
+};
+
+/*
+* the meta of the @length bytes at @data, in pieces of @piece_size,
+* hashed by @threads threads at once. returns 0, or -1 for a piece size
+* that is no multiple of the block size
+*/
+int meta_create(struct meta *m, const char *name, const unsigned char *data,
+	unsigned long long length, unsigned int piece_size, enum hash_algo algo,
+	int threads);
+int meta_write(const struct meta *m, const char *path);
+/* returns 0, or -1 if @path is no meta file */
+int meta_read(struct meta *m, const char *path);
+void meta_free(struct meta *m);
+
+/* the length of piece @i, the last one may be short */
+size_t piece_len(const struct meta *m, unsigned int i);
+/* does piece @i of the content at @data have the hash it should */
+int piece_ok(const struct meta *m, const unsigned char *data, unsigned int i);
+/*
+* check every piece of the content at @data, @threads at once, and mark
+* the good ones in @have, one byte per piece. returns how many are good
+*/
+unsigned int meta_check(const struct meta *m, const unsigned char *data,
+	unsigned char *have, int threads);
+
+#endif
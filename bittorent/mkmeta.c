@@ -0,0 +1,107 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "meta.h"
+
+/*
+* mkmeta splits a file into pieces, hashes them, all cores at once,
+* and writes what peers need to know of it to <file>.meta (see meta.h)
+*/
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s piece KB] [-a sha1|sha256] [-t threads]"
+		" [-o meta file] file\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct meta m;
+	struct timespec t0, t1;
+	struct stat sb;
+	unsigned char *data;
+	char out[4096];
+	const char *path, *name, *meta_path = NULL;
+	unsigned int piece_kb = 256;
+	enum hash_algo algo = HASH_SHA1;
+	int opt, fd, threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double secs;
+
+	while((opt = getopt(argc, argv, "s:a:t:o:")) != -1) {
+		switch(opt) {
+		case 's':
+			piece_kb = atoi(optarg);
+			break;
+		case 'a':
+			if(strcmp(optarg, "sha1") == 0)
+				algo = HASH_SHA1;
+			else if(strcmp(optarg, "sha256") == 0)
+				algo = HASH_SHA256;
+			else
+				usage(argv[0]);
+			break;
+		case 't':
+			threads = atoi(optarg);
+			break;
+		case 'o':
+			meta_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || threads < 1)
+		usage(argv[0]);
+	path = argv[optind];
+	if(meta_path == NULL) {
+		snprintf(out, sizeof out, "%s.meta", path);
+		meta_path = out;
+	}
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0 || fstat(fd, &sb) < 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if(sb.st_size == 0) {
+		fprintf(stderr, "%s: nothing in there to share\n", path);
+		exit(EXIT_FAILURE);
+	}
+	data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if(data == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	/* read ahead of the hashing threads, they go through it once */
+	madvise(data, sb.st_size, MADV_SEQUENTIAL);
+	name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if(meta_create(&m, name, data, sb.st_size, piece_kb * 1024, algo, threads) < 0) {
+		fprintf(stderr, "a piece is a multiple of %d KB\n", BLOCK_SIZE / 1024);
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	if(meta_write(&m, meta_path) < 0) {
+		perror(meta_path);
+		exit(EXIT_FAILURE);
+	}
+	printf("%s: %u pieces of %u KB, %s\n", meta_path, m.nr_pieces, piece_kb,
+		algo == HASH_SHA256 ? "sha256" : "sha1");
+	printf("hashed %.1f MB in %.3f s with %d threads, %.2f GB/s\n",
+		m.length / 1e6, secs, threads, secs > 0 ? m.length / secs / 1e9 : 0.0);
+	meta_free(&m);
+	return 0;
+}
@@ -0,0 +1,104 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include "swarm.h"
+
+/*
+* peer is one peer of a swarm (see swarm.h): it seeds the file with -s,
+* else it downloads it, from every peer it is connected to, and serves
+* what it got so far to them too. It dials the peers given with -c, and
+* takes in those that dial it, until -n of them came.
+*/
+
+#define MAX_PEERS 256
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s -m meta file -f file [-s] [-p port]"
+		" [-c host:port,...] [-n peers] [-w depth] [-t threads]\n"
+		"  -s  seed: the file is all there already\n"
+		"  -c  peers to dial, a port alone is one on this host\n"
+		"  -n  peers there are to serve besides us (default as many as -c)\n"
+		"  -w  blocks of %d KB in flight per peer (default 32)\n",
+		prog, BLOCK_SIZE / 1024);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct sockaddr_in peers[MAX_PEERS];
+	struct swarm_config cfg;
+	struct swarm_stats st;
+	struct meta m;
+	const char *meta_path = NULL;
+	int opt, ret;
+
+	memset(&cfg, 0, sizeof cfg);
+	cfg.port = 6881;
+	cfg.depth = 32;
+	cfg.expect = -1;
+	cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	cfg.peers = peers;
+	while((opt = getopt(argc, argv, "m:f:sp:c:n:w:t:")) != -1) {
+		switch(opt) {
+		case 'm':
+			meta_path = optarg;
+			break;
+		case 'f':
+			cfg.path = optarg;
+			break;
+		case 's':
+			cfg.seed = 1;
+			break;
+		case 'p':
+			cfg.port = atoi(optarg);
+			break;
+		case 'c':
+			cfg.nr_peers = parse_peers(optarg, peers, MAX_PEERS);
+			if(cfg.nr_peers < 0)
+				usage(argv[0]);
+			break;
+		case 'n':
+			cfg.expect = atoi(optarg);
+			break;
+		case 'w':
+			cfg.depth = atoi(optarg);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(meta_path == NULL || cfg.path == NULL || cfg.depth < 1)
+		usage(argv[0]);
+	if(cfg.expect < 0)
+		cfg.expect = cfg.nr_peers;
+	if(meta_read(&m, meta_path) < 0) {
+		fprintf(stderr, "%s: no meta file\n", meta_path);
+		exit(EXIT_FAILURE);
+	}
+	cfg.meta = &m;
+	/* a peer hanging up while we write to it is no reason to die */
+	signal(SIGPIPE, SIG_IGN);
+
+	ret = swarm_run(&cfg, &st);
+	if(st.check_secs > 0)
+		printf("checked %.1f MB in %.3f s, %.2f GB/s\n", m.length / 1e6,
+			st.check_secs, m.length / st.check_secs / 1e9);
+	printf("downloaded %.1f MB in %.3f s (%.1f MB/s), uploaded %.1f MB,"
+		" %u bad pieces\n", st.downloaded / 1e6, st.secs,
+		st.secs > 0 ? st.downloaded / st.secs / 1e6 : 0.0,
+		st.uploaded / 1e6, st.bad_pieces);
+	if(ret < 0)
+		fprintf(stderr, "%s\n", "the swarm is gone, and some pieces with it");
+	meta_free(&m);
+	return ret < 0 ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,709 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "swarm.h"
+
+#define MAX_EVENTS 64
+/* the most a peer may ask for in one request */
+#define REQUEST_MAX (128 * 1024)
+/* the peers we dial may not be listening yet, give them a while */
+#define DIAL_TRIES 100
+#define DIAL_WAIT_MS 50
+/* a message header: length and type, and for MSG_PIECE piece and offset */
+#define MSG_HDR_LEN 5
+#define PIECE_HDR_LEN 13
+
+enum piece_state { PIECE_MISSING, PIECE_ACTIVE, PIECE_HAVE };
+
+/* a block a peer asked for, to go out once the bytes queued before it did */
+struct block {
+	struct block *next;
+	/* where in the stream of bytes to the peer it goes */
+	unsigned long long at;
+	off_t off;
+	size_t left;
+};
+
+struct conn {
+	int fd;
+	/* the peer's handshake is in */
+	int up;
+	/* what the peer has, one byte per piece, and how many */
+	unsigned char *has;
+	unsigned int nr_has;
+
+	/*
+	* reading: the header of a message, then its body. The body of a
+	* MSG_PIECE is read right where the block goes in the mapping, any
+	* other into @msg
+	*/
+	unsigned char hdr[HANDSHAKE_LEN];
+	size_t hdr_len, hdr_got;
+	unsigned char *body;
+	size_t body_len, body_got;
+	unsigned char *msg;
+	size_t msg_cap;
+	/* the block being read, -1 for one we did not ask for */
+	int block_piece;
+
+	/*
+	* writing: the bytes of our messages, and the blocks of the file that
+	* go out in between them, each at its place in the stream. @queued is
+	* the length of the stream so far, @sent what went out of it
+	*/
+	unsigned char *out;
+	size_t out_off, out_len, out_cap;
+	unsigned long long queued, sent;
+	struct block *blocks, **blocks_tail;
+
+	/* the piece we ask it for, the offset of its next block, blocks asked for */
+	int piece;
+	size_t next_off;
+	int in_flight;
+
+	struct conn *next;
+};
+
+struct swarm {
+	const struct swarm_config *cfg;
+	const struct meta *m;
+	struct swarm_stats *st;
+	/* the file, and all of it mapped */
+	int fd;
+	unsigned char *map;
+	int epfd, listenfd;
+	/* per piece: where it is at, who we asked for it, how much of it is in */
+	unsigned char *state;
+	struct conn **owner;
+	size_t *got;
+	/* per piece: how many of our peers have it */
+	unsigned int *avail;
+	unsigned int nr_have;
+	struct conn *conns;
+	/* peers that came up, whether still connected or not */
+	int seen;
+	unsigned int seed;
+};
+
+static double now_secs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static size_t bitfield_len(const struct meta *m)
+{
+	return (m->nr_pieces + 7) / 8;
+}
+
+/* @len bytes to the end of what goes to the peer */
+static void out_put(struct conn *c, const void *buf, size_t len)
+{
+	if(c->out_len + len > c->out_cap) {
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+		while(c->out_len + len > c->out_cap)
+			c->out_cap *= 2;
+		c->out = realloc(c->out, c->out_cap);
+	}
+	memcpy(c->out + c->out_len, buf, len);
+	c->out_len += len;
+	c->queued += len;
+}
+
+/* a message of type @id with @nr numbers in it, and @extra bytes to follow */
+static void put_msg(struct conn *c, int id, const unsigned int *nums, int nr,
+	size_t extra)
+{
+	unsigned char buf[MSG_HDR_LEN + 3 * 4];
+	int i;
+
+	put32(buf, 1 + 4 * nr + extra);
+	buf[4] = id;
+	for(i = 0; i < nr; i++)
+		put32(buf + MSG_HDR_LEN + 4 * i, nums[i]);
+	out_put(c, buf, MSG_HDR_LEN + 4 * nr);
+}
+
+/*
+* write out as much as the socket takes: our bytes up to the next block,
+* then the block, with sendfile(), and so on.
+* returns 0, or -1 if the peer is gone
+*/
+static int conn_flush(struct swarm *s, struct conn *c)
+{
+	struct block *b;
+	size_t len;
+	ssize_t n;
+
+	while(1) {
+		b = c->blocks;
+		len = c->out_len - c->out_off;
+		if(b && b->at - c->sent < len)
+			len = b->at - c->sent;
+		if(len > 0) {
+			/* a block follows: no point in a packet of its header alone */
+			n = send(c->fd, c->out + c->out_off, len,
+				MSG_NOSIGNAL | (b ? MSG_MORE : 0));
+			if(n < 0)
+				return errno == EAGAIN ? 0 : -1;
+			c->out_off += n;
+			c->sent += n;
+			continue;
+		}
+		if(b == NULL)
+			break;
+		n = sendfile(c->fd, s->fd, &b->off, b->left);
+		if(n < 0)
+			return errno == EAGAIN ? 0 : -1;
+		if(n == 0)
+			return -1;
+		b->left -= n;
+		c->sent += n;
+		s->st->uploaded += n;
+		if(b->left == 0) {
+			c->blocks = b->next;
+			if(c->blocks == NULL)
+				c->blocks_tail = &c->blocks;
+			free(b);
+		}
+	}
+	c->out_off = c->out_len = 0;
+	return 0;
+}
+
+/*
+* the piece to ask @c for next: of those it has that nobody was asked for,
+* the rarest. Ties are broken by where the search starts, at random,
+* or every peer would ask for the same pieces in the same order.
+*/
+static int pick_piece(struct swarm *s, struct conn *c)
+{
+	unsigned int i, k, nr = s->m->nr_pieces;
+	int best = -1;
+
+	i = rand_r(&s->seed) % nr;
+	for(k = 0; k < nr; k++, i = i + 1 < nr ? i + 1 : 0) {
+		if(!c->has[i] || s->state[i] != PIECE_MISSING)
+			continue;
+		if(best < 0 || s->avail[i] < s->avail[best])
+			best = i;
+	}
+	return best;
+}
+
+/* keep the pipeline to @c full, with as many requests as it takes */
+static void conn_request(struct swarm *s, struct conn *c)
+{
+	unsigned int req[3];
+	size_t len;
+
+	while(c->up && c->in_flight < s->cfg->depth) {
+		if(c->piece < 0 || c->next_off >= piece_len(s->m, c->piece)) {
+			c->piece = pick_piece(s, c);
+			if(c->piece < 0)
+				return;
+			s->state[c->piece] = PIECE_ACTIVE;
+			s->owner[c->piece] = c;
+			c->next_off = 0;
+		}
+		len = piece_len(s->m, c->piece) - c->next_off;
+		if(len > BLOCK_SIZE)
+			len = BLOCK_SIZE;
+		req[0] = c->piece;
+		req[1] = c->next_off;
+		req[2] = len;
+		put_msg(c, MSG_REQUEST, req, 3, 0);
+		c->next_off += len;
+		c->in_flight++;
+	}
+}
+
+/* pieces are up for grabs again, whoever has them is asked */
+static void request_all(struct swarm *s)
+{
+	struct conn *c;
+
+	for(c = s->conns; c; c = c->next)
+		conn_request(s, c);
+}
+
+/* a new connection, dialed or accepted: say who we are, and what we have */
+static struct conn *conn_new(struct swarm *s, int fd)
+{
+	struct conn *c = calloc(1, sizeof *c);
+	struct epoll_event ev;
+	unsigned char hs[HANDSHAKE_LEN], *bits;
+	unsigned int i;
+	int one = 1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	/* requests are tiny, and the pipeline waits on every one of them */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	c->fd = fd;
+	c->has = calloc(s->m->nr_pieces, 1);
+	c->hdr_len = HANDSHAKE_LEN;
+	c->msg_cap = bitfield_len(s->m) > BLOCK_SIZE ? bitfield_len(s->m) : BLOCK_SIZE;
+	c->msg = malloc(c->msg_cap);
+	c->out_cap = 4096;
+	c->out = malloc(c->out_cap);
+	c->blocks_tail = &c->blocks;
+	c->piece = -1;
+	c->next = s->conns;
+	s->conns = c;
+
+	memset(hs, 0, sizeof hs);
+	strcpy((char *)hs, SWARM_MAGIC);
+	memcpy(hs + 8, s->m->info_hash, INFO_HASH_LEN);
+	out_put(c, hs, sizeof hs);
+	bits = calloc(bitfield_len(s->m), 1);
+	for(i = 0; i < s->m->nr_pieces; i++)
+		if(s->state[i] == PIECE_HAVE)
+			bits[i / 8] |= 0x80 >> (i % 8);
+	put_msg(c, MSG_BITFIELD, NULL, 0, bitfield_len(s->m));
+	out_put(c, bits, bitfield_len(s->m));
+	free(bits);
+
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+	ev.data.ptr = c;
+	epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev);
+	return c;
+}
+
+/* the peer is gone: whatever it was asked for is up for grabs again */
+static void conn_close(struct swarm *s, struct conn *c)
+{
+	struct conn **pp;
+	struct block *b;
+	unsigned int i;
+
+	for(pp = &s->conns; *pp != c; pp = &(*pp)->next)
+		;
+	*pp = c->next;
+	for(i = 0; i < s->m->nr_pieces; i++) {
+		if(c->has[i])
+			s->avail[i]--;
+		if(s->owner[i] == c && s->state[i] == PIECE_ACTIVE) {
+			s->state[i] = PIECE_MISSING;
+			s->got[i] = 0;
+		}
+		if(s->owner[i] == c)
+			s->owner[i] = NULL;
+	}
+	while((b = c->blocks) != NULL) {
+		c->blocks = b->next;
+		free(b);
+	}
+	close(c->fd);
+	free(c->has);
+	free(c->msg);
+	free(c->out);
+	free(c);
+	request_all(s);
+}
+
+/* the peer has piece @i */
+static void peer_has(struct swarm *s, struct conn *c, unsigned int i)
+{
+	if(c->has[i])
+		return;
+	c->has[i] = 1;
+	c->nr_has++;
+	s->avail[i]++;
+}
+
+/* all of piece @i is in: check it, and tell everybody if it is good */
+static void piece_done(struct swarm *s, unsigned int i)
+{
+	unsigned int num = i;
+	struct conn *c;
+
+	s->owner[i] = NULL;
+	if(!piece_ok(s->m, s->map, i)) {
+		/* asked for again, from whoever has it */
+		s->state[i] = PIECE_MISSING;
+		s->got[i] = 0;
+		s->st->bad_pieces++;
+		return;
+	}
+	s->state[i] = PIECE_HAVE;
+	if(++s->nr_have == s->m->nr_pieces)
+		s->st->secs = now_secs() - s->st->secs;
+	/*
+	* every peer is told, even one that has it too: that is how it knows
+	* we are done. And one whose handshake is not in yet: our bitfield went
+	* to it when it connected, without this piece in it
+	*/
+	for(c = s->conns; c; c = c->next)
+		put_msg(c, MSG_HAVE, &num, 1, 0);
+}
+
+/*
+* the header of a message is all in, see where its body goes.
+* returns 0, or -1 for a peer that makes no sense
+*/
+static int begin_body(struct swarm *s, struct conn *c)
+{
+	unsigned int len, i, off;
+
+	if(!c->up)
+		return memcmp(c->hdr, SWARM_MAGIC, sizeof SWARM_MAGIC) == 0
+			&& memcmp(c->hdr + 8, s->m->info_hash, INFO_HASH_LEN) == 0 ? 0 : -1;
+	len = get32(c->hdr);
+	c->body = c->msg;
+	c->body_len = len > 0 ? len - 1 : 0;
+	if(len == 0 || c->hdr[4] != MSG_PIECE)
+		return c->body_len <= c->msg_cap ? 0 : -1;
+	if(c->hdr_len == MSG_HDR_LEN) {
+		/* a block: its piece and offset first */
+		c->hdr_len = PIECE_HDR_LEN;
+		return len >= PIECE_HDR_LEN - 4 ? 0 : -1;
+	}
+	i = get32(c->hdr + MSG_HDR_LEN);
+	off = get32(c->hdr + MSG_HDR_LEN + 4);
+	c->body_len = len - (PIECE_HDR_LEN - 4);
+	c->block_piece = -1;
+	if(i < s->m->nr_pieces && s->owner[i] == c && s->state[i] == PIECE_ACTIVE
+		&& c->body_len <= BLOCK_SIZE && off + c->body_len <= piece_len(s->m, i)) {
+		/* right where it belongs */
+		c->block_piece = i;
+		c->body = s->map + (unsigned long long)i * s->m->piece_size + off;
+	}
+	return c->body_len <= c->msg_cap ? 0 : -1;
+}
+
+/* a whole message is in. returns 0, or -1 for a peer that makes no sense */
+static int end_message(struct swarm *s, struct conn *c)
+{
+	struct block *b;
+	unsigned int len, i, off, hdr[2];
+
+	if(!c->up) {
+		c->up = 1;
+		s->seen++;
+		return 0;
+	}
+	if(get32(c->hdr) == 0)
+		return 0;
+	switch(c->hdr[4]) {
+	case MSG_HAVE:
+		if(c->body_len != 4 || (i = get32(c->body)) >= s->m->nr_pieces)
+			return -1;
+		peer_has(s, c, i);
+		break;
+	case MSG_BITFIELD:
+		if(c->body_len != bitfield_len(s->m))
+			return -1;
+		for(i = 0; i < s->m->nr_pieces; i++)
+			if(c->body[i / 8] & 0x80 >> (i % 8))
+				peer_has(s, c, i);
+		break;
+	case MSG_REQUEST:
+		if(c->body_len != 12)
+			return -1;
+		i = get32(c->body);
+		off = get32(c->body + 4);
+		len = get32(c->body + 8);
+		if(i >= s->m->nr_pieces || s->state[i] != PIECE_HAVE || len == 0
+			|| len > REQUEST_MAX || off + len > piece_len(s->m, i))
+			return -1;
+		hdr[0] = i;
+		hdr[1] = off;
+		put_msg(c, MSG_PIECE, hdr, 2, len);
+		b = malloc(sizeof *b);
+		b->next = NULL;
+		b->at = c->queued;
+		b->off = (off_t)i * s->m->piece_size + off;
+		b->left = len;
+		*c->blocks_tail = b;
+		c->blocks_tail = &b->next;
+		c->queued += len;
+		break;
+	case MSG_PIECE:
+		s->st->downloaded += c->body_len;
+		if(c->block_piece < 0)
+			break;
+		c->in_flight--;
+		i = c->block_piece;
+		s->got[i] += c->body_len;
+		if(s->got[i] == piece_len(s->m, i))
+			piece_done(s, i);
+		break;
+	}
+	conn_request(s, c);
+	return 0;
+}
+
+/*
+* read whatever the peer sent, message by message, until the socket
+* has no more. returns 0, or -1 if the peer is gone or makes no sense
+*/
+static int conn_read(struct swarm *s, struct conn *c)
+{
+	ssize_t n;
+
+	while(1) {
+		if(c->hdr_got < c->hdr_len) {
+			n = read(c->fd, c->hdr + c->hdr_got, c->hdr_len - c->hdr_got);
+			if(n <= 0)
+				return n < 0 && errno == EAGAIN ? 0 : -1;
+			c->hdr_got += n;
+			if(c->hdr_got < c->hdr_len)
+				continue;
+			if(begin_body(s, c) < 0)
+				return -1;
+			/* a block has more of a header */
+			if(c->hdr_got < c->hdr_len)
+				continue;
+		}
+		if(c->body_got < c->body_len) {
+			n = read(c->fd, c->body + c->body_got, c->body_len - c->body_got);
+			if(n <= 0)
+				return n < 0 && errno == EAGAIN ? 0 : -1;
+			c->body_got += n;
+			if(c->body_got < c->body_len)
+				continue;
+		}
+		if(end_message(s, c) < 0)
+			return -1;
+		c->hdr_len = MSG_HDR_LEN;
+		c->hdr_got = c->body_len = c->body_got = 0;
+	}
+}
+
+static void swarm_accept(struct swarm *s)
+{
+	int fd;
+
+	while((fd = accept4(s->listenfd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+		conn_new(s, fd);
+}
+
+/* a blocking connect to @addr, retried for a while */
+static int dial(struct sockaddr_in *addr)
+{
+	struct timespec ts;
+	int fd, i;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = DIAL_WAIT_MS * 1000000L;
+	for(i = 0; i < DIAL_TRIES; i++) {
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(connect(fd, (struct sockaddr *)addr, sizeof *addr) == 0)
+			return fd;
+		close(fd);
+		nanosleep(&ts, NULL);
+	}
+	return -1;
+}
+
+static int open_listener(unsigned short port)
+{
+	struct sockaddr_in addr;
+	int fd, one = 1;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(fd, 64) < 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+* the file, mapped: the seed's as it is, a leecher's the length it is
+* going to be. Whatever is in there already is checked, a leecher that
+* was stopped carries on where it was.
+*/
+static int open_content(struct swarm *s)
+{
+	const struct meta *m = s->m;
+	struct stat sb;
+	unsigned int i;
+	double start;
+
+	s->fd = open(s->cfg->path, s->cfg->seed ? O_RDONLY : O_RDWR | O_CREAT, 0644);
+	if(s->fd < 0 || fstat(s->fd, &sb) < 0)
+		return -1;
+	if(s->cfg->seed && (unsigned long long)sb.st_size != m->length)
+		return -1;
+	if(!s->cfg->seed && (unsigned long long)sb.st_size != m->length) {
+		/* nothing worth checking in there */
+		sb.st_size = 0;
+		if(ftruncate(s->fd, 0) < 0 || ftruncate(s->fd, m->length) < 0)
+			return -1;
+	}
+	s->map = mmap(NULL, m->length, PROT_READ | (s->cfg->seed ? 0 : PROT_WRITE),
+		MAP_SHARED, s->fd, 0);
+	if(s->map == MAP_FAILED)
+		return -1;
+	if(sb.st_size == 0)
+		return 0;
+	start = now_secs();
+	s->nr_have = meta_check(m, s->map, s->state, s->cfg->threads);
+	s->st->check_secs = now_secs() - start;
+	for(i = 0; i < m->nr_pieces; i++)
+		s->state[i] = s->state[i] ? PIECE_HAVE : PIECE_MISSING;
+	return 0;
+}
+
+/* we have it all, and so does everybody */
+static int swarm_done(struct swarm *s)
+{
+	struct conn *c;
+
+	if(s->nr_have < s->m->nr_pieces || s->seen < s->cfg->expect)
+		return 0;
+	for(c = s->conns; c; c = c->next)
+		if(!c->up || c->nr_has < s->m->nr_pieces)
+			return 0;
+	return 1;
+}
+
+int swarm_run(const struct swarm_config *cfg, struct swarm_stats *st)
+{
+	struct epoll_event events[MAX_EVENTS], ev;
+	struct swarm s;
+	struct conn *c, *next;
+	unsigned int nr = cfg->meta->nr_pieces;
+	int i, n, fd, ret = 0;
+
+	memset(&s, 0, sizeof s);
+	memset(st, 0, sizeof *st);
+	s.cfg = cfg;
+	s.m = cfg->meta;
+	s.st = st;
+	s.seed = getpid();
+	s.state = calloc(nr, 1);
+	s.owner = calloc(nr, sizeof *s.owner);
+	s.got = calloc(nr, sizeof *s.got);
+	s.avail = calloc(nr, sizeof *s.avail);
+	if(open_content(&s) < 0) {
+		perror(cfg->path);
+		return -1;
+	}
+	s.epfd = epoll_create1(EPOLL_CLOEXEC);
+	s.listenfd = open_listener(cfg->port);
+	if(s.listenfd < 0) {
+		perror("listen");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(s.epfd, EPOLL_CTL_ADD, s.listenfd, &ev);
+	for(i = 0; i < cfg->nr_peers; i++) {
+		fd = dial(&cfg->peers[i]);
+		if(fd < 0) {
+			perror("connect");
+			return -1;
+		}
+		conn_new(&s, fd);
+	}
+
+	/* counting from now, until we have it all */
+	st->secs = now_secs();
+	if(s.nr_have == nr)
+		st->secs = 0;
+	while(!swarm_done(&s)) {
+		/* everybody came and went, and what we lack, nobody had */
+		if(s.conns == NULL && s.seen >= cfg->expect) {
+			ret = -1;
+			break;
+		}
+		n = epoll_wait(s.epfd, events, MAX_EVENTS, 1000);
+		for(i = 0; i < n; i++) {
+			c = events[i].data.ptr;
+			if(c == NULL) {
+				swarm_accept(&s);
+				continue;
+			}
+			if(((events[i].events & ~EPOLLOUT) && conn_read(&s, c) < 0)
+				|| conn_flush(&s, c) < 0) {
+				conn_close(&s, c);
+				continue;
+			}
+		}
+		/*
+		* HAVEs to the others, of pieces that came in on one of them,
+		* and requests for what somebody that left was asked for
+		*/
+		for(c = s.conns; c; c = next) {
+			next = c->next;
+			if(c->out_len > c->out_off && conn_flush(&s, c) < 0)
+				conn_close(&s, c);
+		}
+	}
+	if(ret < 0)
+		st->secs = now_secs() - st->secs;
+	while((c = s.conns) != NULL) {
+		s.conns = c->next;
+		close(c->fd);
+	}
+	close(s.listenfd);
+	close(s.epfd);
+	munmap(s.map, s.m->length);
+	close(s.fd);
+	return ret;
+}
+
+int parse_peers(char *list, struct sockaddr_in *addrs, int max)
+{
+	char *tok, *colon;
+	int n = 0;
+
+	for(tok = strtok(list, ","); tok && n < max; tok = strtok(NULL, ",")) {
+		colon = strchr(tok, ':');
+		memset(&addrs[n], 0, sizeof addrs[n]);
+		addrs[n].sin_family = AF_INET;
+		if(colon == NULL) {
+			/* a port alone is one on this host */
+			addrs[n].sin_port = htons(atoi(tok));
+			addrs[n].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		} else {
+			*colon = '\0';
+			addrs[n].sin_port = htons(atoi(colon + 1));
+			if(inet_pton(AF_INET, tok, &addrs[n].sin_addr) != 1)
+				return -1;
+		}
+		n++;
+	}
+	return n;
+}
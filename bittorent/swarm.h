@@ -0,0 +1,83 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef SWARM_H
+#define SWARM_H
+
+#include <netinet/in.h>
+#include "meta.h"
+
+/*
+* One peer of a swarm: it serves the pieces it has to every peer it is
+* connected to, and gets the ones it lacks from whichever peers have them,
+* all at once, from one epoll loop.
+*
+* The wire is BitTorrent's, with what a swarm on a trusted network needs
+* and no more. Both ends start with a handshake of SWARM_MAGIC and the info
+* hash (meta.h), and then the pieces they have, as a bitfield. After that,
+* every message is a 4 byte length, a byte of type and the rest:
+*   MSG_HAVE     <piece>                     a piece came in and checked out
+*   MSG_BITFIELD <a bit per piece, msb first>
+*   MSG_REQUEST  <piece> <offset> <length>   a block, see BLOCK_SIZE
+*   MSG_PIECE    <piece> <offset> <bytes>    the block asked for
+* all numbers 4 bytes, big endian. Nobody is ever choked: every request is
+* served, in the order it came in.
+*
+* Which piece next: of the pieces the peer has and we do not, nor asked
+* anybody else for, the one the fewest peers have. Rare pieces get copied
+* first, and leave the swarm less dependent on whoever has them.
+* A peer is asked for a piece block by block, up to a number of blocks in
+* flight (the pipeline depth): the next request is on its way while the
+* answer to the last one is, and the link never idles.
+*
+* The data path has no copies of ours: a block read off a socket is read
+* right into a shared mapping of the file it belongs in, and a block is
+* served with sendfile(), from the page cache to the socket. A piece is
+* hashed once it is all in, and only then is it told about, and served.
+*/
+
+#define SWARM_MAGIC "swarm/1"
+/* the magic and its '\0', and the info hash */
+#define HANDSHAKE_LEN (8 + INFO_HASH_LEN)
+
+#define MSG_HAVE 4
+#define MSG_BITFIELD 5
+#define MSG_REQUEST 6
+#define MSG_PIECE 7
+
+struct swarm_config {
+	const struct meta *meta;
+	/* the content: there already with @seed, else where it goes */
+	const char *path;
+	int seed;
+	/* where we listen on, and the peers we dial */
+	unsigned short port;
+	struct sockaddr_in *peers;
+	int nr_peers;
+	/* how many peers there are to serve besides us, dialed or not */
+	int expect;
+	/* blocks in flight per peer */
+	int depth;
+	/* threads hashing what is there at start */
+	int threads;
+};
+
+struct swarm_stats {
+	unsigned long long downloaded, uploaded;
+	/* how long until we had it all, and hashing what was there at start */
+	double secs, check_secs;
+	/* pieces that came in and did not check out */
+	unsigned int bad_pieces;
+};
+
+/*
+* run a peer until it has everything, and so do all the peers it is
+* connected to. returns 0, or -1 if it never got everything
+*/
+int swarm_run(const struct swarm_config *cfg, struct swarm_stats *st);
+
+/* "host:port,host:port,..." into @addrs, up to @max. returns how many */
+int parse_peers(char *list, struct sockaddr_in *addrs, int max);
+
+#endif
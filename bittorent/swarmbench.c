@@ -0,0 +1,158 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include "swarm.h"
+
+/*
+* swarmbench runs a whole swarm on this host, each peer a process of its
+* own on a loopback port of its own: peer 0 seeds the file, peers 1 to
+* -n - 1 download it, into -d, from it and from each other. Peer i dials
+* every peer before it, so every two of them are connected once.
+* Each peer tells how it went through a pipe, and the bench adds it up:
+* how much the swarm moved, and how fast, and how much of it came from
+* the seed: the less, the more the peers served each other.
+*/
+
+#define MAX_PEERS 64
+
+/* what a peer tells the bench, in one write() to the pipe */
+struct report {
+	int id, ret;
+	struct swarm_stats st;
+};
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-n peers] [-p base port] [-w depth]"
+		" [-t threads] [-d dir] [-k] meta file\n"
+		"  -d  where the peers put what they download (default /tmp)\n"
+		"  -k  keep it there afterwards\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+/* peer @id of the swarm, in a process of its own */
+static void run_peer(struct swarm_config *cfg, int id, unsigned short base,
+	int pipefd)
+{
+	struct sockaddr_in peers[MAX_PEERS];
+	struct report r;
+	int i;
+
+	for(i = 0; i < id; i++) {
+		memset(&peers[i], 0, sizeof peers[i]);
+		peers[i].sin_family = AF_INET;
+		peers[i].sin_port = htons(base + i);
+		peers[i].sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+	cfg->peers = peers;
+	cfg->nr_peers = id;
+	cfg->port = base + id;
+	cfg->seed = id == 0;
+	r.id = id;
+	r.ret = swarm_run(cfg, &r.st);
+	write(pipefd, &r, sizeof r);
+	_exit(r.ret < 0 ? EXIT_FAILURE : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct swarm_config cfg;
+	struct report r[MAX_PEERS], rep;
+	struct meta m;
+	char paths[MAX_PEERS][4096];
+	const char *dir = "/tmp";
+	unsigned short base = 7000;
+	unsigned long long moved = 0;
+	double secs = 0;
+	int opt, i, n = 4, keep = 0, pipefd[2], failed = 0;
+
+	memset(&cfg, 0, sizeof cfg);
+	cfg.depth = 32;
+	cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+	while((opt = getopt(argc, argv, "n:p:w:t:d:k")) != -1) {
+		switch(opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'p':
+			base = atoi(optarg);
+			break;
+		case 'w':
+			cfg.depth = atoi(optarg);
+			break;
+		case 't':
+			cfg.threads = atoi(optarg);
+			break;
+		case 'd':
+			dir = optarg;
+			break;
+		case 'k':
+			keep = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 2 || n < 2 || n > MAX_PEERS || cfg.depth < 1)
+		usage(argv[0]);
+	if(meta_read(&m, argv[optind]) < 0) {
+		fprintf(stderr, "%s: no meta file\n", argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	cfg.meta = &m;
+	cfg.expect = n - 1;
+	signal(SIGPIPE, SIG_IGN);
+
+	snprintf(paths[0], sizeof paths[0], "%s", argv[optind + 1]);
+	for(i = 1; i < n; i++) {
+		snprintf(paths[i], sizeof paths[i], "%s/%s.%d", dir, m.name, i);
+		/* every peer starts from nothing */
+		unlink(paths[i]);
+	}
+	pipe(pipefd);
+	for(i = 0; i < n; i++) {
+		cfg.path = paths[i];
+		if(fork() == 0)
+			run_peer(&cfg, i, base, pipefd[1]);
+	}
+	close(pipefd[1]);
+	memset(r, 0, sizeof r);
+	while(read(pipefd[0], &rep, sizeof rep) == sizeof rep)
+		r[rep.id] = rep;
+	while(wait(NULL) > 0)
+		;
+
+	printf("%d peers, %.1f MB in %u pieces of %u KB, %d blocks in flight\n",
+		n, m.length / 1e6, m.nr_pieces, m.piece_size / 1024, cfg.depth);
+	printf("seed checked it in %.3f s, %.2f GB/s\n", r[0].st.check_secs,
+		r[0].st.check_secs > 0 ? m.length / r[0].st.check_secs / 1e9 : 0.0);
+	printf("peer %11s %11s %9s %9s\n", "down MB", "up MB", "secs", "MB/s");
+	for(i = 0; i < n; i++) {
+		printf("%4d %11.1f %11.1f %9.3f %9.1f%s\n", i, r[i].st.downloaded / 1e6,
+			r[i].st.uploaded / 1e6, r[i].st.secs, r[i].st.secs > 0 ?
+			r[i].st.downloaded / r[i].st.secs / 1e6 : 0.0,
+			r[i].ret < 0 ? " failed" : "");
+		failed |= r[i].ret < 0;
+		if(i > 0) {
+			moved += r[i].st.downloaded;
+			if(r[i].st.secs > secs)
+				secs = r[i].st.secs;
+		}
+	}
+	printf("swarm moved %.1f MB in %.3f s, %.1f MB/s aggregate,"
+		" %.0f%% of it from the seed\n", moved / 1e6, secs,
+		secs > 0 ? moved / secs / 1e6 : 0.0,
+		moved ? 100.0 * r[0].st.uploaded / moved : 0.0);
+	for(i = 1; i < n && !keep; i++)
+		unlink(paths[i]);
+	meta_free(&m);
+	return failed ? EXIT_FAILURE : 0;
+}
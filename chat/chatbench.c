@@ -0,0 +1,1106 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "proto.h"
+#include "hist.h"
+#include "tls.h"
+#include "shm.h"
+#include "p2p.h"
+#include "lz.h"
+
+/*
+* chatbench is a load generator for chatserver.
+* It opens -c connections, registers them as <prefix>0, <prefix>1 ...
+* and then sends `send` frames to random users among them at -r msgs
+* per second in total, with -l percent of the ops being `ls` instead.
+*
+* Each msg carries the time it was due to go out, so the receiving end
+* can tell how long delivery took. The time is the *scheduled* one, not
+* the one the msg actually left at: if the server falls behind and the
+* bench has to wait to write, that wait counts as latency too, just as
+* it would for a real user (no coordinated omission).
+*
+* Connections are split among -T threads, each running its own epoll
+* loop, pacing its share of the rate and recording latencies into a
+* histogram of its own. The histograms are merged at the end.
+*
+* Against a cluster, -p takes the client port of every node, and
+* connection i goes to node i % nodes. Msgs to a user on the node the
+* sender is on and msgs that had to be forwarded to another node are
+* told apart, and their latencies kept apart too.
+*
+* With -C it measures logins instead: -c threads each connect, register,
+* wait for the reply to an `ls` and hang up, over and over, as a crowd of
+* clients reconnecting all at once after a restart would.
+* With -S each thread logs in once, and then hangs up and resumes its
+* session (see OP_RESUME) over and over, as a crowd of clients whose
+* connections all broke at once would. The server needs sessions, -g.
+*
+* With -E every connection talks TLS, to a server whose certificate is
+* in the file given. A login storm then resumes the TLS session of its
+* last connection on every new one, with the ticket it got; -F makes
+* it do a full handshake each time instead, to see what tickets save.
+*
+* With -U it connects to the server's unix socket instead, and with -M
+* too every connection moves over to shared memory (see shm.h). -P takes
+* the pid of the server: the CPU time it took, and the bench took, per
+* msg delivered, is printed at the end, to tell the transports apart by
+* more than their latency.
+*
+* With -D the connections talk in pairs, 2i to 2i + 1 and back, and the
+* percentage of the pairs given takes direct links (see p2p.h): they say
+* P2P_HEAVY msgs through the server, then 2i asks to be introduced to
+* 2i + 1, dials it, and from then on the pair talks over the link. Msgs
+* that came directly are counted apart, and with -P, the CPU the server
+* took per msg delivered shows what it was spared.
+*
+* With -A the msgs say lines of the file given, at random, rather than
+* padding, which packs like nothing else does. With -Z every connection
+* packs its msgs against the dictionary given, and the server packs the
+* msgs to it (see lz.h). How many bytes a msg took on the wire is
+* printed either way, and with -P what packing cost the server.
+*/
+
+#define RING_SIZE 4096
+#define RING_MAX (16 * 1024 * 1024)
+#define USERNAME_MAX_SIZE 20
+/* `ls` in flight per connection, their ids wrap around this */
+#define LS_SLOTS 64
+#define MAX_EVENTS 256
+#define MAX_PORTS 64
+/* what a packed msg unpacks to at most */
+#define UNPACKED_MAX 512
+
+static const char *host = "127.0.0.1";
+static unsigned short ports[MAX_PORTS] = { 55555 };
+static int nr_ports = 1;
+static int nr_conns = 100;
+static int nr_threads = 1;
+static double rate = 10000;
+static double duration = 10;
+static double warmup = 1;
+static double ls_pct = 0;
+static int msg_size = 64;
+static const char *prefix = "bench";
+static int storm = 0, resume = 0;
+static int use_tls = 0, full_handshakes = 0;
+static const char *local_path = NULL;
+static int use_shm = 0, server_pid = 0;
+/* -D: talk in pairs, this percentage of them directly, -1 for no pairs */
+static int direct_pct = -1;
+/* -Z: the dictionary to pack msgs against, -A: what the msgs say */
+static struct lz_dict *pack_dict = NULL;
+static char **texts;
+static int nr_texts = 0;
+
+/* when the measured part of the run starts and when sending stops */
+static unsigned long start_ns, measure_ns, stop_ns;
+static pthread_barrier_t ready, go;
+
+struct conn {
+	int fd;
+	/* NULL without -E */
+	struct tls *tls;
+	/* NULL without -M */
+	struct shm *shm;
+	struct ringbuf in;
+	/* frames waiting to be written, from off to len */
+	char *out;
+	size_t off, len, cap;
+	int dirty;
+	/* scheduled time of each `ls` in flight, 0 if the slot is free */
+	unsigned long ls_sent[LS_SLOTS];
+	unsigned short ls_id;
+	int registered;
+	/* which of the -p ports it is connected to */
+	int node;
+	/* its number, what its name is made of */
+	int id;
+	/*
+	* with -D, a connection whose pair talks directly takes direct links,
+	* and has the link to its partner once it is up. The link, and the
+	* listening socket, are in the epoll set as conns of their @user.
+	*/
+	struct p2p *p2p;
+	struct conn *link, *user;
+	int listening;
+	/* msgs to the partner through the server */
+	unsigned int relayed;
+	/* the server takes our msgs packed, and packs those to us */
+	int packing;
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	int epfd;
+	/* fires when the next op is due, in the epoll set with a NULL ptr */
+	int timerfd;
+	struct conn **conns;
+	int nr;
+	unsigned int seed;
+	unsigned long sent, ls, delivered, ls_replies, late, logins;
+	/* of the msgs delivered, those that came over a direct link */
+	unsigned long direct;
+	/* TLS handshakes of a login storm that resumed a session */
+	unsigned long tls_resumed;
+	/* bytes of the msgs sent and delivered, on the wire and unpacked */
+	unsigned long wire_out, plain_out, wire_in, plain_in;
+	/* msg_lat is for msgs within a node, xmsg_lat across nodes */
+	struct hist msg_lat, xmsg_lat, ls_lat;
+};
+
+static unsigned long now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static void die(const char *what)
+{
+	perror(what);
+	exit(EXIT_FAILURE);
+}
+
+/* append a frame to what @c has to write */
+static void conn_put(struct conn *c, int op, int flags, int id,
+	const char *payload, size_t len)
+{
+	if(c->len + FRAME_HDR_SIZE + len > c->cap) {
+		if(c->off) {
+			memmove(c->out, c->out + c->off, c->len - c->off);
+			c->len -= c->off;
+			c->off = 0;
+		}
+		while(c->len + FRAME_HDR_SIZE + len > c->cap)
+			c->cap *= 2;
+		c->out = realloc(c->out, c->cap);
+	}
+	frame_pack((unsigned char *)c->out + c->len, op, flags, id, len);
+	memcpy(c->out + c->len + FRAME_HDR_SIZE, payload, len);
+	c->len += FRAME_HDR_SIZE + len;
+}
+
+static void conn_frame(struct conn *c, int op, int id, const char *payload, size_t len)
+{
+	conn_put(c, op, 0, id, payload, len);
+}
+
+/* a msg for the server to relay, packed if @c may and it gets smaller */
+static void conn_msg(struct worker *w, struct conn *c, int op,
+	const char *payload, size_t len)
+{
+	char packed[USERNAME_MAX_SIZE + 256];
+	size_t n = 0;
+
+	if(c->packing && len > 1)
+		n = lz_pack(pack_dict, payload, len, packed, len - 1);
+	if(n > 0)
+		conn_put(c, op, FLAG_PACKED, 0, packed, n);
+	else
+		conn_put(c, op, 0, 0, payload, len);
+	w->plain_out += FRAME_HDR_SIZE + len;
+	w->wire_out += FRAME_HDR_SIZE + (n > 0 ? n : len);
+}
+
+/* what a msg says after its header: a line of -A, or padding up to -s */
+static int msg_text(struct worker *w, char *payload, int len)
+{
+	const char *t;
+	int n;
+
+	if(nr_texts == 0) {
+		while(len < msg_size)
+			payload[len++] = 'x';
+		return len;
+	}
+	t = texts[rand_r(&w->seed) % nr_texts];
+	n = strlen(t);
+	/* the server turns longer msgs down */
+	if(len + n > 200)
+		n = 200 - len;
+	memcpy(payload + len, t, n);
+	return len + n;
+}
+
+/*
+* write out as much as the socket takes. Whatever does not fit waits
+* for EPOLLOUT, frames queued meanwhile go out with it in one write()
+*/
+static void conn_flush(struct conn *c)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	while(c->off < c->len) {
+		iov.iov_base = c->out + c->off;
+		iov.iov_len = c->len - c->off;
+		if(c->shm)
+			n = shm_writev(c->shm, &iov, 1);
+		else if(c->tls)
+			n = tls_writev(c->tls, &iov, 1);
+		else
+			n = write(c->fd, iov.iov_base, iov.iov_len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(n < 0)
+			die("write");
+		c->off += n;
+	}
+	c->off = c->len = 0;
+}
+
+static void link_attach(struct worker *w, struct conn *user, int fd);
+
+/* OP_PEER, the partner's address to dial, or OP_INTRO, it is to dial us */
+static void introduced(struct worker *w, struct conn *c, struct frame_hdr *fh,
+	char *payload)
+{
+	char buf[256], name[USERNAME_MAX_SIZE], me[USERNAME_MAX_SIZE];
+	char addr[64], nonce[P2P_NONCE_MAX + 1];
+	struct sockaddr_in sa;
+	int fd = -1;
+
+	if(fh->len >= sizeof buf)
+		return;
+	memcpy(buf, payload, fh->len);
+	buf[fh->len] = '\0';
+	if(fh->op == OP_PEER && sscanf(buf, "%19s %63s %32s", name, addr, nonce) == 3
+		&& p2p_addr(addr, &sa) == 0) {
+		snprintf(me, sizeof me, "%s%d", prefix, c->id);
+		fd = p2p_dial(&sa, me, nonce);
+	}
+	if(fh->op == OP_INTRO && sscanf(buf, "%19s %32s", name, nonce) == 2)
+		fd = p2p_expect(c->p2p, name, nonce);
+	if(fd >= 0)
+		link_attach(w, c, fd);
+}
+
+static void handle_frame(struct worker *w, struct conn *c, struct frame_hdr *fh,
+	char *payload, unsigned long now)
+{
+	char unpacked[UNPACKED_MAX];
+	unsigned long sent;
+	char *t, *end;
+	ssize_t n;
+	int slot;
+
+	/* idle between ops, the server may want to know we are alive */
+	if(fh->op == OP_PING) {
+		conn_frame(c, OP_PONG, 0, NULL, 0);
+		conn_flush(c);
+		return;
+	}
+	if(fh->op == OP_LS_REPLY) {
+		if(!c->registered) {
+			/* the reply to the `ls` right after registering */
+			c->registered = 1;
+			return;
+		}
+		slot = fh->id % LS_SLOTS;
+		sent = c->ls_sent[slot];
+		c->ls_sent[slot] = 0;
+		if(sent == 0)
+			return;
+		w->ls_replies++;
+		if(sent >= measure_ns)
+			hist_record(&w->ls_lat, now - sent);
+		return;
+	}
+	if(fh->op == OP_PEER || fh->op == OP_INTRO) {
+		introduced(w, c, fh, payload);
+		return;
+	}
+	if(fh->op == OP_PACK_OK) {
+		c->packing = fh->len > 0;
+		return;
+	}
+	if(fh->op != OP_MSG)
+		return;
+
+	w->wire_in += FRAME_HDR_SIZE + fh->len;
+	if(fh->flags & FLAG_PACKED) {
+		n = pack_dict ? lz_unpack(pack_dict, payload, fh->len, unpacked,
+			sizeof unpacked) : -1;
+		if(n < 0) {
+			fprintf(stderr, "a msg that does not unpack\n");
+			exit(EXIT_FAILURE);
+		}
+		payload = unpacked;
+		fh->len = n;
+	}
+	w->plain_in += FRAME_HDR_SIZE + fh->len;
+
+	/* `<sender>: t=<ns> <padding>`, `t=<ns>+ <padding>` across nodes */
+	t = memchr(payload, '=', fh->len);
+	if(t == NULL)
+		return;
+	sent = strtoul(t + 1, &end, 10);
+	w->delivered++;
+	if(c->user)
+		w->direct++;
+	if(now > stop_ns)
+		w->late++;
+	if(sent < measure_ns)
+		return;
+	if(end < payload + fh->len && *end == '+')
+		hist_record(&w->xmsg_lat, now - sent);
+	else
+		hist_record(&w->msg_lat, now - sent);
+}
+
+/* read and parse everything there is to read on @c */
+static void conn_read(struct worker *w, struct conn *c)
+{
+	struct frame_hdr fh;
+	char *payload;
+	unsigned long now;
+	ssize_t n;
+	int ret;
+
+	while(1) {
+		if(c->shm)
+			n = shm_ring_read(c->shm, &c->in);
+		else
+			n = c->tls ? tls_ring_read(c->tls, &c->in) : ring_read(c->fd, &c->in);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(n <= 0) {
+			fprintf(stderr, "server hung up\n");
+			exit(EXIT_FAILURE);
+		}
+		now = now_ns();
+		while((ret = frame_next(&c->in, &fh, &payload)) == 1)
+			handle_frame(w, c, &fh, payload, now);
+		if(ret < 0) {
+			fprintf(stderr, "frame too big\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static void handle_events(struct worker *w, int timeout)
+{
+	struct epoll_event events[MAX_EVENTS];
+	struct conn *c;
+	unsigned long long expirations;
+	char name[P2P_NAME_MAX];
+	int i, n, fd;
+
+	n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+	for(i = 0; i < n; i++) {
+		c = events[i].data.ptr;
+		if(c == NULL) {
+			read(w->timerfd, &expirations, sizeof expirations);
+			continue;
+		}
+		if(c->listening) {
+			while((fd = p2p_accept(c->user->p2p, name)) >= 0)
+				link_attach(w, c->user, fd);
+			continue;
+		}
+		/* the doorbell, for room in the one ring or frames in the other */
+		if(c->shm) {
+			shm_ack(c->shm);
+			conn_read(w, c);
+			conn_flush(c);
+			continue;
+		}
+		if(events[i].events & EPOLLIN)
+			conn_read(w, c);
+		if(events[i].events & EPOLLOUT)
+			conn_flush(c);
+	}
+}
+
+/* a blocking socket connected to the server, the -p port @port or -U */
+static int dial(unsigned short port)
+{
+	struct sockaddr_in addr;
+	struct sockaddr_un local_addr;
+	int fd, one = 1;
+
+	if(local_path) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0)
+			die("socket");
+		memset(&local_addr, 0, sizeof local_addr);
+		local_addr.sun_family = AF_UNIX;
+		strncpy(local_addr.sun_path, local_path, sizeof local_addr.sun_path - 1);
+		if(connect(fd, (struct sockaddr *)&local_addr, sizeof local_addr) < 0)
+			die(local_path);
+		return fd;
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd < 0)
+		die("socket");
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if(inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+		fprintf(stderr, "bad address %s\n", host);
+		exit(EXIT_FAILURE);
+	}
+	if(connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0)
+		die("connect");
+	/* frames are small and latency is what we measure */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	return fd;
+}
+
+static struct conn *conn_open(int id)
+{
+	struct conn *c;
+	char name[USERNAME_MAX_SIZE];
+
+	c = calloc(1, sizeof *c);
+	c->id = id;
+	c->node = id % nr_ports;
+	c->fd = dial(ports[c->node]);
+	/* the handshake blocks, the socket is non-blocking from then on */
+	if(use_tls) {
+		c->tls = tls_client();
+		if(tls_connect(c->tls, c->fd, NULL, 0) < 0)
+			die("TLS handshake");
+	}
+	if(use_shm && (c->shm = shm_connect(c->fd)) == NULL) {
+		fprintf(stderr, "no shared memory from the server\n");
+		exit(EXIT_FAILURE);
+	}
+	fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+	ring_init(&c->in, RING_SIZE, RING_MAX);
+	c->cap = 4096;
+	c->out = malloc(c->cap);
+	/*
+	* frames on a connection are handled in order, so once the reply to
+	* this `ls` is back the server surely knows our name
+	*/
+	snprintf(name, sizeof name, "%s%d", prefix, id);
+	conn_frame(c, OP_REGISTER, 0, name, strlen(name));
+	/* pair i / 2 talks directly if it is one of the -D percent, spread out */
+	if(direct_pct > 0 && (id / 2 + 1) * direct_pct / 100 > id / 2 * direct_pct / 100) {
+		c->p2p = malloc(sizeof *c->p2p);
+		if(p2p_init(c->p2p, 0) < 0)
+			die("direct links");
+		conn_frame(c, OP_P2P, 0, name, sprintf(name, "%u", c->p2p->port));
+	}
+	/* the answer comes before the `ls` reply, packing is settled by then */
+	if(pack_dict)
+		conn_frame(c, OP_PACK, 0, name, sprintf(name, "%08x", pack_dict->id));
+	conn_frame(c, OP_LS, 0, NULL, 0);
+	return c;
+}
+
+/* a conn in the epoll set of @w for @fd, owned by @user */
+static struct conn *conn_add(struct worker *w, struct conn *user, int fd,
+	int events)
+{
+	struct epoll_event ev;
+	struct conn *c;
+
+	c = calloc(1, sizeof *c);
+	c->fd = fd;
+	c->user = user;
+	ring_init(&c->in, RING_SIZE, RING_MAX);
+	c->cap = 4096;
+	c->out = malloc(c->cap);
+	ev.events = events;
+	ev.data.ptr = c;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+	return c;
+}
+
+/* the direct link of @user to its partner is up, on @fd */
+static void link_attach(struct worker *w, struct conn *user, int fd)
+{
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	user->link = conn_add(w, user, fd, EPOLLIN | EPOLLOUT | EPOLLET);
+}
+
+/* the next op of @c, due at @due. returns the conn it went on */
+static struct conn *send_op(struct worker *w, struct conn *c, unsigned long due)
+{
+	char payload[USERNAME_MAX_SIZE + 256];
+	unsigned short id;
+	int len, to;
+
+	if(direct_pct >= 0) {
+		/* `<sender>: <msg>` over the link, as the server would have it */
+		if(c->link) {
+			len = sprintf(payload, "%s%d: t=%lu ", prefix, c->id, due);
+			len = msg_text(w, payload, len);
+			conn_frame(c->link, OP_MSG, 0, payload, len);
+			w->plain_out += FRAME_HDR_SIZE + len;
+			w->wire_out += FRAME_HDR_SIZE + len;
+			w->sent++;
+			return c->link;
+		}
+		len = sprintf(payload, "%s%d t=%lu ", prefix, c->id ^ 1, due);
+		len = msg_text(w, payload, len);
+		conn_msg(w, c, OP_SEND, payload, len);
+		w->sent++;
+		/* one of the pair asks, the other is dialed */
+		if(c->p2p && !(c->id & 1) && ++c->relayed == P2P_HEAVY) {
+			len = sprintf(payload, "%s%d", prefix, c->id ^ 1);
+			conn_frame(c, OP_WHERE, 0, payload, len);
+		}
+		return c;
+	}
+
+	if(ls_pct > 0 && rand_r(&w->seed) % 10000 < ls_pct * 100) {
+		id = c->ls_id++;
+		if(c->ls_sent[id % LS_SLOTS])
+			return c;
+		c->ls_sent[id % LS_SLOTS] = due;
+		conn_frame(c, OP_LS, id, NULL, 0);
+		w->ls++;
+		return c;
+	} else {
+		to = rand_r(&w->seed) % nr_conns;
+		len = sprintf(payload, "%s%d t=%lu%s ", prefix, to, due,
+			to % nr_ports != c->node ? "+" : "");
+		/* pad up to the msg size asked for */
+		len = msg_text(w, payload, len);
+		conn_msg(w, c, OP_SEND, payload, len);
+		w->sent++;
+	}
+	return c;
+}
+
+void *worker_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct epoll_event ev;
+	struct itimerspec its;
+	struct conn **dirty, *c;
+	unsigned long interval, due, now;
+	int i, registered, nr_dirty, next = 0;
+
+	w->epfd = epoll_create1(0);
+	/*
+	* epoll_wait() only sleeps in whole ms, which is about what we are
+	* trying to measure. A timerfd wakes us up to the ns.
+	*/
+	w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+	memset(&its, 0, sizeof its);
+	for(i = 0; i < w->nr; i++) {
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+		ev.data.ptr = w->conns[i];
+		/* on shm, there is nothing but the doorbell to wait for */
+		if(w->conns[i]->shm)
+			epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->conns[i]->shm->bell, &ev);
+		else
+			epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->conns[i]->fd, &ev);
+		/* where its links come in, level-triggered */
+		if(w->conns[i]->p2p)
+			conn_add(w, w->conns[i], w->conns[i]->p2p->fd,
+				EPOLLIN)->listening = 1;
+		conn_flush(w->conns[i]);
+		/* nobody rings it for a ring we have not found empty once */
+		if(w->conns[i]->shm)
+			conn_read(w, w->conns[i]);
+	}
+	/* wait for all of our users to be known to the server */
+	do {
+		handle_events(w, 100);
+		for(registered = 0, i = 0; i < w->nr; i++)
+			registered += w->conns[i]->registered;
+	} while(registered < w->nr);
+
+	pthread_barrier_wait(&ready);
+	pthread_barrier_wait(&go);
+
+	/* every conn and its link */
+	dirty = malloc(2 * w->nr * sizeof *dirty);
+	interval = 1e9 / (rate / nr_threads);
+	/* spread the threads' ops out rather than firing them together */
+	due = start_ns + rand_r(&w->seed) % interval;
+
+	while((now = now_ns()) < stop_ns) {
+		nr_dirty = 0;
+		/* catch up on every op that is due by now */
+		for(; due <= now && due < stop_ns; due += interval) {
+			c = send_op(w, w->conns[next], due);
+			if(!c->dirty) {
+				c->dirty = 1;
+				dirty[nr_dirty++] = c;
+			}
+			next = (next + 1) % w->nr;
+		}
+		for(i = 0; i < nr_dirty; i++) {
+			dirty[i]->dirty = 0;
+			conn_flush(dirty[i]);
+		}
+		its.it_value.tv_sec = due / 1000000000UL;
+		its.it_value.tv_nsec = due % 1000000000UL;
+		timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+		handle_events(w, 100);
+	}
+	/* give msgs still on the way a second to arrive */
+	while(now_ns() < stop_ns + 1000000000UL)
+		handle_events(w, 10);
+	free(dirty);
+	return NULL;
+}
+
+/*
+* read off @fd, through @t unless it is NULL, until a frame of @op comes
+* in, its payload is in @payload. A session token on the way is copied
+* to @token.
+*/
+static void wait_frame(int fd, struct tls *t, struct ringbuf *in, int op,
+	char **payload, char *token)
+{
+	struct frame_hdr fh;
+	int ret;
+
+	while(1) {
+		while((ret = frame_next(in, &fh, payload)) == 1) {
+			if(fh.op == OP_SESSION && fh.len == SESSION_TOKEN_SIZE)
+				memcpy(token, *payload, SESSION_TOKEN_SIZE);
+			if(fh.op == op)
+				return;
+		}
+		if(ret < 0 || (t ? tls_read_wait(t, in) : ring_read(fd, in)) <= 0) {
+			fprintf(stderr, "server hung up\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+* hang up with a RST rather than a FIN: no TIME_WAIT is left
+* behind, which would run us out of local ports in seconds
+*/
+static void hang_up(int fd)
+{
+	struct linger lg;
+
+	lg.l_onoff = 1;
+	lg.l_linger = 0;
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+	close(fd);
+}
+
+/*
+* a new connection of a login storm, with the @len bytes of frames in
+* @buf written on it. With -E, the TLS handshake is done over it first,
+* by @t, resuming the TLS session of the last one unless -F.
+*/
+static int storm_dial(struct worker *w, struct tls *t, const char *buf, int len)
+{
+	int fd = dial(ports[w->id % nr_ports]);
+
+	if(t == NULL) {
+		if(write(fd, buf, len) < 0)
+			die("write");
+		return fd;
+	}
+	if(full_handshakes && t->ticket) {
+		SSL_SESSION_free(t->ticket);
+		t->ticket = NULL;
+	}
+	if(tls_connect(t, fd, buf, len) < 0)
+		die("TLS handshake");
+	return fd;
+}
+
+/* and its end: the TLS session stays for the next one */
+static void storm_hang_up(struct tls *t, int fd)
+{
+	if(t)
+		tls_close(t);
+	hang_up(fd);
+}
+
+/*
+* log in as a new user, wait until the server has taken it in
+* and hang up, again and again.
+* With -S, log in once, and then hang up and resume again and again.
+*/
+void *storm_loop(void *arg)
+{
+	struct worker *w = arg;
+	struct ringbuf in;
+	char buf[2 * FRAME_HDR_SIZE + USERNAME_MAX_SIZE + 1 + SESSION_TOKEN_SIZE];
+	char name[USERNAME_MAX_SIZE], token[SESSION_TOKEN_SIZE + 1], *payload;
+	unsigned long start, i = 0;
+	struct tls *t = use_tls ? tls_client() : NULL;
+	int fd = -1, len, resumed;
+
+	ring_init(&in, RING_SIZE, RING_MAX);
+	token[0] = '\0';
+	if(resume) {
+		len = sprintf(name, "%s%d", prefix, w->id);
+		frame_pack((unsigned char *)buf, OP_REGISTER, FLAG_ACK, 0, len);
+		memcpy(buf + FRAME_HDR_SIZE, name, len);
+		fd = storm_dial(w, t, buf, FRAME_HDR_SIZE + len);
+		/* the token comes before the ack */
+		wait_frame(fd, t, &in, OP_ACK, &payload, token);
+		if(token[0] == '\0') {
+			fprintf(stderr, "no session, is the server running with -g?\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	pthread_barrier_wait(&ready);
+	pthread_barrier_wait(&go);
+
+	while((start = now_ns()) < stop_ns) {
+		in.head = in.tail = 0;
+		if(resume) {
+			storm_hang_up(t, fd);
+			len = sprintf(buf + FRAME_HDR_SIZE, "%s %s", name, token);
+			frame_pack((unsigned char *)buf, OP_RESUME, FLAG_ACK, 0, len);
+			fd = storm_dial(w, t, buf, FRAME_HDR_SIZE + len);
+			resumed = t && tls_resumed(t);
+			wait_frame(fd, t, &in, OP_ACK, &payload, token);
+			if(payload[0] != ACK_OK) {
+				fprintf(stderr, "session lost\n");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			/* a fresh name each time, the last one may not be gone yet */
+			len = sprintf(buf + FRAME_HDR_SIZE, "%s%d_%lu", prefix,
+				w->id, i++ % 1000000);
+			frame_pack((unsigned char *)buf, OP_REGISTER, 0, 0, len);
+			frame_pack((unsigned char *)buf + FRAME_HDR_SIZE + len,
+				OP_LS, 0, 0, 0);
+			fd = storm_dial(w, t, buf, 2 * FRAME_HDR_SIZE + len);
+			resumed = t && tls_resumed(t);
+			wait_frame(fd, t, &in, OP_LS_REPLY, &payload, token);
+			storm_hang_up(t, fd);
+		}
+
+		if(start >= measure_ns) {
+			w->logins++;
+			w->tls_resumed += resumed;
+			hist_record(&w->ls_lat, now_ns() - start);
+		}
+	}
+	if(resume)
+		storm_hang_up(t, fd);
+	if(t)
+		tls_free(t);
+	ring_free(&in);
+	return NULL;
+}
+
+/* the CPU time of the process @pid so far, in usecs */
+static double proc_cpu(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if(f == NULL)
+		return 0;
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	/* past the command, which may have spaces in it, and 11 more fields */
+	if(p == NULL || (p = strrchr(buf, ')')) == NULL || sscanf(p + 2,
+		"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2)
+		return 0;
+	return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+/* and ours */
+static double self_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec
+		+ ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+}
+
+/* the lines of @path, what the msgs of -A say */
+static void load_texts(const char *path)
+{
+	char line[256];
+	int size = 0;
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL)
+		die(path);
+	while(fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if(line[0] == '\0')
+			continue;
+		if(nr_texts == size) {
+			size = size ? 2 * size : 1024;
+			texts = realloc(texts, size * sizeof *texts);
+		}
+		texts[nr_texts++] = strdup(line);
+	}
+	fclose(f);
+	if(nr_texts == 0) {
+		fprintf(stderr, "%s: nothing to say in there\n", path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void print_hist(const char *what, struct hist *h)
+{
+	if(h->total == 0) {
+		printf("%-9s no samples\n", what);
+		return;
+	}
+	printf("%-9s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", what,
+		h->sum / h->total / 1e3,
+		hist_percentile(h, 50) / 1e3, hist_percentile(h, 90) / 1e3,
+		hist_percentile(h, 99) / 1e3, hist_percentile(h, 99.9) / 1e3,
+		h->max / 1e3);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-H host] [-p port,port,...] [-c connections]"
+		" [-T threads] [-r ops/sec] [-d seconds] [-w warmup seconds]"
+		" [-l ls percent] [-s msg size] [-n name prefix] [-C] [-S]"
+		" [-E server cert pem] [-F] [-U unix socket [-M]] [-P server pid]"
+		" [-D direct percent] [-A msg texts] [-Z dictionary]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct hist msg_lat, xmsg_lat, ls_lat;
+	char *tok;
+	unsigned long sent = 0, ls = 0, delivered = 0, ls_replies = 0, late = 0;
+	unsigned long logins = 0, tls_resumed = 0, direct = 0;
+	unsigned long wire_out = 0, plain_out = 0, wire_in = 0, plain_in = 0;
+	const char *ca = NULL;
+	double secs, server_cpu = 0, bench_cpu = 0;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "H:p:c:T:r:d:w:l:s:n:CSE:FU:MP:D:A:Z:")) != -1) {
+		switch(opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			nr_ports = 0;
+			for(tok = strtok(optarg, ","); tok && nr_ports < MAX_PORTS;
+					tok = strtok(NULL, ","))
+				ports[nr_ports++] = atoi(tok);
+			break;
+		case 'c':
+			nr_conns = atoi(optarg);
+			break;
+		case 'T':
+			nr_threads = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'd':
+			duration = atof(optarg);
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		case 'l':
+			ls_pct = atof(optarg);
+			break;
+		case 's':
+			msg_size = atoi(optarg);
+			break;
+		case 'n':
+			prefix = optarg;
+			break;
+		case 'C':
+			storm = 1;
+			break;
+		case 'S':
+			storm = resume = 1;
+			break;
+		case 'E':
+			ca = optarg;
+			break;
+		case 'F':
+			full_handshakes = 1;
+			break;
+		case 'U':
+			local_path = optarg;
+			break;
+		case 'M':
+			use_shm = 1;
+			break;
+		case 'P':
+			server_pid = atoi(optarg);
+			break;
+		case 'D':
+			direct_pct = atoi(optarg);
+			break;
+		case 'A':
+			load_texts(optarg);
+			break;
+		case 'Z':
+			pack_dict = lz_dict_load(optarg);
+			if(pack_dict == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	/* the server turns msgs longer than this down */
+	if(msg_size > 200)
+		msg_size = 200;
+	if(nr_conns < 1 || nr_threads < 1 || rate <= 0 || duration <= 0
+		|| nr_ports < 1 || strlen(prefix) + 7 >= USERNAME_MAX_SIZE)
+		usage(argv[0]);
+	/* shm is for the unix socket, TLS for TCP, and logins take neither */
+	if((use_shm && (local_path == NULL || storm)) || (local_path && ca))
+		usage(argv[0]);
+	/* pairs, talking plaintext over a socket, nothing but msgs */
+	if(direct_pct >= 0 && (direct_pct > 100 || nr_conns % 2 || storm || ca
+		|| use_shm || ls_pct > 0))
+		usage(argv[0]);
+	if(ca) {
+		if(tls_client_init(ca) < 0) {
+			fprintf(stderr, "%s: no certificate in there\n", ca);
+			exit(EXIT_FAILURE);
+		}
+		use_tls = 1;
+		/* a server hanging up on an SSL_write() is no reason to die */
+		signal(SIGPIPE, SIG_IGN);
+	}
+	/* a login storm has every connection in a thread of its own */
+	if(storm || nr_threads > nr_conns)
+		nr_threads = nr_conns;
+
+	workers = calloc(nr_threads, sizeof *workers);
+	for(i = 0; i < nr_threads; i++) {
+		workers[i].conns = malloc((nr_conns / nr_threads + 1) * sizeof(struct conn *));
+		workers[i].id = i;
+		workers[i].seed = i + 1;
+		hist_init(&workers[i].msg_lat);
+		hist_init(&workers[i].xmsg_lat);
+		hist_init(&workers[i].ls_lat);
+	}
+	/* connection i goes to thread i % threads */
+	for(i = 0; i < nr_conns && !storm; i++) {
+		struct worker *w = &workers[i % nr_threads];
+		w->conns[w->nr++] = conn_open(i);
+	}
+
+	pthread_barrier_init(&ready, NULL, nr_threads + 1);
+	pthread_barrier_init(&go, NULL, nr_threads + 1);
+	for(i = 0; i < nr_threads; i++)
+		pthread_create(&workers[i].thread, NULL,
+			storm ? storm_loop : worker_loop, &workers[i]);
+	pthread_barrier_wait(&ready);
+	start_ns = now_ns();
+	measure_ns = start_ns + warmup * 1e9;
+	stop_ns = start_ns + (warmup + duration) * 1e9;
+	if(storm)
+		printf("%d threads %s for %.0fs (+%.0fs warmup)\n", nr_threads,
+			resume ? "resuming sessions" : "logging in", duration, warmup);
+	else
+		printf("%d connections, %d threads, %.0f ops/sec for %.0fs"
+			" (+%.0fs warmup), %.1f%% ls, %d byte msgs\n", nr_conns,
+			nr_threads, rate, duration, warmup, ls_pct, msg_size);
+	if(server_pid) {
+		server_cpu = proc_cpu(server_pid);
+		bench_cpu = self_cpu();
+	}
+	pthread_barrier_wait(&go);
+
+	hist_init(&msg_lat);
+	hist_init(&xmsg_lat);
+	hist_init(&ls_lat);
+	for(i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		sent += workers[i].sent;
+		ls += workers[i].ls;
+		delivered += workers[i].delivered;
+		direct += workers[i].direct;
+		ls_replies += workers[i].ls_replies;
+		late += workers[i].late;
+		logins += workers[i].logins;
+		tls_resumed += workers[i].tls_resumed;
+		wire_out += workers[i].wire_out;
+		plain_out += workers[i].plain_out;
+		wire_in += workers[i].wire_in;
+		plain_in += workers[i].plain_in;
+		hist_merge(&msg_lat, &workers[i].msg_lat);
+		hist_merge(&xmsg_lat, &workers[i].xmsg_lat);
+		hist_merge(&ls_lat, &workers[i].ls_lat);
+	}
+	if(server_pid) {
+		server_cpu = proc_cpu(server_pid) - server_cpu;
+		bench_cpu = self_cpu() - bench_cpu;
+	}
+
+	if(storm) {
+		printf("%-9s %lu (%.0f/sec)\n", resume ? "resumes" : "logins",
+			logins, logins / duration);
+		printf("%-9s %9s %9s %9s %9s %9s %9s\n", "usecs",
+			"mean", "p50", "p90", "p99", "p99.9", "max");
+		print_hist(resume ? "resume" : "login", &ls_lat);
+		if(use_tls)
+			printf("TLS handshakes: %lu resumed, %lu full\n",
+				tls_resumed, logins - tls_resumed);
+		return 0;
+	}
+
+	secs = warmup + duration;
+	printf("sent      %lu msgs (%.0f/sec), %lu ls\n", sent, sent / secs, ls);
+	printf("delivered %lu msgs (%.0f/sec), %lu after sending stopped,"
+		" %lu missing\n", delivered, delivered / secs, late,
+		sent > delivered ? sent - delivered : 0);
+	if(direct_pct >= 0)
+		printf("direct    %lu msgs (%.0f%% of those delivered)\n", direct,
+			delivered ? 100.0 * direct / delivered : 0.0);
+	printf("ls        %lu replies\n", ls_replies);
+	if(sent > 0 && delivered > 0)
+		printf("bytes     %.1f per msg sent, %.1f per msg delivered\n",
+			(double)wire_out / sent, (double)wire_in / delivered);
+	if(pack_dict && wire_out > 0 && wire_in > 0)
+		printf("packed    %.2f times smaller sent, %.2f delivered\n",
+			(double)plain_out / wire_out, (double)plain_in / wire_in);
+	printf("%-9s %9s %9s %9s %9s %9s %9s\n", "usecs",
+		"mean", "p50", "p90", "p99", "p99.9", "max");
+	print_hist("msg", &msg_lat);
+	if(nr_ports > 1)
+		print_hist("msg xnode", &xmsg_lat);
+	print_hist("ls", &ls_lat);
+	if(server_pid && delivered > 0)
+		printf("cpu       %.2f usecs per msg in the server, %.2f in the bench\n",
+			server_cpu / delivered, bench_cpu / delivered);
+	return 0;
+}
@@ -6,25 +6,184 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include "proto.h"
+#include "spsc.h"
+#include "tls.h"
+#include "shm.h"
+#include "p2p.h"
+#include "relay.h"
+#include "lz.h"
 
 #define BUFF_SIZE 256
+/* an `ls` reply holds every username on the server, let it grow big */
+#define RING_SIZE 4096
+#define RING_MAX (16 * 1024 * 1024)
+/* frames on their way from the receiver to the printer */
+#define INBOX_SIZE (1024 * 1024)
+/* what the printer gathers for one write() to stdout */
+#define OUT_BATCH (64 * 1024)
 #define USERNAME_MAX_SIZE 20
+/*
+* how often to dial again when the connection broke,
+* waiting twice as long every time, up to a limit
+*/
+#define RECONNECT_TRIES 20
+#define RECONNECT_MIN_MS 100
+#define RECONNECT_MAX_MS 2000
+/* direct links to other clients at most */
+#define LINKS_MAX 256
+/* files we asked to send and the server did not answer yet, at most */
+#define FILES_MAX 16
+/* the name a file goes by, see OP_FILE */
+#define FILE_NAME_MAX 128
+/* how much of a file one sendfile() or splice() moves at most */
+#define FILE_CHUNK (1024 * 1024)
+/*
+* ops of the inbox's own, never on the wire: something of ours for the
+* printer to print, and that we are back on a new connection
+*/
+#define OP_NOTICE 254
+#define OP_BACK   255
+
+/*
+* batch mode: commands allowed in flight, i.e. sent and not acked yet,
+* how many bytes of frames are gathered for one write() at most,
+* and how long a command line may be
+*/
+#define BATCH_WINDOW 1024
+#define BATCH_OUT_MAX (64 * 1024)
+#define BATCH_LINE_MAX 4096
 
 static unsigned short port = 55555;
+/*
+* struct sockaddr defines a socket address.
+* A socket address is a combination of address family,
+* ip address and port.
+* For IP sockets, we may use struct sockaddr_in which is
+* just a wrapper around struct sockaddr.
+* Funtions like bind() etc are only aware of struct sockaddr.
+* We keep the server's, to dial it again should the connection break.
+*/
+static struct sockaddr_in serv_addr;
+/* or the server's unix socket, with -U */
+static struct sockaddr_un local_addr;
+static int local;
 static char username[USERNAME_MAX_SIZE];
+/* what the server gave us to resume our session with, if anything */
+static char session[SESSION_TOKEN_SIZE + 1];
+/* set once we said `exit`, the server hanging up is expected then */
+static volatile int exiting;
+/*
+* TLS with the server, trusted by the certificate given with -T, NULL
+* for plaintext. Its ticket resumes the TLS session on a reconnect.
+*/
+static struct tls *tls;
+/*
+* With -M, on the unix socket, the frames go through shared memory
+* instead (shm.h), NULL until then. @shm_lock keeps the frames of the
+* console and the receiver apart, and @shm from going away under them.
+*/
+static int use_shm;
+static struct shm *shm;
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+* The receiver thread reads frames off the socket and hands them to the
+* printer thread through @inbox, a queue that takes no lock (spsc.h).
+* The printer prints them, as many as there are in one write().
+* The console waits on @reply_sem for the answer to its `ls` or `stats`:
+* the printer posts it once the reply whose id is @reply_id is printed,
+* and never for anything else.
+*/
+static struct spsc inbox;
+static sem_t reply_sem;
+static volatile unsigned short reply_id;
+
+/*
+* With -P, we take direct links from other clients (see p2p.h), and once
+* we said P2P_HEAVY msgs to somebody through the server, we ask it to
+* introduce us, and say the rest to them directly. There is a struct link
+* per user we talked to, whether there is a link to them or not.
+* The receiver reads the links along with the server's socket, and it
+* alone opens and closes them; the console writes msgs to them.
+* @links_lock keeps the list, a link's @wlock its @fd while it is written
+* to: a write that blocks holds up nobody else.
+*/
+struct link {
+	char name[USERNAME_MAX_SIZE];
+	pthread_mutex_t wlock;
+	/* the link, -1 for none */
+	int fd;
+	/* msgs go over it, else through the server */
+	int up;
+	/* msgs to them through the server, and we asked where they are */
+	unsigned int relayed;
+	int asked;
+	/* they take no direct links, there is no point in asking again */
+	int never;
+	/* read off the link, not yet a whole frame */
+	struct ringbuf in;
+	struct link *next;
+};
+
+/*
+* Files, `sendfile <user> <path>` (see relay.h). The console asks the
+* server, and the file waits in @files for the OP_FILE_GO answering it,
+* by the id of the frame. The receiver gets that and starts a thread
+* that sends the file to the relay with sendfile(), from the page cache
+* straight to the socket. With -r, a file offered to us in an OP_OFFER
+* comes in on a thread of its own too, spliced from the socket into a
+* file in @file_dir; without, none is taken. Either way the chat goes on
+* while the bytes go. What became of a file is told on stderr: the
+* printer's inbox takes frames from the receiver alone.
+*/
+struct file {
+	/* the file, and the id of the OP_FILE it was asked about in */
+	int fd;
+	unsigned short id;
+	unsigned long long size;
+	/* who it goes to, or comes from */
+	char user[USERNAME_MAX_SIZE];
+	char name[FILE_NAME_MAX + 1];
+	/* where the relay is, and what to tell it */
+	unsigned short port;
+	char token[SESSION_TOKEN_SIZE + 1];
+	/* a file coming in goes here until all of it is in */
+	char *tmp;
+};
+
+static const char *file_dir;
+static struct file *files[FILES_MAX];
+static unsigned short file_id;
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /*
-* Conditional variables (@console_cv) permit us to wait until
-* another thread completes an arbitrary activity.
-* A mutex (@console_cv_lock) is required to protect the condition
-* variable itself from race condition.
+* With -Z, msgs go packed against this dictionary (see lz.h), both ways,
+* once the server said it has it too: the receiver sets @packing when
+* the OP_PACK_OK comes, and it is cleared whenever we register afresh.
 */
-pthread_cond_t console_cv;
-pthread_mutex_t console_cv_lock;
+static struct lz_dict *pack_dict;
+static volatile int packing;
+
+static int use_p2p;
+static unsigned short p2p_port;
+static struct p2p p2p;
+static struct link *links;
+static int nr_links;
+static pthread_mutex_t links_lock = PTHREAD_MUTEX_INITIALIZER;
 
 void error(void)
 {
@@ -32,10 +191,735 @@ void error(void)
 		"syntax: [command] [optional recipient] [optional msg]");
 }
 
+/*
+* Work out what frame the command in @line makes.
+* returns its opcode, with its payload in @payload and @len,
+* 0 for an empty line, and -1 for a bad command
+*/
+int parse_command(char *line, char **payload, size_t *len)
+{
+	char *recipient, *tmp;
+
+	*payload = NULL;
+	*len = 0;
+	if(strcmp(line, "") == 0)
+		return 0;
+
+	if(strncmp(line, "exit", 4) == 0)
+		return OP_EXIT;
+	if(strncmp(line, "ls", 2) == 0)
+		return OP_LS;
+	if(strcmp(line, "stats") == 0)
+		return OP_STATS;
+
+	/* `join <room>` and `leave <room>` */
+	if(strncmp(line, "join ", 5) == 0 || strncmp(line, "leave ", 6) == 0) {
+		tmp = strchr(line, ' ') + 1;
+		if(*tmp == '\0' || strchr(tmp, ' '))
+			return -1;
+		*payload = tmp;
+		*len = strlen(tmp);
+		return line[0] == 'j' ? OP_JOIN : OP_LEAVE;
+	}
+
+	/* `broadcast <room> <msg>` sends <msg> to everybody in <room> */
+	if(strncmp(line, "broadcast ", 10) == 0) {
+		tmp = line + 10;
+		if(strchr(tmp, ' ') == NULL)
+			return -1;
+		*payload = tmp;
+		*len = strlen(tmp);
+		return OP_BROADCAST;
+	}
+
+	/* `sendfile <recipient> <path>`, the console frames it, see send_file() */
+	if(strncmp(line, "sendfile ", 9) == 0) {
+		tmp = strchr(line + 9, ' ');
+		if(tmp == NULL || tmp == line + 9 || tmp[1] == '\0')
+			return -1;
+		*payload = line + 9;
+		*len = strlen(line + 9);
+		return OP_FILE;
+	}
+
+	/* `send <recipient> <msg>` sends <msg> to the given <username> */
+	if(strncmp(line, "send ", 5) == 0) {
+		/* the following is to validate the syntax */
+		recipient = line + 5;
+		tmp = strchr(recipient, ' ');
+		if(tmp == NULL)
+			return -1;
+		/* the `send` command goes to the server as "<recipient> <msg>" */
+		*payload = recipient;
+		*len = strlen(recipient);
+		return OP_SEND;
+	}
+	return -1;
+}
+
+/* a whole frame in @buf, which has room for FRAME_HDR_SIZE + @len */
+static size_t frame_make(char *buf, int op, int flags, int id,
+	const void *payload, size_t len)
+{
+	frame_pack((unsigned char *)buf, op, flags, id, len);
+	if(len > 0)
+		memcpy(buf + FRAME_HDR_SIZE, payload, len);
+	return FRAME_HDR_SIZE + len;
+}
+
+/* the server hung up on @sockfd, which carries nothing else anymore */
+static int hung_up(int sockfd)
+{
+	struct pollfd pfd;
+
+	pfd.fd = sockfd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) != 0;
+}
+
+/*
+* all of @len bytes of @frame into the ring, with @shm_lock held.
+* A full ring is waited out a millisecond at a time: our doorbell is
+* the receiver's to wait on, and the server drains the ring soon enough
+*/
+static int shm_write_wait(int sockfd, const char *frame, size_t len)
+{
+	struct timespec ts = {0, 1000000};
+	struct iovec iov;
+	ssize_t n;
+
+	while(len > 0) {
+		iov.iov_base = (void *)frame;
+		iov.iov_len = len;
+		n = shm ? shm_writev(shm, &iov, 1) : -1;
+		if(n < 0 && errno == EAGAIN && !hung_up(sockfd)) {
+			nanosleep(&ts, NULL);
+			continue;
+		}
+		if(n < 0)
+			return -1;
+		frame += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+* frame_write(), through shm or TLS if we have that. The console and the
+* receiver both write, a frame goes to shm_write_wait() or
+* tls_write_wait() in one piece so that no other ends up in the middle of it.
+*/
+static int send_frame(int sockfd, int op, int flags, int id,
+	const void *payload, size_t len)
+{
+	char frame[FRAME_HDR_SIZE + BUFF_SIZE];
+	int ret;
+
+	if(tls == NULL && !use_shm)
+		return frame_write(sockfd, op, flags, id, payload, len);
+	if(len > BUFF_SIZE)
+		return -1;
+	len = frame_make(frame, op, flags, id, payload, len);
+	if(tls)
+		return tls_write_wait(tls, frame, len);
+	pthread_mutex_lock(&shm_lock);
+	ret = shm_write_wait(sockfd, frame, len);
+	pthread_mutex_unlock(&shm_lock);
+	return ret;
+}
+
+/*
+* send_frame() for a command, a msg packed if the server takes them
+* packed and packing makes it smaller
+*/
+static int send_command(int sockfd, int op, int id, const char *payload, size_t len)
+{
+	char packed[BUFF_SIZE];
+	size_t n = 0;
+
+	if(packing && (op == OP_SEND || op == OP_BROADCAST) && len > 1)
+		n = lz_pack(pack_dict, payload, len, packed,
+			len - 1 < sizeof packed ? len - 1 : sizeof packed);
+	if(n > 0)
+		return send_frame(sockfd, op, FLAG_PACKED, id, packed, n);
+	return send_frame(sockfd, op, 0, id, payload, len);
+}
+
+/* a new socket connected to the server, over TCP or the unix socket */
+static int dial(void)
+{
+	int fd;
+
+	if(local) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(connect(fd, (struct sockaddr *)&local_addr, sizeof local_addr) == 0)
+			return fd;
+	} else {
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(connect(fd, (struct sockaddr *)&serv_addr, sizeof serv_addr) == 0)
+			return fd;
+	}
+	close(fd);
+	return -1;
+}
+
+/*
+* ring_read() off the rings, waiting for the server to put something in
+* there. returns 0 once the socket says the server is gone
+*/
+static ssize_t shm_read_wait(int sockfd, struct ringbuf *rb)
+{
+	struct pollfd pfd[2];
+	ssize_t n;
+
+	for(;;) {
+		n = shm_ring_read(shm, rb);
+		if(n >= 0 || errno != EAGAIN)
+			return n;
+		pfd[0].fd = sockfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = shm->bell;
+		pfd[1].events = POLLIN;
+		if(poll(pfd, 2, -1) < 0)
+			continue;
+		if(pfd[0].revents)
+			return 0;
+		shm_ack(shm);
+	}
+}
+
+/* tell the printer something of our own, as if the server had said it */
+static void notice(const char *what)
+{
+	spsc_push(&inbox, OP_NOTICE, 0, what, strlen(what));
+}
+
+/*
+* and that we are back: a reply the console waits for went with the old
+* connection, the printer lets it go once this is printed
+*/
+static void notice_back(const char *what)
+{
+	spsc_push(&inbox, OP_BACK, 0, what, strlen(what));
+}
+
+/* OP_PACK_OK, the server has our dictionary if it says its id */
+static int packing_agreed(const char *payload, size_t len)
+{
+	char ours[16];
+	int n = sprintf(ours, "%08x", pack_dict->id);
+
+	return len == (size_t)n && memcmp(payload, ours, n) == 0;
+}
+
+/* the link of @name, @len bytes of it, a new one if @create and there is none */
+static struct link *find_link(const char *name, size_t len, int create)
+{
+	struct link *l;
+
+	for(l = links; l; l = l->next)
+		if(strncmp(l->name, name, len) == 0 && l->name[len] == '\0')
+			return l;
+	if(!create || nr_links == LINKS_MAX || len >= USERNAME_MAX_SIZE)
+		return NULL;
+	l = calloc(1, sizeof *l);
+	memcpy(l->name, name, len);
+	pthread_mutex_init(&l->wlock, NULL);
+	l->fd = -1;
+	ring_init(&l->in, RING_SIZE, RING_MAX);
+	l->next = links;
+	links = l;
+	nr_links++;
+	return l;
+}
+
+/*
+* `send <recipient> <msg>` over a direct link, if there is one up.
+* returns 1 if it went, 0 if it is for the server to relay. The server
+* is asked where they are once it relayed P2P_HEAVY msgs to them.
+*/
+static int send_direct(int sockfd, char *payload, size_t len)
+{
+	char buf[BUFF_SIZE + USERNAME_MAX_SIZE + 2];
+	char *msg = memchr(payload, ' ', len);
+	struct link *l;
+	size_t n, msglen;
+	int sent = 0, ask = 0;
+
+	if(msg == NULL)
+		return 0;
+	pthread_mutex_lock(&links_lock);
+	l = find_link(payload, msg - payload, 1);
+	pthread_mutex_unlock(&links_lock);
+	if(l == NULL)
+		return 0;
+	msg++;
+	msglen = len - (msg - payload);
+
+	pthread_mutex_lock(&l->wlock);
+	if(l->up) {
+		/* just what the server would have made of it */
+		n = sprintf(buf, "%s: ", username);
+		memcpy(buf + n, msg, msglen);
+		if(frame_write(l->fd, OP_MSG, 0, 0, buf, n + msglen) == 0) {
+			sent = 1;
+		} else {
+			/* the receiver finds it broken too, and closes it */
+			l->up = 0;
+			shutdown(l->fd, SHUT_RDWR);
+		}
+	}
+	if(!sent && l->fd < 0 && !l->asked && !l->never && ++l->relayed >= P2P_HEAVY)
+		ask = l->asked = 1;
+	pthread_mutex_unlock(&l->wlock);
+	if(ask)
+		send_frame(sockfd, OP_WHERE, 0, 0, l->name, strlen(l->name));
+	return sent;
+}
+
+/*
+* a link to @name came up, we dialed it if @dialed. When both ends dial
+* at once, there are two: both keep the one dialed by whose name sorts
+* first, and close the other
+*/
+static void link_up(const char *name, int fd, int dialed)
+{
+	char what[USERNAME_MAX_SIZE + 32];
+	struct link *l;
+
+	pthread_mutex_lock(&links_lock);
+	l = find_link(name, strlen(name), 1);
+	pthread_mutex_unlock(&links_lock);
+	if(l == NULL || (l->fd >= 0 && dialed != (strcmp(username, name) < 0))) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&l->wlock);
+	if(l->fd >= 0)
+		close(l->fd);
+	l->fd = fd;
+	l->up = 1;
+	l->in.head = l->in.tail;
+	pthread_mutex_unlock(&l->wlock);
+	sprintf(what, "(talking to %s directly)", name);
+	notice(what);
+}
+
+/* the link broke, back to the server, until we said enough again */
+static void link_down(struct link *l)
+{
+	char what[USERNAME_MAX_SIZE + 48];
+
+	pthread_mutex_lock(&l->wlock);
+	close(l->fd);
+	l->fd = -1;
+	l->up = 0;
+	l->asked = 0;
+	l->relayed = 0;
+	pthread_mutex_unlock(&l->wlock);
+	sprintf(what, "(talking to %s through the server again)", l->name);
+	notice(what);
+}
+
+/*
+* the msgs that came in over @l, on to the printer. A msg that claims
+* to be from anybody but who is at the other end breaks the link
+*/
+static void link_read(struct link *l)
+{
+	struct frame_hdr fh;
+	char *payload;
+	size_t len = strlen(l->name);
+	int ret;
+
+	if(ring_read(l->fd, &l->in) <= 0) {
+		link_down(l);
+		return;
+	}
+	while((ret = frame_next(&l->in, &fh, &payload)) > 0) {
+		if(fh.op != OP_MSG || fh.len < len + 2 || memcmp(payload, l->name, len)
+			|| payload[len] != ':') {
+			ret = -1;
+			break;
+		}
+		spsc_push(&inbox, fh.op, 0, payload, fh.len);
+	}
+	if(ret < 0)
+		link_down(l);
+}
+
+/*
+* OP_PEER: where the user we asked about takes direct links, dial it.
+* If it does not, we never ask again; if it does and the dial fails,
+* once we said enough again
+*/
+static void peer_found(char *payload, size_t len)
+{
+	char name[USERNAME_MAX_SIZE], addr[64], nonce[P2P_NONCE_MAX + 1];
+	char buf[BUFF_SIZE];
+	struct sockaddr_in sa;
+	struct link *l;
+	int fd = -1, n;
+
+	if(len >= sizeof buf)
+		return;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	n = sscanf(buf, "%19s %63s %32s", name, addr, nonce);
+	if(n < 1)
+		return;
+	if(n == 3 && p2p_addr(addr, &sa) == 0)
+		fd = p2p_dial(&sa, username, nonce);
+	if(fd >= 0) {
+		link_up(name, fd, 1);
+		return;
+	}
+	pthread_mutex_lock(&links_lock);
+	l = find_link(name, strlen(name), 0);
+	pthread_mutex_unlock(&links_lock);
+	if(l == NULL)
+		return;
+	pthread_mutex_lock(&l->wlock);
+	l->never = n < 3;
+	l->asked = 0;
+	l->relayed = 0;
+	pthread_mutex_unlock(&l->wlock);
+}
+
+/* OP_INTRO: @name is going to dial us, unless it did already */
+static void intro(char *payload, size_t len)
+{
+	char name[USERNAME_MAX_SIZE], nonce[P2P_NONCE_MAX + 1], buf[BUFF_SIZE];
+	int fd;
+
+	if(len >= sizeof buf)
+		return;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	if(sscanf(buf, "%19s %32s", name, nonce) != 2)
+		return;
+	fd = p2p_expect(&p2p, name, nonce);
+	if(fd >= 0)
+		link_up(name, fd, 0);
+}
+
+/*
+* ring_read() off the server's socket, taking in links and whatever
+* comes over them on the way. The receiver alone opens and closes links,
+* the fds it polls stay what they were until it is done with them.
+*/
+static ssize_t p2p_read_wait(int sockfd, struct ringbuf *rb)
+{
+	struct pollfd pfd[2 + LINKS_MAX];
+	struct link *ls[LINKS_MAX], *l;
+	char name[P2P_NAME_MAX];
+	int i, n, fd;
+
+	for(;;) {
+		pfd[0].fd = sockfd;
+		pfd[1].fd = p2p.fd;
+		n = 2;
+		pthread_mutex_lock(&links_lock);
+		for(l = links; l; l = l->next) {
+			if(l->fd >= 0) {
+				ls[n - 2] = l;
+				pfd[n++].fd = l->fd;
+			}
+		}
+		pthread_mutex_unlock(&links_lock);
+		for(i = 0; i < n; i++)
+			pfd[i].events = POLLIN;
+		if(poll(pfd, n, -1) < 0)
+			continue;
+		for(i = 2; i < n; i++)
+			if(pfd[i].revents)
+				link_read(ls[i - 2]);
+		/* after the reads: a new link may take the place of one polled */
+		if(pfd[1].revents)
+			while((fd = p2p_accept(&p2p, name)) >= 0)
+				link_up(name, fd, 0);
+		spsc_wake(&inbox);
+		if(pfd[0].revents)
+			return ring_read(sockfd, rb);
+	}
+}
+
+/* a connection to the relay on @port, as @end of the transfer of @token */
+static int dial_relay(unsigned short port, const char *token, int end)
+{
+	struct sockaddr_in addr = serv_addr;
+	char hello[RELAY_HELLO_SIZE];
+	int fd;
+
+	/* over the unix socket, the server is on this host */
+	if(local)
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	memcpy(hello, token, SESSION_TOKEN_SIZE);
+	hello[SESSION_TOKEN_SIZE] = end;
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0
+		|| write(fd, hello, sizeof hello) != sizeof hello) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static double since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* how it went, on stderr. @what is "sent ... to" or "received ... from" */
+static void file_done(struct file *f, const char *what, unsigned long long done,
+	const struct timespec *start)
+{
+	double secs = since(start);
+
+	fprintf(stderr, "(");
+	fprintf(stderr, what, f->name, f->user);
+	if(done == f->size)
+		fprintf(stderr, ", %.1f MB in %.2f s, %.1f MB/s)\n", done / 1e6, secs,
+			secs > 0 ? done / secs / 1e6 : 0);
+	else
+		fprintf(stderr, ", cut short at %llu of %llu bytes)\n", done, f->size);
+	close(f->fd);
+	free(f->tmp);
+	free(f);
+}
+
+/* a thread sending file @arg to the relay */
+static void *file_out(void *arg)
+{
+	struct file *f = arg;
+	struct timespec start;
+	unsigned long long done = 0;
+	off_t off = 0;
+	ssize_t n;
+	int fd;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = dial_relay(f->port, f->token, RELAY_SENDER);
+	while(fd >= 0 && done < f->size) {
+		n = sendfile(fd, f->fd, &off, f->size - done < FILE_CHUNK
+			? f->size - done : FILE_CHUNK);
+		if(n <= 0)
+			break;
+		done += n;
+	}
+	if(fd >= 0)
+		close(fd);
+	file_done(f, "sent %s to %s", done, &start);
+	return NULL;
+}
+
+/* a thread taking file @arg in from the relay, socket to pipe to file */
+static void *file_in(void *arg)
+{
+	struct file *f = arg;
+	struct timespec start;
+	unsigned long long done = 0;
+	char path[4096];
+	ssize_t n, m;
+	int fd, p[2] = {-1, -1}, ok = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fd = dial_relay(f->port, f->token, RELAY_RECIPIENT);
+	if(fd >= 0 && pipe2(p, O_CLOEXEC) == 0)
+		fcntl(p[1], F_SETPIPE_SZ, FILE_CHUNK);
+	while(fd >= 0 && p[0] >= 0 && ok && done < f->size) {
+		n = splice(fd, NULL, p[1], NULL, f->size - done < FILE_CHUNK
+			? f->size - done : FILE_CHUNK, SPLICE_F_MOVE);
+		if(n <= 0)
+			break;
+		while(n > 0) {
+			m = splice(p[0], NULL, f->fd, NULL, n, SPLICE_F_MOVE);
+			if(m <= 0) {
+				ok = 0;
+				break;
+			}
+			n -= m;
+			done += m;
+		}
+	}
+	if(p[0] >= 0) {
+		close(p[0]);
+		close(p[1]);
+	}
+	if(fd >= 0)
+		close(fd);
+	/*
+	* only a file that came in whole goes by its name, and never over
+	* one that turned up there meanwhile: link() does not replace it
+	*/
+	snprintf(path, sizeof path, "%s/%s", file_dir, f->name);
+	if(done == f->size && link(f->tmp, path) < 0)
+		fprintf(stderr, "(not keeping %s from %s, there is one now)\n",
+			f->name, f->user);
+	unlink(f->tmp);
+	file_done(f, "received %s from %s", done, &start);
+	return NULL;
+}
+
+/*
+* `sendfile <recipient> <path>`: ask the server to relay the file at
+* <path> to <recipient>, as the name it has in its dir
+*/
+static void send_file(int sockfd, char *args)
+{
+	char *path = strchr(args, ' '), *base, buf[BUFF_SIZE];
+	struct stat st;
+	struct file *f;
+	int fd, i, n;
+
+	*path++ = '\0';
+	base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if(strlen(args) >= USERNAME_MAX_SIZE || *base == '\0'
+		|| strlen(base) > FILE_NAME_MAX) {
+		error();
+		return;
+	}
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd < 0 || fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "%s: no file to send\n", path);
+		if(fd >= 0)
+			close(fd);
+		return;
+	}
+	f = calloc(1, sizeof *f);
+	f->fd = fd;
+	f->size = st.st_size;
+	strcpy(f->user, args);
+	strcpy(f->name, base);
+	pthread_mutex_lock(&files_lock);
+	for(i = 0; i < FILES_MAX && files[i]; i++)
+		;
+	if(i < FILES_MAX) {
+		f->id = ++file_id;
+		files[i] = f;
+	}
+	pthread_mutex_unlock(&files_lock);
+	if(i == FILES_MAX) {
+		fprintf(stderr, "%s\n", "too many files waiting for the server");
+		close(fd);
+		free(f);
+		return;
+	}
+	n = sprintf(buf, "%s %llu %s", f->user, f->size, f->name);
+	send_frame(sockfd, OP_FILE, 0, f->id, buf, n);
+}
+
+/* OP_FILE_GO: the server's answer about the file of frame @id */
+static void file_go(int id, char *payload, size_t len)
+{
+	char buf[BUFF_SIZE];
+	struct file *f = NULL;
+	pthread_t thread;
+	unsigned int port;
+	int i;
+
+	pthread_mutex_lock(&files_lock);
+	for(i = 0; i < FILES_MAX; i++) {
+		if(files[i] && files[i]->id == id) {
+			f = files[i];
+			files[i] = NULL;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&files_lock);
+	if(f == NULL || len >= sizeof buf)
+		return;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	if(sscanf(buf, "%*s %u %32s", &port, f->token) != 2
+		|| strlen(f->token) != SESSION_TOKEN_SIZE) {
+		fprintf(stderr, "(%s takes no files from us)\n", f->user);
+		close(f->fd);
+		free(f);
+		return;
+	}
+	f->port = port;
+	pthread_create(&thread, NULL, file_out, f);
+	pthread_detach(thread);
+}
+
+/*
+* OP_OFFER: a file is coming our way. With -r, it goes into that dir
+* under its name, unless there is a file of that name already, or the
+* name is one of a dot file: then it is not taken, and the server gives
+* up on it in time. It comes in under a name of its own, see file_in().
+*/
+static void file_offered(char *payload, size_t len)
+{
+	char buf[BUFF_SIZE], path[4096], *name;
+	struct stat st;
+	struct file *f;
+	pthread_t thread;
+	unsigned int port;
+	int offset = 0;
+
+	if(len >= sizeof buf)
+		return;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	f = calloc(1, sizeof *f);
+	if(sscanf(buf, "%19s %llu %u %32s %n", f->user, &f->size, &port,
+		f->token, &offset) != 4 || offset == 0) {
+		free(f);
+		return;
+	}
+	name = buf + offset;
+	f->port = port;
+	if(file_dir == NULL) {
+		fprintf(stderr, "(not taking %s from %s, -r takes files)\n",
+			name, f->user);
+		free(f);
+		return;
+	}
+	/*
+	* the server lets no dir through, nor should we. Nor a .profile
+	* or the like, for somebody else to have run in our name.
+	*/
+	if(strlen(name) > FILE_NAME_MAX || strchr(name, '/') || name[0] == '.') {
+		fprintf(stderr, "(not taking %s from %s, not by that name)\n",
+			name, f->user);
+		free(f);
+		return;
+	}
+	snprintf(path, sizeof path, "%s/%s", file_dir, name);
+	if(lstat(path, &st) == 0) {
+		fprintf(stderr, "(not taking %s from %s, there is one here)\n",
+			name, f->user);
+		free(f);
+		return;
+	}
+	snprintf(path, sizeof path, "%s/.incoming.XXXXXX", file_dir);
+	if((f->fd = mkostemp(path, O_CLOEXEC)) < 0) {
+		perror(file_dir);
+		free(f);
+		return;
+	}
+	fchmod(f->fd, 0644);
+	f->tmp = strdup(path);
+	strcpy(f->name, name);
+	fprintf(stderr, "(receiving %s from %s, %llu bytes)\n", name, f->user,
+		f->size);
+	pthread_create(&thread, NULL, file_in, f);
+	pthread_detach(thread);
+}
+
 void console(int sockfd)
 {
 	char buffer[BUFF_SIZE];
-	char *recipient, *msg, *tmp;
+	char *payload;
+	size_t len;
+	unsigned short ls_id = 0;
+	int op;
 
 	memset(buffer, 0, sizeof buffer);
 	printf("%s\n%s\n", "Welcome to chat client console. Please enter commands",
@@ -49,140 +933,697 @@ void console(int sockfd)
 	while(1) {
 		/* console prompt */
 		printf("[%s]$ ", username);
+		fflush(stdout);
 		fgets(buffer, sizeof buffer, stdin);
 		/* fgets also reads the \n from stdin, strip it */
 		buffer[strlen(buffer) - 1] = '\0';
 
-		if(strcmp(buffer, "") == 0)
+		op = parse_command(buffer, &payload, &len);
+		if(op == 0)
 			continue;
+		if(op < 0) {
+			error();
+			continue;
+		}
 
-		if(strncmp(buffer, "exit", 4) == 0) {
+		if(op == OP_EXIT) {
 			/* tell server to clean up structures for the client */
-			write(sockfd, "exit", 6);
-			/* clean up self and exit */
-			pthread_mutex_destroy(&console_cv_lock);
-			pthread_cond_destroy(&console_cv);
+			exiting = 1;
+			send_frame(sockfd, OP_EXIT, 0, 0, NULL, 0);
 			_exit(EXIT_SUCCESS);
 		}
 
 		/*
 		* `ls` is sent to server to get list of connected users.
-		* It is written to server's socket, then using conditional wait,
-		* we `wait` until the reply arrives in the receiver thread, where
-		* `signal` is done immediately when the reply is read
+		* We wait for the reply to come through the printer, before
+		* prompting again. The request id tells our reply from any other,
+		* an id of 0 would be no request at all.
+		* `stats` waits for its reply just the same.
 		*/
-		if(strncmp(buffer, "ls", 2) == 0) {
-			/*
-			* The mutex the protects the conditional has to
-			* be locked before a conditional wait.
-			*/
-			pthread_mutex_lock(&console_cv_lock);
-			write(sockfd, "ls", 2);
-			/* not protected from spurious wakeups */
-			/*
-			* This operation unlocks the given mutex and waits until a 
-			* pthread_cond_signal() happens on the same conditonal variable.
-			* Then the given mutex is again unlocked
-			*/
-			pthread_cond_wait(&console_cv, &console_cv_lock);
-			/* release the mutex */
-			pthread_mutex_unlock(&console_cv_lock);
+		if(op == OP_LS || op == OP_STATS) {
+			if(++ls_id == 0)
+				ls_id = 1;
+			reply_id = ls_id;
+			send_frame(sockfd, op, 0, ls_id, NULL, 0);
+			while(sem_wait(&reply_sem) < 0 && errno == EINTR)
+				;
 			continue;
 		}
 
-		/* `send <recipient> <msg>` sends <msg> to the given <username> */
-		if(strncmp(buffer, "send ", 5) == 0) {
-			/* the following is to validate the syntax */
-			tmp = strchr(buffer, ' ');
-			if(tmp == NULL) {
-				error();
-				continue;
-			}
-			recipient = tmp + 1;
-
-			tmp = strchr(recipient, ' ');
-			if(tmp == NULL) {
-				error();
-				continue;
-			}
-			msg = tmp + 1;
-
-			/* issue the `send` command to server */
-			write(sockfd, buffer, 5 + strlen(recipient) + 1 + strlen(msg) + 1);
+		if(op == OP_FILE) {
+			send_file(sockfd, payload);
 			continue;
 		}
-
-		error();
+		if(op == OP_SEND && use_p2p && send_direct(sockfd, payload, len))
+			continue;
+		send_command(sockfd, op, 0, payload, len);
 	}
 }
 
 /*
-* write username to server
-* in the syntax: register username <username>
+* write username to server, in a register frame, with -P where others
+* may dial us, and with -Z which dictionary we pack msgs against.
+* Nothing goes packed until the server says it has it too.
 */
 void register_username(int sockfd)
 {
-	char *regstring = malloc(USERNAME_MAX_SIZE + 18);
-	sprintf(regstring, "register username %s", username);
-	write(sockfd, regstring, strlen(regstring));
-	free(regstring);
+	char buf[16];
+
+	send_frame(sockfd, OP_REGISTER, 0, 0, username, strlen(username));
+	if(use_p2p)
+		send_frame(sockfd, OP_P2P, 0, 0, buf, sprintf(buf, "%u", p2p.port));
+	if(pack_dict) {
+		packing = 0;
+		send_frame(sockfd, OP_PACK, 0, 0, buf, sprintf(buf, "%08x",
+			pack_dict->id));
+	}
+}
+
+/*
+* The connection broke. With a session, dial the server again, for a
+* while, and resume the session on the new connection (see OP_RESUME).
+* It takes the place of the old one, under the same fd, so the console
+* goes on writing to it none the wiser. What it wrote in between is lost.
+* Over TLS, the handshake resumes the TLS session with the last ticket.
+* On shm, the new connection gets new rings, the resume goes first in there.
+* returns 0 if there is no session, or no server to be reached
+*/
+static int reconnect(int sockfd)
+{
+	char payload[USERNAME_MAX_SIZE + 1 + SESSION_TOKEN_SIZE];
+	char frame[FRAME_HDR_SIZE + sizeof payload];
+	struct timespec ts;
+	long ms = RECONNECT_MIN_MS;
+	struct shm *s;
+	int fd, i, len;
+
+	if(session[0] == '\0' || exiting)
+		return 0;
+	notice("(lost connection to server, reconnecting)");
+	spsc_wake(&inbox);
+	for(i = 0; i < RECONNECT_TRIES; i++) {
+		fd = dial();
+		if(fd >= 0 && use_shm) {
+			s = shm_connect(fd);
+			if(s) {
+				/* the new rings take over with the resume in them */
+				len = sprintf(payload, "%s %s", username, session);
+				len = frame_make(frame, OP_RESUME, FLAG_ACK, 0, payload, len);
+				pthread_mutex_lock(&shm_lock);
+				shm_free(shm);
+				shm = s;
+				shm_write_wait(fd, frame, len);
+				dup2(fd, sockfd);
+				pthread_mutex_unlock(&shm_lock);
+				close(fd);
+				return 1;
+			}
+			close(fd);
+		} else if(fd >= 0 && tls) {
+			/* tls_connect() writes the resume first, and moves the fd */
+			len = sprintf(payload, "%s %s", username, session);
+			len = frame_make(frame, OP_RESUME, FLAG_ACK, 0, payload, len);
+			if(tls_connect(tls, fd, frame, len) == 0)
+				return 1;
+		} else if(fd >= 0) {
+			/* resume first, the console may write as soon as the fd is back */
+			len = sprintf(payload, "%s %s", username, session);
+			frame_write(fd, OP_RESUME, FLAG_ACK, 0, payload, len);
+			dup2(fd, sockfd);
+			close(fd);
+			return 1;
+		}
+		ts.tv_sec = ms / 1000;
+		ts.tv_nsec = ms % 1000 * 1000000;
+		nanosleep(&ts, NULL);
+		ms = ms * 2 < RECONNECT_MAX_MS ? ms * 2 : RECONNECT_MAX_MS;
+	}
+	return 0;
 }
 
 /*
 * the stupid receiver thread
-* It continuously waits for messages from the server,
-* and prints it whatever it is.
+* It continuously waits for frames from the server,
+* and hands them over to the printer.
 */
 void *receiver(void *sfd)
 {
-	char buffer[BUFF_SIZE] = {0};
+	struct ringbuf ring;
+	struct frame_hdr fh;
+	char *payload, unpacked[2 * BUFF_SIZE];
 	int sockfd = *(int*)sfd;
-	int readlen;
+	int readlen, ret;
+	ssize_t n;
+
+	ring_init(&ring, RING_SIZE, RING_MAX);
 	/*
 	* If a new msg is received when we are processing the prev msg,
 	* the kernel buffers the received data for us since we use streaming sockets.
 	* It waits in queue until the next read().
 	* That's the reason we do not create a thread for every received msg.
+	* A read() may bring in several frames, or only part of one: the ring
+	* holds on to the bytes until a whole frame has arrived.
 	*/
 	while(1) {
-		memset(buffer, 0, sizeof buffer);
-		readlen = read(sockfd, buffer, sizeof buffer);
+		if(shm)
+			readlen = shm_read_wait(sockfd, &ring);
+		else if(use_p2p)
+			readlen = p2p_read_wait(sockfd, &ring);
+		else
+			readlen = tls ? tls_read_wait(tls, &ring) : ring_read(sockfd, &ring);
+		if(readlen < 1 && reconnect(sockfd)) {
+			/* a frame cut short by the break is of no use */
+			ring.head = ring.tail;
+			continue;
+		}
 		if(readlen < 1)
+			break;
+		while((ret = frame_next(&ring, &fh, &payload)) > 0) {
+			if(fh.op == OP_SESSION && fh.len == SESSION_TOKEN_SIZE) {
+				memcpy(session, payload, SESSION_TOKEN_SIZE);
+				continue;
+			}
+			/* introductions, to other clients for direct links */
+			if(fh.op == OP_PEER) {
+				peer_found(payload, fh.len);
+				continue;
+			}
+			if(fh.op == OP_INTRO) {
+				intro(payload, fh.len);
+				continue;
+			}
+			/* files, to and from other clients through the relay */
+			if(fh.op == OP_FILE_GO) {
+				file_go(fh.id, payload, fh.len);
+				continue;
+			}
+			if(fh.op == OP_OFFER) {
+				file_offered(payload, fh.len);
+				continue;
+			}
+			/* the server checking on us, nothing to print */
+			if(fh.op == OP_PING) {
+				send_frame(sockfd, OP_PONG, 0, 0, NULL, 0);
+				continue;
+			}
+			if(fh.op == OP_PACK_OK) {
+				packing = packing_agreed(payload, fh.len);
+				if(!packing)
+					notice("(the server has not got our dictionary,"
+						" msgs go as they are)");
+				continue;
+			}
+			/* packed against our dictionary, unpacked for the printer */
+			if(fh.flags & FLAG_PACKED) {
+				n = pack_dict ? lz_unpack(pack_dict, payload, fh.len,
+					unpacked, sizeof unpacked) : -1;
+				if(n < 0) {
+					ret = -1;
+					break;
+				}
+				payload = unpacked;
+				fh.len = n;
+			}
+			/* the only frame we ever want acked is OP_RESUME */
+			if(fh.op == OP_ACK && fh.len == 1) {
+				if(payload[0] == ACK_OK) {
+					notice_back("(reconnected)");
+					continue;
+				}
+				/* too late, start afresh under the same name */
+				notice_back("(reconnected, the session is gone)");
+				session[0] = '\0';
+				register_username(sockfd);
+				continue;
+			}
+			spsc_push(&inbox, fh.op, fh.id, payload, fh.len);
+		}
+		spsc_wake(&inbox);
+		if(ret < 0) {
+			fprintf(stderr, "%s\n", "bad frame from server");
+			_exit(EXIT_FAILURE);
+		}
+	}
+	/* a frame of op 0 tells the printer the server is gone */
+	if(!exiting) {
+		spsc_push(&inbox, 0, 0, NULL, 0);
+		spsc_wake(&inbox);
+	}
+	return NULL;
+}
+
+static void flush_out(char *out, size_t *outlen)
+{
+	struct iovec iov;
+
+	if(*outlen == 0)
+		return;
+	iov.iov_base = out;
+	iov.iov_len = *outlen;
+	writev_all(STDOUT_FILENO, &iov, 1);
+	*outlen = 0;
+}
+
+/*
+* the printer thread
+* Prints whatever frames the receiver queued, gathered up: the batch is
+* written once there is nothing more to print for now, or it is full.
+* A burst of msgs is a single write(), however many there are.
+*/
+void *printer(void *arg)
+{
+	static char out[OUT_BATCH];
+	struct iovec iov[2];
+	struct frame_hdr fh;
+	char *payload;
+	size_t outlen = 0;
+
+	while(1) {
+		if(!spsc_peek(&inbox, &fh, &payload, 0)) {
+			flush_out(out, &outlen);
+			spsc_peek(&inbox, &fh, &payload, 1);
+		}
+		if(fh.op == 0) {
+			flush_out(out, &outlen);
+			fprintf(stderr, "%s\n", "lost connection to server");
+			_exit(EXIT_FAILURE);
+		}
+		if(outlen + fh.len + 1 > sizeof out)
+			flush_out(out, &outlen);
+		if(fh.len + 1 > sizeof out) {
+			/* too big to gather, it goes out on its own */
+			iov[0].iov_base = payload;
+			iov[0].iov_len = fh.len;
+			iov[1].iov_base = "\n";
+			iov[1].iov_len = 1;
+			writev_all(STDOUT_FILENO, iov, 2);
+		} else {
+			memcpy(out + outlen, payload, fh.len);
+			outlen += fh.len;
+			out[outlen++] = '\n';
+		}
+		spsc_pop(&inbox);
+
+		/*
+		* the console waits for this one, it must be out before the
+		* prompt. A reply that the connection breaking took with it is
+		* not waited for any longer, once we are back.
+		*/
+		if(reply_id != 0 && (fh.op == OP_BACK
+			|| ((fh.op == OP_LS_REPLY || fh.op == OP_STATS_REPLY)
+				&& fh.id == reply_id))) {
+			flush_out(out, &outlen);
+			reply_id = 0;
+			sem_post(&reply_sem);
+		}
+	}
+	return NULL;
+}
+
+/*
+* Batch mode, for scripts that have a lot to say.
+* Commands are read from a file or a pipe rather than typed in, and sent
+* without waiting for the server to answer each one: every frame asks
+* for an OP_ACK (see FLAG_ACK), and up to @window commands may be in
+* flight at once. The frames of whatever lines came in are gathered in
+* @out and go out in as few write()s as the socket takes.
+* One thread does all of it, poll()ing the input and the socket.
+*/
+struct batch {
+	int infd, sockfd;
+	unsigned int window, inflight;
+	unsigned short seq;
+	/* the input ended, and there are no more commands either */
+	int ineof, eof;
+	/* input read, not yet cut into lines */
+	char in[BATCH_LINE_MAX];
+	size_t inlen;
+	/* frames not yet written */
+	char out[BATCH_OUT_MAX + FRAME_HDR_SIZE + BATCH_LINE_MAX];
+	size_t outlen;
+	/* what to tell at the end */
+	unsigned long cmds, bad, writes, bytes, packed;
+	unsigned long acks[ACK_DROPPED + 1];
+};
+
+/* frame the command in @line onto the output of @b */
+static void batch_command(struct batch *b, char *line)
+{
+	char *payload;
+	size_t len, n;
+	int op;
+
+	op = parse_command(line, &payload, &len);
+	if(op == 0)
+		return;
+	/* files go from the console, with a thread of their own each */
+	if(op < 0 || op == OP_FILE) {
+		fprintf(stderr, "bad command: %s\n", line);
+		b->bad++;
+		return;
+	}
+	/* `exit` ends the input, we leave once everything is acked */
+	if(op == OP_EXIT) {
+		b->eof = 1;
+		return;
+	}
+	/* a msg packed right into the output, if that makes it smaller */
+	n = 0;
+	if(packing && (op == OP_SEND || op == OP_BROADCAST) && len > 1)
+		n = lz_pack(pack_dict, payload, len,
+			b->out + b->outlen + FRAME_HDR_SIZE, len - 1);
+	if(n > 0) {
+		frame_pack((unsigned char *)b->out + b->outlen, op,
+			FLAG_ACK | FLAG_PACKED, b->seq++, n);
+		b->outlen += FRAME_HDR_SIZE + n;
+		b->packed++;
+	} else {
+		frame_pack((unsigned char *)b->out + b->outlen, op, FLAG_ACK,
+			b->seq++, len);
+		memcpy(b->out + b->outlen + FRAME_HDR_SIZE, payload, len);
+		b->outlen += FRAME_HDR_SIZE + len;
+	}
+	b->inflight++;
+	b->cmds++;
+}
+
+/*
+* cut the input read so far into lines and frame them,
+* as long as the window and the output buffer have room
+*/
+static void batch_fill(struct batch *b)
+{
+	char *nl;
+	size_t used = 0;
+
+	while(!b->eof && b->inflight < b->window && b->outlen < BATCH_OUT_MAX) {
+		nl = memchr(b->in + used, '\n', b->inlen - used);
+		if(nl == NULL)
+			break;
+		*nl = '\0';
+		batch_command(b, b->in + used);
+		used = nl + 1 - b->in;
+	}
+	memmove(b->in, b->in + used, b->inlen - used);
+	b->inlen -= used;
+	if(b->ineof && b->inlen == 0)
+		b->eof = 1;
+}
+
+/* read more input, a line too long for the buffer is a bad one */
+static void batch_read(struct batch *b)
+{
+	ssize_t n;
+
+	n = read(b->infd, b->in + b->inlen, sizeof b->in - 1 - b->inlen);
+	if(n < 0)
+		return;
+	if(n == 0) {
+		/* the last line may have no newline */
+		if(b->inlen > 0 && b->in[b->inlen - 1] != '\n')
+			b->in[b->inlen++] = '\n';
+		b->ineof = 1;
+		return;
+	}
+	b->inlen += n;
+	if(b->inlen == sizeof b->in - 1 && memchr(b->in, '\n', b->inlen) == NULL) {
+		fprintf(stderr, "%s\n", "bad command: line too long");
+		b->bad++;
+		b->inlen = 0;
+	}
+}
+
+/* everything the server sent, acks are counted and the rest printed */
+static void batch_frames(struct batch *b, struct ringbuf *ring)
+{
+	struct frame_hdr fh;
+	char *payload, unpacked[2 * BUFF_SIZE];
+	ssize_t n;
+	int ret;
+
+	while((ret = frame_next(ring, &fh, &payload)) > 0) {
+		/* no resuming a batch, it only hears of the session */
+		if(fh.op == OP_SESSION)
+			continue;
+		/* msgs go packed from the next command on */
+		if(fh.op == OP_PACK_OK) {
+			packing = packing_agreed(payload, fh.len);
+			continue;
+		}
+		if(fh.flags & FLAG_PACKED) {
+			n = pack_dict ? lz_unpack(pack_dict, payload, fh.len,
+				unpacked, sizeof unpacked) : -1;
+			if(n < 0) {
+				ret = -1;
+				break;
+			}
+			payload = unpacked;
+			fh.len = n;
+		}
+		/* answered along with the next commands, no ack expected */
+		if(fh.op == OP_PING && b->outlen + FRAME_HDR_SIZE <= sizeof b->out) {
+			frame_pack((unsigned char *)b->out + b->outlen, OP_PONG, 0, 0, 0);
+			b->outlen += FRAME_HDR_SIZE;
 			continue;
-		pthread_mutex_lock(&console_cv_lock);
-		printf("%s\n", buffer);
-		/* let the other thread stop waiting, if it is */
-		pthread_cond_signal(&console_cv);
-		pthread_mutex_unlock(&console_cv_lock);
+		}
+		if(fh.op != OP_ACK) {
+			printf("%.*s\n", (int)fh.len, payload);
+			continue;
+		}
+		if(fh.len == 1 && (unsigned char)payload[0] <= ACK_DROPPED)
+			b->acks[(unsigned char)payload[0]]++;
+		if(b->inflight > 0)
+			b->inflight--;
+	}
+	if(ret < 0) {
+		fprintf(stderr, "%s\n", "bad frame from server");
+		_exit(EXIT_FAILURE);
 	}
 }
 
-int main(void)
+static double elapsed(const struct timespec *start)
 {
-	int sockfd;
+	struct timespec now;
 
-	/*
-	* struct sockaddr defines a socket address.
-	* A socket address is a combination of address family,
-	* ip address and port.
-	* For IP sockets, we may use struct sockaddr_in which is
-	* just a wrapper around struct sockaddr.
-	* Funtions like bind() etc are only aware of struct sockaddr.
-	*/
-	struct sockaddr_in serv_addr;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
 
-	/* just to dump the handle for the spawned thread - no use */
-	pthread_t receiver_thread;
+static void lost_server(void)
+{
+	/* what was printed so far is not to be lost with it */
+	fflush(stdout);
+	fprintf(stderr, "%s\n", "lost connection to server");
+	_exit(EXIT_FAILURE);
+}
+
+void batch(int sockfd, int infd, unsigned int window)
+{
+	static struct batch b;
+	struct ringbuf ring;
+	struct pollfd pfd[3];
+	struct timespec start;
+	struct iovec iov;
+	double secs;
+	ssize_t n;
+	/* on shm: the rings had something for us, or room, the last time round */
+	int nfds, pending, busy = 1;
 
-	pthread_cond_init(&console_cv, NULL);
-	pthread_mutex_init(&console_cv_lock, NULL);
+	b.sockfd = sockfd;
+	b.infd = infd;
+	b.window = window;
+	ring_init(&ring, RING_SIZE, RING_MAX);
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+	clock_gettime(CLOCK_MONOTONIC, &start);
 
+	while(1) {
+		batch_fill(&b);
+		if(b.eof && b.inflight == 0 && b.outlen == 0)
+			break;
+
+		pfd[0].fd = sockfd;
+		pfd[0].events = POLLIN | (b.outlen > 0 && !shm ? POLLOUT : 0);
+		if(tls && tls->want_write)
+			pfd[0].events |= POLLOUT;
+		/* no more input until the lines we have are sent */
+		pfd[1].fd = -1;
+		if(!b.ineof && !b.eof && b.inflight < b.window &&
+				b.outlen < BATCH_OUT_MAX)
+			pfd[1].fd = infd;
+		pfd[1].events = POLLIN;
+		nfds = 2;
+		/*
+		* on shm, the socket only says the server is gone,
+		* and the doorbell says when to look at the rings again
+		*/
+		if(shm) {
+			pfd[2].fd = shm->bell;
+			pfd[2].events = POLLIN;
+			nfds = 3;
+		}
+		/*
+		* what the SSL read already, poll() cannot tell us about,
+		* nor about rings we have not seen the end of
+		*/
+		pending = tls ? tls_pending(tls) : shm && busy;
+		if(poll(pfd, nfds, pending ? 0 : -1) < 0) {
+			if(errno == EINTR)
+				continue;
+			perror("poll");
+			_exit(EXIT_FAILURE);
+		}
+		if(pending && tls)
+			pfd[0].revents |= POLLIN;
+		if(shm) {
+			if(pfd[0].revents)
+				lost_server();
+			if(pfd[2].revents & POLLIN)
+				shm_ack(shm);
+			/* the rings are looked at every time round, it takes no syscall */
+			pfd[0].revents = POLLIN | POLLOUT;
+			busy = 0;
+		}
+
+		if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			if(shm)
+				n = shm_ring_read(shm, &ring);
+			else
+				n = tls ? tls_ring_read(tls, &ring) : ring_read(sockfd, &ring);
+			busy |= n > 0;
+			if(n == 0 || (n < 0 && errno != EAGAIN))
+				lost_server();
+			batch_frames(&b, &ring);
+		}
+		if(b.outlen > 0 && (pfd[0].revents & POLLOUT)) {
+			iov.iov_base = b.out;
+			iov.iov_len = b.outlen;
+			if(shm)
+				n = shm_writev(shm, &iov, 1);
+			else
+				n = tls ? tls_writev(tls, &iov, 1) : write(sockfd, b.out, b.outlen);
+			busy |= n > 0;
+			if(n > 0) {
+				b.writes++;
+				b.bytes += n;
+				memmove(b.out, b.out + n, b.outlen - n);
+				b.outlen -= n;
+			}
+		}
+		if(pfd[1].fd >= 0 && (pfd[1].revents & (POLLIN | POLLHUP | POLLERR)))
+			batch_read(&b);
+	}
+	secs = elapsed(&start);
+
+	/* all acked, say goodbye */
+	fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) & ~O_NONBLOCK);
+	send_frame(sockfd, OP_EXIT, 0, 0, NULL, 0);
+	fflush(stdout);
+
+	fprintf(stderr, "%lu commands in %.3f s, %.0f cmds/s\n",
+		b.cmds, secs, secs > 0 ? b.cmds / secs : 0.0);
+	fprintf(stderr, "%.2f MB out in %lu writes\n", b.bytes / 1e6, b.writes);
+	if(pack_dict)
+		fprintf(stderr, "%lu msgs went packed\n", b.packed);
+	fprintf(stderr, "acks: %lu ok, %lu stored, %lu no user, %lu dropped\n",
+		b.acks[ACK_OK], b.acks[ACK_STORED], b.acks[ACK_NOUSER],
+		b.acks[ACK_DROPPED]);
+	if(b.bad > 0)
+		fprintf(stderr, "%lu bad commands\n", b.bad);
+	ring_free(&ring);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p port] [-u username] [-f file|-] [-w window]"
+		" [-T server cert pem] [-U unix socket [-M]] [-P port] [-Z dictionary]"
+		" [-r dir]\n"
+		"  -f  batch mode: send the commands in file, - for stdin,\n"
+		"      pipelined, and report what became of them. needs -u\n"
+		"  -w  batch mode: commands in flight at most (default %d)\n"
+		"  -T  talk TLS, to a server with this certificate or signed by it\n"
+		"  -U  connect to the server's unix socket instead, on this host\n"
+		"  -M  and move over to shared memory, if the server lets us\n"
+		"  -P  take direct links from other clients on this port, 0 for any,\n"
+		"      and talk directly to those we talk to a lot\n"
+		"  -Z  pack msgs against this dictionary, if the server has it too\n"
+		"  -r  take the files others send us, into this dir\n",
+		prog, BATCH_WINDOW);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	int sockfd, opt;
+	int infd = -1;
+	unsigned int window = BATCH_WINDOW;
+	const char *file = NULL, *ca = NULL;
+
+	/* just to dump the handles for the spawned threads - no use */
+	pthread_t receiver_thread, printer_thread;
+
+	while((opt = getopt(argc, argv, "p:u:f:w:T:U:MP:Z:r:")) != -1) {
+		switch(opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'u':
+			strncpy(username, optarg, sizeof username - 1);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'T':
+			ca = optarg;
+			break;
+		case 'U':
+			local = 1;
+			local_addr.sun_family = AF_UNIX;
+			strncpy(local_addr.sun_path, optarg, sizeof local_addr.sun_path - 1);
+			break;
+		case 'M':
+			use_shm = 1;
+			break;
+		case 'P':
+			use_p2p = 1;
+			p2p_port = atoi(optarg);
+			break;
+		case 'Z':
+			pack_dict = lz_dict_load(optarg);
+			if(pack_dict == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		case 'r':
+			file_dir = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(file && (username[0] == '\0' || window == 0))
+		usage(argv[0]);
+	/* shm is for the unix socket, TLS for TCP */
+	if((use_shm && !local) || (local && ca))
+		usage(argv[0]);
 	/*
-	* creates a socket of family Internet sockets (AF_INET) and
-	* of type stream. 0 indicates to system to choose appropriate
-	* protocol (eg: TCP)
+	* direct links are plaintext, and read by the receiver in place of
+	* the socket: not under TLS, nor shm, nor in batch mode
 	*/
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(use_p2p && (ca || use_shm || file))
+		usage(argv[0]);
+	if(file) {
+		infd = strcmp(file, "-") == 0 ? STDIN_FILENO : open(file, O_RDONLY);
+		if(infd < 0) {
+			perror(file);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+
+	/* writing to a connection that broke must not kill us, we reconnect */
+	signal(SIGPIPE, SIG_IGN);
 
 	/*
 	* Socket adddress represented by struct sockaddr:
@@ -232,17 +1673,60 @@ int main(void)
 		bind(sockfd, (struct sockaddr*) &client_addr, sizeof client_addr);
 	*/
 
-	/* makes connection per the socket address */
-	connect(sockfd, (struct sockaddr*) &serv_addr, sizeof serv_addr);
+	/*
+	* creates a socket of family Internet sockets (AF_INET), or unix ones
+	* with -U, of type stream, and makes connection per the socket address
+	*/
+	sockfd = dial();
+	if(sockfd < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	if(use_shm) {
+		shm = shm_connect(sockfd);
+		if(shm == NULL) {
+			fprintf(stderr, "%s\n", "no shared memory from the server,"
+				" staying on the socket");
+			use_shm = 0;
+		}
+	}
+	if(ca) {
+		if(tls_client_init(ca) < 0) {
+			fprintf(stderr, "%s: no certificate in there\n", ca);
+			exit(EXIT_FAILURE);
+		}
+		tls = tls_client();
+		if(tls_connect(tls, sockfd, NULL, 0) < 0) {
+			fprintf(stderr, "%s\n", "TLS handshake failed");
+			exit(EXIT_FAILURE);
+		}
+	}
 
-	printf("%s\n", "Enter a username (max 20 characters, no spaces):");
-	fgets(username, sizeof username, stdin);
-	/* fgets also reads the \n from stdin, strip it */
-	username[strlen(username) - 1] = '\0';
+	if(username[0] == '\0') {
+		printf("%s\n", "Enter a username (max 20 characters, no spaces):");
+		fgets(username, sizeof username, stdin);
+		/* fgets also reads the \n from stdin, strip it */
+		username[strlen(username) - 1] = '\0';
+	}
 
+	if(use_p2p && p2p_init(&p2p, p2p_port) < 0) {
+		perror("direct links");
+		exit(EXIT_FAILURE);
+	}
 	register_username(sockfd);
+	if(file) {
+		batch(sockfd, infd, window);
+		return 0;
+	}
+	sem_init(&reply_sem, 0, 0);
+	if(spsc_init(&inbox, INBOX_SIZE) < 0) {
+		perror("spsc_init");
+		exit(EXIT_FAILURE);
+	}
 	/* spawn a new thread that continuously listens for any msgs from server */
 	pthread_create(&receiver_thread, NULL, receiver, (void*)&sockfd);
+	/* and one that prints them */
+	pthread_create(&printer_thread, NULL, printer, NULL);
 	/* get our console in action, let the user enter commands */
 	console(sockfd);
 
@@ -9,210 +9,1477 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <arpa/inet.h>
+#include "proto.h"
+#include "registry.h"
+#include "rooms.h"
+#include "stats.h"
+#include "log.h"
+#include "store.h"
+#include "cluster.h"
+#include "session.h"
+#include "timer.h"
+#include "tls.h"
+#include "shm.h"
+#include "relay.h"
+#include "lz.h"
+#include "reactor.h"
+#include "chatserver.h"
 
 #define BUFF_SIZE 256
-#define USERNAME_MAX_SIZE 20
+/* the text of stats_format(), with room to spare */
+#define STATS_BUFF_SIZE 2048
 
 static unsigned short port = 55555;
 
-/* client_node abstracts a connected client */
-struct client_node {
-	int sockfd;
-	char username[USERNAME_MAX_SIZE];
-	struct client_node *next;
-};
+/*
+* The server can run in one of two modes:
+* MODE_THREAD - the classic one, a thread is spawned per connected client
+*               and it blocks in read() until the client says something.
+* MODE_EPOLL  - a small fixed number of reactor threads each own an epoll
+*               instance and serve all their clients from it with
+*               non-blocking, edge-triggered sockets.
+* MODE_URING  - reactor threads too, but each owns an io_uring and has
+*               the kernel do the reads and writes for it
+*/
+enum server_mode { MODE_THREAD, MODE_EPOLL, MODE_URING };
+static enum server_mode mode = MODE_THREAD;
+
+/*
+* @listen_backlog - how many connections the kernel holds for us until we
+*                   accept() them, SYNs beyond that are dropped
+* @defer_accept   - with TCP_DEFER_ACCEPT set to this many secs, a connection
+*                   is only handed to us once the client has sent something,
+*                   its REGISTER, so accepting it never finds an idle socket
+* @reuseport      - rather than one listening socket, open one per reactor
+*                   (or per acceptor thread in thread mode), all on the same
+*                   port with SO_REUSEPORT. The kernel spreads connections
+*                   among them, and each keeps those it accepted.
+*/
+static int listen_backlog = SOMAXCONN;
+static int defer_accept = 0;
+static int reuseport = 0;
+
+/*
+* @log_rate   - lines a second the log may take, see log.h
+* @stats_path - where to listen for anybody wanting the stats
+*/
+static unsigned long log_rate = 1000;
+static const char *stats_path = NULL;
+
+/*
+* @store_dir - keep msgs to users offline in a store in this dir,
+*              and hand them over when they register (see store.h)
+* @sync_ms   - how often what was stored is synced to disk
+*/
+const char *store_dir = NULL;
+static int sync_ms = 100;
+
+/*
+* Dead peers. A peer that crashed, or whose network went away, says
+* nothing: its connection is half-open, and would be kept forever.
+* @heartbeat_ms - a client that sent nothing for this long is sent an
+*                 OP_PING. One that still sent nothing, not even the
+*                 OP_PONG, by twice that long is evicted: its connection
+*                 is cut, and with a session it is detached like on any
+*                 broken connection.
+* @idle_ms      - a client that said nothing but OP_PONGs for this long
+*                 is evicted, session and all
+* @keepalive    - have TCP probe connections idle for this many secs,
+*                 @keepalive_intvl secs apart, and give up on them after
+*                 @keepalive_cnt unanswered probes. Unacked data gives
+*                 up as soon (TCP_USER_TIMEOUT). Goes for links too.
+* Every client has a timer on the timing wheel (see timer.h) for it.
+* Its frames only note the tick they came in at, the timer looks at
+* that when it fires and is armed again for the next deadline, so no
+* timer is touched for a client that keeps talking.
+*/
+static int heartbeat_ms = 0;
+static int idle_ms = 0;
+static int keepalive = 0;
+static int keepalive_intvl = 5;
+static int keepalive_cnt = 3;
+
+/*
+* TLS for clients, with the certificate and key in this PEM file
+* (see tls.h). Links between nodes stay plaintext.
+*/
+static const char *tls_pem = NULL;
+
+/*
+* Clients on the same host may also connect to a unix socket at this path,
+* and skip TCP altogether. Over it, they may ask to move on to shared
+* memory (see shm.h). TLS is only for TCP.
+*/
+static const char *local_path = NULL;
+static int local_listenfd = -1;
+
+/*
+* Files go through the relay on this port, spliced from one client's
+* connection to the other's (see relay.h), 0 for no files. With
+* @relay_copy, they are copied through a buffer instead, to compare.
+*/
+static unsigned short file_port = 0;
+static int relay_copy = 0;
+/* the name of a file, as the recipient is told it, at most this long */
+#define FILE_NAME_MAX 128
+
+/*
+* Msgs to clients that have this dictionary too go packed against it
+* (see lz.h), NULL for none. Clients may send theirs packed as well.
+*/
+static const char *pack_path = NULL;
+static struct lz_dict *pack_dict = NULL;
 
 /*
-* a list of `client_node`s which serves as our
-* connected client list
+* Every client has a queue of frames on their way to it (see outq.h).
+* A queue may hold up to @outq_hwm bytes, the high-water mark. What happens
+* to a frame that would go over it is up to @outq_policy:
+* OUTQ_BLOCK      - the sender is stalled: nothing more it says is looked at
+*                   until the queue drains to half the mark. Its own socket
+*                   then fills up and TCP pushes back all the way to it.
+* OUTQ_DROP       - the frame is thrown away
+* OUTQ_DISCONNECT - the recipient is a slow consumer and gets disconnected
 */
-struct client_node *client_list = NULL;
+enum outq_policy { OUTQ_BLOCK, OUTQ_DROP, OUTQ_DISCONNECT };
+static enum outq_policy outq_policy = OUTQ_BLOCK;
+size_t outq_hwm = 1024 * 1024;
 
 /*
-* any operation on the client list is to be performed
-* only after getting a lock on this mutex
+* Clients this thread queued frames for while handling what it has read.
+* Rather than a write() per frame, they are flushed once the whole batch
+* of frames is handled, so a burst to one client leaves in one syscall.
 */
-pthread_mutex_t client_list_lock;
+static __thread struct client_node *flush_list;
 
-/* add to the linked list - no rocket science */
-struct client_node *add_client(int cfd)
+/* what became of the frame being handled, for its OP_ACK (see FLAG_ACK) */
+static __thread int frame_status;
+
+/*
+* A client stalled by OUTQ_BLOCK may carry on:
+* hand it back to whoever serves it, along with our reference to it
+*/
+void resume_client(struct client_node *w)
 {
-	struct client_node *p = client_list;
-	struct client_node *c = malloc(sizeof(struct client_node));
-	c->sockfd = cfd;
-	c->username[0] = '\0';
-	c->next = NULL;
-	/* always get a lock before you mess with list */
-	pthread_mutex_lock(&client_list_lock);
-	while(p && p->next)
-		p = p->next;
-	if(p == NULL)
-		client_list = c;
-	else
-		p->next = c;
-	/* release the lock when we are done with */
-	pthread_mutex_unlock(&client_list_lock);
-	return c;
+	struct reactor *reactor = w->reactor;
+
+	w->parked = 0;
+	if(reactor == NULL) {
+		eventfd_write(w->wakefd, 1);
+		put_client(w);
+		return;
+	}
+	pthread_mutex_lock(&reactor->lock);
+	w->wait_next = reactor->resumed;
+	reactor->resumed = w;
+	pthread_mutex_unlock(&reactor->lock);
+	eventfd_write(reactor->wakefd, 1);
+}
+
+void resume_clients(struct client_node *waiters)
+{
+	struct client_node *w;
+
+	while(waiters) {
+		w = waiters;
+		waiters = w->wait_next;
+		resume_client(w);
+	}
 }
 
 /*
-* return NULL if no node is present with username @recipient,
-* else return pointer to the node
+* Write out as much of the client's queue as its socket takes right now,
+* many frames per sendmsg(). Whatever does not fit waits for the socket to
+* become writable: a reactor hears about it from epoll (EPOLLOUT), a client
+* thread is told to poll() for it.
 */
-struct client_node *search_client_list(char *recipient)
+void flush_client(struct client_node *c)
 {
-	struct client_node *p = client_list;
-	if(recipient == NULL || *recipient == '\0')
-		return NULL;
-	/* I am a law abiding citizen, wait until I get a lock */
+	struct iovec iov[FLUSH_IOV];
+	struct msghdr mh;
+	struct client_node *waiters = NULL;
+	unsigned long long recs[FLUSH_IOV];
+	unsigned long start;
+	ssize_t n;
+	int nr;
+
+	/* a uring reactor does the sending for its clients, not for links */
+	if(mode == MODE_URING && c->reactor) {
+		uring_kick(c);
+		return;
+	}
+
+	memset(&mh, 0, sizeof mh);
+	mh.msg_iov = iov;
+
+	pthread_mutex_lock(&c->out_lock);
+	/* a detached client's queue waits for whoever resumes it */
+	while(!c->dead && !c->detached && c->out.count > 0) {
+		mh.msg_iovlen = outq_iov(&c->out, iov, FLUSH_IOV);
+		/* never block here, and never die of SIGPIPE either */
+		start = stats_now();
+		if(c->shm)
+			n = shm_writev(c->shm, iov, mh.msg_iovlen);
+		else if(c->tls)
+			n = tls_writev(c->tls, iov, mh.msg_iovlen);
+		else
+			n = sendmsg(c->sockfd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+		stat_lat(LAT_WRITE, start);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if(c->wakefd >= 0)
+				eventfd_write(c->wakefd, 1);
+			break;
+		}
+		if(n < 0) {
+			/*
+			* the reader of the socket will find out and drop the client.
+			* What is queued stays for a session to resume with.
+			*/
+			c->dead = 1;
+			if(c->session[0] == '\0')
+				outq_clear(&c->out);
+			break;
+		}
+		stat_inc(ST_WRITES);
+		stat_add(ST_BYTES_OUT, n);
+		nr = outq_consume(&c->out, n, recs);
+		/* msgs out of the store are gone from it once written, see store.h */
+		if(nr > 0) {
+			/* a queue is locked with the store held, never the other way */
+			pthread_mutex_unlock(&c->out_lock);
+			store_written(c->username, recs, nr);
+			pthread_mutex_lock(&c->out_lock);
+		}
+	}
+	/* low-water mark: let the stalled senders have another go */
+	if(c->waiters && (c->dead || c->out.bytes <= outq_hwm / 2)) {
+		waiters = c->waiters;
+		c->waiters = NULL;
+	}
+	pthread_mutex_unlock(&c->out_lock);
+	resume_clients(waiters);
+}
+
+/* flush every client this thread queued frames for */
+void flush_queued(void)
+{
+	struct client_node *c;
+
+	while((c = flush_list) != NULL) {
+		flush_list = c->flush_next;
+		pthread_mutex_lock(&c->out_lock);
+		c->flush_pending = 0;
+		pthread_mutex_unlock(&c->out_lock);
+		flush_client(c);
+		put_client(c);
+	}
+}
+
+/*
+* queue @m for @to and have this thread flush it later,
+* with @to's out_lock held
+*/
+void push_msg(struct client_node *to, struct msgbuf *m)
+{
+	outq_push(&to->out, m);
+	if(!to->flush_pending) {
+		to->flush_pending = 1;
+		get_client(to);
+		to->flush_next = flush_list;
+		flush_list = to;
+	}
+	stat_inc(ST_ENQUEUED);
+}
+
+/*
+* the frame of @m that goes to @to, packed if @to takes packed msgs.
+* Packing is done before the queue is locked, it only ever gets turned
+* on: a client that just now took it gets a msg plain, which does no harm
+*/
+static struct msgbuf *msg_for(struct client_node *to, struct msgbuf *m)
+{
+	int fresh = m->packed == NULL;
+	struct msgbuf *p;
+
+	if(!to->packing)
+		return m;
+	p = msgbuf_pack(m, pack_dict);
+	if(fresh && p != m)
+		stat_inc(ST_PACKED);
+	return p;
+}
+
+/* queue_msg(), but for the time it takes */
+static int enqueue_msg(struct client_node *from, struct client_node *to,
+	struct msgbuf *m)
+{
+	struct msgbuf *plain = m;
+
+	m = msg_for(to, m);
+	pthread_mutex_lock(&to->out_lock);
+	if(to->dead) {
+		pthread_mutex_unlock(&to->out_lock);
+		return CLIENT_OK;
+	}
+	if(to->out.bytes + m->len > outq_hwm && to->out.bytes > 0) {
+		/* a detached client is not going to drain it any time soon */
+		if(outq_policy == OUTQ_BLOCK && from && !to->detached) {
+			/* @to wakes us up once it drains, see flush_client() */
+			get_client(from);
+			from->parked = 1;
+			from->wait_next = to->waiters;
+			to->waiters = from;
+			pthread_mutex_unlock(&to->out_lock);
+			stat_inc(ST_PARKS);
+			return CLIENT_PARKED;
+		}
+		if(outq_policy == OUTQ_DISCONNECT && !to->detached) {
+			to->dead = 1;
+			outq_clear(&to->out);
+			/* its reader sees the connection end and drops it */
+			shutdown(to->sockfd, SHUT_RDWR);
+		}
+		pthread_mutex_unlock(&to->out_lock);
+		stat_inc(ST_ENQUEUE_DROPS);
+		if(from)
+			frame_status = ACK_DROPPED;
+		return CLIENT_OK;
+	}
+	push_msg(to, m);
+	pthread_mutex_unlock(&to->out_lock);
+	if(m != plain)
+		stat_add(ST_PACK_SAVED, plain->len - m->len);
+	return CLIENT_OK;
+}
+
+/*
+* queue the frame @m for @to.
+* @from is the client we are doing this for, it is the one stalled
+* if @to is over its high-water mark. Pass NULL for a frame that
+* must not stall anybody, it is then dropped instead.
+* returns CLIENT_PARKED if @from has to wait, CLIENT_OK otherwise
+*/
+int queue_msg(struct client_node *from, struct client_node *to, struct msgbuf *m)
+{
+	unsigned long start = stats_now();
+	int ret;
+
+	ret = enqueue_msg(from, to, m);
+	stat_lat(LAT_ENQUEUE, start);
+	return ret;
+}
+
+/* frame up @len bytes of @payload and queue them for @to alone */
+int queue_frame(struct client_node *from, struct client_node *to,
+	int op, int id, const char *payload, size_t len)
+{
+	struct msgbuf *m = msgbuf_new(op, 0, id, payload, len);
+	int ret;
+
+	ret = queue_msg(from, to, m);
+	msgbuf_put(m);
+	return ret;
+}
+
+/*
+* nothing is written to @cnode anymore: let go of its TLS or its shm,
+* with its out_lock held
+*/
+static void drop_transport(struct client_node *cnode)
+{
+	if(cnode->tls) {
+		tls_free(cnode->tls);
+		cnode->tls = NULL;
+	}
+	if(cnode->shm) {
+		if(mode == MODE_EPOLL)
+			epoll_ctl(cnode->reactor->epfd, EPOLL_CTL_DEL,
+				cnode->shm->bell, NULL);
+		shm_free(cnode->shm);
+		cnode->shm = NULL;
+	}
+}
+
+/*
+* clean up when a client quits.
+* Whoever is in the middle of sending to the client keeps the node
+* (and its fd) alive until they are done, so just make sure nobody finds
+* it anymore, that its reactor forgets about it, and that nothing
+* more is queued for it.
+*/
+void drop_client(struct client_node *cnode)
+{
+	struct client_node *waiters;
+
+	stat_inc(ST_DISCONNECTS);
+	/*
+	* msgs to us are stored again from here on. Before we are out of the
+	* registry, so a sender never finds us neither there nor online.
+	*/
+	if(store_dir)
+		store_offline(cnode->username, cnode);
+	unregister_user(cnode);
+	leave_all_rooms(cnode);
+	if(mode == MODE_EPOLL)
+		epoll_ctl(cnode->reactor->epfd, EPOLL_CTL_DEL, cnode->sockfd, NULL);
+	pthread_mutex_lock(&cnode->out_lock);
+	cnode->dead = 1;
+	cnode->closed = 1;
+	outq_clear(&cnode->out);
+	drop_transport(cnode);
+	waiters = cnode->waiters;
+	cnode->waiters = NULL;
+	pthread_mutex_unlock(&cnode->out_lock);
+	/* nobody is going to drain our queue, do not keep them waiting */
+	resume_clients(waiters);
+	shutdown(cnode->sockfd, SHUT_RDWR);
+	put_client(cnode);
+}
+
+/*
+* The connection of @cnode broke, or the client hung up without an `exit`.
+* A client with a session is only detached: it keeps its name, its rooms
+* and its queue for a while, to be resumed over another connection
+* (see session.h). Any other is dropped.
+*/
+void lose_client(struct client_node *cnode)
+{
+	struct client_node *waiters;
+
+	/* the timer may take the session away, see idle_check() */
+	pthread_mutex_lock(&cnode->out_lock);
+	if(session_grace_ms == 0 || cnode->session[0] == '\0') {
+		pthread_mutex_unlock(&cnode->out_lock);
+		drop_client(cnode);
+		return;
+	}
+	stat_inc(ST_DETACHES);
+	if(mode == MODE_EPOLL)
+		epoll_ctl(cnode->reactor->epfd, EPOLL_CTL_DEL, cnode->sockfd, NULL);
+	/* frames keep being queued, with nobody to write them out */
+	cnode->detached = 1;
+	cnode->dead = 0;
+	/* and whoever served it is done with it */
+	cnode->closed = 1;
+	/* whatever the SSL had of a frame goes out again whole, if resumed */
+	drop_transport(cnode);
+	waiters = cnode->waiters;
+	cnode->waiters = NULL;
+	pthread_mutex_unlock(&cnode->out_lock);
+	shutdown(cnode->sockfd, SHUT_RDWR);
+	log_msg("%s detached, socket: %d\n", cnode->username, cnode->sockfd);
+	/* our reference is the list's now, the node may be gone any time */
+	session_detach(cnode);
+	/* senders stalled on it, or a client waiting to resume it */
+	resume_clients(waiters);
+}
+
+/*
+* `ls` lists all clients' usernames that are
+* currently connected, one per line
+*/
+int list_clients(struct client_node *cnode, int id)
+{
+	struct client_node *tmpnode;
+	size_t len = 0, size = BUFF_SIZE;
+	char *buffer = malloc(size);
+	int ret;
+
 	pthread_mutex_lock(&client_list_lock);
-	while(p != NULL) {
-		if(strcmp(p->username, recipient) == 0) {
-			/* never forget to release the lock, don't you like freedom */
-			pthread_mutex_unlock(&client_list_lock);
-			return p;
+	tmpnode = client_list;
+	while(tmpnode) {
+		/* there are as many as there are, grow the buffer to fit */
+		if(len + USERNAME_MAX_SIZE + 1 > size) {
+			size *= 2;
+			buffer = realloc(buffer, size);
 		}
-		p = p->next;
+		/* concatenate each username to the buffer */
+		strcpy(buffer + len, tmpnode->username);
+		len += strlen(tmpnode->username);
+		buffer[len++] = '\n';
+		tmpnode = tmpnode->next;
 	}
 	pthread_mutex_unlock(&client_list_lock);
-	return NULL;
+	/* and everybody on the other nodes of a cluster */
+	if(cluster_nodes > 1)
+		dir_list(&buffer, &len, &size);
+	/* queue the buffer for the client's socket */
+	ret = queue_frame(cnode, cnode, OP_LS_REPLY, id, buffer, len);
+	free(buffer);
+	return ret;
 }
 
-/* remove the client fromt he list of clients */
-void remove_client(struct client_node *c)
+/* `stats` gets the server's counters and latencies, see stats.h */
+int send_stats(struct client_node *cnode, int id)
 {
-	struct client_node *p, *prev;
-	p = client_list;
-	prev = NULL;
-	/* get a lock and only then touch the list */
-	pthread_mutex_lock(&client_list_lock);
-	if(p == c) {
-		client_list = p->next;
-		pthread_mutex_unlock(&client_list_lock);
+	char buffer[STATS_BUFF_SIZE];
+	size_t len;
+
+	len = stats_format(buffer, sizeof buffer);
+	return queue_frame(cnode, cnode, OP_STATS_REPLY, id, buffer, len);
+}
+
+/* keep `<sender>: <msg>` for @recipient, who is not online */
+int store_msg(struct client_node *cnode, const char *recipient,
+	const char *msg, size_t msglen)
+{
+	char buffer[BUFF_SIZE];
+	size_t namelen = strlen(cnode->username);
+	int ret;
+
+	memcpy(buffer, cnode->username, namelen);
+	memcpy(buffer + namelen, ": ", 2);
+	memcpy(buffer + namelen + 2, msg, msglen);
+	ret = store_put(recipient, buffer, namelen + 2 + msglen);
+	if(ret == STORE_STORED) {
+		stat_inc(ST_STORED);
+		log_msg("%s stored msg for %s\n", cnode->username, recipient);
+	}
+	return ret;
+}
+
+/*
+* a msg kept in the store for @c, on its way at last. It stays in the
+* store until it was written, @rec tells the store which one it was.
+* returns 0, or -1 if @c is gone and the msg is to stay where it is
+*/
+int queue_stored(void *c, const char *payload, size_t len,
+	unsigned long long rec)
+{
+	struct client_node *cnode = (struct client_node *)c;
+	struct msgbuf *m = msgbuf_new(OP_MSG, 0, 0, payload, len);
+	struct msgbuf *p = msg_for(cnode, m);
+	int ret = -1;
+
+	/* nobody else has a hold of either, it is for this client alone */
+	p->rec = rec;
+	pthread_mutex_lock(&cnode->out_lock);
+	if(!cnode->dead) {
+		push_msg(cnode, p);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&cnode->out_lock);
+	msgbuf_put(m);
+	if(ret == 0)
+		stat_inc(ST_UNSTORED);
+	return ret;
+}
+
+/*
+* queue a frame for @cnode whatever the high-water mark says: the
+* server's answers to the client itself, it could not do without them
+*/
+static void queue_reply(struct client_node *cnode, int op, int id,
+	const char *payload, size_t len)
+{
+	struct msgbuf *m = msgbuf_new(op, 0, id, payload, len);
+
+	pthread_mutex_lock(&cnode->out_lock);
+	if(!cnode->dead)
+		push_msg(cnode, m);
+	pthread_mutex_unlock(&cnode->out_lock);
+	msgbuf_put(m);
+}
+
+/*
+* Tell @cnode what became of its frame @id.
+* Acks do not count against the high-water mark: a client has only
+* so many frames waiting for one.
+*/
+void queue_ack(struct client_node *cnode, int id, int status)
+{
+	unsigned char s = status;
+
+	queue_reply(cnode, OP_ACK, id, (char *)&s, 1);
+}
+
+/*
+* Hand @cnode, just registered, the msgs stored for it while it was away.
+* They go out half a high-water mark's worth at a time. While there are
+* more, the client parks on its own queue like a sender stalled on a full
+* one: its REGISTER is handled again once the queue drained, and brings
+* it back here for the next lot. Nothing else it says is looked at
+* meanwhile, so its backlog comes first.
+* returns CLIENT_PARKED while there is more to come, else CLIENT_OK
+*/
+int deliver_backlog(struct client_node *cnode)
+{
+	size_t room;
+
+	while(1) {
+		pthread_mutex_lock(&cnode->out_lock);
+		room = cnode->out.bytes < outq_hwm / 2
+			? outq_hwm / 2 - cnode->out.bytes : 0;
+		pthread_mutex_unlock(&cnode->out_lock);
+		cnode->backlog = store_deliver(cnode->username, cnode, room,
+			queue_stored, cnode);
+		if(!cnode->backlog)
+			return CLIENT_OK;
+
+		pthread_mutex_lock(&cnode->out_lock);
+		if(cnode->dead) {
+			pthread_mutex_unlock(&cnode->out_lock);
+			return CLIENT_OK;
+		}
+		/* only wait for a queue that is to drain below the mark yet */
+		if(cnode->out.bytes > outq_hwm / 2) {
+			get_client(cnode);
+			cnode->parked = 1;
+			cnode->wait_next = cnode->waiters;
+			cnode->waiters = cnode;
+			pthread_mutex_unlock(&cnode->out_lock);
+			return CLIENT_PARKED;
+		}
+		pthread_mutex_unlock(&cnode->out_lock);
+	}
+}
+
+/* `send <recipient> <msg>` sends <msg> to the given <username> */
+int send_msg(struct client_node *cnode, char *payload, size_t len)
+{
+	struct client_node *targetnode;
+	char recipient[USERNAME_MAX_SIZE];
+	char *msg, *tmp;
+	size_t msglen, namelen;
+	struct msgbuf *m;
+	unsigned long start;
+	int ret, node;
+
+	/* parse payload to separate recipient and msg */
+	tmp = memchr(payload, ' ', len);
+	if(tmp == NULL || tmp - payload >= USERNAME_MAX_SIZE)
+		return CLIENT_OK;
+	memcpy(recipient, payload, tmp - payload);
+	recipient[tmp - payload] = '\0';
+	msg = tmp + 1;
+	msglen = len - (msg - payload);
+
+	/* msgs are kept short */
+	namelen = strlen(cnode->username);
+	if(BUFF_SIZE < namelen + msglen + 2)
+		return CLIENT_OK;
+
+	/* search for the recipient in the cient list */
+	while(1) {
+		start = stats_now();
+		targetnode = search_client_list(recipient);
+		stat_lat(LAT_LOOKUP, start);
+		stat_inc(ST_LOOKUPS);
+		if(targetnode)
+			break;
+		stat_inc(ST_LOOKUP_MISSES);
+		/* not ours, maybe another node's */
+		if(cluster_nodes > 1 && (node = dir_lookup(recipient)) >= 0
+			&& (ret = forward_msg(cnode, node, recipient, msg, msglen)) >= 0)
+			return ret;
+		/*
+		* on invalid recipient, do nothing. With a store, keep the msg
+		* for when they are back, unless they just now came back and
+		* are to be found after all
+		*/
+		if(store_dir == NULL) {
+			frame_status = ACK_NOUSER;
+			return CLIENT_OK;
+		}
+		switch(store_msg(cnode, recipient, msg, msglen)) {
+		case STORE_STORED:
+			frame_status = ACK_STORED;
+			return CLIENT_OK;
+		case STORE_FULL:
+			frame_status = ACK_DROPPED;
+			return CLIENT_OK;
+		}
+	}
+	/*
+	* create a string of syntax `<sender>: <msg>` to send to recipient,
+	* right in a pooled frame: no trip to the heap for a msg
+	*/
+	m = msgbuf_new(OP_MSG, 0, 0, NULL, namelen + 2 + msglen);
+	tmp = m->data + FRAME_HDR_SIZE;
+	memcpy(tmp, cnode->username, namelen);
+	memcpy(tmp + namelen, ": ", 2);
+	memcpy(tmp + namelen + 2, msg, msglen);
+	/* Hey target client, You've got message ;) */
+	ret = queue_msg(cnode, targetnode, m);
+	msgbuf_put(m);
+	/* logging in the server */
+	if(ret == CLIENT_OK)
+		log_msg("%s sent msg to %s\n", cnode->username, targetnode->username);
+	/* done with the recipient, let it go if it has quit meanwhile */
+	put_client(targetnode);
+	return ret;
+}
+
+/*
+* `broadcast <room> <msg>` sends <msg> to everybody in <room> but us.
+* The frame is built once and the very same buffer is queued for every
+* member, so a msg to a room of thousands costs one allocation.
+* Members whose queue is full miss it, a broadcast never stalls the sender.
+*/
+int broadcast_msg(struct client_node *cnode, char *payload, size_t len)
+{
+	char name[ROOM_MAX_SIZE], *msg, *tmp;
+	size_t msglen, namelen, roomlen;
+	struct msgbuf *m;
+	struct room *room;
+	unsigned int i;
+
+	tmp = memchr(payload, ' ', len);
+	if(tmp == NULL || tmp - payload >= ROOM_MAX_SIZE)
+		return CLIENT_OK;
+	roomlen = tmp - payload;
+	memcpy(name, payload, roomlen);
+	name[roomlen] = '\0';
+	msg = tmp + 1;
+	msglen = len - (msg - payload);
+
+	namelen = strlen(cnode->username);
+	if(BUFF_SIZE < namelen + 1 + roomlen + msglen + 2)
+		return CLIENT_OK;
+	/* `<sender>@<room>: <msg>`, built right into the frame */
+	m = msgbuf_new(OP_MSG, 0, 0, NULL, namelen + 1 + roomlen + 2 + msglen);
+	tmp = m->data + FRAME_HDR_SIZE;
+	memcpy(tmp, cnode->username, namelen);
+	tmp[namelen] = '@';
+	memcpy(tmp + namelen + 1, name, roomlen);
+	memcpy(tmp + namelen + 1 + roomlen, ": ", 2);
+	memcpy(tmp + namelen + 1 + roomlen + 2, msg, msglen);
+
+	pthread_rwlock_rdlock(&rooms_lock);
+	room = find_room(name);
+	for(i = 0; room && i < room->nr; i++)
+		if(room->members[i]->client != cnode)
+			queue_msg(NULL, room->members[i]->client, m);
+	pthread_rwlock_unlock(&rooms_lock);
+	msgbuf_put(m);
+	return CLIENT_OK;
+}
+
+/* `join <room>` and `leave <room>` */
+void join_or_leave(struct client_node *cnode, int op, char *payload, size_t len)
+{
+	char name[ROOM_MAX_SIZE];
+
+	if(len == 0 || len >= ROOM_MAX_SIZE || memchr(payload, ' ', len))
 		return;
+	memcpy(name, payload, len);
+	name[len] = '\0';
+	if(op == OP_JOIN)
+		join_room(cnode, name);
+	else
+		leave_room(cnode, name);
+}
+
+/*
+* `resume <username> <token>`: a client back after its connection broke
+* takes over the session it had (see session.h), right where it was.
+* The old connection may not have been found broken yet: it is cut off
+* then, and we park on it until its reader detaches it.
+* With no such session, the frame is acked ACK_NOUSER and the client
+* is none the wiser: it may register afresh.
+*/
+int resume_session(struct client_node *cnode, char *payload, size_t len)
+{
+	char username[USERNAME_MAX_SIZE], *token;
+	struct msgbuf *bufs[FLUSH_IOV];
+	struct client_node *old;
+	int i, n, detached;
+
+	frame_status = ACK_NOUSER;
+	token = memchr(payload, ' ', len);
+	if(session_grace_ms == 0 || token == NULL
+		|| token - payload >= USERNAME_MAX_SIZE)
+		return CLIENT_OK;
+	memcpy(username, payload, token - payload);
+	username[token - payload] = '\0';
+	token++;
+	old = search_client_list(username);
+	if(old == NULL)
+		return CLIENT_OK;
+	if(!session_match(old->session, token, len - (token - payload))) {
+		put_client(old);
+		return CLIENT_OK;
 	}
-	while(p != c && p != NULL) {
-		prev = p;
-		p = p->next;
+
+	pthread_mutex_lock(&old->out_lock);
+	detached = old->detached;
+	if(!detached && !old->closed) {
+		/* lose_client() wakes us up, drop_client() too if it exits first */
+		get_client(cnode);
+		cnode->parked = 1;
+		cnode->wait_next = old->waiters;
+		old->waiters = cnode;
+		pthread_mutex_unlock(&old->out_lock);
+		shutdown(old->sockfd, SHUT_RDWR);
+		put_client(old);
+		return CLIENT_PARKED;
 	}
-	if(prev && p)
-		prev->next = p->next;
-	pthread_mutex_unlock(&client_list_lock);
+	pthread_mutex_unlock(&old->out_lock);
+	/* it may have expired just now, or been resumed by another */
+	if(!detached || !session_claim(old)) {
+		put_client(old);
+		return CLIENT_OK;
+	}
+
+	/*
+	* Senders find us by the name as soon as the slot is ours, but our
+	* queue is locked until the old one's frames are in, ahead of theirs.
+	* The frame the old connection was in the middle of goes out whole.
+	*/
+	pthread_mutex_lock(&old->out_lock);
+	pthread_mutex_lock(&cnode->out_lock);
+	replace_client(old, cnode);
+	strcpy(cnode->session, old->session);
+	while((n = outq_take(&old->out, bufs, FLUSH_IOV)) > 0) {
+		for(i = 0; i < n; i++) {
+			push_msg(cnode, bufs[i]);
+			msgbuf_put(bufs[i]);
+		}
+	}
+	outq_clear(&old->out);
+	old->dead = 1;
+	cnode->backlog = old->backlog;
+	cnode->p2p = old->p2p;
+	/* what is queued was packed for the old one, it is for us to unpack */
+	cnode->packing = old->packing;
+	pthread_mutex_unlock(&cnode->out_lock);
+	pthread_mutex_unlock(&old->out_lock);
+	move_rooms(old, cnode);
+	/*
+	* its msgs are ours to take from the store now, and those it was
+	* handed went into our queue with the rest
+	*/
+	if(store_dir)
+		store_handover(username, old, cnode);
+	stat_inc(ST_RESUMES);
+	log_msg("%s resumed, socket: %d\n", cnode->username, cnode->sockfd);
+	/* the reference from the lookup, and the one of the list */
+	put_client(old);
+	put_client(old);
+	frame_status = ACK_OK;
+	return store_dir ? deliver_backlog(cnode) : CLIENT_OK;
+}
+
+/*
+* OP_SHM: move a client on the unix socket over to shared memory (shm.h).
+* The answer goes out on the socket itself, with the fds along, and every
+* frame after it through the rings. Nothing may be queued for the client
+* yet, or part of it could end up on either side. Anywhere else, and in
+* uring mode, whose reactors have the kernel read the socket, the answer
+* comes without fds and the client stays where it is.
+*/
+static int offer_shm(struct client_node *cnode)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+	struct sockaddr_un addr;
+	socklen_t len = sizeof addr;
+	struct epoll_event ev;
+	struct shm *shm = NULL;
+	int fds[SHM_NR_FDS];
+
+	frame_pack(hdr, OP_SHM_READY, 0, 0, 0);
+	pthread_mutex_lock(&cnode->out_lock);
+	if(mode != MODE_URING && cnode->shm == NULL && cnode->out.count == 0
+		&& getsockname(cnode->sockfd, (struct sockaddr *)&addr, &len) == 0
+		&& addr.sun_family == AF_UNIX)
+		shm = shm_create(fds);
+	if(send_fds(cnode->sockfd, hdr, sizeof hdr, fds, shm ? SHM_NR_FDS : 0) < 0
+		&& shm) {
+		shm_free(shm);
+		close(fds[0]);
+		shm = NULL;
+	}
+	if(shm) {
+		close(fds[0]);
+		cnode->shm = shm;
+	}
+	pthread_mutex_unlock(&cnode->out_lock);
+	if(shm == NULL)
+		return CLIENT_OK;
+	stat_inc(ST_SHM);
+	/* the socket stays in the set too, to hear the client hang up */
+	if(mode == MODE_EPOLL) {
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.ptr = (void *)((unsigned long)cnode | BELL_TAG);
+		epoll_ctl(cnode->reactor->epfd, EPOLL_CTL_ADD, shm->bell, &ev);
+	}
+	return CLIENT_OK;
+}
+
+/*
+* `OP_P2P <port>`: the client takes direct links from other clients on
+* <port> (see p2p.h), at the address it connected from. Over the unix
+* socket, that is on this host.
+*/
+static void set_p2p(struct client_node *cnode, char *payload, size_t len)
+{
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof addr;
+	char buf[8];
+	int p;
+
+	if(len == 0 || len >= sizeof buf)
+		return;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	p = atoi(buf);
+	if(p <= 0 || p > 65535)
+		return;
+	if(getpeername(cnode->sockfd, (struct sockaddr *)&addr, &alen) < 0
+		|| addr.sin_family != AF_INET) {
+		memset(&addr, 0, sizeof addr);
+		addr.sin_family = AF_INET;
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	}
+	addr.sin_port = htons(p);
+	pthread_mutex_lock(&cnode->out_lock);
+	cnode->p2p = addr;
+	pthread_mutex_unlock(&cnode->out_lock);
+}
+
+/*
+* `OP_WHERE <username>`: introduce the client to <username>, for a direct
+* link between the two (see p2p.h). Both get the same nonce: <username>
+* along with the name of who is going to dial it, in an OP_INTRO, and
+* the client along with the address to dial, in the OP_PEER answering
+* its frame. From then on, what they say to each other never comes here.
+* A user that takes no direct links, or is on another node of a cluster,
+* gets the client an OP_PEER with no address: it stays with us.
+*/
+static int introduce(struct client_node *cnode, int id, char *payload, size_t len)
+{
+	char name[USERNAME_MAX_SIZE], nonce[SESSION_TOKEN_SIZE + 1];
+	char ip[INET_ADDRSTRLEN], buf[BUFF_SIZE];
+	struct client_node *target;
+	struct sockaddr_in addr;
+	int n;
+
+	if(len == 0 || len >= USERNAME_MAX_SIZE)
+		return CLIENT_OK;
+	memcpy(name, payload, len);
+	name[len] = '\0';
+	target = search_client_list(name);
+	addr.sin_port = 0;
+	if(target) {
+		pthread_mutex_lock(&target->out_lock);
+		addr = target->p2p;
+		pthread_mutex_unlock(&target->out_lock);
+	}
+	if(target == NULL || target == cnode || addr.sin_port == 0
+		|| session_token(nonce) < 0) {
+		queue_reply(cnode, OP_PEER, id, name, len);
+	} else {
+		n = sprintf(buf, "%s %s", cnode->username, nonce);
+		queue_reply(target, OP_INTRO, 0, buf, n);
+		inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof ip);
+		n = sprintf(buf, "%s %s:%d %s", name, ip, ntohs(addr.sin_port), nonce);
+		queue_reply(cnode, OP_PEER, id, buf, n);
+		stat_inc(ST_INTROS);
+		log_msg("%s introduced to %s\n", cnode->username, name);
+	}
+	if(target)
+		put_client(target);
+	return CLIENT_OK;
 }
 
-char *get_username(struct client_node *cnode)
+/*
+* `OP_FILE <recipient> <size> <name>`: the client has a file for
+* <recipient>. The relay is told to expect a transfer of <size> bytes,
+* <recipient> is offered the file in an OP_OFFER, and the client is told
+* where to send it in the OP_FILE_GO answering its frame, both with the
+* same token. A recipient that is not on this node, or no relay, gets
+* the client an OP_FILE_GO with no token: nothing is sent.
+*/
+static int offer_file(struct client_node *cnode, int id, char *payload, size_t len)
 {
-	char *str = malloc(38);
-	read(cnode->sockfd, str, 38);
+	char name[USERNAME_MAX_SIZE], file[FILE_NAME_MAX + 1];
+	char token[SESSION_TOKEN_SIZE + 1], buf[BUFF_SIZE];
+	struct client_node *target = NULL;
+	unsigned long long size;
+	int n, offset;
+
+	if(len >= sizeof buf)
+		return CLIENT_OK;
+	memcpy(buf, payload, len);
+	buf[len] = '\0';
+	if(sscanf(buf, "%19s %llu %n", name, &size, &offset) != 2)
+		return CLIENT_OK;
+	/* the name is the rest, whatever is in it, but for any dirs */
+	if(buf[offset] == '\0' || strlen(buf + offset) > FILE_NAME_MAX
+		|| strchr(buf + offset, '/'))
+		return CLIENT_OK;
+	strcpy(file, buf + offset);
+	if(file_port)
+		target = search_client_list(name);
+	if(target == NULL || target == cnode || session_token(token) < 0) {
+		queue_reply(cnode, OP_FILE_GO, id, name, strlen(name));
+	} else {
+		relay_expect(token, size);
+		n = sprintf(buf, "%s %llu %u %s %s", cnode->username, size,
+			file_port, token, file);
+		queue_reply(target, OP_OFFER, 0, buf, n);
+		n = sprintf(buf, "%s %u %s", name, file_port, token);
+		queue_reply(cnode, OP_FILE_GO, id, buf, n);
+		log_msg("%s sends %s to %s, %llu bytes\n", cnode->username, file,
+			name, size);
+	}
+	if(target)
+		put_client(target);
+	return CLIENT_OK;
+}
+
+/*
+* OP_PACK: the client has the dictionary of the id in @payload, and takes
+* msgs packed against it from now on, if it is ours. It is told so in the
+* same breath as it is marked, under its queue lock: no packed msg gets
+* to it ahead of the answer.
+*/
+static void set_packing(struct client_node *cnode, int id, char *payload, size_t len)
+{
+	char ours[16];
+	struct msgbuf *m;
+	int n = pack_dict ? sprintf(ours, "%08x", pack_dict->id) : 0;
+	int ok = n > 0 && len == (size_t)n && memcmp(payload, ours, n) == 0;
+
+	m = msgbuf_new(OP_PACK_OK, 0, id, ours, ok ? n : 0);
+	pthread_mutex_lock(&cnode->out_lock);
+	if(!cnode->dead) {
+		if(ok)
+			cnode->packing = 1;
+		push_msg(cnode, m);
+	}
+	pthread_mutex_unlock(&cnode->out_lock);
+	msgbuf_put(m);
+}
+
+/*
+* Take appropriate action for one frame from the client.
+* Both server modes funnel everything the client says through here.
+* returns CLIENT_GONE if the client is gone (and @cnode dropped),
+* CLIENT_PARKED if it has to wait before the frame can be handled,
+* CLIENT_OK otherwise
+*/
+int handle_frame(struct client_node *cnode, struct frame_hdr *fh, char *payload)
+{
+	char username[USERNAME_MAX_SIZE], unpacked[2 * BUFF_SIZE];
+	struct frame_hdr plain;
+	unsigned long start;
+	ssize_t n;
+	int ret;
+
+	stat_inc(ST_FRAMES_IN);
+	/* answers to our OP_PINGs, they only show the client is there */
+	if(fh->op == OP_PONG)
+		return CLIENT_OK;
+	cnode->last_cmd = timer_now;
 	/*
-	* gives pointer to the character after the second space,
-	* assuming str to be "register username <username>"
+	* The first thing a client says is its username,
+	* there is nothing else it may do before that,
+	* but for moving over to shared memory.
 	*/
-	return strrchr(str, ' ') + 1;
+	if(cnode->username[0] == '\0') {
+		if(fh->op == OP_SHM)
+			return offer_shm(cnode);
+		if(fh->op == OP_RESUME)
+			return resume_session(cnode, payload, fh->len);
+		if(fh->op != OP_REGISTER || fh->len == 0 || fh->len >= USERNAME_MAX_SIZE) {
+			drop_client(cnode);
+			return CLIENT_GONE;
+		}
+		memcpy(username, payload, fh->len);
+		username[fh->len] = '\0';
+		/* the token is written before anybody may find us by name */
+		if(session_grace_ms)
+			session_new(cnode);
+		start = stats_now();
+		ret = register_user(cnode, username);
+		stat_lat(LAT_REGISTER, start);
+		/* logging in the server */
+		log_msg("user: %s, socket: %d, thread:%lu\n",
+			cnode->username, cnode->sockfd, (unsigned long)pthread_self());
+		if(!ret) {
+			cnode->session[0] = '\0';
+			return CLIENT_OK;
+		}
+		stat_inc(ST_REGISTERS);
+		if(cnode->session[0] != '\0')
+			queue_reply(cnode, OP_SESSION, 0, cnode->session,
+				SESSION_TOKEN_SIZE);
+		/* welcome back, here is what you missed */
+		return store_dir ? deliver_backlog(cnode) : CLIENT_OK;
+	}
+
+	/*
+	* a packed msg is handled as the msg it unpacks to. The frame stays
+	* packed in the ring, it may be handled again after a park. Whoever
+	* packs what we never agreed on, or what does not unpack, is no
+	* client of ours
+	*/
+	if(fh->flags & FLAG_PACKED) {
+		if(!cnode->packing || (fh->op != OP_SEND && fh->op != OP_BROADCAST)
+			|| (n = lz_unpack(pack_dict, payload, fh->len, unpacked,
+				sizeof unpacked)) < 0) {
+			drop_client(cnode);
+			return CLIENT_GONE;
+		}
+		plain = *fh;
+		plain.len = n;
+		fh = &plain;
+		payload = unpacked;
+	}
+
+	switch(fh->op) {
+	case OP_REGISTER:
+	case OP_RESUME:
+		/* back from a break in handing over the backlog */
+		if(cnode->backlog)
+			return deliver_backlog(cnode);
+		break;
+	case OP_EXIT:
+		drop_client(cnode);
+		return CLIENT_GONE;
+	case OP_LS:
+		return list_clients(cnode, fh->id);
+	case OP_STATS:
+		return send_stats(cnode, fh->id);
+	case OP_SEND:
+		return send_msg(cnode, payload, fh->len);
+	case OP_JOIN:
+	case OP_LEAVE:
+		join_or_leave(cnode, fh->op, payload, fh->len);
+		break;
+	case OP_BROADCAST:
+		return broadcast_msg(cnode, payload, fh->len);
+	case OP_P2P:
+		set_p2p(cnode, payload, fh->len);
+		break;
+	case OP_WHERE:
+		return introduce(cnode, fh->id, payload, fh->len);
+	case OP_FILE:
+		return offer_file(cnode, fh->id, payload, fh->len);
+	case OP_PACK:
+		set_packing(cnode, fh->id, payload, fh->len);
+		break;
+	}
+	return CLIENT_OK;
+}
+
+/*
+* Handle every complete frame sitting in the client's ring.
+* What is left is the start of a frame the rest of which
+* is still on its way, or the frame the client is parked on.
+* Then send out whatever the frames queued up.
+* returns CLIENT_GONE, CLIENT_PARKED or CLIENT_OK like handle_frame()
+*/
+int handle_frames(struct client_node *cnode)
+{
+	struct frame_hdr fh;
+	char *payload;
+	int ret;
+
+	cnode->last_rx = timer_now;
+	while((ret = frame_next(&cnode->in, &fh, &payload)) > 0) {
+		frame_status = ACK_OK;
+		ret = handle_frame(cnode, &fh, payload);
+		if(ret == CLIENT_OK && (fh.flags & FLAG_ACK))
+			queue_ack(cnode, fh.id, frame_status);
+		if(ret == CLIENT_PARKED) {
+			/* put the frame back, it is handled again once we resume */
+			cnode->in.head -= FRAME_HDR_SIZE + fh.len;
+			break;
+		}
+		if(ret == CLIENT_GONE)
+			break;
+	}
+	if(ret < 0) {
+		/* a frame larger than we will ever take, this is no client of ours */
+		drop_client(cnode);
+		ret = CLIENT_GONE;
+	}
+	flush_queued();
+	return ret;
+}
+
+/*
+* ring_read() for @cnode, off its rings if it is on shm, or through TLS
+* if it has that, in which case the first few reads are the handshake.
+* Once that is done, it is counted, and whatever was queued for the
+* client in the meantime goes out.
+*/
+ssize_t client_read(struct client_node *cnode)
+{
+	struct tls *t = cnode->tls;
+	ssize_t n;
+	int up;
+
+	if(cnode->shm)
+		return shm_ring_read(cnode->shm, &cnode->in);
+	if(t == NULL)
+		return ring_read(cnode->sockfd, &cnode->in);
+	up = t->up;
+	n = tls_ring_read(t, &cnode->in);
+	if(!up && t->up) {
+		stat_inc(ST_TLS_HANDSHAKES);
+		if(tls_resumed(t))
+			stat_inc(ST_TLS_RESUMED);
+		if(!t->rx || !t->tx)
+			stat_inc(ST_KTLS);
+		flush_client(cnode);
+	}
+	return n;
 }
 
 void *handle_client(void* c)
 {
-	char buffer[BUFF_SIZE] = {0};
-	struct client_node *cnode, *targetnode, *tmpnode;
-	char *recipient, *msg, *tmp, *formatted_msg;
+	struct client_node *cnode;
+	struct pollfd pfd[3];
+	eventfd_t v;
+	ssize_t readlen;
+	/* the rings of a client on shm still have more for us */
+	int readable, more = 0;
 	/* cast the void* pointer back to its original type */
 	cnode = (struct client_node *)c;
+	cnode->wakefd = eventfd(0, EFD_NONBLOCK);
 
 	/*
-	* expecting client program's register_username() to send
-	* a msg of syntax "register username <username>"
-	* This parsed by get_username() to retrieve username,
-	* and then copied to the client's node.
-	*/
-	strcpy(cnode->username, get_username(cnode));
-	/* logging in the server */
-	printf("user: %s, socket: %d, thread:%lu\n",
-		cnode->username, cnode->sockfd, (unsigned long)pthread_self());
-
-	/*
-	* read each `instruction` from the client,
-	* take approprite action, and then come back to beginning
-	* of the loop to wait for further instructions
+	* read what the client says into its ring,
+	* take approprite action for every whole frame in there,
+	* and then come back to beginning of the loop to wait
+	* for further instructions.
+	* Other threads queue frames for our client too, and poke us through
+	* wakefd when the socket is too full to take them: then we also wait
+	* for it to become writable, and write them out.
+	* A client on shm has its doorbell instead, for both, and its socket
+	* only ever says it hung up.
 	*/
 	while(1) {
-		memset(buffer, 0, sizeof buffer);
-		/* read() call blocks till receipt of a msg */
-		read(cnode->sockfd, buffer, sizeof buffer);
-
-		if(strncmp(buffer, "exit", 4) == 0) {
-			/* clean up when a client quits */
-			remove_client(cnode);
-			close(cnode->sockfd);
-			free(cnode);
+		pfd[0].fd = cnode->sockfd;
+		pfd[0].events = cnode->parked && !cnode->shm ? 0 : POLLIN;
+		pthread_mutex_lock(&cnode->out_lock);
+		/* nothing is written before the TLS handshake is done */
+		if(cnode->out.count > 0 && cnode->shm == NULL
+			&& (cnode->tls == NULL || cnode->tls->up))
+			pfd[0].events |= POLLOUT;
+		pthread_mutex_unlock(&cnode->out_lock);
+		/* an SSL stuck on a full socket, handshake or not */
+		if(cnode->tls && cnode->tls->want_write)
+			pfd[0].events |= POLLOUT;
+		pfd[1].fd = cnode->wakefd;
+		pfd[1].events = POLLIN;
+		pfd[2].fd = cnode->shm ? cnode->shm->bell : -1;
+		pfd[2].events = POLLIN;
+		/*
+		* poll() call blocks till there is something to do,
+		* unless the SSL still has some of what it read
+		*/
+		if(poll(pfd, 3, !cnode->parked && (more || (cnode->tls
+			&& tls_pending(cnode->tls))) ? 0 : -1) < 0)
+			continue;
+		if(!cnode->parked && cnode->tls && tls_pending(cnode->tls))
+			pfd[0].revents |= POLLIN;
+
+		readable = more;
+		if(pfd[1].revents & POLLIN) {
+			eventfd_read(cnode->wakefd, &v);
+			/* maybe we were parked and may now carry on */
+			if(!cnode->parked && handle_frames(cnode) == CLIENT_GONE)
+				break;
+			/* what waits in a ring rang its doorbell long ago */
+			readable = cnode->shm != NULL;
+		}
+		if(cnode->shm) {
+			if(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+				lose_client(cnode);
+				break;
+			}
+			/* room to write in the one ring, frames in the other, or both */
+			if(pfd[2].revents & POLLIN) {
+				shm_ack(cnode->shm);
+				flush_client(cnode);
+				readable = 1;
+			}
+			if(!readable || cnode->parked)
+				continue;
+		} else {
+			if(pfd[0].revents & POLLOUT) {
+				/* what the handshake had to write, it writes on the next read */
+				if(cnode->tls && !cnode->tls->up)
+					pfd[0].revents |= POLLIN;
+				flush_client(cnode);
+			}
+			if(!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if(cnode->parked) {
+				/* not reading while parked, but a dead peer is a dead peer */
+				lose_client(cnode);
+				break;
+			}
 		}
 
+		readlen = client_read(cnode);
 		/*
-		* `ls` lists all clients' usernames that are
-		* currently connected
+		* a TLS socket is non-blocking, and may have had only a handshake,
+		* and a ring may have been emptied on a wake up before
 		*/
-		if(strncmp(buffer, "ls", 2) == 0) {
-			memset(buffer, 0, sizeof buffer);
-			tmpnode = client_list;
-			while(tmpnode) {
-				/* concatenate each username to the buffer */
-				strcat(buffer, tmpnode->username);
-				strcat(buffer, "\n");
-				tmpnode = tmpnode->next;
-			}
-			/* write the buffer to cient's socket */
-			write(cnode->sockfd, buffer, strlen(buffer));
+		more = 0;
+		if(readlen < 0 && (errno == EINTR || errno == EAGAIN))
+			continue;
+
+		/* the peer went away without saying `exit` */
+		if(readlen <= 0) {
+			lose_client(cnode);
+			break;
 		}
 
-		/* `send <recipient> <msg>` sends <msg> to the given <username> */
-		if(strncmp(buffer, "send ", 5) == 0) {
-			/* parse buffer to separate recipient and msg */
-			tmp = strchr(buffer, ' ');
-			if(tmp == NULL)
-				continue;
-			recipient = tmp + 1;
+		if(handle_frames(cnode) == CLIENT_GONE)
+			break;
+		/*
+		* look at the rings until they are empty, only then is the
+		* doorbell rung again: also right after moving over to them
+		*/
+		more = cnode->shm != NULL;
+	}
+	return NULL;
+}
 
-			tmp = strchr(recipient, ' ');
-			if(tmp == NULL)
-				continue;
-			*tmp = '\0';
-			msg = tmp + 1;
+void print_pool(struct pool *p)
+{
+	struct pool_stats st;
 
-			/* search for the recipient in the cient list */
-			targetnode = search_client_list(recipient);
+	pool_stats(p, &st);
+	fprintf(stderr, "%-12s allocs %lu frees %lu in use %lu"
+		" depot gets %lu puts %lu slabs %lu heap %lu bytes\n",
+		p->name, st.allocs, st.frees, st.in_use,
+		st.depot_gets, st.depot_puts, st.slabs, (unsigned long)st.heap_bytes);
+}
 
-			/* on invalid recipient, do nothing */
-			if(targetnode == NULL)
-				continue;
+void print_stats(void)
+{
+	char buffer[STATS_BUFF_SIZE];
 
-			formatted_msg = malloc(BUFF_SIZE);
-			/* sprint is notorious for buffer overflow */
-			if(BUFF_SIZE < strlen(cnode->username) + strlen(msg) + 2)
-				continue;
-			/* create a string of syntax `<sender>: <msg>` to send to recipient */
-			sprintf(formatted_msg, "%s: %s", cnode->username, msg);
-			/* logging in the server */
-			printf("%s sent msg to %s\n", cnode->username, targetnode->username);
-			/* Hey target client, You've got message ;) */
-			write(targetnode->sockfd, formatted_msg, strlen(formatted_msg) + 1);
-			free(formatted_msg);
-		}
+	stats_format(buffer, sizeof buffer);
+	fputs(buffer, stderr);
+}
+
+/*
+* `kill -USR1 <pid>` dumps the allocation counters of the pools,
+* and the stats.
+* SIGUSR1 is blocked in every thread but this one, which waits for
+* it in sigwait() and may then call whatever it likes.
+*/
+void *signal_thread(void *set)
+{
+	int sig;
+
+	while(1) {
+		if(sigwait((sigset_t *)set, &sig) != 0)
+			continue;
+		print_pool(&client_pool);
+		print_pool(&msgbuf_pool);
+		if(mode == MODE_URING)
+			print_urings();
+		print_stats();
 	}
+	return NULL;
+}
 
-	/*
-	* clean up
-	* Let me tell you a secret, this never happens
-	* Oh, wait !!
-	*/
-	pthread_mutex_destroy(&client_list_lock);
-	close(cnode->sockfd);
+/*
+* listen on a unix socket at @path, in place of any socket file left
+* behind there by an earlier run. returns the socket, or -1
+*/
+static int unix_listener(const char *path, int backlog)
+{
+	struct sockaddr_un addr;
+	int sockfd;
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+	unlink(path);
+	if(bind(sockfd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	listen(sockfd, backlog);
+	return sockfd;
+}
+
+/*
+* -U <path>: whoever connects to the unix socket at <path> gets the
+* stats and is hung up on, `nc -U <path>` will do to read them.
+* It needs no chat client, and works however busy the chat port is.
+*/
+void *stats_socket(void *arg)
+{
+	char buffer[STATS_BUFF_SIZE];
+	int sockfd, fd;
+	size_t len;
+
+	if((sockfd = unix_listener(stats_path, 16)) < 0) {
+		perror("stats socket");
+		return NULL;
+	}
+	while(1) {
+		if((fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+			continue;
+		len = stats_format(buffer, sizeof buffer);
+		write(fd, buffer, len);
+		close(fd);
+	}
 	return NULL;
 }
 
-int main(void)
+/* TCP keepalive on @fd, see @keepalive */
+void set_keepalive(int fd)
+{
+	int one = 1, timeout;
+
+	if(keepalive == 0)
+		return;
+	timeout = (keepalive + keepalive_intvl * keepalive_cnt) * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof one);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &keepalive, sizeof keepalive);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+		&keepalive_intvl, sizeof keepalive_intvl);
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &keepalive_cnt, sizeof keepalive_cnt);
+	setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof timeout);
+}
+
+void usage(const char *prog)
 {
-	int sockfd, client_sockfd;
+	fprintf(stderr, "usage: %s [-m thread|epoll|uring] [-t reactor threads]"
+		" [-s registry shards] [-q queue high-water mark]"
+		" [-Q block|drop|disconnect] [-p port] [-b listen backlog]"
+		" [-D defer accept secs] [-R] [-L log lines/sec] [-U stats socket]"
+		" [-O offline store dir] [-F store sync ms]"
+		" [-N node id -C host:port,host:port,... -S cluster secret file]"
+		" [-g session grace ms]"
+		" [-H heartbeat secs] [-I idle secs] [-K keepalive secs[:intvl[:count]]]"
+		" [-T cert and key pem] [-u unix socket] [-X file relay port [-x]]"
+		" [-Z dictionary]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+/*
+* open a socket listening on @port.
+* With -R there is one of these per reactor or acceptor thread.
+*/
+int open_listener(void)
+{
+	int sockfd, one = 1;
 
 	/*
 	* struct sockaddr defines a socket address.
@@ -222,25 +1489,14 @@ int main(void)
 	* just a wrapper around struct sockaddr.
 	* Funtions like bind() etc are only aware of struct sockaddr.
 	*/
-	struct sockaddr_in serv_addr, client_addr;
-	unsigned int supplied_len;
-	unsigned int *ip_suppliedlen_op_storedlen;
-
-	/* just to dump the handle for the spawned thread - no use */
-	pthread_t thread;
-
-	/*
-	* initiate a mutex to protect the client list from
-	* being accessed by multiple threads at the same time
-	*/
-	pthread_mutex_init(&client_list_lock, NULL);
+	struct sockaddr_in serv_addr;
 
 	/*
 	* creates a socket of family Internet sockets (AF_INET) and
 	* of type stream. 0 indicates to system to choose appropriate
 	* protocol (eg: TCP)
 	*/
-	sockfd = socket(AF_INET, SOCK_STREAM, 0);
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
 
 	/*
 	* Socket adddress represented by struct sockaddr:
@@ -275,42 +1531,417 @@ int main(void)
 		memcpy(&serv_addr, filler, sizeof(serv_addr));
 	*/
 
+	/*
+	* let a restarted server bind the port right away instead of
+	* waiting for the previous run's connections to leave TIME_WAIT
+	*/
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	/* and let every reactor bind it, the kernel balances among them */
+	if(reuseport)
+		setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+
 	/* binds a socket to an address */
-	bind(sockfd, (struct sockaddr*) &serv_addr, sizeof serv_addr);
+	if(bind(sockfd, (struct sockaddr*) &serv_addr, sizeof serv_addr) < 0) {
+		perror("bind");
+		exit(EXIT_FAILURE);
+	}
+
+	if(defer_accept)
+		setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+			&defer_accept, sizeof defer_accept);
 
 	/*
 	* allows the process to listen on the socket for given
 	* max number of connections
 	*/
-	listen(sockfd, 5);
+	listen(sockfd, listen_backlog);
+	return sockfd;
+}
+
+/* cut off @c, whoever serves it finds its connection broken */
+static void evict_client(struct client_node *c, const char *why)
+{
+	stat_inc(ST_EVICTIONS);
+	log_msg("%s evicted (%s), socket: %d\n", c->username, why, c->sockfd);
+	shutdown(c->sockfd, SHUT_RDWR);
+}
 
+/*
+* The timer of a client fired: see what it has been up to, and arm the
+* timer again for when it next has to be looked at. The timer has a
+* reference of its own to the client, dropped once the client is done.
+*/
+static void idle_check(struct timer *t)
+{
+	struct client_node *c;
+	unsigned long now = timer_now, rx, next;
+	unsigned long hb = timer_ticks(heartbeat_ms), idle = timer_ticks(idle_ms);
+
+	c = (struct client_node *)((char *)t - offsetof(struct client_node, idle));
+	if(c->closed) {
+		put_client(c);
+		return;
+	}
 	/*
-	* This ptr on input specifies the length of the supplied sockaddr,
-	* and on output specifies the length of the stored address
+	* a parked client is not read from, it may well be talking.
+	* Only whoever reads the client writes last_rx, its silence starts
+	* over once it is read from again.
 	*/
-	supplied_len = sizeof(client_addr);
-	ip_suppliedlen_op_storedlen = &supplied_len;
+	rx = c->parked ? now : c->last_rx;
+	next = now + (hb ? hb : idle);
+
+	if(idle && now - c->last_cmd >= idle) {
+		/* no session to come back to either, see lose_client() */
+		pthread_mutex_lock(&c->out_lock);
+		c->session[0] = '\0';
+		pthread_mutex_unlock(&c->out_lock);
+		evict_client(c, "idle");
+		put_client(c);
+		return;
+	}
+	if(idle && c->last_cmd + idle < next)
+		next = c->last_cmd + idle;
+
+	if(hb && now - rx >= 2 * hb) {
+		evict_client(c, "no heartbeat");
+		put_client(c);
+		return;
+	}
+	if(hb && now - rx >= hb) {
+		/* once per silence, what we have not heard back from yet */
+		if(c->pinged != rx) {
+			c->pinged = rx;
+			stat_inc(ST_PINGS);
+			queue_reply(c, OP_PING, 0, "", 0);
+			flush_queued();
+		}
+		if(rx + 2 * hb < next)
+			next = rx + 2 * hb;
+	} else if(hb && rx + hb < next) {
+		next = rx + hb;
+	}
+	timer_arm(&c->idle, next, idle_check);
+}
+
+/*
+* Take in a client just accepted: add it to the client list and
+* hand it to @reactor (any reactor if NULL), or to a thread of its own.
+* A @local one came in on the unix socket, and has no TCP to tune.
+*/
+void serve_new_client(int client_sockfd, struct reactor *reactor, int local)
+{
+	struct client_node *cnode;
+	unsigned long start = stats_now();
+	int one = 1;
+
+	/* just to dump the handle for the spawned thread - no use */
+	pthread_t thread;
+
+	stat_inc(ST_ACCEPTS);
 
 	/*
-	* Now ready to accept clients -
-	* For each client, a new client_node is created and added to the client list.
-	* To handle the client, a new thread is spawned handled by handle_client().
-	* Then, we let the main thread come back to the beginning of the loop to wait for
-	* further clients while the newly spawned thread deals with the accepted client.
+	* chat frames are tiny and each is already written in one go,
+	* holding them back for Nagle only costs a delayed ACK's worth
+	* of latency (up to 40ms) per msg
 	*/
+	if(!local) {
+		setsockopt(client_sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		set_keepalive(client_sockfd);
+	}
+
+	cnode = add_client(client_sockfd);
+	if(tls_pem && !local) {
+		/* the handshake is read along with the rest, never waited for */
+		if(mode == MODE_THREAD)
+			fcntl(client_sockfd, F_SETFL, O_NONBLOCK);
+		cnode->tls = tls_accept(client_sockfd);
+	}
+	if(heartbeat_ms || idle_ms) {
+		get_client(cnode);
+		timer_arm(&cnode->idle, timer_now + timer_ticks(heartbeat_ms ?
+			heartbeat_ms : idle_ms), idle_check);
+	}
+
+	if(mode == MODE_EPOLL) {
+		reactor_add_client(reactor, cnode);
+	} else if(mode == MODE_URING) {
+		/* a uring reactor accepted it itself, and starts receiving right away */
+		cnode->reactor = reactor;
+		uring_arm_recv(reactor, cnode);
+	} else {
+		/* pass a pointer to the correspond client node to the new thread's handler */ 
+		pthread_create(&thread, NULL, handle_client, (void*)cnode);
+		/* nobody joins client threads, let them clean up after themselves */
+		pthread_detach(thread);
+	}
+	stat_lat(LAT_ACCEPT, start);
+}
+
+/*
+* Now ready to accept clients on listening socket @fd -
+* For each client, a new client_node is created and added to the client list.
+* To handle the client, a new thread is spawned handled by handle_client().
+* Then, we come back to the beginning of the loop to wait for
+* further clients while the newly spawned thread deals with the accepted client.
+* In epoll mode no thread is spawned, the client is handed to a reactor instead.
+*/
+void *accept_loop(void *fd)
+{
+	int sockfd = (int)(long)fd, client_sockfd;
+	struct sockaddr_in client_addr;
+	socklen_t supplied_len;
+	/* epoll mode wants its sockets non-blocking, and none leak into children */
+	int flags = SOCK_CLOEXEC | (mode == MODE_EPOLL ? SOCK_NONBLOCK : 0);
+
 	while(1) {
-		struct client_node *cnode;
 		/*
-		* causes the process to block until a client connects to the server,
+		* This on input specifies the length of the supplied sockaddr,
+		* and on output specifies the length of the stored address
+		*/
+		supplied_len = sizeof(client_addr);
+		/*
+		* causes the thread to block until a client connects to the server,
 		* returns a new file descriptor to communicate with the connected client
 		*/
-		client_sockfd = accept(sockfd, (struct sockaddr*) &client_addr,
-							ip_suppliedlen_op_storedlen);
+		client_sockfd = accept4(sockfd, (struct sockaddr*) &client_addr,
+							&supplied_len, flags);
 
-		cnode = add_client(client_sockfd);
+		if(client_sockfd < 0)
+			continue;
+		serve_new_client(client_sockfd, NULL, sockfd == local_listenfd);
+	}
+	return NULL;
+}
 
-		/* pass a pointer to the correspond client node to the new thread's handler */ 
-		pthread_create(&thread, NULL, handle_client, (void*)cnode);
+/* the unix socket at @local_path, for clients on this host */
+int open_local_listener(void)
+{
+	int sockfd;
+
+	if((sockfd = unix_listener(local_path, listen_backlog)) < 0) {
+		perror(local_path);
+		exit(EXIT_FAILURE);
+	}
+	return sockfd;
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, i, nr_shards = 0, node_id = -1, grace_ms = 0;
+	const char *nodes = NULL, *secret_path = NULL;
+	static sigset_t sigs;
+	pthread_t thread;
+
+	while((opt = getopt(argc, argv, "m:t:s:q:Q:p:b:D:RL:U:O:F:N:C:S:g:H:I:K:T:u:X:xZ:")) != -1) {
+		switch(opt) {
+		case 'm':
+			if(strcmp(optarg, "thread") == 0)
+				mode = MODE_THREAD;
+			else if(strcmp(optarg, "epoll") == 0)
+				mode = MODE_EPOLL;
+			else if(strcmp(optarg, "uring") == 0)
+				mode = MODE_URING;
+			else
+				usage(argv[0]);
+			break;
+		case 't':
+			nr_reactors = atoi(optarg);
+			break;
+		case 's':
+			nr_shards = atoi(optarg);
+			break;
+		case 'q':
+			outq_hwm = atol(optarg);
+			break;
+		case 'Q':
+			if(strcmp(optarg, "block") == 0)
+				outq_policy = OUTQ_BLOCK;
+			else if(strcmp(optarg, "drop") == 0)
+				outq_policy = OUTQ_DROP;
+			else if(strcmp(optarg, "disconnect") == 0)
+				outq_policy = OUTQ_DISCONNECT;
+			else
+				usage(argv[0]);
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'b':
+			listen_backlog = atoi(optarg);
+			break;
+		case 'D':
+			defer_accept = atoi(optarg);
+			break;
+		case 'R':
+			reuseport = 1;
+			break;
+		case 'L':
+			log_rate = atol(optarg);
+			break;
+		case 'U':
+			stats_path = optarg;
+			break;
+		case 'O':
+			store_dir = optarg;
+			break;
+		case 'F':
+			sync_ms = atoi(optarg);
+			break;
+		case 'N':
+			node_id = atoi(optarg);
+			break;
+		case 'C':
+			nodes = optarg;
+			break;
+		case 'S':
+			secret_path = optarg;
+			break;
+		case 'g':
+			grace_ms = atoi(optarg);
+			break;
+		case 'H':
+			heartbeat_ms = atoi(optarg) * 1000;
+			break;
+		case 'I':
+			idle_ms = atoi(optarg) * 1000;
+			break;
+		case 'K':
+			if(sscanf(optarg, "%d:%d:%d", &keepalive, &keepalive_intvl,
+				&keepalive_cnt) < 1 || keepalive < 1
+				|| keepalive_intvl < 1 || keepalive_cnt < 1)
+				usage(argv[0]);
+			break;
+		case 'T':
+			tls_pem = optarg;
+			break;
+		case 'u':
+			local_path = optarg;
+			break;
+		case 'X':
+			file_port = atoi(optarg);
+			break;
+		case 'x':
+			relay_copy = 1;
+			break;
+		case 'Z':
+			pack_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	/* a uring reactor has the kernel do its reads, SSL has to do them itself */
+	if(tls_pem && mode == MODE_URING)
+		usage(argv[0]);
+	/* nor can a file be spliced through, it would go in the clear */
+	if(tls_pem && file_port)
+		usage(argv[0]);
+	if(tls_pem && tls_server_init(tls_pem) < 0) {
+		fprintf(stderr, "%s: no certificate and key in there\n", tls_pem);
+		exit(EXIT_FAILURE);
+	}
+	if(pack_path && (pack_dict = lz_dict_load(pack_path)) == NULL)
+		exit(EXIT_FAILURE);
+
+	/* a node needs the list of nodes, its place in it, and the secret */
+	if((nodes || node_id >= 0 || secret_path) && (nodes == NULL
+		|| secret_path == NULL || cluster_init(node_id, nodes) < 0))
+		usage(argv[0]);
+	if(secret_path && cluster_secret(secret_path) < 0) {
+		fprintf(stderr, "%s: no cluster secret of 16 bytes or more in there\n",
+			secret_path);
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	* set up the client list and username table, and the mutex
+	* that protects them from being accessed by multiple threads
+	* at the same time
+	*/
+	registry_init(nr_shards);
+	rooms_init();
+
+	/*
+	* writing to a client that has hung up raises SIGPIPE, which would
+	* kill the whole server. Failing the write with EPIPE will do.
+	*/
+	signal(SIGPIPE, SIG_IGN);
+
+	/* every thread created from here on inherits the blocked SIGUSR1 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	pthread_create(&thread, NULL, signal_thread, &sigs);
+
+	/* frames of chat msgs come from a pool */
+	msgbuf_init();
+
+	stats_init();
+	log_init(log_rate);
+	if(store_dir && store_open(store_dir, sync_ms) < 0) {
+		perror(store_dir);
+		exit(EXIT_FAILURE);
+	}
+	/* sessions, heartbeats and idle clients run on the timing wheel */
+	if((grace_ms > 0 || heartbeat_ms > 0 || idle_ms > 0) && timers_init() < 0) {
+		perror("timers_init");
+		exit(EXIT_FAILURE);
+	}
+	/* a session that is not resumed in time ends like any client */
+	if(grace_ms > 0 && session_init(grace_ms, drop_client) < 0) {
+		perror("session_init");
+		exit(EXIT_FAILURE);
+	}
+	if(stats_path) {
+		pthread_create(&thread, NULL, stats_socket, NULL);
+		pthread_detach(thread);
+	}
+	if(cluster_nodes > 1)
+		start_cluster();
+	if(file_port && relay_init(file_port, relay_copy) < 0) {
+		perror("relay");
+		exit(EXIT_FAILURE);
+	}
+
+	/* as many reactors, or acceptors with -R, as there are cores */
+	if(nr_reactors < 1)
+		nr_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+	if(nr_reactors < 1)
+		nr_reactors = 1;
+
+	if(local_path)
+		local_listenfd = open_local_listener();
+	if(mode == MODE_EPOLL)
+		start_reactors(reuseport);
+	if(mode == MODE_URING)
+		start_uring_reactors(reuseport, local_listenfd);
+	/* the unix socket has an acceptor of its own, but in uring mode */
+	if(local_listenfd >= 0 && mode != MODE_URING) {
+		pthread_create(&thread, NULL, accept_loop, (void *)(long)local_listenfd);
+		pthread_detach(thread);
+	}
+
+	/* uring reactors accept for themselves, on whatever listener */
+	if(mode == MODE_URING) {
+		while(1)
+			pause();
+	}
+	if(!reuseport) {
+		/* the one listener, accepted from by the main thread */
+		accept_loop((void *)(long)open_listener());
+		return 0;
+	}
+	/* the reactors accept on their own listeners, nothing left to do */
+	if(mode == MODE_EPOLL) {
+		while(1)
+			pause();
+	}
+	/* thread mode: a listener and an acceptor thread per core */
+	for(i = 1; i < nr_reactors; i++) {
+		pthread_create(&thread, NULL, accept_loop, (void *)(long)open_listener());
+		pthread_detach(thread);
 	}
+	accept_loop((void *)(long)open_listener());
 	return 0;
 }
@@ -0,0 +1,47 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef CHATSERVER_H
+#define CHATSERVER_H
+
+#include <sys/types.h>
+#include "registry.h"
+#include "pool.h"
+
+/*
+* What chatserver.c lends the parts of the server that live elsewhere:
+* the reactors (see reactor.h) queue, read and hand over clients with it,
+* the links of a cluster (see cluster.h) forward and store msgs.
+*/
+
+/* how many queued frames go out in one sendmsg() */
+#define FLUSH_IOV 64
+
+/* return codes of handle_frame() and friends */
+#define CLIENT_OK     0
+#define CLIENT_GONE   1
+#define CLIENT_PARKED 2
+
+/* how many bytes a queue may hold, see outq_policy */
+extern size_t outq_hwm;
+/* where msgs to users offline are kept, NULL if they are not */
+extern const char *store_dir;
+
+struct reactor;
+
+void resume_clients(struct client_node *waiters);
+void flush_client(struct client_node *c);
+void flush_queued(void);
+void push_msg(struct client_node *to, struct msgbuf *m);
+int queue_msg(struct client_node *from, struct client_node *to, struct msgbuf *m);
+ssize_t client_read(struct client_node *cnode);
+int handle_frames(struct client_node *cnode);
+void drop_client(struct client_node *cnode);
+void lose_client(struct client_node *cnode);
+void set_keepalive(int fd);
+void serve_new_client(int client_sockfd, struct reactor *reactor, int local);
+int open_listener(void);
+void print_pool(struct pool *p);
+
+#endif
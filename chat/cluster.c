@@ -0,0 +1,763 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/random.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include "registry.h"
+#include "stats.h"
+#include "log.h"
+#include "store.h"
+#include "session.h"
+#include "cluster.h"
+#include "chatserver.h"
+
+int cluster_self = 0, cluster_nodes = 1;
+static struct sockaddr_in addrs[CLUSTER_MAX_NODES];
+
+/*
+* The directory is a hash table of names, chained, behind a reader-writer
+* lock: every `send` to somebody not on this node looks a name up, only
+* users coming and going elsewhere change it. It is doubled whenever it
+* holds twice as many names as it has buckets.
+*/
+#define DIR_MIN_BUCKETS 1024
+
+struct dir_entry {
+	char name[USERNAME_MAX_SIZE];
+	unsigned int hash;
+	int node;
+	struct dir_entry *next;
+};
+
+static struct dir_entry **buckets;
+static unsigned int nr_buckets, nr_entries;
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+int cluster_init(int self, const char *nodes)
+{
+	char *list = strdup(nodes), *tok, *colon, *save;
+	int n = 0;
+
+	for(tok = strtok_r(list, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		colon = strchr(tok, ':');
+		if(n == CLUSTER_MAX_NODES || colon == NULL)
+			break;
+		*colon = '\0';
+		memset(&addrs[n], 0, sizeof addrs[n]);
+		addrs[n].sin_family = AF_INET;
+		addrs[n].sin_port = htons(atoi(colon + 1));
+		if(inet_pton(AF_INET, tok, &addrs[n].sin_addr) != 1)
+			break;
+		n++;
+	}
+	free(list);
+	if(tok || self < 0 || self >= n)
+		return -1;
+	cluster_self = self;
+	cluster_nodes = n;
+	nr_buckets = DIR_MIN_BUCKETS;
+	buckets = calloc(nr_buckets, sizeof *buckets);
+	return 0;
+}
+
+const struct sockaddr_in *cluster_addr(int node)
+{
+	return &addrs[node];
+}
+
+/* the secret every node knows */
+#define SECRET_MIN 16
+#define SECRET_MAX 256
+static unsigned char secret[SECRET_MAX];
+static size_t secret_len;
+
+int cluster_secret(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+
+	if(fp == NULL)
+		return -1;
+	secret_len = fread(secret, 1, SECRET_MAX, fp);
+	fclose(fp);
+	/* a line in a file, the newline is not part of it */
+	while(secret_len > 0 && (secret[secret_len - 1] == '\n'
+			|| secret[secret_len - 1] == '\r'))
+		secret_len--;
+	return secret_len < SECRET_MIN ? -1 : 0;
+}
+
+/* the link to @name's entry, or to where it would go */
+static struct dir_entry **dir_find(const char *name, unsigned int hash)
+{
+	struct dir_entry **e = &buckets[hash & (nr_buckets - 1)];
+
+	while(*e && ((*e)->hash != hash || strcmp((*e)->name, name) != 0))
+		e = &(*e)->next;
+	return e;
+}
+
+static void dir_grow(void)
+{
+	struct dir_entry **old = buckets, *e, *next;
+	unsigned int i, old_nr = nr_buckets;
+
+	nr_buckets *= 2;
+	buckets = calloc(nr_buckets, sizeof *buckets);
+	for(i = 0; i < old_nr; i++) {
+		for(e = old[i]; e; e = next) {
+			next = e->next;
+			e->next = buckets[e->hash & (nr_buckets - 1)];
+			buckets[e->hash & (nr_buckets - 1)] = e;
+		}
+	}
+	free(old);
+}
+
+/* @name is on @node now, wherever it was before */
+void dir_add(const char *name, int node)
+{
+	unsigned int hash = hash_name(name);
+	struct dir_entry **e, *n;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	e = dir_find(name, hash);
+	if(*e == NULL) {
+		n = malloc(sizeof *n);
+		strncpy(n->name, name, USERNAME_MAX_SIZE - 1);
+		n->name[USERNAME_MAX_SIZE - 1] = '\0';
+		n->hash = hash;
+		n->next = NULL;
+		*e = n;
+		if(++nr_entries > 2 * nr_buckets)
+			dir_grow();
+		e = dir_find(name, hash);
+	}
+	(*e)->node = node;
+	pthread_rwlock_unlock(&dir_lock);
+}
+
+/*
+* @name left @node. Should it have shown up on another node meanwhile,
+* the news of which came first, it stays.
+*/
+void dir_del(const char *name, int node)
+{
+	unsigned int hash = hash_name(name);
+	struct dir_entry **e, *dead;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	e = dir_find(name, hash);
+	if(*e && (*e)->node == node) {
+		dead = *e;
+		*e = dead->next;
+		free(dead);
+		nr_entries--;
+	}
+	pthread_rwlock_unlock(&dir_lock);
+}
+
+/* the node @name is on, -1 if none of the others has them */
+int dir_lookup(const char *name)
+{
+	unsigned int hash = hash_name(name);
+	struct dir_entry **e;
+	int node = -1;
+
+	pthread_rwlock_rdlock(&dir_lock);
+	e = dir_find(name, hash);
+	if(*e)
+		node = (*e)->node;
+	pthread_rwlock_unlock(&dir_lock);
+	return node;
+}
+
+/* forget everybody on @node, its link is down */
+void dir_drop(int node)
+{
+	struct dir_entry **e, *dead;
+	unsigned int i;
+
+	pthread_rwlock_wrlock(&dir_lock);
+	for(i = 0; i < nr_buckets; i++) {
+		e = &buckets[i];
+		while(*e) {
+			if((*e)->node != node) {
+				e = &(*e)->next;
+				continue;
+			}
+			dead = *e;
+			*e = dead->next;
+			free(dead);
+			nr_entries--;
+		}
+	}
+	pthread_rwlock_unlock(&dir_lock);
+}
+
+void dir_list(char **buf, size_t *len, size_t *size)
+{
+	struct dir_entry *e;
+	unsigned int i;
+
+	pthread_rwlock_rdlock(&dir_lock);
+	for(i = 0; i < nr_buckets; i++) {
+		for(e = buckets[i]; e; e = e->next) {
+			if(*len + USERNAME_MAX_SIZE + 1 > *size) {
+				*size *= 2;
+				*buf = realloc(*buf, *size);
+			}
+			strcpy(*buf + *len, e->name);
+			*len += strlen(e->name);
+			(*buf)[(*len)++] = '\n';
+		}
+	}
+	pthread_rwlock_unlock(&dir_lock);
+}
+
+/* a link's receive ring, it carries the traffic of many users */
+#define LINK_RING_SIZE 65536
+#define LINK_RING_MAX (1024 * 1024)
+
+/*
+* The links.
+* The link to another node is a client_node too, only it is never on the
+* client list nor in the registry. Frames for the other node are queued
+* on it by whatever thread has them, like frames for a client, and go
+* out many per sendmsg() the same way. A sender that finds the link over
+* its high-water mark is stalled like on any full queue.
+*/
+struct peer {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* the link to the node while it is up, NULL otherwise */
+	struct client_node *link;
+};
+static struct peer peers[CLUSTER_MAX_NODES];
+
+/*
+* Users registering and leaving are announced to the other nodes under
+* @announce_lock, and a new link is told about everybody under it too.
+* So a node always hears about a name in the order things happened here:
+* a user leaving and the next one taking the name never reach it the
+* other way round.
+*/
+static pthread_mutex_t announce_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the link to @node with a reference taken, NULL while it is down */
+static struct client_node *get_link(int node)
+{
+	struct client_node *link;
+
+	pthread_mutex_lock(&peers[node].lock);
+	link = peers[node].link;
+	if(link)
+		get_client(link);
+	pthread_mutex_unlock(&peers[node].lock);
+	return link;
+}
+
+/* queue a directory update about @name for @link, over its mark or not */
+static void push_dir(struct client_node *link, int op, const char *name)
+{
+	struct msgbuf *m = msgbuf_new(op, 0, 0, name, strlen(name));
+
+	pthread_mutex_lock(&link->out_lock);
+	if(!link->dead)
+		push_msg(link, m);
+	pthread_mutex_unlock(&link->out_lock);
+	msgbuf_put(m);
+}
+
+/* tell every node we have a link to, with announce_lock held */
+static void announce(int op, const char *name)
+{
+	struct client_node *link;
+	int i;
+
+	for(i = 0; i < cluster_nodes; i++) {
+		if(i == cluster_self || (link = get_link(i)) == NULL)
+			continue;
+		push_dir(link, op, name);
+		put_client(link);
+	}
+	flush_queued();
+}
+
+/*
+* register_client(), and in a cluster only if no other node has a user
+* of that name either. The other nodes hear about the new user.
+*/
+int register_user(struct client_node *cnode, const char *username)
+{
+	int ret;
+
+	if(cluster_nodes == 1)
+		return register_client(cnode, username);
+	pthread_mutex_lock(&announce_lock);
+	if(dir_lookup(username) >= 0) {
+		/* taken on another node, which is as good as taken here */
+		strcpy(cnode->username, username);
+		ret = 0;
+	} else if((ret = register_client(cnode, username)) != 0) {
+		announce(OP_NODE_ADD, cnode->username);
+	}
+	pthread_mutex_unlock(&announce_lock);
+	return ret;
+}
+
+/* remove_client(), and the other nodes hear that the user left */
+void unregister_user(struct client_node *cnode)
+{
+	if(cluster_nodes == 1) {
+		remove_client(cnode);
+		return;
+	}
+	pthread_mutex_lock(&announce_lock);
+	if(remove_client(cnode))
+		announce(OP_NODE_DEL, cnode->username);
+	pthread_mutex_unlock(&announce_lock);
+}
+
+/*
+* send `<sender>: <msg>` on to @recipient, a user of @node.
+* returns what queue_msg() does, or -1 if the link to the node is down
+*/
+int forward_msg(struct client_node *cnode, int node, const char *recipient,
+	const char *msg, size_t msglen)
+{
+	struct client_node *link = get_link(node);
+	size_t rlen = strlen(recipient), namelen = strlen(cnode->username);
+	struct msgbuf *m;
+	char *tmp;
+	int ret;
+
+	if(link == NULL)
+		return -1;
+	/* `<recipient> <sender>: <msg>` */
+	m = msgbuf_new(OP_NODE_SEND, 0, 0, NULL, rlen + 1 + namelen + 2 + msglen);
+	tmp = m->data + FRAME_HDR_SIZE;
+	memcpy(tmp, recipient, rlen);
+	tmp[rlen] = ' ';
+	memcpy(tmp + rlen + 1, cnode->username, namelen);
+	memcpy(tmp + rlen + 1 + namelen, ": ", 2);
+	memcpy(tmp + rlen + 1 + namelen + 2, msg, msglen);
+	ret = queue_msg(cnode, link, m);
+	msgbuf_put(m);
+	if(ret == CLIENT_OK)
+		stat_inc(ST_FORWARDED);
+	put_client(link);
+	return ret;
+}
+
+/*
+* A `send` another node forwarded to a user of ours. Should they have
+* left meanwhile, it is stored like a msg sent here would be.
+* It never stalls the link: a msg to a full queue is dropped instead,
+* like a broadcast would be.
+*/
+static void deliver_forwarded(char *payload, size_t len)
+{
+	char recipient[USERNAME_MAX_SIZE];
+	struct client_node *target;
+	struct msgbuf *m;
+	char *msg;
+
+	msg = memchr(payload, ' ', len);
+	if(msg == NULL || msg - payload >= USERNAME_MAX_SIZE)
+		return;
+	memcpy(recipient, payload, msg - payload);
+	recipient[msg - payload] = '\0';
+	msg++;
+	len -= msg - payload;
+	stat_inc(ST_FORWARDS_IN);
+
+	while((target = search_client_list(recipient)) == NULL) {
+		if(store_dir == NULL || store_put(recipient, msg, len) != STORE_ONLINE)
+			return;
+	}
+	m = msgbuf_new(OP_MSG, 0, 0, msg, len);
+	queue_msg(NULL, target, m);
+	msgbuf_put(m);
+	put_client(target);
+}
+
+/* what the node at the other end of a link says */
+static void link_frame(int node, struct frame_hdr *fh, char *payload)
+{
+	char name[USERNAME_MAX_SIZE];
+	struct client_node *c;
+
+	if(fh->op == OP_NODE_SEND) {
+		deliver_forwarded(payload, fh->len);
+		return;
+	}
+	if(fh->len == 0 || fh->len >= USERNAME_MAX_SIZE)
+		return;
+	memcpy(name, payload, fh->len);
+	name[fh->len] = '\0';
+	if(fh->op == OP_NODE_DEL)
+		dir_del(name, node);
+	if(fh->op != OP_NODE_ADD)
+		return;
+	/*
+	* The name was taken on two nodes at once, before either heard of
+	* the other. The node with the lower id keeps its user, the other
+	* one's is hung up on, its reader finds out and drops it.
+	*/
+	if((c = search_client_list(name)) != NULL) {
+		if(node < cluster_self) {
+			/* with no coming back to the name either */
+			pthread_mutex_lock(&c->out_lock);
+			c->session[0] = '\0';
+			pthread_mutex_unlock(&c->out_lock);
+			shutdown(c->sockfd, SHUT_RDWR);
+			if(session_claim(c))
+				drop_client(c);
+		}
+		put_client(c);
+		if(node > cluster_self)
+			return;
+	}
+	dir_add(name, node);
+}
+
+/*
+* tell the node at the other end of a new @link about all our users,
+* with announce_lock held so nobody comes or goes meanwhile
+*/
+static void send_directory(struct client_node *link)
+{
+	struct client_node *c, *found;
+
+	pthread_mutex_lock(&client_list_lock);
+	for(c = client_list; c; c = c->next) {
+		if(c->username[0] == '\0')
+			continue;
+		/* a client whose name was taken has it all the same */
+		found = search_client_list(c->username);
+		if(found == c)
+			push_dir(link, OP_NODE_ADD, c->username);
+		if(found)
+			put_client(found);
+	}
+	pthread_mutex_unlock(&client_list_lock);
+}
+
+/*
+* Serve the link to @node on @fd until it breaks, much like a client in
+* thread mode: read what comes in and handle it, and write out what is
+* queued whenever the socket was too full to take it right away.
+*/
+static void serve_link(int node, int fd)
+{
+	struct peer *peer = &peers[node];
+	struct client_node *link = new_client(fd), *waiters;
+	struct pollfd pfd[2];
+	struct frame_hdr fh;
+	char *payload;
+	eventfd_t v;
+	ssize_t n;
+	int ret, one = 1;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+	set_keepalive(fd);
+	ring_free(&link->in);
+	ring_init(&link->in, LINK_RING_SIZE, LINK_RING_MAX);
+	link->wakefd = eventfd(0, EFD_NONBLOCK);
+
+	/*
+	* The node dialed again before we saw its old link break: out with
+	* the old one, and wait until it is gone with everything it knew.
+	* Not with announce_lock held, the old one may need it to drop a
+	* client on its way out, and every register would wait meanwhile.
+	* Then we are up, and start by telling the node who is here, with
+	* announce_lock held; should yet another link of the node have come
+	* up in between, it is the one to wait for.
+	*/
+	while(1) {
+		pthread_mutex_lock(&peer->lock);
+		while(peer->link) {
+			shutdown(peer->link->sockfd, SHUT_RDWR);
+			pthread_cond_wait(&peer->cond, &peer->lock);
+		}
+		pthread_mutex_unlock(&peer->lock);
+		pthread_mutex_lock(&announce_lock);
+		pthread_mutex_lock(&peer->lock);
+		if(peer->link == NULL)
+			break;
+		pthread_mutex_unlock(&peer->lock);
+		pthread_mutex_unlock(&announce_lock);
+	}
+	peer->link = link;
+	get_client(link);
+	pthread_mutex_unlock(&peer->lock);
+	send_directory(link);
+	pthread_mutex_unlock(&announce_lock);
+	flush_queued();
+	log_msg("link to node %d up\n", node);
+
+	while(!link->dead) {
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		pthread_mutex_lock(&link->out_lock);
+		if(link->out.count > 0)
+			pfd[0].events |= POLLOUT;
+		pthread_mutex_unlock(&link->out_lock);
+		pfd[1].fd = link->wakefd;
+		pfd[1].events = POLLIN;
+		if(poll(pfd, 2, -1) < 0)
+			continue;
+
+		if(pfd[1].revents & POLLIN)
+			eventfd_read(link->wakefd, &v);
+		if(pfd[0].revents & POLLOUT)
+			flush_client(link);
+		if(!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		n = ring_read(fd, &link->in);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			break;
+		while((ret = frame_next(&link->in, &fh, &payload)) > 0)
+			link_frame(node, &fh, payload);
+		flush_queued();
+		if(ret < 0)
+			break;
+	}
+
+	/*
+	* The users over there are out of reach until the link is back.
+	* Senders stalled on the link get to try again, and find that out.
+	*/
+	dir_drop(node);
+	pthread_mutex_lock(&link->out_lock);
+	link->dead = 1;
+	link->closed = 1;
+	outq_clear(&link->out);
+	waiters = link->waiters;
+	link->waiters = NULL;
+	pthread_mutex_unlock(&link->out_lock);
+	resume_clients(waiters);
+
+	pthread_mutex_lock(&peer->lock);
+	peer->link = NULL;
+	pthread_cond_broadcast(&peer->cond);
+	pthread_mutex_unlock(&peer->lock);
+	log_msg("link to node %d down\n", node);
+	shutdown(fd, SHUT_RDWR);
+	/* the peer's reference, and ours */
+	put_client(link);
+	put_client(link);
+}
+
+/*
+* Before a link is up, each end proves it knows the secret: the dialer
+* says hello with a nonce, the other end answers with a nonce of its own
+* and the MAC of both under the secret, and the dialer with the MAC of
+* them the other way round. A MAC covers who dials whom and which end
+* made it, so neither end's can be played back to it, nor to another node.
+* Only the hellos are checked, the frames after them are not: the links
+* are for a network nobody else is on.
+*/
+#define NONCE_SIZE 16
+#define MAC_SIZE 32
+/* how long a hello may take, and how many may be under way */
+#define HELLO_SECS 5
+#define MAX_HELLOS (4 * CLUSTER_MAX_NODES)
+
+static int hellos;
+
+/* the MAC @by ('D' the dialer or 'L' the other end) makes of two nonces */
+static void link_mac(int by, int dialer, int listener,
+	const unsigned char *first, const unsigned char *second, unsigned char *mac)
+{
+	unsigned char data[3 + 2 * NONCE_SIZE];
+	unsigned int len = MAC_SIZE;
+
+	data[0] = by;
+	data[1] = dialer;
+	data[2] = listener;
+	memcpy(data + 3, first, NONCE_SIZE);
+	memcpy(data + 3 + NONCE_SIZE, second, NONCE_SIZE);
+	HMAC(EVP_sha256(), secret, secret_len, data, sizeof data, mac, &len);
+}
+
+/* a frame of @op with a payload of @len bytes exactly, or -1 */
+static int read_hello(int fd, int op, struct frame_hdr *fh, void *payload,
+	size_t len)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+
+	if(recv(fd, hdr, sizeof hdr, MSG_WAITALL) != sizeof hdr)
+		return -1;
+	frame_unpack(hdr, fh);
+	if(fh->op != op || fh->len != len)
+		return -1;
+	if(recv(fd, payload, len, MSG_WAITALL) != (ssize_t)len)
+		return -1;
+	return 0;
+}
+
+/* a hello that does not hear back in time gives up */
+static void hello_timeout(int fd, int secs)
+{
+	struct timeval tv;
+
+	tv.tv_sec = secs;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+}
+
+/* say hello to @node on @fd. returns 0 if it knows the secret */
+static int dial_hello(int node, int fd)
+{
+	unsigned char nonce[NONCE_SIZE], reply[NONCE_SIZE + MAC_SIZE], mac[MAC_SIZE];
+	struct frame_hdr fh;
+
+	if(getrandom(nonce, sizeof nonce, 0) != sizeof nonce)
+		return -1;
+	hello_timeout(fd, HELLO_SECS);
+	if(frame_write(fd, OP_NODE_HELLO, 0, cluster_self, nonce, sizeof nonce) < 0
+		|| read_hello(fd, OP_NODE_AUTH, &fh, reply, sizeof reply) < 0)
+		return -1;
+	link_mac('L', cluster_self, node, nonce, reply, mac);
+	if(CRYPTO_memcmp(mac, reply + NONCE_SIZE, MAC_SIZE) != 0) {
+		log_msg("node %d does not know the cluster secret\n", node);
+		return -1;
+	}
+	link_mac('D', cluster_self, node, reply, nonce, mac);
+	if(frame_write(fd, OP_NODE_AUTH, 0, cluster_self, mac, sizeof mac) < 0)
+		return -1;
+	hello_timeout(fd, 0);
+	return 0;
+}
+
+/*
+* the hello of a node dialing us on @fd. returns the node, or -1 if it is
+* no node of ours
+*/
+static int take_hello(int fd)
+{
+	unsigned char nonce[NONCE_SIZE], reply[NONCE_SIZE + MAC_SIZE];
+	unsigned char mac[MAC_SIZE], want[MAC_SIZE];
+	struct frame_hdr fh;
+	int node;
+
+	hello_timeout(fd, HELLO_SECS);
+	if(read_hello(fd, OP_NODE_HELLO, &fh, nonce, sizeof nonce) < 0
+		|| fh.id <= cluster_self || fh.id >= cluster_nodes
+		|| getrandom(reply, NONCE_SIZE, 0) != NONCE_SIZE)
+		return -1;
+	node = fh.id;
+	link_mac('L', node, cluster_self, nonce, reply, reply + NONCE_SIZE);
+	if(frame_write(fd, OP_NODE_AUTH, 0, cluster_self, reply, sizeof reply) < 0
+		|| read_hello(fd, OP_NODE_AUTH, &fh, mac, sizeof mac) < 0)
+		return -1;
+	link_mac('D', node, cluster_self, reply, nonce, want);
+	if(CRYPTO_memcmp(mac, want, MAC_SIZE) != 0) {
+		log_msg("node %d does not know the cluster secret\n", node);
+		return -1;
+	}
+	hello_timeout(fd, 0);
+	return node;
+}
+
+/* keep a link to @node, a node with a lower id, dialing it again if it breaks */
+static void *link_dialer(void *arg)
+{
+	int node = (int)(long)arg;
+	int fd;
+
+	while(1) {
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(connect(fd, (struct sockaddr *)cluster_addr(node),
+				sizeof(struct sockaddr_in)) == 0
+			&& dial_hello(node, fd) == 0)
+			serve_link(node, fd);
+		else
+			close(fd);
+		sleep(1);
+	}
+	return NULL;
+}
+
+/*
+* a connection accepted on (long)@arg, a link once it says hello. On a
+* thread of its own, so a connection that is slow to say it, or never
+* does, holds up no other
+*/
+static void *link_accepted(void *arg)
+{
+	int fd = (int)(long)arg, node = take_hello(fd);
+
+	__sync_fetch_and_sub(&hellos, 1);
+	if(node < 0)
+		close(fd);
+	else
+		serve_link(node, fd);
+	return NULL;
+}
+
+/* take the links of the nodes with higher ids than ours */
+static void *link_listener(void *arg)
+{
+	int sockfd = (int)(long)arg, fd;
+	pthread_t thread;
+
+	while(1) {
+		if((fd = accept4(sockfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+			continue;
+		/* a node has one link to us, not hundreds of hellos */
+		if(__sync_fetch_and_add(&hellos, 1) >= MAX_HELLOS
+			|| pthread_create(&thread, NULL, link_accepted,
+				(void *)(long)fd) != 0) {
+			__sync_fetch_and_sub(&hellos, 1);
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+/* listen for the nodes above us, and dial those below */
+void start_cluster(void)
+{
+	pthread_t thread;
+	int i, sockfd, one = 1;
+
+	for(i = 0; i < cluster_nodes; i++) {
+		pthread_mutex_init(&peers[i].lock, NULL);
+		pthread_cond_init(&peers[i].cond, NULL);
+	}
+	sockfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	if(bind(sockfd, (struct sockaddr *)cluster_addr(cluster_self),
+			sizeof(struct sockaddr_in)) < 0) {
+		perror("cluster bind");
+		exit(EXIT_FAILURE);
+	}
+	listen(sockfd, CLUSTER_MAX_NODES);
+	pthread_create(&thread, NULL, link_listener, (void *)(long)sockfd);
+	pthread_detach(thread);
+	for(i = 0; i < cluster_self; i++) {
+		pthread_create(&thread, NULL, link_dialer, (void *)(long)i);
+		pthread_detach(thread);
+	}
+}
@@ -0,0 +1,72 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include <stddef.h>
+#include <netinet/in.h>
+#include "registry.h"
+
+/*
+* A cluster is several chatservers, each with clients of its own, that
+* look like one server to them: a user may `send` to anybody connected
+* to any node, and `ls` lists everybody.
+*
+* Every two nodes are joined by a link, one TCP connection that carries
+* everything between them, the frames of any number of users either way,
+* and stays up as long as both nodes do. The node with the higher id
+* dials, the other one accepts, once both ends proved they know the
+* cluster's secret.
+*
+* Every node keeps a directory of the users connected to the other nodes,
+* and which node each one is on. It is replicated: a node tells all the
+* others when one of its users registers and when they leave, and when a
+* link comes up, each end starts by telling the other about all of its
+* users. A `send` to a user the node does not have is looked up there,
+* and forwarded over the link to the node that has them. The directory
+* travels on the links along with the msgs, so a msg never arrives at a
+* node before the news that its recipient is there.
+* When a link breaks, the users of the node at the other end are
+* forgotten until it is back.
+*/
+#define CLUSTER_MAX_NODES 64
+
+/* this node's id, and how many nodes there are (1 when not clustered) */
+extern int cluster_self, cluster_nodes;
+
+/*
+* @nodes lists the link address of every node, `host:port,host:port,...`,
+* node ids are positions in the list.
+* returns -1 on a bad list or id
+*/
+int cluster_init(int self, const char *nodes);
+/*
+* the secret every node knows, at least 16 bytes in the file at @path.
+* A node takes no link from one that does not know it, nor dials one.
+* returns -1 if there is none
+*/
+int cluster_secret(const char *path);
+const struct sockaddr_in *cluster_addr(int node);
+
+/* the directory: who is on which other node */
+void dir_add(const char *name, int node);
+void dir_del(const char *name, int node);
+int dir_lookup(const char *name);
+void dir_drop(int node);
+/* append every name, one per line, to @buf, growing it as need be */
+void dir_list(char **buf, size_t *len, size_t *size);
+
+/* the links: take and dial them, and keep them up for good */
+void start_cluster(void);
+/*
+* register_client() and remove_client(), only the other nodes hear
+* about it, and a name may not be taken on any node
+*/
+int register_user(struct client_node *cnode, const char *username);
+void unregister_user(struct client_node *cnode);
+int forward_msg(struct client_node *cnode, int node, const char *recipient,
+	const char *msg, size_t msglen);
+
+#endif
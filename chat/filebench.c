@@ -0,0 +1,319 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "proto.h"
+#include "relay.h"
+
+/*
+* filebench measures files going through the relay of chatserver (-X).
+* It registers -c pairs of users, <prefix>s<i> and <prefix>r<i>, and
+* every sender sends -n files of -s MB to its recipient, one after the
+* other, all pairs at once. There are no files on disk: a sender writes
+* the same buffer over and over, and a recipient splices what comes in
+* on to /dev/null, so the bench touches as few of the bytes as it can.
+* It prints how fast the bytes went, all pairs together, and with -P
+* the pid of the server, how much CPU the server took per GB relayed,
+* and how much the bench took, to tell splicing (the default) from
+* copying (chatserver -x) by more than the time it took.
+*/
+
+#define RING_SIZE 4096
+#define RING_MAX (1024 * 1024)
+#define CHUNK (1024 * 1024)
+
+static const char *host = "127.0.0.1";
+static unsigned short port = 55555;
+static int nr_pairs = 1;
+static int nr_files = 4;
+static unsigned long long file_size = 1024ULL * 1024 * 1024;
+static const char *prefix = "fb";
+static int server_pid = 0;
+
+static char chunk[CHUNK];
+
+struct pair {
+	pthread_t sender, sink;
+	int id;
+	/* the connections to the server of either end */
+	int sfd, rfd;
+	struct ringbuf sin, rin;
+	unsigned long long received;
+	/* files that came in, and how many of them came whole */
+	int files_in, whole;
+};
+
+static int dial(unsigned short p)
+{
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(p);
+	inet_pton(AF_INET, host, &addr.sin_addr);
+	if(connect(fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		perror("connect");
+		exit(EXIT_FAILURE);
+	}
+	return fd;
+}
+
+/* the next frame of @op off @fd, the others are of no interest */
+static int wait_frame(int fd, struct ringbuf *rb, int op, char *buf, size_t size)
+{
+	struct frame_hdr fh;
+	char *payload;
+	int ret;
+
+	for(;;) {
+		while((ret = frame_next(rb, &fh, &payload)) > 0) {
+			if(fh.op != op)
+				continue;
+			if(fh.len >= size)
+				return -1;
+			memcpy(buf, payload, fh.len);
+			buf[fh.len] = '\0';
+			return 0;
+		}
+		if(ret < 0 || ring_read(fd, rb) <= 0)
+			return -1;
+	}
+}
+
+/* an end of a transfer, at the relay on @p, to go by @token */
+static int dial_relay(unsigned short p, const char *token, int end)
+{
+	char hello[RELAY_HELLO_SIZE];
+	int fd = dial(p);
+
+	memcpy(hello, token, SESSION_TOKEN_SIZE);
+	hello[SESSION_TOKEN_SIZE] = end;
+	if(write(fd, hello, sizeof hello) != sizeof hello) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* ask for a transfer to the pair's recipient, and write the file */
+static void *sender(void *arg)
+{
+	struct pair *pr = arg;
+	char buf[256], token[SESSION_TOKEN_SIZE + 1];
+	unsigned long long left;
+	unsigned int p;
+	ssize_t n;
+	int i, fd, len;
+
+	for(i = 0; i < nr_files; i++) {
+		len = sprintf(buf, "%sr%d %llu file%d", prefix, pr->id, file_size, i);
+		frame_write(pr->sfd, OP_FILE, 0, i, buf, len);
+		if(wait_frame(pr->sfd, &pr->sin, OP_FILE_GO, buf, sizeof buf) < 0
+			|| sscanf(buf, "%*s %u %32s", &p, token) != 2) {
+			fprintf(stderr, "pair %d: no transfer, is there a relay (-X)?\n",
+				pr->id);
+			exit(EXIT_FAILURE);
+		}
+		fd = dial_relay(p, token, RELAY_SENDER);
+		for(left = file_size; fd >= 0 && left > 0; left -= n) {
+			n = write(fd, chunk, left < CHUNK ? left : CHUNK);
+			if(n <= 0)
+				break;
+		}
+		if(fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+/* take the files offered to the pair's recipient, into /dev/null */
+static void *sink(void *arg)
+{
+	struct pair *pr = arg;
+	char buf[256], token[SESSION_TOKEN_SIZE + 1];
+	unsigned long long size, done;
+	unsigned int p;
+	ssize_t n, m, k;
+	int fd, pipefd[2], null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+
+	pipe2(pipefd, O_CLOEXEC);
+	fcntl(pipefd[1], F_SETPIPE_SZ, CHUNK);
+	while(pr->files_in < nr_files) {
+		if(wait_frame(pr->rfd, &pr->rin, OP_OFFER, buf, sizeof buf) < 0
+			|| sscanf(buf, "%*s %llu %u %32s", &size, &p, token) != 3)
+			break;
+		fd = dial_relay(p, token, RELAY_RECIPIENT);
+		for(done = 0; fd >= 0 && done < size; done += n) {
+			n = splice(fd, NULL, pipefd[1], NULL, CHUNK, SPLICE_F_MOVE);
+			if(n <= 0)
+				break;
+			for(m = n; m > 0; ) {
+				k = splice(pipefd[0], NULL, null, NULL, m, SPLICE_F_MOVE);
+				if(k <= 0)
+					break;
+				m -= k;
+			}
+		}
+		if(fd >= 0)
+			close(fd);
+		pr->received += done;
+		pr->files_in++;
+		pr->whole += done == size;
+	}
+	close(pipefd[0]);
+	close(pipefd[1]);
+	close(null);
+	return NULL;
+}
+
+/* the CPU time of the process @pid so far, in usecs */
+static double proc_cpu(int pid)
+{
+	char path[64], buf[1024], *p;
+	unsigned long utime, stime;
+	FILE *f;
+
+	sprintf(path, "/proc/%d/stat", pid);
+	f = fopen(path, "r");
+	if(f == NULL)
+		return 0;
+	p = fgets(buf, sizeof buf, f);
+	fclose(f);
+	/* past the command, which may have spaces in it, and 11 more fields */
+	if(p == NULL || (p = strrchr(buf, ')')) == NULL || sscanf(p + 2,
+		"%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+		&utime, &stime) != 2)
+		return 0;
+	return (utime + stime) * 1e6 / sysconf(_SC_CLK_TCK);
+}
+
+/* and ours */
+static double self_cpu(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1e6 + ru.ru_utime.tv_usec
+		+ ru.ru_stime.tv_sec * 1e6 + ru.ru_stime.tv_usec;
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-h host] [-p port] [-c pairs] [-n files]"
+		" [-s MB per file] [-u user prefix] [-P server pid]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pair *pairs;
+	char name[64];
+	unsigned long long total = 0;
+	double start, secs, server_cpu = 0, bench_cpu = 0;
+	int opt, i, files = 0;
+
+	while((opt = getopt(argc, argv, "h:p:c:n:s:u:P:")) != -1) {
+		switch(opt) {
+		case 'h':
+			host = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'c':
+			nr_pairs = atoi(optarg);
+			break;
+		case 'n':
+			nr_files = atoi(optarg);
+			break;
+		case 's':
+			file_size = atof(optarg) * 1024 * 1024;
+			break;
+		case 'u':
+			prefix = optarg;
+			break;
+		case 'P':
+			server_pid = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(nr_pairs < 1 || nr_files < 1 || file_size == 0)
+		usage(argv[0]);
+	memset(chunk, 'x', sizeof chunk);
+
+	pairs = calloc(nr_pairs, sizeof *pairs);
+	for(i = 0; i < nr_pairs; i++) {
+		pairs[i].id = i;
+		ring_init(&pairs[i].sin, RING_SIZE, RING_MAX);
+		ring_init(&pairs[i].rin, RING_SIZE, RING_MAX);
+		pairs[i].sfd = dial(port);
+		pairs[i].rfd = dial(port);
+		frame_write(pairs[i].sfd, OP_REGISTER, 0, 0, name,
+			sprintf(name, "%ss%d", prefix, i));
+		frame_write(pairs[i].rfd, OP_REGISTER, 0, 0, name,
+			sprintf(name, "%sr%d", prefix, i));
+	}
+	/* every recipient is registered once its `ls` is answered */
+	for(i = 0; i < nr_pairs; i++) {
+		frame_write(pairs[i].rfd, OP_LS, 0, 1, NULL, 0);
+		if(wait_frame(pairs[i].rfd, &pairs[i].rin, OP_LS_REPLY, chunk,
+			sizeof chunk) < 0) {
+			fprintf(stderr, "%s\n", "lost the server");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if(server_pid)
+		server_cpu = proc_cpu(server_pid);
+	bench_cpu = self_cpu();
+	start = now();
+	for(i = 0; i < nr_pairs; i++) {
+		pthread_create(&pairs[i].sink, NULL, sink, &pairs[i]);
+		pthread_create(&pairs[i].sender, NULL, sender, &pairs[i]);
+	}
+	for(i = 0; i < nr_pairs; i++) {
+		pthread_join(pairs[i].sender, NULL);
+		pthread_join(pairs[i].sink, NULL);
+		total += pairs[i].received;
+		files += pairs[i].whole;
+	}
+	secs = now() - start;
+	bench_cpu = self_cpu() - bench_cpu;
+	if(server_pid)
+		server_cpu = proc_cpu(server_pid) - server_cpu;
+
+	printf("%d pairs, %d files of %.0f MB each\n", nr_pairs, nr_files,
+		file_size / 1048576.0);
+	printf("relayed %.2f GB in %.2f s, %.0f MB/s, %d of %d files whole\n",
+		total / 1e9, secs, total / secs / 1e6, files, nr_pairs * nr_files);
+	if(total < file_size * nr_pairs * nr_files)
+		printf("%llu bytes went missing\n",
+			file_size * nr_pairs * nr_files - total);
+	if(server_pid && total > 0)
+		printf("cpu       %.3f secs per GB in the server, %.3f in the bench\n",
+			server_cpu / 1e6 / (total / 1e9), bench_cpu / 1e6 / (total / 1e9));
+	return 0;
+}
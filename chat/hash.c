@@ -0,0 +1,17 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include "hash.h"
+
+unsigned int fnv1a(const void *p, size_t len, unsigned int seed)
+{
+	const unsigned char *s = p;
+	unsigned int h = seed;
+
+	while(len--) {
+		h ^= *s++;
+		h *= 16777619u;
+	}
+	return h;
+}
@@ -0,0 +1,19 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef HASH_H
+#define HASH_H
+
+#include <stddef.h>
+
+/*
+* FNV-1a, cheap and good enough for the names and short payloads hashed
+* around here. Start a hash with FNV_SEED; a hash of several pieces is
+* chained by handing the hash of one piece in as the seed of the next.
+*/
+#define FNV_SEED 2166136261u
+
+unsigned int fnv1a(const void *p, size_t len, unsigned int seed);
+
+#endif
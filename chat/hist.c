@@ -0,0 +1,90 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <string.h>
+#include "hist.h"
+
+static int msb(unsigned long v)
+{
+	return 8 * sizeof(v) - 1 - __builtin_clzl(v);
+}
+
+/* the bucket @v is counted in */
+unsigned int hist_bucket(unsigned long v)
+{
+	int shift;
+
+	if(v < 2 * HIST_SUB)
+		return v;
+	/* shift so that v lands in [HIST_SUB, 2 * HIST_SUB) */
+	shift = msb(v) - 5;
+	return 2 * HIST_SUB + (shift - 1) * HIST_SUB + (v >> shift) - HIST_SUB;
+}
+
+/* the smallest value that falls in bucket @i */
+static unsigned long bucket_start(unsigned int i)
+{
+	int shift;
+
+	if(i < 2 * HIST_SUB)
+		return i;
+	shift = (i - 2 * HIST_SUB) / HIST_SUB + 1;
+	return (unsigned long)((i - 2 * HIST_SUB) % HIST_SUB + HIST_SUB) << shift;
+}
+
+void hist_init(struct hist *h)
+{
+	memset(h, 0, sizeof *h);
+	h->min = ~0UL;
+}
+
+void hist_record(struct hist *h, unsigned long v)
+{
+	h->counts[hist_bucket(v)]++;
+	h->total++;
+	h->sum += v;
+	if(v < h->min)
+		h->min = v;
+	if(v > h->max)
+		h->max = v;
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	unsigned int i;
+
+	for(i = 0; i < HIST_BUCKETS; i++)
+		dst->counts[i] += src->counts[i];
+	dst->total += src->total;
+	dst->sum += src->sum;
+	if(src->min < dst->min)
+		dst->min = src->min;
+	if(src->max > dst->max)
+		dst->max = src->max;
+}
+
+/*
+* the value below which @p percent of the recorded values fall,
+* as the top of the bucket it is in
+*/
+unsigned long hist_percentile(const struct hist *h, double p)
+{
+	unsigned long want, seen = 0;
+	unsigned int i;
+
+	if(h->total == 0)
+		return 0;
+	want = (unsigned long)(h->total * p / 100.0 + 0.5);
+	if(want < 1)
+		want = 1;
+	for(i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->counts[i];
+		if(seen >= want)
+			break;
+	}
+	if(i + 1 >= HIST_BUCKETS)
+		return h->max;
+	/* never claim more than what was actually seen */
+	return bucket_start(i + 1) - 1 < h->max ? bucket_start(i + 1) - 1 : h->max;
+}
@@ -0,0 +1,32 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef HIST_H
+#define HIST_H
+
+/*
+* A log-linear histogram, in the spirit of HdrHistogram.
+* Values below 64 get a bucket each. Above that, every power of two
+* is split into 32 buckets, so a recorded value is off by at most ~3%
+* whatever its magnitude, and the whole range of an unsigned long
+* fits in a couple of thousand counters.
+*/
+#define HIST_SUB 32
+#define HIST_BUCKETS (2 * HIST_SUB + 58 * HIST_SUB)
+
+struct hist {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long total;
+	unsigned long min, max;
+	/* sum of all values, for the mean */
+	double sum;
+};
+
+void hist_init(struct hist *h);
+void hist_record(struct hist *h, unsigned long v);
+unsigned int hist_bucket(unsigned long v);
+void hist_merge(struct hist *dst, const struct hist *src);
+unsigned long hist_percentile(const struct hist *h, double p);
+
+#endif
@@ -0,0 +1,120 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+/* lines waiting for the logger, and how long one may be */
+#define LOG_LINES 1024
+#define LOG_LINE_MAX 160
+
+/*
+* A ring of lines, protected by @lock.
+* The logger sleeps on @cond when it is empty.
+*/
+static char lines[LOG_LINES][LOG_LINE_MAX];
+static unsigned int head, count;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+
+/*
+* lines a second we let through, 0 for none at all.
+* @this_sec counts the lines of the current second, the logger zeroes
+* it every second. Over the limit a line is dropped before it is even
+* formatted, which costs no more than an atomic add.
+*/
+static unsigned long log_rate;
+static unsigned long this_sec;
+static unsigned long dropped;
+
+void log_msg(const char *fmt, ...)
+{
+	char line[LOG_LINE_MAX];
+	va_list ap;
+	int n, wake;
+
+	if(log_rate == 0)
+		return;
+	if(__sync_fetch_and_add(&this_sec, 1) >= log_rate) {
+		__sync_fetch_and_add(&dropped, 1);
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(line, sizeof line, fmt, ap);
+	va_end(ap);
+	/* a line cut short still ends the line */
+	if(n >= (int)sizeof line)
+		line[sizeof line - 2] = '\n';
+
+	pthread_mutex_lock(&lock);
+	if(count == LOG_LINES) {
+		pthread_mutex_unlock(&lock);
+		__sync_fetch_and_add(&dropped, 1);
+		return;
+	}
+	strcpy(lines[(head + count) % LOG_LINES], line);
+	/* the logger only waits for a ring that was empty */
+	wake = count++ == 0;
+	pthread_mutex_unlock(&lock);
+	if(wake)
+		pthread_cond_signal(&cond);
+}
+
+/*
+* write out what is in the ring, a batch at a time, and once a second
+* start the next second's worth of lines and own up to the dropped ones
+*/
+static void *logger(void *arg)
+{
+	static char batch[LOG_LINES * LOG_LINE_MAX];
+	struct timespec deadline, now;
+	unsigned long n;
+	size_t len;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec++;
+	pthread_mutex_lock(&lock);
+	while(1) {
+		if(count == 0)
+			pthread_cond_timedwait(&cond, &lock, &deadline);
+		/* copy the lines out, and let go of the lock while writing */
+		for(len = 0; count > 0; count--) {
+			strcpy(batch + len, lines[head]);
+			len += strlen(lines[head]);
+			head = (head + 1) % LOG_LINES;
+		}
+		pthread_mutex_unlock(&lock);
+		if(len > 0) {
+			fwrite(batch, 1, len, stdout);
+			fflush(stdout);
+		}
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		if(now.tv_sec >= deadline.tv_sec) {
+			deadline.tv_sec = now.tv_sec + 1;
+			__sync_lock_test_and_set(&this_sec, 0);
+			if((n = __sync_lock_test_and_set(&dropped, 0)) > 0) {
+				printf("(%lu log lines dropped)\n", n);
+				fflush(stdout);
+			}
+		}
+		pthread_mutex_lock(&lock);
+	}
+	return NULL;
+}
+
+void log_init(unsigned long rate)
+{
+	pthread_t thread;
+
+	log_rate = rate;
+	if(rate == 0)
+		return;
+	pthread_create(&thread, NULL, logger, NULL);
+	pthread_detach(thread);
+}
@@ -0,0 +1,19 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef LOG_H
+#define LOG_H
+
+/*
+* The server's log, on stdout.
+* log_msg() only formats the line and hands it to a logger thread,
+* which writes out whatever piled up in one go. Whoever logs never
+* waits on the terminal, or on whatever else stdout is.
+* Beyond @rate lines a second, or when the logger cannot keep up,
+* lines are dropped, and the logger says how many.
+*/
+void log_init(unsigned long rate);
+void log_msg(const char *fmt, ...);
+
+#endif
@@ -0,0 +1,349 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lz.h"
+#include "hash.h"
+
+/* matches are this long at least, and what is hashed to find them */
+#define MINMATCH 4
+/*
+* the LZ4 block format ends in this many literals at least, and no
+* match starts closer than MFLIMIT to the end
+*/
+#define LASTLITERALS 5
+#define MFLIMIT 12
+/* positions of the msg being packed, by the hash of the 4 bytes there */
+#define MSG_HASH_BITS 10
+
+/*
+* the trainer counts every string of TRAIN_D bytes in the samples, and
+* picks pieces of TRAIN_K bytes made of those that come up the most
+*/
+#define TRAIN_D 6
+#define TRAIN_K 48
+#define TRAIN_HASH_BITS 20
+/* a string across two lines, which no msg has */
+#define TRAIN_NONE 0xffffffffU
+
+static unsigned int read32(const void *p)
+{
+	unsigned int v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static unsigned int hash32(unsigned int v, int bits)
+{
+	return (v * 2654435761U) >> (32 - bits);
+}
+
+struct lz_dict *lz_dict_new(const void *data, size_t size)
+{
+	struct lz_dict *d;
+	size_t i;
+
+	if(size > LZ_DICT_MAX)
+		return NULL;
+	d = calloc(1, sizeof *d);
+	d->data = malloc(size + 1);
+	memcpy(d->data, data, size);
+	d->size = size;
+	/* an id both ends work out the same */
+	d->id = fnv1a(d->data, size, FNV_SEED);
+	for(i = 0; i + MINMATCH <= size; i++)
+		d->table[hash32(read32(d->data + i), LZ_DICT_HASH_BITS)] = i;
+	return d;
+}
+
+struct lz_dict *lz_dict_load(const char *path)
+{
+	static char buf[LZ_DICT_MAX + 1];
+	struct lz_dict *d;
+	size_t n;
+	FILE *f;
+
+	f = fopen(path, "r");
+	if(f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	n = fread(buf, 1, sizeof buf, f);
+	fclose(f);
+	d = n > 0 ? lz_dict_new(buf, n) : NULL;
+	if(d == NULL)
+		fprintf(stderr, "%s: no dictionary of 1 to %d bytes\n", path,
+			LZ_DICT_MAX);
+	return d;
+}
+
+void lz_dict_free(struct lz_dict *d)
+{
+	free(d->data);
+	free(d);
+}
+
+/* how many bytes at @a, up to @a_end, are the same as those at @b, up to @b_end */
+static size_t common(const unsigned char *a, const unsigned char *a_end,
+	const unsigned char *b, const unsigned char *b_end)
+{
+	const unsigned char *start = a;
+
+	while(a < a_end && b < b_end && *a == *b) {
+		a++;
+		b++;
+	}
+	return a - start;
+}
+
+/* the rest of a length of 15 or more, in bytes of 255 and one less */
+static unsigned char *put_len(unsigned char *op, size_t n)
+{
+	for(; n >= 255; n -= 255)
+		*op++ = 255;
+	*op++ = n;
+	return op;
+}
+
+/*
+* A position is looked up by the hash of its 4 bytes in the msg's own
+* table, of the positions before it, and in the dictionary's, and the
+* longer match of the two wins. Nothing is written to the dictionary's
+* table, every thread packs off the same one at once.
+*/
+size_t lz_pack(const struct lz_dict *d, const char *src, size_t len,
+	char *dst, size_t cap)
+{
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *ref, *ref_start, *limit;
+	unsigned char *out = (unsigned char *)dst, *op = out, *token;
+	unsigned short table[1 << MSG_HASH_BITS];
+	size_t ip = 0, anchor = 0, lit, ml, m, off = 0, cand, pos;
+	size_t dsize = d ? d->size : 0;
+	unsigned int seq, h;
+
+	memset(table, 0, sizeof table);
+	/* matches end this far from the end of the msg */
+	limit = len > MFLIMIT ? in + len - LASTLITERALS : in;
+	while(len > MFLIMIT && ip + MFLIMIT <= len) {
+		seq = read32(in + ip);
+		h = hash32(seq, MSG_HASH_BITS);
+		/* positions of long msgs wrap around, the compare tells */
+		cand = table[h];
+		table[h] = ip;
+		ml = 0;
+		ref = ref_start = NULL;
+		if(cand < ip && ip - cand <= 65535 && read32(in + cand) == seq) {
+			ml = MINMATCH + common(in + ip + MINMATCH, limit,
+				in + cand + MINMATCH, limit);
+			off = ip - cand;
+			ref = in + cand;
+			ref_start = in;
+		}
+		if(dsize >= MINMATCH) {
+			pos = d->table[hash32(seq, LZ_DICT_HASH_BITS)];
+			if(pos + MINMATCH <= dsize && dsize - pos + ip <= 65535
+				&& read32(d->data + pos) == seq) {
+				m = MINMATCH + common(in + ip + MINMATCH, limit,
+					d->data + pos + MINMATCH, d->data + dsize);
+				if(m > ml) {
+					ml = m;
+					off = dsize - pos + ip;
+					ref = d->data + pos;
+					ref_start = d->data;
+				}
+			}
+		}
+		if(ml == 0) {
+			ip++;
+			continue;
+		}
+		/* the literals before may match too */
+		while(ip > anchor && ref > ref_start && in[ip - 1] == ref[-1]) {
+			ip--;
+			ref--;
+			ml++;
+		}
+
+		lit = ip - anchor;
+		if((size_t)(out + cap - op) < 1 + lit / 255 + 1 + lit + 2
+			+ (ml - MINMATCH) / 255 + 1)
+			return 0;
+		token = op++;
+		*token = (lit < 15 ? lit : 15) << 4;
+		if(lit >= 15)
+			op = put_len(op, lit - 15);
+		memcpy(op, in + anchor, lit);
+		op += lit;
+		*op++ = off & 0xff;
+		*op++ = off >> 8;
+		*token |= ml - MINMATCH < 15 ? ml - MINMATCH : 15;
+		if(ml - MINMATCH >= 15)
+			op = put_len(op, ml - MINMATCH - 15);
+		ip += ml;
+		anchor = ip;
+		/* what the match skipped over is not in the table, one of it is */
+		if(ip + MFLIMIT <= len)
+			table[hash32(read32(in + ip - 2), MSG_HASH_BITS)] = ip - 2;
+	}
+
+	/* the rest, as literals */
+	lit = len - anchor;
+	if((size_t)(out + cap - op) < 1 + lit / 255 + 1 + lit)
+		return 0;
+	token = op++;
+	*token = (lit < 15 ? lit : 15) << 4;
+	if(lit >= 15)
+		op = put_len(op, lit - 15);
+	memcpy(op, in + anchor, lit);
+	op += lit;
+	return op - out;
+}
+
+/* a length of 15 plus what follows, into @n. returns -1 past @end */
+static int get_len(const unsigned char **ip, const unsigned char *end, size_t *n)
+{
+	unsigned int b;
+
+	do {
+		if(*ip == end)
+			return -1;
+		b = *(*ip)++;
+		*n += b;
+	} while(b == 255);
+	return 0;
+}
+
+ssize_t lz_unpack(const struct lz_dict *d, const char *src, size_t len,
+	char *dst, size_t cap)
+{
+	const unsigned char *ip = (const unsigned char *)src, *end = ip + len;
+	unsigned char *out = (unsigned char *)dst;
+	size_t op = 0, lit, ml, off, n;
+	size_t dsize = d ? d->size : 0;
+	unsigned int token;
+
+	if(len == 0)
+		return -1;
+	while(ip < end) {
+		token = *ip++;
+		lit = token >> 4;
+		if(lit == 15 && get_len(&ip, end, &lit) < 0)
+			return -1;
+		if((size_t)(end - ip) < lit || cap - op < lit)
+			return -1;
+		memcpy(out + op, ip, lit);
+		ip += lit;
+		op += lit;
+		/* the last literals have no match after them */
+		if(ip == end)
+			break;
+		if(end - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		ml = token & 15;
+		if(ml == 15 && get_len(&ip, end, &ml) < 0)
+			return -1;
+		ml += MINMATCH;
+		if(off == 0 || off > op + dsize || cap - op < ml)
+			return -1;
+		if(off > op) {
+			/* it starts in the dictionary, and may go on in the msg */
+			n = off - op < ml ? off - op : ml;
+			memcpy(out + op, d->data + dsize - (off - op), n);
+			op += n;
+			ml -= n;
+		}
+		/* byte by byte, a match may overlap what it makes */
+		for(; ml > 0; ml--, op++)
+			out[op] = out[op - off];
+	}
+	return op;
+}
+
+/* the hash of the TRAIN_D bytes at @p, TRAIN_NONE for one across lines */
+static unsigned int train_hash(const unsigned char *p)
+{
+	if(memchr(p, '\n', TRAIN_D))
+		return TRAIN_NONE;
+	return fnv1a(p, TRAIN_D, FNV_SEED) >> (32 - TRAIN_HASH_BITS);
+}
+
+/*
+* After the cover algorithm of zstd's trainer, in short. Every string
+* of TRAIN_D bytes is counted over all the samples. The samples are cut
+* into as many epochs as there is room for pieces of TRAIN_K bytes, and
+* from each epoch the piece whose strings add up to the most goes into
+* the dictionary. The strings of a piece taken count for nothing from
+* then on, so the next pieces bring something else. A piece that is in
+* every other msg makes it in, one that is in a single msg never does,
+* however long it is.
+*/
+size_t lz_train(const char *samples, size_t len, char *dict, size_t size)
+{
+	const unsigned char *s = (const unsigned char *)samples;
+	unsigned int *freq, *hashes;
+	unsigned long score, best_score;
+	size_t seg, win, nr, epochs, epoch, e, i, begin, end, best, filled = 0;
+
+	if(size > LZ_DICT_MAX)
+		size = LZ_DICT_MAX;
+	/* samples that fit whole are the best dictionary there is */
+	if(len <= size) {
+		memcpy(dict, samples, len);
+		return len;
+	}
+	seg = size < TRAIN_K ? size : TRAIN_K;
+	if(seg < TRAIN_D)
+		return 0;
+	/* the strings a piece is made of */
+	win = seg - TRAIN_D + 1;
+	nr = len - TRAIN_D + 1;
+
+	freq = calloc(1 << TRAIN_HASH_BITS, sizeof *freq);
+	hashes = malloc(nr * sizeof *hashes);
+	for(i = 0; i < nr; i++) {
+		hashes[i] = train_hash(s + i);
+		if(hashes[i] != TRAIN_NONE)
+			freq[hashes[i]]++;
+	}
+
+	epochs = size / seg;
+	epoch = nr / epochs;
+	for(e = 0; e < epochs && filled + seg <= size; e++) {
+		begin = e * epoch;
+		end = e == epochs - 1 ? nr : begin + epoch;
+		if(end - begin < win)
+			break;
+		/* slide a window of a piece over the epoch */
+		for(score = 0, i = begin; i < begin + win; i++)
+			score += hashes[i] == TRAIN_NONE ? 0 : freq[hashes[i]];
+		best = begin;
+		best_score = score;
+		for(i = begin + win; i < end; i++) {
+			score += hashes[i] == TRAIN_NONE ? 0 : freq[hashes[i]];
+			score -= hashes[i - win] == TRAIN_NONE ? 0 : freq[hashes[i - win]];
+			if(score > best_score) {
+				best_score = score;
+				best = i - win + 1;
+			}
+		}
+		if(best_score == 0)
+			continue;
+		/* from the end backwards, like zstd, the first epoch goes last */
+		filled += seg;
+		memcpy(dict + size - filled, s + best, seg);
+		for(i = best; i < best + win; i++)
+			if(hashes[i] != TRAIN_NONE)
+				freq[hashes[i]] = 0;
+	}
+	memmove(dict, dict + size - filled, filled);
+	free(hashes);
+	free(freq);
+	return filled;
+}
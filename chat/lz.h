@@ -0,0 +1,81 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+* Chat msgs packed against a shared dictionary.
+*
+* The msgs of bots say the same things over and over: the same names,
+* the same `<sender>: ` in front, alerts off the same few templates.
+* Any one msg is too short to have much that repeats within itself, so
+* packing msgs one by one gains little, and packing a connection as one
+* stream would have the server pack every msg of a room once for each
+* member. Instead, both ends hold the same dictionary, a few KB of what
+* msgs usually say, and a msg is packed as literals and matches that
+* may reach back into the dictionary as well as into the msg. A msg is
+* packed on its own, so a frame packed once is good for every client
+* that took the same dictionary.
+*
+* The packed form is the LZ4 block format: tokens of literal and match
+* lengths, the literals, and matches 4 bytes or longer, 2 byte offsets
+* back from where they go. An offset that reaches back past the start
+* of the msg goes on into the end of the dictionary, the way
+* LZ4_decompress_safe_usingDict() takes it. The dictionary is hashed
+* once, when it is loaded, and only ever read after that: packing a
+* msg touches a hash table of its own and the dictionary's, nothing
+* else, and costs no more for a long dictionary than for a short one.
+*
+* A dictionary is trained off samples of msgs by mkdict (lz_train()),
+* and goes by its id, a hash of its bytes, which the ends compare
+* before they pack anything (see OP_PACK).
+*/
+
+/* the offsets are 16 bits, matches reach back no further */
+#define LZ_DICT_MAX 65535
+/* dictionary positions by the hash of the 4 bytes there */
+#define LZ_DICT_HASH_BITS 14
+
+struct lz_dict {
+	unsigned char *data;
+	size_t size;
+	unsigned int id;
+	/* the last position every hash was seen at, see lz_pack() */
+	unsigned short table[1 << LZ_DICT_HASH_BITS];
+};
+
+/* a dictionary of the @size bytes at @data, which it copies */
+struct lz_dict *lz_dict_new(const void *data, size_t size);
+/* the dictionary in the file @path, NULL if there is none */
+struct lz_dict *lz_dict_load(const char *path);
+void lz_dict_free(struct lz_dict *d);
+
+/*
+* pack the @len bytes of @src into @dst, which has room for @cap.
+* returns the packed length, or 0 if it would not fit, so a @cap of
+* @len - 1 only takes what packing made smaller. A NULL @d packs
+* without a dictionary
+*/
+size_t lz_pack(const struct lz_dict *d, const char *src, size_t len,
+	char *dst, size_t cap);
+/*
+* unpack the @len bytes of @src into @dst, which has room for @cap.
+* returns the unpacked length, or -1 if @src is no packed msg, or
+* unpacks to more than @cap
+*/
+ssize_t lz_unpack(const struct lz_dict *d, const char *src, size_t len,
+	char *dst, size_t cap);
+
+/*
+* train a dictionary of @size bytes at most into @dict, off the @len
+* bytes of samples in @samples, one msg per line.
+* returns how big it came out
+*/
+size_t lz_train(const char *samples, size_t len, char *dict, size_t size);
+
+#endif
@@ -0,0 +1,103 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lz.h"
+
+/*
+* mkdict trains the dictionary chatserver and its clients pack msgs
+* against (-Z, see lz.h) off a file of sample msgs, one per line, as the
+* server sends them: `<sender>: <msg>`. The more the samples look like
+* what goes over the wire, the better: a log of a day's bot traffic,
+* say. packbench -g makes up some to try it with.
+*/
+
+/* samples read at most */
+#define SAMPLES_MAX (256 * 1024 * 1024)
+
+/* all of @path, its length in @len. NULL if it cannot be read */
+static char *read_samples(const char *path, size_t *len)
+{
+	size_t size = 1024 * 1024, n;
+	char *buf = malloc(size);
+	FILE *f = fopen(path, "r");
+
+	if(f == NULL) {
+		perror(path);
+		return NULL;
+	}
+	*len = 0;
+	while((n = fread(buf + *len, 1, size - *len, f)) > 0) {
+		*len += n;
+		if(*len == size && size < SAMPLES_MAX) {
+			size *= 2;
+			buf = realloc(buf, size);
+		} else if(*len == size) {
+			break;
+		}
+	}
+	fclose(f);
+	return buf;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s dictionary size] [-o dictionary] samples\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *out_path = "chat.dict";
+	char *samples, *dict;
+	size_t len, size = 16 * 1024, n;
+	struct lz_dict *d;
+	struct timespec t0, t1;
+	FILE *f;
+	int opt;
+
+	while((opt = getopt(argc, argv, "s:o:")) != -1) {
+		switch(opt) {
+		case 's':
+			size = atol(optarg);
+			break;
+		case 'o':
+			out_path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(optind != argc - 1 || size == 0 || size > LZ_DICT_MAX)
+		usage(argv[0]);
+	samples = read_samples(argv[optind], &len);
+	if(samples == NULL)
+		exit(EXIT_FAILURE);
+
+	dict = malloc(size);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	n = lz_train(samples, len, dict, size);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if(n == 0) {
+		fprintf(stderr, "%s: nothing in there worth a dictionary\n",
+			argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+
+	f = fopen(out_path, "w");
+	if(f == NULL || fwrite(dict, 1, n, f) != n || fclose(f) != 0) {
+		perror(out_path);
+		exit(EXIT_FAILURE);
+	}
+	d = lz_dict_new(dict, n);
+	printf("%s: %lu bytes, id %08x, off %.1f MB of samples in %.3f s\n",
+		out_path, (unsigned long)n, d->id, len / 1e6,
+		(t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+	return 0;
+}
@@ -0,0 +1,214 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include "proto.h"
+#include "outq.h"
+
+/* the ring of a queue starts with this many slots */
+#define OUTQ_MIN_SIZE 8
+
+struct pool msgbuf_pool;
+
+void msgbuf_init(void)
+{
+	pool_init(&msgbuf_pool, "msgbuf",
+		sizeof(struct msgbuf) + FRAME_HDR_SIZE + MSGBUF_SMALL);
+}
+
+/*
+* a frame with header and payload laid out one after the other,
+* the caller holds the one reference to it.
+* With no @payload, the @len bytes after the header are left
+* for the caller to fill in.
+*/
+struct msgbuf *msgbuf_new(int op, int flags, int id, const char *payload, size_t len)
+{
+	struct msgbuf *m;
+
+	if(len <= MSGBUF_SMALL) {
+		m = pool_alloc(&msgbuf_pool);
+		m->pooled = 1;
+	} else {
+		m = malloc(sizeof(struct msgbuf) + FRAME_HDR_SIZE + len);
+		m->pooled = 0;
+	}
+	m->refcnt = 1;
+	m->len = FRAME_HDR_SIZE + len;
+	m->data = (char *)(m + 1);
+	m->packed = NULL;
+	m->rec = 0;
+	frame_pack((unsigned char *)m->data, op, flags, id, len);
+	if(payload)
+		memcpy(m->data + FRAME_HDR_SIZE, payload, len);
+	return m;
+}
+
+void msgbuf_get(struct msgbuf *m)
+{
+	__sync_fetch_and_add(&m->refcnt, 1);
+}
+
+void msgbuf_put(struct msgbuf *m)
+{
+	if(__sync_sub_and_fetch(&m->refcnt, 1) != 0)
+		return;
+	if(m->packed && m->packed != m)
+		msgbuf_put(m->packed);
+	if(m->pooled)
+		pool_free(&msgbuf_pool, m);
+	else
+		free(m);
+}
+
+/*
+* @m packed against @d, for a client that takes packed msgs.
+* It is packed once, by whoever asks first, and the very same frame goes
+* to every client that asks after that: a msg to a room is packed once,
+* not once per member. Only the thread that made @m queues it, so there
+* is nobody to pack it meanwhile.
+* Only msgs are packed, the server's answers are short and for one client.
+*/
+struct msgbuf *msgbuf_pack(struct msgbuf *m, const struct lz_dict *d)
+{
+	struct frame_hdr fh;
+	struct msgbuf *p;
+	size_t n;
+
+	if(m->packed)
+		return m->packed;
+	frame_unpack((unsigned char *)m->data, &fh);
+	if(fh.op != OP_MSG || fh.len < 2) {
+		m->packed = m;
+		return m;
+	}
+	/* room for what is smaller than the msg, or it goes as it is */
+	p = msgbuf_new(fh.op, fh.flags | FLAG_PACKED, fh.id, NULL, fh.len - 1);
+	n = lz_pack(d, m->data + FRAME_HDR_SIZE, fh.len,
+		p->data + FRAME_HDR_SIZE, fh.len - 1);
+	if(n == 0) {
+		msgbuf_put(p);
+		m->packed = m;
+		return m;
+	}
+	frame_pack((unsigned char *)p->data, fh.op, fh.flags | FLAG_PACKED,
+		fh.id, n);
+	p->len = FRAME_HDR_SIZE + n;
+	m->packed = p;
+	return p;
+}
+
+void outq_init(struct outq *q)
+{
+	q->slots = NULL;
+	q->size = q->head = q->count = 0;
+	q->bytes = 0;
+	q->off = 0;
+}
+
+/* @i-th oldest frame in the queue */
+static struct msgbuf *outq_at(struct outq *q, unsigned int i)
+{
+	return q->slots[(q->head + i) & (q->size - 1)];
+}
+
+/* queue @m, taking a reference of our own to it */
+void outq_push(struct outq *q, struct msgbuf *m)
+{
+	struct msgbuf **slots;
+	unsigned int i, size;
+
+	if(q->count == q->size) {
+		size = q->size ? q->size * 2 : OUTQ_MIN_SIZE;
+		slots = malloc(size * sizeof(struct msgbuf *));
+		for(i = 0; i < q->count; i++)
+			slots[i] = outq_at(q, i);
+		free(q->slots);
+		q->slots = slots;
+		q->size = size;
+		q->head = 0;
+	}
+	msgbuf_get(m);
+	q->slots[(q->head + q->count++) & (q->size - 1)] = m;
+	q->bytes += m->len;
+}
+
+/*
+* point up to @max entries of @iov at what is left to write,
+* so all of it (or the first @max frames of it) goes out in one writev()
+* returns the number of entries filled in
+*/
+int outq_iov(struct outq *q, struct iovec *iov, int max)
+{
+	struct msgbuf *m;
+	int n;
+
+	for(n = 0; (unsigned int)n < q->count && n < max; n++) {
+		m = outq_at(q, n);
+		iov[n].iov_base = m->data;
+		iov[n].iov_len = m->len;
+	}
+	if(n > 0) {
+		iov[0].iov_base = (char *)iov[0].iov_base + q->off;
+		iov[0].iov_len -= q->off;
+	}
+	return n;
+}
+
+/*
+* @n bytes were written, let go of the frames that went out entirely.
+* The records of those that came out of the store go into @recs, which
+* has room for as many frames as went out in one go.
+* returns how many there are
+*/
+int outq_consume(struct outq *q, size_t n, unsigned long long *recs)
+{
+	struct msgbuf *m;
+	int nr = 0;
+
+	q->bytes -= n;
+	n += q->off;
+	while(q->count > 0 && n >= (m = outq_at(q, 0))->len) {
+		n -= m->len;
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
+		if(m->rec)
+			recs[nr++] = m->rec;
+		msgbuf_put(m);
+	}
+	q->off = n;
+	return nr;
+}
+
+/*
+* take up to @max of the oldest frames off the queue into @bufs,
+* along with the queue's references to them, for whoever is going to
+* write them out. None of them may have been partly written.
+* returns the number of frames taken
+*/
+int outq_take(struct outq *q, struct msgbuf **bufs, int max)
+{
+	int n;
+
+	for(n = 0; q->count > 0 && n < max; n++) {
+		bufs[n] = outq_at(q, 0);
+		q->bytes -= bufs[n]->len;
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
+	}
+	return n;
+}
+
+/* throw away everything still queued */
+void outq_clear(struct outq *q)
+{
+	while(q->count > 0) {
+		msgbuf_put(outq_at(q, 0));
+		q->head = (q->head + 1) & (q->size - 1);
+		q->count--;
+	}
+	free(q->slots);
+	outq_init(q);
+}
@@ -0,0 +1,72 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef OUTQ_H
+#define OUTQ_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include "pool.h"
+#include "lz.h"
+
+/*
+* One whole frame waiting to go out.
+* The same frame may sit in the queues of many clients at once
+* (think of a broadcast to a room), it is freed when the last of
+* them has written it out.
+*/
+struct msgbuf {
+	int refcnt;
+	/* it came from msgbuf_pool rather than the heap */
+	int pooled;
+	size_t len;
+	char *data;
+	/*
+	* the frame packed, for clients that take packed msgs (see lz.h),
+	* NULL until one asks for it, and the frame itself if packing does
+	* not make it smaller. It is freed along with the frame.
+	*/
+	struct msgbuf *packed;
+	/*
+	* a msg out of the offline store, the record it is in (see
+	* store_written()), 0 for any other frame
+	*/
+	unsigned long long rec;
+};
+
+/*
+* Frames with up to this many payload bytes (every chat msg, that is)
+* come from a pool instead of the heap, see pool.h
+*/
+#define MSGBUF_SMALL 256
+
+extern struct pool msgbuf_pool;
+
+/*
+* The frames queued up for one client, oldest first.
+* It is a ring of pointers, so queueing a shared frame for yet another
+* client costs no allocation: the ring only grows once in a while.
+* @off bytes of the oldest frame have already been written.
+*/
+struct outq {
+	struct msgbuf **slots;
+	unsigned int size, head, count;
+	size_t bytes;
+	size_t off;
+};
+
+void msgbuf_init(void);
+struct msgbuf *msgbuf_new(int op, int flags, int id, const char *payload, size_t len);
+void msgbuf_get(struct msgbuf *m);
+void msgbuf_put(struct msgbuf *m);
+struct msgbuf *msgbuf_pack(struct msgbuf *m, const struct lz_dict *d);
+
+void outq_init(struct outq *q);
+void outq_push(struct outq *q, struct msgbuf *m);
+int outq_iov(struct outq *q, struct iovec *iov, int max);
+int outq_consume(struct outq *q, size_t n, unsigned long long *recs);
+int outq_take(struct outq *q, struct msgbuf **bufs, int max);
+void outq_clear(struct outq *q);
+
+#endif
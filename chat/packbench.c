@@ -0,0 +1,218 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "lz.h"
+
+/*
+* packbench measures what packing msgs (see lz.h) saves and costs, off
+* a file of sample msgs, one per line: how many bytes a msg takes on
+* the wire, plain, packed on its own and packed against the dictionary
+* given with -d, and how long packing and unpacking one takes.
+* A msg that packing does not make smaller goes plain, like the server
+* sends it, and counts at its plain size.
+* Train the dictionary on other samples than those measured, or it
+* knows every msg by heart:
+* $ ./packbench -g 200000 > train.txt; ./packbench -g 20000 > test.txt
+* $ ./mkdict -o chat.dict train.txt
+* $ ./packbench -d chat.dict test.txt
+*/
+
+/* the longest line taken as a msg */
+#define MSG_MAX 1024
+
+/* made up msgs, -g: bots telling a channel what they see */
+static const char *hosts[] = { "db", "web", "cache", "queue", "search" };
+static const char *services[] = { "checkout", "payments", "search-api",
+	"auth", "inventory", "notifications" };
+
+static void make_up(unsigned int *seed)
+{
+	const char *host = hosts[rand_r(seed) % 5];
+	const char *svc = services[rand_r(seed) % 6];
+	int n = rand_r(seed) % 40, v = rand_r(seed) % 100;
+
+	switch(rand_r(seed) % 8) {
+	case 0:
+		printf("alertbot: [ALERT] disk usage on %s-%02d is at %d%%,"
+			" above the threshold of 90%%\n", host, n, 90 + v % 10);
+		break;
+	case 1:
+		printf("alertbot: [RESOLVED] disk usage on %s-%02d is back"
+			" to %d%%\n", host, n, 40 + v % 40);
+		break;
+	case 2:
+		printf("alertbot: [WARN] p99 latency of %s is %dms, the SLO"
+			" is 250ms\n", svc, 250 + v * 7);
+		break;
+	case 3:
+		printf("deploybot: deploy #%d of %s to production started"
+			" by %s\n", 4000 + rand_r(seed) % 1000, svc,
+			v % 2 ? "release-train" : "oncall");
+		break;
+	case 4:
+		printf("deploybot: deploy #%d of %s to production finished"
+			" in %ds, %d of %d hosts healthy\n",
+			4000 + rand_r(seed) % 1000, svc, 60 + v * 3, 24 + n, 24 + n);
+		break;
+	case 5:
+		printf("cibot: build %s #%d failed: %d tests failed, see"
+			" https://ci.example.com/job/%s/%d/\n", svc,
+			10000 + rand_r(seed) % 5000, 1 + v % 7, svc,
+			10000 + rand_r(seed) % 5000);
+		break;
+	case 6:
+		printf("cibot: build %s #%d passed in %dm%02ds\n", svc,
+			10000 + rand_r(seed) % 5000, 3 + n % 20, v % 60);
+		break;
+	default:
+		printf("backupbot: backup of %s-%02d completed, %d.%d GB in"
+			" %d min\n", host, n, 10 + v, n % 10, 5 + v % 50);
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+struct result {
+	unsigned long plain, wire, packed;
+	double pack_ns, unpack_ns;
+};
+
+/*
+* pack every one of the @nr msgs @rounds times, and unpack it again.
+* returns -1 if one came back other than it went in
+*/
+static int measure(const struct lz_dict *d, char **msgs, size_t *lens,
+	int nr, int rounds, struct result *r)
+{
+	char packed[MSG_MAX], back[MSG_MAX];
+	size_t n;
+	double start;
+	int i, j;
+
+	memset(r, 0, sizeof *r);
+	start = now();
+	for(j = 0; j < rounds; j++)
+		for(i = 0; i < nr; i++)
+			lz_pack(d, msgs[i], lens[i], packed, lens[i] - 1);
+	r->pack_ns = (now() - start) * 1e9 / ((double)nr * rounds);
+
+	for(i = 0; i < nr; i++) {
+		r->plain += lens[i];
+		n = lz_pack(d, msgs[i], lens[i], packed, lens[i] - 1);
+		if(n == 0) {
+			r->wire += lens[i];
+			continue;
+		}
+		r->wire += n;
+		r->packed++;
+		start = now();
+		for(j = 0; j < rounds; j++)
+			lz_unpack(d, packed, n, back, sizeof back);
+		r->unpack_ns += now() - start;
+		if(lz_unpack(d, packed, n, back, sizeof back) != (ssize_t)lens[i]
+			|| memcmp(back, msgs[i], lens[i]))
+			return -1;
+	}
+	if(r->packed)
+		r->unpack_ns = r->unpack_ns * 1e9 / ((double)r->packed * rounds);
+	return 0;
+}
+
+static void print_result(const char *what, const struct result *r, int nr)
+{
+	printf("%-14s %9.1f %7.2f %9.0f%% %9.0f %11.0f\n", what,
+		(double)r->wire / nr, (double)r->plain / r->wire,
+		100.0 * r->packed / nr, r->pack_ns, r->unpack_ns);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dictionary] [-r rounds] samples\n"
+		"       %s -g msgs\n", prog, prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char line[MSG_MAX], **msgs = NULL, name[64];
+	size_t *lens = NULL;
+	struct lz_dict *d = NULL;
+	struct result none, dict;
+	unsigned int seed;
+	int opt, i, nr = 0, size = 0, rounds = 10, made_up = 0;
+	FILE *f;
+
+	while((opt = getopt(argc, argv, "d:r:g:")) != -1) {
+		switch(opt) {
+		case 'd':
+			d = lz_dict_load(optarg);
+			if(d == NULL)
+				exit(EXIT_FAILURE);
+			break;
+		case 'r':
+			rounds = atoi(optarg);
+			break;
+		case 'g':
+			made_up = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(made_up > 0) {
+		seed = time(NULL) ^ getpid();
+		for(i = 0; i < made_up; i++)
+			make_up(&seed);
+		return 0;
+	}
+	if(optind != argc - 1 || rounds < 1)
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "r");
+	if(f == NULL) {
+		perror(argv[optind]);
+		exit(EXIT_FAILURE);
+	}
+	while(fgets(line, sizeof line, f)) {
+		line[strcspn(line, "\n")] = '\0';
+		if(line[0] == '\0')
+			continue;
+		if(nr == size) {
+			size = size ? 2 * size : 1024;
+			msgs = realloc(msgs, size * sizeof *msgs);
+			lens = realloc(lens, size * sizeof *lens);
+		}
+		lens[nr] = strlen(line);
+		msgs[nr++] = strdup(line);
+	}
+	fclose(f);
+	if(nr == 0)
+		usage(argv[0]);
+
+	if(measure(NULL, msgs, lens, nr, rounds, &none) < 0
+		|| (d && measure(d, msgs, lens, nr, rounds, &dict) < 0)) {
+		fprintf(stderr, "%s\n", "a msg did not unpack to what was packed");
+		exit(EXIT_FAILURE);
+	}
+	printf("%d msgs, %.1f bytes each\n", nr, (double)none.plain / nr);
+	printf("%-14s %9s %7s %10s %9s %11s\n", "", "bytes/msg", "ratio",
+		"packed", "pack ns", "unpack ns");
+	print_result("no dictionary", &none, nr);
+	if(d) {
+		sprintf(name, "%lu B dict", (unsigned long)d->size);
+		print_result(name, &dict, nr);
+	}
+	return 0;
+}
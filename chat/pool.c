@@ -0,0 +1,185 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_BATCH 64
+
+/*
+* A free object doubles as a list node. The first object of a batch
+* in the depot also links to the next batch and knows its length.
+*/
+struct free_obj {
+	struct free_obj *next;
+	struct free_obj *next_batch;
+	unsigned long count;
+};
+
+/* what one thread keeps of one pool */
+struct pool_cache {
+	struct pool *pool;
+	struct free_obj *free;
+	unsigned int nfree;
+	unsigned long allocs, frees;
+	struct pool_cache *prev, *next;
+};
+
+/* hand a chain of @count free objects to the depot, with the lock held */
+static void depot_put(struct pool *p, struct free_obj *chain, unsigned long count)
+{
+	chain->count = count;
+	chain->next_batch = p->depot;
+	p->depot = chain;
+	p->depot_puts++;
+}
+
+/* a thread is exiting: give its objects back and fold in its counts */
+static void cache_destroy(void *c)
+{
+	struct pool_cache *cache = (struct pool_cache *)c;
+	struct pool *p = cache->pool;
+
+	pthread_mutex_lock(&p->lock);
+	if(cache->free)
+		depot_put(p, cache->free, cache->nfree);
+	p->retired_allocs += cache->allocs;
+	p->retired_frees += cache->frees;
+	if(cache->prev)
+		cache->prev->next = cache->next;
+	else
+		p->caches = cache->next;
+	if(cache->next)
+		cache->next->prev = cache->prev;
+	pthread_mutex_unlock(&p->lock);
+	free(cache);
+}
+
+static struct pool_cache *get_cache(struct pool *p)
+{
+	struct pool_cache *cache = pthread_getspecific(p->key);
+
+	if(cache)
+		return cache;
+	cache = calloc(1, sizeof(struct pool_cache));
+	cache->pool = p;
+	pthread_setspecific(p->key, cache);
+	pthread_mutex_lock(&p->lock);
+	cache->next = p->caches;
+	if(p->caches)
+		p->caches->prev = cache;
+	p->caches = cache;
+	pthread_mutex_unlock(&p->lock);
+	return cache;
+}
+
+void pool_init(struct pool *p, const char *name, size_t objsize)
+{
+	memset(p, 0, sizeof *p);
+	p->name = name;
+	/* room for the free list links, and keep every object 16 byte aligned */
+	if(objsize < sizeof(struct free_obj))
+		objsize = sizeof(struct free_obj);
+	p->objsize = (objsize + 15) & ~(size_t)15;
+	p->batch = POOL_BATCH;
+	pthread_key_create(&p->key, cache_destroy);
+	pthread_mutex_init(&p->lock, NULL);
+}
+
+/* fill an empty cache up from the depot, or from a new slab */
+static void cache_refill(struct pool *p, struct pool_cache *cache)
+{
+	struct free_obj *batch, *o;
+	char *slab;
+	unsigned int i;
+
+	pthread_mutex_lock(&p->lock);
+	batch = p->depot;
+	if(batch) {
+		p->depot = batch->next_batch;
+		p->depot_gets++;
+		pthread_mutex_unlock(&p->lock);
+		cache->free = batch;
+		cache->nfree = batch->count;
+		return;
+	}
+	p->slabs++;
+	pthread_mutex_unlock(&p->lock);
+
+	slab = malloc(p->batch * p->objsize);
+	for(i = 0; i < p->batch; i++) {
+		o = (struct free_obj *)(slab + i * p->objsize);
+		o->next = i + 1 < p->batch ? (struct free_obj *)(slab + (i + 1) * p->objsize) : NULL;
+	}
+	cache->free = (struct free_obj *)slab;
+	cache->nfree = p->batch;
+}
+
+void *pool_alloc(struct pool *p)
+{
+	struct pool_cache *cache = get_cache(p);
+	struct free_obj *o;
+
+	if(cache->free == NULL)
+		cache_refill(p, cache);
+	o = cache->free;
+	cache->free = o->next;
+	cache->nfree--;
+	cache->allocs++;
+	return o;
+}
+
+void pool_free(struct pool *p, void *obj)
+{
+	struct pool_cache *cache = get_cache(p);
+	struct free_obj *o = (struct free_obj *)obj, *chain, *tail;
+	unsigned int i;
+
+	o->next = cache->free;
+	cache->free = o;
+	cache->nfree++;
+	cache->frees++;
+	if(cache->nfree < 2 * p->batch)
+		return;
+
+	/*
+	* Threads that free more than they allocate (eg: the one flushing
+	* a busy client's queue) would hoard objects otherwise.
+	* Give a batch back for the others to use.
+	*/
+	chain = cache->free;
+	for(tail = chain, i = 1; i < p->batch; i++)
+		tail = tail->next;
+	cache->free = tail->next;
+	cache->nfree -= p->batch;
+	tail->next = NULL;
+	pthread_mutex_lock(&p->lock);
+	depot_put(p, chain, p->batch);
+	pthread_mutex_unlock(&p->lock);
+}
+
+/*
+* Sum up the counts of every thread. The threads are not stopped for it,
+* so the numbers may be a little behind, which is fine for statistics.
+*/
+void pool_stats(struct pool *p, struct pool_stats *st)
+{
+	struct pool_cache *cache;
+
+	pthread_mutex_lock(&p->lock);
+	st->allocs = p->retired_allocs;
+	st->frees = p->retired_frees;
+	for(cache = p->caches; cache; cache = cache->next) {
+		st->allocs += cache->allocs;
+		st->frees += cache->frees;
+	}
+	st->in_use = st->allocs - st->frees;
+	st->depot_gets = p->depot_gets;
+	st->depot_puts = p->depot_puts;
+	st->slabs = p->slabs;
+	st->heap_bytes = p->slabs * p->batch * p->objsize;
+	pthread_mutex_unlock(&p->lock);
+}
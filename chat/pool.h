@@ -0,0 +1,50 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+* A pool hands out objects of one fixed size.
+* Every thread keeps a cache of free objects of its own, so the usual
+* alloc and free touch no lock and no shared cache line. A cache that
+* runs dry takes a batch of objects from the pool's shared depot, one
+* that grows too full gives a batch back. Only when the depot is empty
+* too does the pool go to the heap, for a whole slab of objects at once.
+* Objects never go back to the heap.
+*/
+struct pool {
+	const char *name;
+	size_t objsize;
+	/* objects moved between a thread's cache and the depot at once */
+	unsigned int batch;
+	pthread_key_t key;
+
+	/* everything below is protected by @lock */
+	pthread_mutex_t lock;
+	/* batches of free objects */
+	void *depot;
+	unsigned long slabs;
+	/* caches of running threads, and the counts of those gone */
+	struct pool_cache *caches;
+	unsigned long retired_allocs, retired_frees;
+	unsigned long depot_gets, depot_puts;
+};
+
+struct pool_stats {
+	unsigned long allocs, frees, in_use;
+	/* trips to the depot, and to the heap */
+	unsigned long depot_gets, depot_puts, slabs;
+	size_t heap_bytes;
+};
+
+void pool_init(struct pool *p, const char *name, size_t objsize);
+void *pool_alloc(struct pool *p);
+void pool_free(struct pool *p, void *obj);
+void pool_stats(struct pool *p, struct pool_stats *st);
+
+#endif
@@ -0,0 +1,233 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include "proto.h"
+
+/* write a frame header describing a @len byte payload into @hdr */
+void frame_pack(unsigned char *hdr, int op, int flags, int id, size_t len)
+{
+	hdr[0] = len >> 24 & 0xFF;
+	hdr[1] = len >> 16 & 0xFF;
+	hdr[2] = len >> 8 & 0xFF;
+	hdr[3] = len & 0xFF;
+	hdr[4] = op;
+	hdr[5] = flags;
+	hdr[6] = id >> 8 & 0xFF;
+	hdr[7] = id & 0xFF;
+}
+
+void frame_unpack(const unsigned char *hdr, struct frame_hdr *fh)
+{
+	fh->len = (unsigned int)hdr[0] << 24 | hdr[1] << 16 | hdr[2] << 8 | hdr[3];
+	fh->op = hdr[4];
+	fh->flags = hdr[5];
+	fh->id = hdr[6] << 8 | hdr[7];
+}
+
+/*
+* @size is where the ring starts and @max is how large it may grow
+* to hold one frame, both are rounded up to a power of two
+*/
+void ring_init(struct ringbuf *rb, size_t size, size_t max)
+{
+	rb->size = 64;
+	while(rb->size < size)
+		rb->size <<= 1;
+	rb->max = rb->size;
+	while(rb->max < max)
+		rb->max <<= 1;
+	rb->buf = malloc(rb->size);
+	rb->head = rb->tail = 0;
+}
+
+void ring_free(struct ringbuf *rb)
+{
+	free(rb->buf);
+	rb->buf = NULL;
+}
+
+/* copy @len bytes starting @off bytes past head out of the ring */
+static void ring_copy(struct ringbuf *rb, size_t off, char *dst, size_t len)
+{
+	size_t pos = (rb->head + off) & (rb->size - 1);
+	size_t first = rb->size - pos;
+
+	if(first > len)
+		first = len;
+	memcpy(dst, rb->buf + pos, first);
+	memcpy(dst + first, rb->buf, len - first);
+}
+
+/* move into a buf of @size, with the held bytes laid out from offset 0 */
+static void ring_resize(struct ringbuf *rb, size_t size)
+{
+	size_t used = rb->tail - rb->head;
+	char *buf;
+
+	buf = malloc(size);
+	ring_copy(rb, 0, buf, used);
+	free(rb->buf);
+	rb->buf = buf;
+	rb->size = size;
+	rb->head = 0;
+	rb->tail = used;
+}
+
+/* make room for @need bytes, without going over the max */
+static int ring_grow(struct ringbuf *rb, size_t need)
+{
+	size_t size = rb->size;
+
+	while(size < need)
+		size <<= 1;
+	if(size > rb->max)
+		return -1;
+	ring_resize(rb, size);
+	return 0;
+}
+
+/*
+* read() whatever fits from @fd into the free space of the ring.
+* The free space may wrap around the end of buf, so read into both
+* pieces of it at once with readv().
+* returns what readv() returned
+*/
+ssize_t ring_read(int fd, struct ringbuf *rb)
+{
+	struct iovec iov[2];
+	size_t pos = rb->tail & (rb->size - 1);
+	size_t space = rb->size - (rb->tail - rb->head);
+	ssize_t n;
+
+	iov[0].iov_base = rb->buf + pos;
+	iov[0].iov_len = rb->size - pos;
+	if(iov[0].iov_len > space)
+		iov[0].iov_len = space;
+	iov[1].iov_base = rb->buf;
+	iov[1].iov_len = space - iov[0].iov_len;
+
+	n = readv(fd, iov, iov[1].iov_len ? 2 : 1);
+	if(n > 0)
+		rb->tail += n;
+	return n;
+}
+
+/*
+* append @len bytes at @data to the ring, for bytes that were read
+* somewhere else first. The ring grows to hold them, past its max if
+* need be: they were read already and have to go somewhere. The max
+* still holds for frames, frame_next() turns a larger one down.
+*/
+void ring_put(struct ringbuf *rb, const char *data, size_t len)
+{
+	size_t used = rb->tail - rb->head, size = rb->size, pos, first;
+
+	if(used + len > size) {
+		while(size < used + len)
+			size <<= 1;
+		ring_resize(rb, size);
+	}
+	pos = rb->tail & (rb->size - 1);
+	first = rb->size - pos;
+	if(first > len)
+		first = len;
+	memcpy(rb->buf + pos, data, first);
+	memcpy(rb->buf, data + first, len - first);
+	rb->tail += len;
+}
+
+/*
+* Parse the next frame out of the ring, if all of it has arrived.
+* returns 1 and fills in @fh and @payload if there was one,
+* 0 if the frame is still on its way, and -1 if it can never fit.
+*
+* @payload points into the ring and is not NUL terminated, it only stays
+* valid until the next ring_read(). A payload that wraps around the end
+* of buf is straightened out first, which is rare enough not to matter.
+*/
+int frame_next(struct ringbuf *rb, struct frame_hdr *fh, char **payload)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+	size_t used = rb->tail - rb->head, pos;
+
+	if(used < FRAME_HDR_SIZE)
+		return 0;
+	ring_copy(rb, 0, (char *)hdr, FRAME_HDR_SIZE);
+	frame_unpack(hdr, fh);
+
+	if(FRAME_HDR_SIZE + (size_t)fh->len > rb->size) {
+		/* make room for the whole frame to come */
+		if(ring_grow(rb, FRAME_HDR_SIZE + fh->len) < 0)
+			return -1;
+		return 0;
+	}
+	if(used < FRAME_HDR_SIZE + fh->len)
+		return 0;
+
+	pos = (rb->head + FRAME_HDR_SIZE) & (rb->size - 1);
+	if(pos + fh->len > rb->size) {
+		ring_resize(rb, rb->size);
+		pos = FRAME_HDR_SIZE;
+	}
+	*payload = rb->buf + pos;
+	rb->head += FRAME_HDR_SIZE + fh->len;
+	return 1;
+}
+
+/*
+* writev() all of @iov to @fd.
+* A non-blocking socket may take only part of it or none at all (EAGAIN),
+* in which case wait until it drains a bit and carry on where it stopped.
+* @iov is used up in the process.
+*/
+int writev_all(int fd, struct iovec *iov, int iovcnt)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while(iovcnt > 0) {
+		n = writev(fd, iov, iovcnt);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, -1);
+			continue;
+		}
+		if(n < 0)
+			return -1;
+		/* skip over whatever went out */
+		while(iovcnt > 0 && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if(iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* write a whole frame, header and payload in one go */
+int frame_write(int fd, int op, int flags, int id, const void *payload, size_t len)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+	struct iovec iov[2];
+
+	frame_pack(hdr, op, flags, id, len);
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = FRAME_HDR_SIZE;
+	iov[1].iov_base = (void *)payload;
+	iov[1].iov_len = len;
+	return writev_all(fd, iov, len ? 2 : 1);
+}
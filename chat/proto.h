@@ -0,0 +1,125 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef PROTO_H
+#define PROTO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+* The chat wire protocol.
+* TCP is a byte stream: one write() at one end may show up as two read()s
+* at the other end, and two write()s may show up as one read(). So every
+* msg goes out as a frame, an 8 byte header followed by a payload:
+*
+*  0       4    5       6       8
+*  +-------+----+-------+-------+-------------------+
+*  |  len  | op | flags |  id   | payload (len bytes) |
+*  +-------+----+-------+-------+-------------------+
+*
+* len   - number of payload bytes, network byte order
+* op    - what the frame is, one of the OP_* below
+* flags - bitwise or of FLAG_* below
+* id    - picked by the client, the server echoes it in its reply
+*/
+#define FRAME_HDR_SIZE 8
+
+/*
+* FLAG_ACK - have the server answer the frame with an OP_ACK once it is
+*            handled, carrying the frame's id and one of ACK_* below.
+*            Lets a client pipeline commands and still tell what became
+*            of each.
+*/
+#define FLAG_ACK 1
+/*
+* FLAG_PACKED - the payload is packed against the dictionary both ends
+*               agreed on with OP_PACK (see lz.h). Only OP_SEND and
+*               OP_BROADCAST from a client, and OP_MSG to it, are packed.
+*/
+#define FLAG_PACKED 2
+
+/* client -> server */
+#define OP_REGISTER 1	/* payload: <username> */
+#define OP_LS       2	/* no payload */
+#define OP_SEND     3	/* payload: <recipient> <msg> */
+#define OP_EXIT     4	/* no payload */
+#define OP_JOIN     5	/* payload: <room> */
+#define OP_LEAVE    6	/* payload: <room> */
+#define OP_BROADCAST 7	/* payload: <room> <msg> */
+#define OP_STATS    8	/* no payload */
+#define OP_RESUME   9	/* payload: <username> <token>, see OP_SESSION */
+#define OP_PONG    10	/* no payload, the answer to an OP_PING */
+#define OP_SHM     11	/* no payload, move over to shared memory, see shm.h */
+#define OP_P2P     12	/* payload: <port>, we take direct links on it, see p2p.h */
+#define OP_WHERE   13	/* payload: <username>, to be introduced to for a direct link */
+#define OP_FILE    14	/* payload: <recipient> <size> <name>, a file to send, see relay.h */
+#define OP_PACK    15	/* payload: <dictionary id>, pack msgs against it, see lz.h */
+/* server -> client */
+#define OP_MSG      64	/* payload: <sender>: <msg> or <sender>@<room>: <msg> */
+#define OP_LS_REPLY 65	/* payload: one username per line */
+#define OP_STATS_REPLY 66	/* payload: the server's counters, see stats.h */
+#define OP_ACK      67	/* payload: one byte, ACK_* */
+#define OP_SESSION  68	/* payload: <token>, to OP_RESUME the session with */
+#define OP_PING     69	/* no payload, answer with an OP_PONG */
+#define OP_SHM_READY 70	/* no payload, the answer to OP_SHM, see shm.h */
+#define OP_PEER     71	/* payload: <username> <ip>:<port> <nonce>, the answer to
+			   OP_WHERE, or <username> alone for no direct link */
+#define OP_INTRO    72	/* payload: <username> <nonce>, who is to dial us */
+#define OP_FILE_GO  73	/* payload: <recipient> <port> <token>, the answer to OP_FILE,
+			   or <recipient> alone for no transfer */
+#define OP_OFFER    74	/* payload: <sender> <size> <port> <token> <name>, a file
+			   coming our way */
+#define OP_PACK_OK  75	/* payload: <dictionary id>, the answer to OP_PACK, or
+			   nothing if the server has not got that dictionary */
+/* node <-> node, on the links of a cluster (see cluster.h) */
+#define OP_NODE_HELLO 96	/* payload: <nonce>, id: the id of the node dialing */
+#define OP_NODE_ADD   97	/* payload: <username>, a user of the node */
+#define OP_NODE_DEL   98	/* payload: <username>, who left it */
+#define OP_NODE_SEND  99	/* payload: <recipient> <sender>: <msg> */
+#define OP_NODE_AUTH 100	/* payload: [<nonce>] <MAC>, proof of the secret */
+
+/* what became of a frame with FLAG_ACK */
+#define ACK_OK      0	/* done, a msg is on its way */
+#define ACK_STORED  1	/* the recipient is offline, the msg is kept for them */
+#define ACK_NOUSER  2	/* nobody by that name, the msg is gone */
+#define ACK_DROPPED 3	/* the recipient's queue was full, the msg is gone */
+
+/* a session token is this many hex digits */
+#define SESSION_TOKEN_SIZE 32
+
+struct frame_hdr {
+	unsigned int len;
+	unsigned char op;
+	unsigned char flags;
+	unsigned short id;
+};
+
+/*
+* A ring buffer of bytes read off a connection but not yet parsed.
+* head and tail only ever grow, (x & (size - 1)) is their position
+* in buf, and tail - head is the number of bytes held.
+*/
+struct ringbuf {
+	char *buf;
+	size_t size;
+	/* the ring never grows beyond this */
+	size_t max;
+	size_t head, tail;
+};
+
+void frame_pack(unsigned char *hdr, int op, int flags, int id, size_t len);
+void frame_unpack(const unsigned char *hdr, struct frame_hdr *fh);
+
+void ring_init(struct ringbuf *rb, size_t size, size_t max);
+void ring_free(struct ringbuf *rb);
+ssize_t ring_read(int fd, struct ringbuf *rb);
+void ring_put(struct ringbuf *rb, const char *data, size_t len);
+int frame_next(struct ringbuf *rb, struct frame_hdr *fh, char **payload);
+
+int writev_all(int fd, struct iovec *iov, int iovcnt);
+int frame_write(int fd, int op, int flags, int id, const void *payload, size_t len);
+
+#endif
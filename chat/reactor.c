@@ -0,0 +1,618 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "registry.h"
+#include "uring.h"
+#include "stats.h"
+#include "store.h"
+#include "tls.h"
+#include "shm.h"
+#include "reactor.h"
+#include "chatserver.h"
+
+/* how many ready sockets a reactor picks up per epoll_wait() */
+#define MAX_EVENTS 64
+
+struct reactor *reactors;
+int nr_reactors = 0;
+
+/*
+* Called by a reactor when the socket of @cnode becomes readable.
+* The socket is edge-triggered, so we will not hear about it again
+* until new data arrives: keep reading until the kernel says EAGAIN.
+*/
+static void reactor_read(struct client_node *cnode)
+{
+	ssize_t readlen;
+
+	while(1) {
+		readlen = client_read(cnode);
+		if(readlen < 0 && errno == EINTR)
+			continue;
+		if(readlen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if(readlen <= 0) {
+			lose_client(cnode);
+			return;
+		}
+
+		/*
+		* one read may have brought in several frames,
+		* or just a piece of one.
+		* A parked client is not read from until it resumes,
+		* the rest of what it sent stays in the socket meanwhile.
+		*/
+		if(handle_frames(cnode) != CLIENT_OK)
+			return;
+	}
+}
+
+/*
+* pick up the clients handed back to us by resume_client(),
+* and carry on with each where it stopped
+*/
+static void reactor_resume(struct reactor *reactor)
+{
+	struct client_node *w, *list;
+	eventfd_t v;
+
+	eventfd_read(reactor->wakefd, &v);
+	pthread_mutex_lock(&reactor->lock);
+	list = reactor->resumed;
+	reactor->resumed = NULL;
+	pthread_mutex_unlock(&reactor->lock);
+
+	while(list) {
+		w = list;
+		list = w->wait_next;
+		if(!w->closed && !w->parked && handle_frames(w) == CLIENT_OK)
+			reactor_read(w);
+		put_client(w);
+	}
+}
+
+/*
+* accept everybody waiting on the reactor's own listener,
+* they stay with this reactor for good
+*/
+static void reactor_accept(struct reactor *reactor)
+{
+	int client_sockfd;
+
+	while((client_sockfd = accept4(reactor->listenfd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+		serve_new_client(client_sockfd, reactor, 0);
+}
+
+/* the event loop of a single reactor thread */
+static void *reactor_loop(void *r)
+{
+	struct reactor *reactor = (struct reactor *)r;
+	struct epoll_event events[MAX_EVENTS];
+	struct client_node *cnode, *pinned[MAX_EVENTS];
+	unsigned long ptr;
+	int i, n, resumed, nr_pinned;
+
+	while(1) {
+		n = epoll_wait(reactor->epfd, events, MAX_EVENTS, -1);
+		resumed = 0;
+		nr_pinned = 0;
+		for(i = 0; i < n; i++) {
+			/* the listener is the one pointing at the reactor */
+			if(events[i].data.ptr == (void *)reactor) {
+				reactor_accept(reactor);
+				continue;
+			}
+			ptr = (unsigned long)events[i].data.ptr;
+			cnode = (struct client_node *)(ptr & ~BELL_TAG);
+			/* the wakefd is the one without a client */
+			if(cnode == NULL) {
+				resumed = 1;
+				continue;
+			}
+			/*
+			* A client on shm has two fds in the set, and may be gone
+			* by the time the second one comes up in events[]: it is
+			* held on to until the batch is done.
+			*/
+			if(cnode->shm || (ptr & BELL_TAG)) {
+				if(!cnode->pinned) {
+					get_client(cnode);
+					cnode->pinned = 1;
+					pinned[nr_pinned++] = cnode;
+				}
+				if(cnode->closed)
+					continue;
+				if(ptr & BELL_TAG) {
+					shm_ack(cnode->shm);
+					flush_client(cnode);
+					if(!cnode->parked)
+						reactor_read(cnode);
+				} else if(events[i].events & ~EPOLLOUT) {
+					/* its socket only ever says it hung up */
+					lose_client(cnode);
+				}
+				continue;
+			}
+			if(events[i].events & EPOLLOUT)
+				flush_client(cnode);
+			/* a TLS handshake is carried on by reading, whichever way it waits */
+			if(((events[i].events & ~EPOLLOUT) || (cnode->tls
+				&& !cnode->tls->up)) && !cnode->parked)
+				reactor_read(cnode);
+		}
+		for(i = 0; i < nr_pinned; i++) {
+			pinned[i]->pinned = 0;
+			put_client(pinned[i]);
+		}
+		/*
+		* resumed clients are only taken care of after the batch:
+		* one of them may go away, and still be further down in events[]
+		*/
+		if(resumed)
+			reactor_resume(reactor);
+	}
+	return NULL;
+}
+
+/*
+* fire up @nr_reactors threads, each with an epoll instance of its own,
+* and with @reuseport a listening socket of its own too
+*/
+void start_reactors(int reuseport)
+{
+	struct epoll_event ev;
+	int i;
+
+	reactors = calloc(nr_reactors, sizeof(struct reactor));
+	for(i = 0; i < nr_reactors; i++) {
+		reactors[i].epfd = epoll_create1(0);
+		reactors[i].wakefd = eventfd(0, EFD_NONBLOCK);
+		pthread_mutex_init(&reactors[i].lock, NULL);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].wakefd, &ev);
+		reactors[i].listenfd = -1;
+		if(reuseport) {
+			reactors[i].listenfd = open_listener();
+			fcntl(reactors[i].listenfd, F_SETFL, O_NONBLOCK);
+			ev.data.ptr = &reactors[i];
+			epoll_ctl(reactors[i].epfd, EPOLL_CTL_ADD, reactors[i].listenfd, &ev);
+		}
+		pthread_create(&reactors[i].thread, NULL, reactor_loop, &reactors[i]);
+	}
+}
+
+/*
+* Hand a freshly accepted, non-blocking client over to @reactor.
+* Clients off the shared listener get a NULL @reactor and are dealt
+* to the reactors round robin. Either way, the client is served by
+* that reactor and only that reactor from then on.
+*/
+void reactor_add_client(struct reactor *reactor, struct client_node *cnode)
+{
+	static unsigned int next;
+	struct epoll_event ev;
+
+	if(reactor == NULL)
+		reactor = &reactors[next++ % nr_reactors];
+	cnode->reactor = reactor;
+
+	/* we also want to hear when there is room to flush its queue again */
+	ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+	ev.data.ptr = cnode;
+	epoll_ctl(cnode->reactor->epfd, EPOLL_CTL_ADD, cnode->sockfd, &ev);
+}
+
+/*
+* uring mode.
+* Reactors again, but rather than hearing that a socket is ready and then
+* reading and writing it themselves, they have the kernel do the I/O
+* through an io_uring (see uring.h) and hear when it is done:
+* - a multishot accept keeps accepting on the listener, a CQE per client
+* - a multishot recv per client keeps reading into buffers the kernel
+*   picks from the reactor's provided buffer ring, a CQE per chunk read
+* - the frames queued for a client go out in one sendmsg, like in epoll
+*   mode, only the kernel finishes it for us when the socket is full
+* What is read goes through handle_frames() like in the other modes.
+* All the requests made while handling a round of CQEs are submitted
+* by the one io_uring_enter() that waits for the next round.
+*/
+#define URING_ENTRIES 1024
+#define URING_BUFS 512
+#define URING_BUF_SIZE 4096
+#define URING_BGID 0
+
+/* what a CQE is about, in the low bits of its user_data */
+#define UD_RECV   0
+#define UD_SEND   1
+#define UD_ACCEPT 2
+#define UD_WAKE   3
+#define UD_CANCEL 4
+#define UD_ACCEPT_LOCAL 5
+#define UD_TAG(ud) ((ud) & 7)
+#define UD_PTR(ud) ((void *)(unsigned long)((ud) & ~7ULL))
+
+/*
+* Frames on their way to one client in a single sendmsg.
+* A client has one chain in flight at most: two of them could go out
+* interleaved. The chain holds the references the queue held to the
+* frames, and the iovec and msghdr, which the kernel reads as it goes.
+*/
+struct send_chain {
+	struct client_node *c;
+	int nr;
+	size_t len;
+	/* when it was submitted */
+	unsigned long start;
+	struct msgbuf *bufs[FLUSH_IOV];
+	struct iovec iov[FLUSH_IOV];
+	struct msghdr mh;
+};
+static struct pool chain_pool;
+
+/* the reactor this thread runs in uring mode */
+static __thread struct reactor *this_reactor;
+
+/* the unix socket the first uring reactor accepts on, -1 for none */
+static int local_listenfd = -1;
+
+/* keep receiving whatever @c sends, as long as it is connected */
+void uring_arm_recv(struct reactor *r, struct client_node *c)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = c->sockfd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = (unsigned long)c | UD_RECV;
+	/* the recv holds on to the node until its last CQE */
+	get_client(c);
+	c->recv_armed = 1;
+}
+
+/* stop receiving for a parked client, its last CQE says when it stopped */
+static void uring_stop_recv(struct reactor *r, struct client_node *c)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = (unsigned long)c | UD_RECV;
+	sqe->user_data = UD_CANCEL;
+}
+
+/* accept on the reactor's listener, or with @local on the unix socket */
+static void uring_arm_accept(struct reactor *r, int local)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = local ? local_listenfd : r->listenfd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	sqe->user_data = (unsigned long)r | (local ? UD_ACCEPT_LOCAL : UD_ACCEPT);
+}
+
+/* wait for other threads to hand us clients, see uring_kick() */
+static void uring_arm_wake(struct reactor *r)
+{
+	struct io_uring_sqe *sqe = uring_sqe(&r->ring);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = r->wakefd;
+	sqe->addr = (unsigned long)&r->wakeval;
+	sqe->len = sizeof r->wakeval;
+	sqe->user_data = (unsigned long)r | UD_WAKE;
+}
+
+/*
+* send out what is queued for @c, unless a chain is already in flight:
+* then this happens again once it is done
+*/
+static void uring_flush(struct reactor *r, struct client_node *c)
+{
+	struct send_chain *ch;
+	struct client_node *waiters = NULL;
+	struct io_uring_sqe *sqe;
+	int i;
+
+	if(c->chain)
+		return;
+	ch = pool_alloc(&chain_pool);
+	pthread_mutex_lock(&c->out_lock);
+	ch->nr = c->dead || c->detached ? 0 : outq_take(&c->out, ch->bufs, FLUSH_IOV);
+	/* low-water mark: let the stalled senders have another go */
+	if(c->waiters && (c->dead || c->out.bytes <= outq_hwm / 2)) {
+		waiters = c->waiters;
+		c->waiters = NULL;
+	}
+	pthread_mutex_unlock(&c->out_lock);
+	resume_clients(waiters);
+	if(ch->nr == 0) {
+		pool_free(&chain_pool, ch);
+		return;
+	}
+
+	ch->c = c;
+	ch->len = 0;
+	for(i = 0; i < ch->nr; i++) {
+		ch->iov[i].iov_base = ch->bufs[i]->data;
+		ch->iov[i].iov_len = ch->bufs[i]->len;
+		ch->len += ch->bufs[i]->len;
+	}
+	memset(&ch->mh, 0, sizeof ch->mh);
+	ch->mh.msg_iov = ch->iov;
+	ch->mh.msg_iovlen = ch->nr;
+	c->chain = ch;
+	get_client(c);
+
+	ch->start = stats_now();
+	sqe = uring_sqe(&r->ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = c->sockfd;
+	sqe->addr = (unsigned long)&ch->mh;
+	/*
+	* MSG_WAITALL: the kernel keeps at it until all of it went out,
+	* however long the client takes to read, so it never comes back short
+	*/
+	sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+	sqe->user_data = (unsigned long)ch | UD_SEND;
+}
+
+/*
+* Have @c's reactor send what is queued for it.
+* Only the reactor may submit to its ring: from any other thread the
+* client goes on the reactor's kicked list and the reactor is woken up,
+* unless the list was not empty and a wakeup is on its way already.
+*/
+void uring_kick(struct client_node *c)
+{
+	struct reactor *r = c->reactor;
+	int wake;
+
+	if(r == this_reactor) {
+		uring_flush(r, c);
+		return;
+	}
+	pthread_mutex_lock(&r->lock);
+	if(c->kicked) {
+		pthread_mutex_unlock(&r->lock);
+		return;
+	}
+	c->kicked = 1;
+	get_client(c);
+	wake = r->kicked == NULL;
+	c->kick_next = r->kicked;
+	r->kicked = c;
+	pthread_mutex_unlock(&r->lock);
+	if(wake)
+		eventfd_write(r->wakefd, 1);
+}
+
+/*
+* handle what @c sent. A parked client is not read from until it resumes:
+* stop its recv then, or the kernel keeps reading on regardless
+*/
+static void uring_handle(struct reactor *r, struct client_node *c)
+{
+	if(!c->closed && !c->parked)
+		handle_frames(c);
+	if(!c->closed && c->parked && c->recv_armed)
+		uring_stop_recv(r, c);
+}
+
+static void uring_accept_done(struct reactor *r, int res, unsigned int flags,
+	int local)
+{
+	if(res >= 0)
+		serve_new_client(res, r, local);
+	if(!(flags & IORING_CQE_F_MORE))
+		uring_arm_accept(r, local);
+}
+
+static void uring_recv_done(struct reactor *r, struct client_node *c, int res,
+	unsigned int flags)
+{
+	unsigned short bid;
+
+	if(res > 0) {
+		/* into the client's ring, and the buffer straight back to the kernel */
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		if(!c->closed)
+			ring_put(&c->in, uring_buf(&r->bufs, bid), res);
+		uring_buf_recycle(&r->bufs, bid);
+		uring_handle(r, c);
+	} else if(res != -ENOBUFS && res != -ECANCELED && !c->closed) {
+		/* the client hung up, or the connection broke */
+		lose_client(c);
+	}
+	if(flags & IORING_CQE_F_MORE)
+		return;
+
+	/* the recv is over, rearm it for a client still around and not parked */
+	c->recv_armed = 0;
+	if(!c->closed && !c->parked)
+		uring_arm_recv(r, c);
+	put_client(c);
+}
+
+static void uring_send_done(struct reactor *r, struct send_chain *ch, int res)
+{
+	struct client_node *c = ch->c, *waiters = NULL;
+	unsigned long long recs[FLUSH_IOV];
+	int i, nr = 0;
+
+	stat_lat(LAT_WRITE, ch->start);
+	stat_inc(ST_WRITES);
+	if(res > 0)
+		stat_add(ST_BYTES_OUT, res);
+	if(res < 0 || (size_t)res != ch->len) {
+		pthread_mutex_lock(&c->out_lock);
+		/* what the chain carried is lost, the rest stays for a session */
+		if(!c->dead && !c->detached) {
+			c->dead = 1;
+			if(c->session[0] == '\0')
+				outq_clear(&c->out);
+			/* have the recv end too, the client is dropped then */
+			shutdown(c->sockfd, SHUT_RDWR);
+		}
+		waiters = c->waiters;
+		c->waiters = NULL;
+		pthread_mutex_unlock(&c->out_lock);
+		resume_clients(waiters);
+	}
+	for(i = 0; i < ch->nr; i++) {
+		/* the chain went out whole, or none of it counts */
+		if(ch->bufs[i]->rec && res >= 0 && (size_t)res == ch->len)
+			recs[nr++] = ch->bufs[i]->rec;
+		msgbuf_put(ch->bufs[i]);
+	}
+	if(nr > 0)
+		store_written(c->username, recs, nr);
+	c->chain = NULL;
+	pool_free(&chain_pool, ch);
+	/* whatever was queued while the chain was out */
+	uring_flush(r, c);
+	put_client(c);
+}
+
+/* clients handed back to us by resume_client() and uring_kick() */
+static void uring_wake_done(struct reactor *r)
+{
+	struct client_node *w, *list;
+
+	pthread_mutex_lock(&r->lock);
+	list = r->resumed;
+	r->resumed = NULL;
+	pthread_mutex_unlock(&r->lock);
+	while(list) {
+		w = list;
+		list = w->wait_next;
+		uring_handle(r, w);
+		if(!w->closed && !w->parked && !w->recv_armed)
+			uring_arm_recv(r, w);
+		put_client(w);
+	}
+
+	/*
+	* a client may be kicked again as soon as it is off the list,
+	* so take them off one at a time and never look back
+	*/
+	while(1) {
+		pthread_mutex_lock(&r->lock);
+		w = r->kicked;
+		if(w) {
+			r->kicked = w->kick_next;
+			w->kicked = 0;
+		}
+		pthread_mutex_unlock(&r->lock);
+		if(w == NULL)
+			break;
+		uring_flush(r, w);
+		put_client(w);
+	}
+	uring_arm_wake(r);
+}
+
+/* the loop of a single uring reactor thread */
+static void *uring_loop(void *arg)
+{
+	struct reactor *r = (struct reactor *)arg;
+	struct io_uring_cqe *cqe;
+	unsigned long long ud;
+	unsigned int flags;
+	int res;
+
+	/* the ring is set up by the thread that uses it, the only one to */
+	this_reactor = r;
+	if(uring_init(&r->ring, URING_ENTRIES) < 0
+		|| uring_bufs_init(&r->ring, &r->bufs, URING_BGID,
+			URING_BUFS, URING_BUF_SIZE) < 0) {
+		perror("io_uring");
+		exit(EXIT_FAILURE);
+	}
+	uring_arm_accept(r, 0);
+	/* the unix socket is left to the first reactor */
+	if(local_listenfd >= 0 && r == &reactors[0])
+		uring_arm_accept(r, 1);
+	uring_arm_wake(r);
+
+	while(1) {
+		/* submit everything asked for, and wait for something to do */
+		uring_submit(&r->ring, 1);
+		while((cqe = uring_cqe(&r->ring)) != NULL) {
+			ud = cqe->user_data;
+			res = cqe->res;
+			flags = cqe->flags;
+			uring_cqe_seen(&r->ring);
+
+			switch(UD_TAG(ud)) {
+			case UD_RECV:
+				uring_recv_done(r, UD_PTR(ud), res, flags);
+				break;
+			case UD_SEND:
+				uring_send_done(r, UD_PTR(ud), res);
+				break;
+			case UD_ACCEPT:
+				uring_accept_done(r, res, flags, 0);
+				break;
+			case UD_ACCEPT_LOCAL:
+				uring_accept_done(r, res, flags, 1);
+				break;
+			case UD_WAKE:
+				uring_wake_done(r);
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+* fire up @nr_reactors uring reactors. They all accept with a multishot
+* accept, each on its own listener with @reuseport, else on a shared one.
+* The first one accepts on the unix socket @localfd too, unless it is -1.
+* Their sockets are blocking ones: the kernel takes care of the waiting.
+*/
+void start_uring_reactors(int reuseport, int localfd)
+{
+	int i, listenfd = -1;
+
+	local_listenfd = localfd;
+	pool_init(&chain_pool, "send chains", sizeof(struct send_chain));
+	if(!reuseport)
+		listenfd = open_listener();
+	reactors = calloc(nr_reactors, sizeof(struct reactor));
+	for(i = 0; i < nr_reactors; i++) {
+		reactors[i].epfd = -1;
+		reactors[i].wakefd = eventfd(0, 0);
+		pthread_mutex_init(&reactors[i].lock, NULL);
+		reactors[i].listenfd = reuseport ? open_listener() : listenfd;
+		pthread_create(&reactors[i].thread, NULL, uring_loop, &reactors[i]);
+	}
+}
+
+/* syscalls made and completions reaped by each uring reactor */
+void print_urings(void)
+{
+	int i;
+
+	print_pool(&chain_pool);
+	for(i = 0; i < nr_reactors; i++)
+		fprintf(stderr, "reactor %-4d io_uring_enter %lu completions %lu\n",
+			i, reactors[i].ring.enters, reactors[i].ring.completions);
+}
@@ -0,0 +1,60 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include "registry.h"
+#include "uring.h"
+
+/*
+* The reactors of epoll and uring mode: a small fixed number of threads
+* that serve all the clients between them, each client by the one reactor
+* it was handed to. What a reactor reads goes through handle_frames(),
+* like what a client thread reads in thread mode.
+*/
+
+/*
+* the doorbell of a client on shm is in a reactor's set too, with the
+* client's pointer and this bit set in it: client_nodes are never this odd
+*/
+#define BELL_TAG 1UL
+
+/*
+* A reactor is one thread waiting on one epoll instance.
+* Other threads hand it clients to get going again through @resumed,
+* and kick it out of epoll_wait() with @wakefd.
+*/
+struct reactor {
+	int epfd;
+	int wakefd;
+	/* the reactor's own listening socket with -R, else -1 */
+	int listenfd;
+	pthread_mutex_t lock;
+	struct client_node *resumed;
+	pthread_t thread;
+	/* uring mode: the ring, the buffers recvs read into, what wakefd read */
+	struct uring ring;
+	struct uring_bufs bufs;
+	unsigned long long wakeval;
+	/* uring mode: clients other threads queued frames for, see uring_kick() */
+	struct client_node *kicked;
+};
+
+/* the reactors, @nr_reactors of them, set before they are started */
+extern struct reactor *reactors;
+extern int nr_reactors;
+
+/* epoll mode */
+void start_reactors(int reuseport);
+void reactor_add_client(struct reactor *reactor, struct client_node *cnode);
+
+/* uring mode */
+void start_uring_reactors(int reuseport, int localfd);
+void uring_arm_recv(struct reactor *r, struct client_node *c);
+void uring_kick(struct client_node *c);
+void print_urings(void);
+
+#endif
@@ -0,0 +1,383 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "registry.h"
+#include "hash.h"
+
+/*
+* The registry keeps connected clients in two places:
+* - client_list, a doubly linked list of everybody in connection order.
+*   It is what `ls` walks; appending and unlinking are O(1).
+* - an open addressing hash table of registered usernames, so that finding
+*   the recipient of a `send` does not mean a strcmp() on every client.
+*
+* The table uses linear probing. Instead of leaving tombstones behind,
+* a removal shifts later entries of the same probe run back into the hole,
+* so lookups never have to skip over dead slots.
+*
+* Lookups vastly outnumber registrations, so the table is split into shards,
+* each a table of its own behind a reader-writer lock. A name always lives in
+* the shard picked by the top bits of its hash. Lookups only take the read
+* side, so they never wait for one another, and a client coming or going
+* only holds up lookups that land in the same shard.
+*/
+
+/*
+* a client's receive ring starts small, what clients send is short,
+* and may grow to hold the largest frame we are willing to take
+*/
+#define RING_SIZE 512
+#define RING_MAX 65536
+
+/* a shard's table is grown when it gets more than half full */
+#define TABLE_MIN_SIZE 64
+
+struct slot {
+	unsigned int hash;
+	struct client_node *node;
+};
+
+struct shard {
+	pthread_rwlock_t lock;
+	struct slot *table;
+	/* always a power of two, so (hash & mask) picks the home slot */
+	unsigned int size, mask, used;
+	/* keep neighbouring shards' locks off each other's cache line */
+	char pad[64];
+};
+
+struct client_node *client_list = NULL;
+static struct client_node *client_list_tail = NULL;
+pthread_mutex_t client_list_lock;
+struct pool client_pool;
+
+static struct shard *shards;
+static unsigned int nr_shards, shard_shift;
+
+unsigned int hash_name(const char *s)
+{
+	return fnv1a(s, strlen(s), FNV_SEED);
+}
+
+static void table_alloc(struct shard *sh, unsigned int size)
+{
+	sh->table = calloc(size, sizeof(struct slot));
+	sh->size = size;
+	sh->mask = size - 1;
+	sh->used = 0;
+}
+
+static void table_put(struct shard *sh, unsigned int hash, struct client_node *node)
+{
+	unsigned int i = hash & sh->mask;
+	while(sh->table[i].node)
+		i = (i + 1) & sh->mask;
+	sh->table[i].hash = hash;
+	sh->table[i].node = node;
+	sh->used++;
+}
+
+/* double the table and rehash everything into it */
+static void table_grow(struct shard *sh)
+{
+	struct slot *old = sh->table;
+	unsigned int i, old_size = sh->size;
+
+	table_alloc(sh, old_size * 2);
+	for(i = 0; i < old_size; i++)
+		if(old[i].node)
+			table_put(sh, old[i].hash, old[i].node);
+	free(old);
+}
+
+/* index of @username in the table, or -1 */
+static int table_find(struct shard *sh, const char *username, unsigned int hash)
+{
+	unsigned int i = hash & sh->mask;
+	while(sh->table[i].node) {
+		if(sh->table[i].hash == hash &&
+		   strcmp(sh->table[i].node->username, username) == 0)
+			return i;
+		i = (i + 1) & sh->mask;
+	}
+	return -1;
+}
+
+/* empty slot @i and pull the rest of its probe run back over the hole */
+static void table_del(struct shard *sh, unsigned int i)
+{
+	unsigned int j = i, home;
+
+	while(1) {
+		j = (j + 1) & sh->mask;
+		if(sh->table[j].node == NULL)
+			break;
+		home = sh->table[j].hash & sh->mask;
+		/*
+		* the entry at j may move into the hole at i only if its home
+		* slot does not lie cyclically within (i, j]
+		*/
+		if((j > i && (home <= i || home > j)) ||
+		   (j < i && (home <= i && home > j))) {
+			sh->table[i] = sh->table[j];
+			i = j;
+		}
+	}
+	sh->table[i].node = NULL;
+	sh->used--;
+}
+
+/*
+* the low bits of the hash pick the slot within a shard,
+* so use the high bits to pick the shard
+*/
+static struct shard *shard_of(unsigned int hash)
+{
+	return &shards[shard_shift < 32 ? hash >> shard_shift : 0];
+}
+
+/* @n is rounded up to a power of two, 0 picks REGISTRY_SHARDS */
+void registry_init(int n)
+{
+	unsigned int i;
+
+	if(n < 1)
+		n = REGISTRY_SHARDS;
+	for(nr_shards = 1, shard_shift = 32; nr_shards < (unsigned int)n; nr_shards <<= 1)
+		shard_shift--;
+	shards = calloc(nr_shards, sizeof(struct shard));
+	for(i = 0; i < nr_shards; i++) {
+		pthread_rwlock_init(&shards[i].lock, NULL);
+		table_alloc(&shards[i], TABLE_MIN_SIZE);
+	}
+	pthread_mutex_init(&client_list_lock, NULL);
+	pool_init(&client_pool, "client_node", sizeof(struct client_node));
+}
+
+/*
+* a node for the connection @cfd, on no list and in no table.
+* Peer links in a cluster are such nodes, clients are add_client()ed.
+*/
+struct client_node *new_client(int cfd)
+{
+	struct client_node *c = pool_alloc(&client_pool);
+	c->sockfd = cfd;
+	c->username[0] = '\0';
+	ring_init(&c->in, RING_SIZE, RING_MAX);
+	pthread_mutex_init(&c->out_lock, NULL);
+	outq_init(&c->out);
+	c->dead = 0;
+	c->closed = 0;
+	c->detached = 0;
+	c->flush_pending = 0;
+	c->flush_next = NULL;
+	c->waiters = NULL;
+	c->parked = 0;
+	c->wait_next = NULL;
+	c->backlog = 0;
+	c->session[0] = '\0';
+	c->sess_timer.pprev = NULL;
+	c->last_rx = c->last_cmd = timer_now;
+	c->pinged = 0;
+	c->idle.pprev = NULL;
+	c->tls = NULL;
+	c->shm = NULL;
+	c->p2p.sin_port = 0;
+	c->packing = 0;
+	c->pinned = 0;
+	c->wakefd = -1;
+	c->rooms = NULL;
+	/* this one belongs to whoever serves the connection */
+	c->refcnt = 1;
+	c->reactor = NULL;
+	c->recv_armed = 0;
+	c->chain = NULL;
+	c->kicked = 0;
+	c->kick_next = NULL;
+	c->prev = c->next = NULL;
+	return c;
+}
+
+/* add to the tail of the linked list - no rocket science */
+struct client_node *add_client(int cfd)
+{
+	struct client_node *c = new_client(cfd);
+
+	/* always get a lock before you mess with list */
+	pthread_mutex_lock(&client_list_lock);
+	c->prev = client_list_tail;
+	if(client_list_tail)
+		client_list_tail->next = c;
+	else
+		client_list = c;
+	client_list_tail = c;
+	/* release the lock when we are done with */
+	pthread_mutex_unlock(&client_list_lock);
+	return c;
+}
+
+/*
+* give @c the name @username and make it findable by that name.
+* If somebody else is already registered with that name, they keep
+* receiving its msgs, and 0 is returned. Otherwise 1 is returned.
+*/
+int register_client(struct client_node *c, const char *username)
+{
+	struct shard *sh;
+	unsigned int hash;
+	int ret = 0;
+
+	/*
+	* The name is only ever written here, before the node is in any
+	* table, so lookups comparing against it never see it half written.
+	* Only name a node once.
+	*/
+	if(c->username[0] != '\0')
+		return 0;
+	strncpy(c->username, username, USERNAME_MAX_SIZE - 1);
+	c->username[USERNAME_MAX_SIZE - 1] = '\0';
+	if(c->username[0] == '\0')
+		return 0;
+
+	hash = hash_name(c->username);
+	sh = shard_of(hash);
+	pthread_rwlock_wrlock(&sh->lock);
+	if(table_find(sh, c->username, hash) < 0) {
+		if(2 * (sh->used + 1) > sh->size)
+			table_grow(sh);
+		table_put(sh, hash, c);
+		ret = 1;
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return ret;
+}
+
+/*
+* return NULL if no node is present with username @recipient,
+* else return pointer to the node.
+* The node comes with a reference taken, put_client() it when done.
+*/
+struct client_node *search_client_list(const char *recipient)
+{
+	struct client_node *p = NULL;
+	struct shard *sh;
+	unsigned int hash;
+	int i;
+	if(recipient == NULL || *recipient == '\0')
+		return NULL;
+	hash = hash_name(recipient);
+	sh = shard_of(hash);
+	/* readers share the lock, only a (un)registration in this shard waits us out */
+	pthread_rwlock_rdlock(&sh->lock);
+	i = table_find(sh, recipient, hash);
+	if(i >= 0) {
+		p = sh->table[i].node;
+		/* pin it before the lock is gone and the client with it */
+		get_client(p);
+	}
+	pthread_rwlock_unlock(&sh->lock);
+	return p;
+}
+
+/* take @c off the client list, with client_list_lock held */
+static void list_unlink(struct client_node *c)
+{
+	if(c->prev)
+		c->prev->next = c->next;
+	else
+		client_list = c->next;
+	if(c->next)
+		c->next->prev = c->prev;
+	else
+		client_list_tail = c->prev;
+}
+
+/*
+* remove the client from the list of clients and from the table.
+* Nobody can find it afterwards, but those who already did may still
+* hold a reference, so it is not freed here.
+* returns 1 if the client was registered by its name, 0 otherwise
+*/
+int remove_client(struct client_node *c)
+{
+	struct shard *sh;
+	unsigned int hash;
+	int i, ret = 0;
+
+	if(c->username[0] != '\0') {
+		hash = hash_name(c->username);
+		sh = shard_of(hash);
+		pthread_rwlock_wrlock(&sh->lock);
+		i = table_find(sh, c->username, hash);
+		/* only if the name actually belongs to us */
+		if(i >= 0 && sh->table[i].node == c) {
+			table_del(sh, i);
+			ret = 1;
+		}
+		pthread_rwlock_unlock(&sh->lock);
+	}
+
+	/* get a lock and only then touch the list */
+	pthread_mutex_lock(&client_list_lock);
+	list_unlink(c);
+	pthread_mutex_unlock(&client_list_lock);
+	return ret;
+}
+
+/*
+* @new, unnamed yet, takes over the name of @old and its slot in the
+* table: whoever looks the name up finds @new from then on, and never
+* misses it in between. @old is taken off the list of clients.
+* returns 1 if it did, 0 if the name was not @old's
+*/
+int replace_client(struct client_node *old, struct client_node *new)
+{
+	struct shard *sh;
+	unsigned int hash;
+	int i, ret = 0;
+
+	/* written before @new is in the table, like in register_client() */
+	strcpy(new->username, old->username);
+	hash = hash_name(old->username);
+	sh = shard_of(hash);
+	pthread_rwlock_wrlock(&sh->lock);
+	i = table_find(sh, old->username, hash);
+	if(i >= 0 && sh->table[i].node == old) {
+		sh->table[i].node = new;
+		ret = 1;
+	}
+	pthread_rwlock_unlock(&sh->lock);
+
+	pthread_mutex_lock(&client_list_lock);
+	list_unlink(old);
+	pthread_mutex_unlock(&client_list_lock);
+	return ret;
+}
+
+void get_client(struct client_node *c)
+{
+	__sync_fetch_and_add(&c->refcnt, 1);
+}
+
+/*
+* drop a reference to @c, the last one out closes the socket.
+* The fd number is only given back to the kernel here, so a writer
+* still holding the node can never hit somebody else's socket.
+*/
+void put_client(struct client_node *c)
+{
+	if(__sync_sub_and_fetch(&c->refcnt, 1) != 0)
+		return;
+	close(c->sockfd);
+	ring_free(&c->in);
+	outq_clear(&c->out);
+	pthread_mutex_destroy(&c->out_lock);
+	if(c->wakefd >= 0)
+		close(c->wakefd);
+	pool_free(&client_pool, c);
+}
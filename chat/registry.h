@@ -0,0 +1,150 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <pthread.h>
+#include <netinet/in.h>
+#include "proto.h"
+#include "outq.h"
+#include "pool.h"
+#include "timer.h"
+
+#define USERNAME_MAX_SIZE 20
+/* default number of lock stripes the username table is split into */
+#define REGISTRY_SHARDS 64
+
+/* client_node abstracts a connected client */
+struct client_node {
+	int sockfd;
+	char username[USERNAME_MAX_SIZE];
+	/* bytes read off the socket that do not make a whole frame yet */
+	struct ringbuf in;
+	/*
+	* Frames on their way to the client. Anybody may queue a frame for
+	* the client, the queue is written out when the socket can take it.
+	* Everything from here to @waiters is protected by @out_lock.
+	*/
+	pthread_mutex_t out_lock;
+	struct outq out;
+	/* the socket is no good anymore, nothing is queued for it */
+	int dead;
+	/* drop_client() is done with this one */
+	int closed;
+	/*
+	* the connection broke, but the client may yet come back over
+	* another one: frames are queued all the same (see session.h)
+	*/
+	int detached;
+	/* the node is on some thread's list of clients to flush */
+	int flush_pending;
+	struct client_node *flush_next;
+	/* senders stalled until our queue drains (see OUTQ_BLOCK) */
+	struct client_node *waiters;
+
+	/* set while the client is stalled on somebody else's full queue */
+	volatile int parked;
+	struct client_node *wait_next;
+	/* msgs kept for it while it was offline are still on their way */
+	int backlog;
+	/*
+	* the token the client may resume its session with,
+	* empty if it has none. Only written before it is registered,
+	* after that it is only ever cleared, with @out_lock held.
+	*/
+	char session[SESSION_TOKEN_SIZE + 1];
+	/* while detached: ends the session, unless it is resumed first */
+	struct timer sess_timer;
+	/*
+	* heartbeats: the ticks (see timer.h) at which the client last sent
+	* anything, and last sent something other than OP_PONG, the tick of
+	* the last_rx it was pinged for, and the timer looking at them.
+	* Like timer_now, the ticks are written by one thread, whoever reads
+	* the client, and read by the timer: a volatile word is all it takes.
+	*/
+	volatile unsigned long last_rx, last_cmd;
+	unsigned long pinged;
+	struct timer idle;
+	/*
+	* the TLS of the connection, NULL for plaintext, and the shm transport
+	* of a local client (see shm.h), NULL if none. Freed once the client
+	* is dropped or detached, with @out_lock held.
+	*/
+	struct tls *tls;
+	struct shm *shm;
+	/*
+	* where the client takes direct links from other clients (see
+	* OP_P2P), a port of 0 if it does not. Protected by @out_lock.
+	*/
+	struct sockaddr_in p2p;
+	/*
+	* the client takes msgs packed against the server's dictionary (see
+	* OP_PACK). Only ever set, with @out_lock held, read without it.
+	*/
+	int packing;
+	/* thread mode: kicks the client's thread out of poll() */
+	int wakefd;
+	/* rooms the client joined, only its own thread touches this */
+	struct membership *rooms;
+	/*
+	* A node may be in use by other threads (eg: someone is sending
+	* it a msg) at the time its client quits, so it is only freed when
+	* the last reference to it is dropped with put_client().
+	*/
+	int refcnt;
+	/* the reactor serving this client in epoll or uring mode, NULL otherwise */
+	struct reactor *reactor;
+	/* epoll mode: held by its reactor until the end of a batch of events */
+	int pinned;
+	/*
+	* uring mode: a multishot recv is armed for the client, and the
+	* sendmsg in flight if there is one. Only the reactor
+	* touches these.
+	*/
+	int recv_armed;
+	struct send_chain *chain;
+	/*
+	* uring mode: the client is on its reactor's list of clients other
+	* threads queued frames for, protected by the reactor's lock
+	*/
+	int kicked;
+	struct client_node *kick_next;
+	/*
+	* every connected client sits on a doubly linked list,
+	* in the order they connected, so `ls` can walk them and
+	* a client can unlink itself without walking anything
+	*/
+	struct client_node *prev, *next;
+};
+
+/*
+* a list of `client_node`s which serves as our
+* connected client list
+*/
+extern struct client_node *client_list;
+
+/*
+* any operation on the client list is to be performed
+* only after getting a lock on this mutex.
+* Looking up a name does not touch the list, so `send` never takes it.
+*/
+extern pthread_mutex_t client_list_lock;
+
+/* client_nodes come from here, see pool.h */
+extern struct pool client_pool;
+
+void registry_init(int nr_shards);
+struct client_node *new_client(int cfd);
+struct client_node *add_client(int cfd);
+int register_client(struct client_node *c, const char *username);
+struct client_node *search_client_list(const char *recipient);
+int remove_client(struct client_node *c);
+int replace_client(struct client_node *old, struct client_node *new);
+void get_client(struct client_node *c);
+void put_client(struct client_node *c);
+/* the hash a name is looked up by, the directory of a cluster goes by it too */
+unsigned int hash_name(const char *s);
+
+#endif
@@ -0,0 +1,163 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include "registry.h"
+
+/*
+* registrybench hammers the client registry with `send` style lookups
+* from 1, 2, 4 ... up to 64 threads and prints how many lookups per second
+* each thread count manages, so the scaling of the sharded registry can be
+* compared with a single lock (-s 1).
+* With -w a writer thread keeps connecting and disconnecting clients
+* during the run, the way logins and logouts would on a live server.
+*/
+
+static int nr_users = 50000;
+static int duration_ms = 500;
+static int max_threads = 64;
+static int churn = 0;
+
+/* flipped by main to start and stop a round */
+static volatile int running;
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	unsigned long lookups;
+	/* each worker counts on a cache line of its own */
+	char pad[64];
+};
+
+static char (*names)[USERNAME_MAX_SIZE];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void *lookup_loop(void *w)
+{
+	struct worker *worker = (struct worker *)w;
+	struct client_node *c;
+	unsigned long n = 0;
+
+	while(!running)
+		;
+	while(running == 1) {
+		c = search_client_list(names[rand_r(&worker->seed) % nr_users]);
+		if(c)
+			put_client(c);
+		n++;
+	}
+	worker->lookups = n;
+	return NULL;
+}
+
+/* log in and out as fast as possible, under names nobody looks up */
+void *churn_loop(void *unused)
+{
+	struct client_node *c;
+	char name[USERNAME_MAX_SIZE];
+	unsigned long i = 0;
+
+	while(running != 2) {
+		sprintf(name, "churn%lu", i++ % 1000);
+		/* -1: there is no socket behind these nodes */
+		c = add_client(-1);
+		register_client(c, name);
+		remove_client(c);
+		put_client(c);
+	}
+	return NULL;
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-u users] [-s shards] [-d ms per round]"
+		" [-T max threads] [-w]\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct worker *workers;
+	pthread_t churner;
+	double start, elapsed, rate, base = 0;
+	unsigned long total;
+	int opt, i, t, nr_shards = 0;
+
+	while((opt = getopt(argc, argv, "u:s:d:T:w")) != -1) {
+		switch(opt) {
+		case 'u':
+			nr_users = atoi(optarg);
+			break;
+		case 's':
+			nr_shards = atoi(optarg);
+			break;
+		case 'd':
+			duration_ms = atoi(optarg);
+			break;
+		case 'T':
+			max_threads = atoi(optarg);
+			break;
+		case 'w':
+			churn = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if(nr_users < 1 || max_threads < 1)
+		usage(argv[0]);
+
+	registry_init(nr_shards);
+	names = malloc(nr_users * sizeof *names);
+	for(i = 0; i < nr_users; i++) {
+		sprintf(names[i], "user%d", i);
+		register_client(add_client(-1), names[i]);
+	}
+
+	printf("%d users, %d cores%s\n", nr_users,
+		(int)sysconf(_SC_NPROCESSORS_ONLN), churn ? ", with login churn" : "");
+	printf("%8s %16s %10s\n", "threads", "lookups/sec", "speedup");
+
+	workers = calloc(max_threads, sizeof(struct worker));
+	for(t = 1; t <= max_threads; t *= 2) {
+		running = 0;
+		for(i = 0; i < t; i++) {
+			workers[i].seed = i + 1;
+			pthread_create(&workers[i].thread, NULL, lookup_loop, &workers[i]);
+		}
+		if(churn)
+			pthread_create(&churner, NULL, churn_loop, NULL);
+
+		start = now();
+		running = 1;
+		usleep(duration_ms * 1000);
+		running = 2;
+
+		total = 0;
+		for(i = 0; i < t; i++) {
+			pthread_join(workers[i].thread, NULL);
+			total += workers[i].lookups;
+		}
+		elapsed = now() - start;
+		if(churn)
+			pthread_join(churner, NULL);
+
+		rate = total / elapsed;
+		if(t == 1)
+			base = rate;
+		printf("%8d %16.0f %9.2fx\n", t, rate, rate / base);
+	}
+	return 0;
+}
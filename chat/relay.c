@@ -0,0 +1,304 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "relay.h"
+#include "session.h"
+#include "stats.h"
+#include "log.h"
+
+/* a buffer of -x, as much as the pipe holds */
+#define COPY_SIZE RELAY_PIPE_SIZE
+
+struct relay_waiting {
+	char token[SESSION_TOKEN_SIZE];
+	unsigned long long size;
+	/* the ends that came, by RELAY_SENDER and RELAY_RECIPIENT, or -1 */
+	int fd[2];
+	/* the slot is taken, since when, and by which transfer */
+	int used;
+	time_t since;
+	unsigned long seq;
+};
+
+static int listenfd = -1;
+static unsigned short listen_port;
+static int copy_bytes;
+/*
+* @lock keeps the transfers that wait, @arrived is broadcast whenever
+* an end came in, or a slot was taken from under whoever waited in it
+*/
+static struct relay_waiting waiting[RELAY_WAITING];
+static unsigned long seq;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arrived = PTHREAD_COND_INITIALIZER;
+
+/* give up on slot @w, and the ends that came for it. With @lock held */
+static void free_slot(struct relay_waiting *w)
+{
+	if(w->fd[0] >= 0)
+		close(w->fd[0]);
+	if(w->fd[1] >= 0)
+		close(w->fd[1]);
+	w->used = 0;
+	pthread_cond_broadcast(&arrived);
+}
+
+/*
+* a free slot, or one waited in for too long, or else the oldest.
+* With @lock held
+*/
+static struct relay_waiting *take_slot(void)
+{
+	struct relay_waiting *w = NULL;
+	time_t now = time(NULL);
+	int i;
+
+	for(i = 0; i < RELAY_WAITING; i++) {
+		if(waiting[i].used && now - waiting[i].since > RELAY_WAIT_SECS)
+			free_slot(&waiting[i]);
+		if(!waiting[i].used)
+			return &waiting[i];
+		if(w == NULL || waiting[i].seq < w->seq)
+			w = &waiting[i];
+	}
+	free_slot(w);
+	return w;
+}
+
+/* the slot of @token, NULL if none. With @lock held */
+static struct relay_waiting *find_slot(const char *token)
+{
+	int i;
+
+	for(i = 0; i < RELAY_WAITING; i++)
+		if(waiting[i].used && session_match(waiting[i].token, token,
+			SESSION_TOKEN_SIZE))
+			return &waiting[i];
+	return NULL;
+}
+
+void relay_expect(const char *token, unsigned long long size)
+{
+	struct relay_waiting *w;
+
+	pthread_mutex_lock(&lock);
+	w = take_slot();
+	memcpy(w->token, token, SESSION_TOKEN_SIZE);
+	w->size = size;
+	w->fd[0] = w->fd[1] = -1;
+	w->used = 1;
+	w->since = time(NULL);
+	w->seq = seq++;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+* @size bytes from @from to @to through a pipe, with splice().
+* SPLICE_F_MORE holds back a packet that is not full while more is on
+* its way, like MSG_MORE. returns how many went
+*/
+static unsigned long long splice_bytes(int from, int to, unsigned long long size)
+{
+	unsigned long long done = 0;
+	ssize_t n, m;
+	int p[2], ok = 1, flags;
+
+	if(pipe2(p, O_CLOEXEC) < 0)
+		return 0;
+	/* the default 64KB makes for sixteen times the splice()s */
+	fcntl(p[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+	while(ok && done < size) {
+		n = splice(from, NULL, p[1], NULL,
+			size - done < RELAY_PIPE_SIZE ? size - done : RELAY_PIPE_SIZE,
+			SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(n <= 0)
+			break;
+		flags = SPLICE_F_MOVE | (done + n < size ? SPLICE_F_MORE : 0);
+		/* empty the pipe before filling it again */
+		while(n > 0) {
+			m = splice(p[0], NULL, to, NULL, n, flags);
+			if(m <= 0) {
+				ok = 0;
+				break;
+			}
+			n -= m;
+			done += m;
+		}
+	}
+	close(p[0]);
+	close(p[1]);
+	return done;
+}
+
+/* the same with read() and write(), through a buffer of ours */
+static unsigned long long copy_through(int from, int to, unsigned long long size)
+{
+	unsigned long long done = 0;
+	char *buf = malloc(COPY_SIZE);
+	ssize_t n, m, k;
+	int ok = 1;
+
+	while(ok && done < size) {
+		n = read(from, buf, size - done < COPY_SIZE ? size - done : COPY_SIZE);
+		if(n <= 0)
+			break;
+		for(m = 0; m < n; m += k) {
+			k = write(to, buf + m, n - m);
+			if(k <= 0) {
+				ok = 0;
+				break;
+			}
+			done += k;
+		}
+	}
+	free(buf);
+	return done;
+}
+
+/* both ends are in: @size bytes of @sender on to @recipient */
+static void relay(int sender, int recipient, unsigned long long size)
+{
+	struct timeval tv;
+	unsigned long long done;
+	unsigned long start = stats_now();
+
+	/* a peer that went away mid-transfer would hold the thread forever */
+	tv.tv_sec = RELAY_STALL_SECS;
+	tv.tv_usec = 0;
+	setsockopt(sender, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	setsockopt(recipient, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+	if(copy_bytes)
+		done = copy_through(sender, recipient, size);
+	else
+		done = splice_bytes(sender, recipient, size);
+	stat_inc(ST_FILES);
+	stat_add(ST_FILE_BYTES, done);
+	log_msg("relayed %llu of %llu bytes in %.3f s\n", done, size,
+		(stats_now() - start) / 1e9);
+	close(sender);
+	close(recipient);
+}
+
+/*
+* an end of a transfer, just accepted: read its hello and wait for the
+* other end in its slot. The end that comes last relays, in this thread
+*/
+static void *take_end(void *arg)
+{
+	char hello[RELAY_HELLO_SIZE];
+	struct relay_waiting *w;
+	struct timeval tv;
+	struct timespec deadline;
+	unsigned long long size;
+	unsigned long my_seq;
+	int fd = (int)(long)arg, end, other, sender, recipient;
+
+	tv.tv_sec = RELAY_HELLO_SECS;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof tv);
+	if(recv(fd, hello, sizeof hello, MSG_WAITALL) != sizeof hello
+		|| (hello[SESSION_TOKEN_SIZE] != RELAY_SENDER
+		&& hello[SESSION_TOKEN_SIZE] != RELAY_RECIPIENT)) {
+		close(fd);
+		return NULL;
+	}
+	end = hello[SESSION_TOKEN_SIZE] == RELAY_SENDER ? 0 : 1;
+	other = !end;
+
+	pthread_mutex_lock(&lock);
+	w = find_slot(hello);
+	if(w == NULL || w->fd[end] >= 0) {
+		pthread_mutex_unlock(&lock);
+		close(fd);
+		return NULL;
+	}
+	w->fd[end] = fd;
+	if(w->fd[other] < 0) {
+		/* first in: wait for the other end, or for the slot to go */
+		my_seq = w->seq;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += RELAY_WAIT_SECS;
+		while(w->used && w->seq == my_seq && w->fd[other] < 0)
+			if(pthread_cond_timedwait(&arrived, &lock, &deadline) == ETIMEDOUT)
+				break;
+		/* taken over by the other end, or given up on by somebody */
+		if(w->used && w->seq == my_seq && w->fd[other] < 0)
+			free_slot(w);
+		pthread_mutex_unlock(&lock);
+		return NULL;
+	}
+	/* last in: the ends are ours now, the slot is free again */
+	sender = w->fd[0];
+	recipient = w->fd[1];
+	size = w->size;
+	w->fd[0] = w->fd[1] = -1;
+	w->used = 0;
+	pthread_cond_broadcast(&arrived);
+	pthread_mutex_unlock(&lock);
+	relay(sender, recipient, size);
+	return NULL;
+}
+
+/* take in the ends of transfers, a thread for each */
+static void *relay_listener(void *arg)
+{
+	pthread_t thread;
+	int fd;
+
+	while(1) {
+		fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC);
+		if(fd < 0)
+			continue;
+		if(pthread_create(&thread, NULL, take_end, (void *)(long)fd) != 0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+int relay_init(unsigned short port, int copy)
+{
+	struct sockaddr_in addr;
+	pthread_t thread;
+	int one = 1;
+
+	listenfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(listenfd < 0)
+		return -1;
+	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(listenfd, (struct sockaddr *)&addr, sizeof addr) < 0
+		|| listen(listenfd, SOMAXCONN) < 0) {
+		close(listenfd);
+		listenfd = -1;
+		return -1;
+	}
+	listen_port = port;
+	copy_bytes = copy;
+	pthread_create(&thread, NULL, relay_listener, NULL);
+	pthread_detach(thread);
+	return 0;
+}
+
+unsigned short relay_port(void)
+{
+	return listen_port;
+}
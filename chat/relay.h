@@ -0,0 +1,61 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef RELAY_H
+#define RELAY_H
+
+#include "proto.h"
+
+/*
+* Files sent from one client to another, through the server.
+*
+* A chat msg is a frame: read into the ring of its sender, looked at,
+* copied into a frame for its recipient and written out again. That is
+* fine for a line of text, not for a log of a few GB. A file goes over
+* connections of its own instead, one from either end to the relay port
+* of the server (-X), and the server splices what comes in on the
+* sender's on to the recipient's through a pipe: the pages go from the
+* one socket into the pipe and from the pipe into the other socket, the
+* bytes are never copied into the server's memory nor out of it.
+*
+* `OP_FILE <recipient> <size> <name>` has the server make up a token for
+* the transfer, a random secret like a session token, and expect it.
+* The recipient is told about the file in an OP_OFFER, and the sender
+* gets the token in the OP_FILE_GO answering its frame. Both then
+* connect to the relay port, and say the token and which end they are.
+* Once both are in, the <size> bytes of the sender go on to the
+* recipient and both connections are closed. A connection that says
+* no token of ours, or whose other end does not come, is closed.
+*
+* Every transfer has a thread of its own, blocked in splice() most of
+* the time, whatever the mode of the server: the reactors never see the
+* bytes of a file go by, and a big one holds up nobody's chat.
+*/
+
+/* the hello: the token, and RELAY_SENDER or RELAY_RECIPIENT */
+#define RELAY_HELLO_SIZE (SESSION_TOKEN_SIZE + 1)
+#define RELAY_SENDER 'S'
+#define RELAY_RECIPIENT 'R'
+/* transfers expected and not yet under way at most, the oldest go first */
+#define RELAY_WAITING 64
+/* how long a hello may take, and an end waits for the other one */
+#define RELAY_HELLO_SECS 5
+#define RELAY_WAIT_SECS 30
+/* a transfer that moves nothing for this long is given up */
+#define RELAY_STALL_SECS 60
+/* the pipe between the two sockets, what one splice() moves at most */
+#define RELAY_PIPE_SIZE (1024 * 1024)
+
+/*
+* listen on @port for the ends of transfers. With @copy, the bytes are
+* read into a buffer and written out of it rather than spliced, to see
+* what splicing saves. returns 0, or -1
+*/
+int relay_init(unsigned short port, int copy);
+/* the port relay_init() listens on, 0 if it was never called */
+unsigned short relay_port(void);
+/* a transfer of @size bytes is coming, its ends will say @token */
+void relay_expect(const char *token, unsigned long long size);
+
+#endif
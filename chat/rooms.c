@@ -0,0 +1,144 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "rooms.h"
+#include "hash.h"
+
+/*
+* Rooms live in a chained hash table, a room comes to be when
+* somebody joins it and goes away when the last member leaves.
+* Members of a room are kept in an array so a broadcast is a plain
+* walk over it. Every member knows its slot, so leaving is O(1):
+* the last member is moved into the slot left behind.
+*/
+#define ROOM_BUCKETS 1024
+
+pthread_rwlock_t rooms_lock;
+static struct room *buckets[ROOM_BUCKETS];
+
+static unsigned int hash_room(const char *s)
+{
+	return fnv1a(s, strlen(s), FNV_SEED) & (ROOM_BUCKETS - 1);
+}
+
+void rooms_init(void)
+{
+	pthread_rwlock_init(&rooms_lock, NULL);
+}
+
+/* to be called with rooms_lock held */
+struct room *find_room(const char *name)
+{
+	struct room *r = buckets[hash_room(name)];
+	while(r && strcmp(r->name, name) != 0)
+		r = r->next;
+	return r;
+}
+
+/*
+* put @c in room @name, creating the room if need be
+* returns 1 if it joined, 0 if it already was a member
+*/
+int join_room(struct client_node *c, const char *name)
+{
+	struct membership *mb;
+	struct room *r;
+	unsigned int b;
+
+	/* the client's list of rooms is only touched by its own thread */
+	for(mb = c->rooms; mb; mb = mb->next)
+		if(strcmp(mb->room->name, name) == 0)
+			return 0;
+
+	pthread_rwlock_wrlock(&rooms_lock);
+	r = find_room(name);
+	if(r == NULL) {
+		r = calloc(1, sizeof(struct room));
+		strncpy(r->name, name, ROOM_MAX_SIZE - 1);
+		b = hash_room(r->name);
+		r->next = buckets[b];
+		buckets[b] = r;
+	}
+	if(r->nr == r->size) {
+		r->size = r->size ? r->size * 2 : 4;
+		r->members = realloc(r->members, r->size * sizeof(struct membership *));
+	}
+	mb = malloc(sizeof(struct membership));
+	mb->room = r;
+	mb->client = c;
+	mb->index = r->nr;
+	r->members[r->nr++] = mb;
+	pthread_rwlock_unlock(&rooms_lock);
+
+	mb->next = c->rooms;
+	c->rooms = mb;
+	return 1;
+}
+
+/* take the membership out of its room, and the room away if it is empty */
+static void unlink_member(struct membership *mb)
+{
+	struct room *r = mb->room, **pp;
+
+	r->members[mb->index] = r->members[--r->nr];
+	r->members[mb->index]->index = mb->index;
+	if(r->nr > 0)
+		return;
+	for(pp = &buckets[hash_room(r->name)]; *pp != r; pp = &(*pp)->next)
+		;
+	*pp = r->next;
+	free(r->members);
+	free(r);
+}
+
+/* returns 1 if @c left room @name, 0 if it was not in there */
+int leave_room(struct client_node *c, const char *name)
+{
+	struct membership *mb, **pp;
+
+	for(pp = &c->rooms; (mb = *pp) != NULL; pp = &mb->next)
+		if(strcmp(mb->room->name, name) == 0)
+			break;
+	if(mb == NULL)
+		return 0;
+	*pp = mb->next;
+
+	pthread_rwlock_wrlock(&rooms_lock);
+	unlink_member(mb);
+	pthread_rwlock_unlock(&rooms_lock);
+	free(mb);
+	return 1;
+}
+
+/* a client that goes away leaves every room it is in */
+void leave_all_rooms(struct client_node *c)
+{
+	struct membership *mb;
+
+	if(c->rooms == NULL)
+		return;
+	pthread_rwlock_wrlock(&rooms_lock);
+	while((mb = c->rooms) != NULL) {
+		c->rooms = mb->next;
+		unlink_member(mb);
+		free(mb);
+	}
+	pthread_rwlock_unlock(&rooms_lock);
+}
+
+/* @to takes the place of @from in every room @from is in, @to is in none */
+void move_rooms(struct client_node *from, struct client_node *to)
+{
+	struct membership *mb;
+
+	pthread_rwlock_wrlock(&rooms_lock);
+	for(mb = from->rooms; mb; mb = mb->next)
+		mb->client = to;
+	pthread_rwlock_unlock(&rooms_lock);
+	to->rooms = from->rooms;
+	from->rooms = NULL;
+}
@@ -0,0 +1,46 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef ROOMS_H
+#define ROOMS_H
+
+#include <pthread.h>
+#include "registry.h"
+
+#define ROOM_MAX_SIZE 20
+
+/*
+* A client being in a room.
+* It is on the client's list of rooms, and it is a slot in the
+* room's array of members, at @index.
+*/
+struct membership {
+	struct room *room;
+	struct client_node *client;
+	unsigned int index;
+	struct membership *next;
+};
+
+struct room {
+	char name[ROOM_MAX_SIZE];
+	struct membership **members;
+	unsigned int nr, size;
+	/* next room in the same hash bucket */
+	struct room *next;
+};
+
+/*
+* Joining and leaving take it for writing, fanning a msg out to
+* the members of a room takes it for reading.
+*/
+extern pthread_rwlock_t rooms_lock;
+
+void rooms_init(void);
+int join_room(struct client_node *c, const char *name);
+int leave_room(struct client_node *c, const char *name);
+void leave_all_rooms(struct client_node *c);
+void move_rooms(struct client_node *from, struct client_node *to);
+struct room *find_room(const char *name);
+
+#endif
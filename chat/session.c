@@ -0,0 +1,78 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stddef.h>
+#include <string.h>
+#include <sys/random.h>
+#include "session.h"
+#include "timer.h"
+
+int session_grace_ms = 0;
+static session_fn expire_fn;
+
+/* nobody resumed the session in time */
+static void session_expired(struct timer *t)
+{
+	struct client_node *c;
+
+	c = (struct client_node *)((char *)t - offsetof(struct client_node, sess_timer));
+	/* the reference that came with the timer goes along */
+	expire_fn(c);
+}
+
+int session_init(int grace_ms, session_fn expire)
+{
+	session_grace_ms = grace_ms;
+	expire_fn = expire;
+	return 0;
+}
+
+int session_token(char *buf)
+{
+	static const char hex[] = "0123456789abcdef";
+	unsigned char rnd[SESSION_TOKEN_SIZE / 2];
+	int i;
+
+	if(getrandom(rnd, sizeof rnd, 0) != sizeof rnd)
+		return -1;
+	for(i = 0; i < (int)sizeof rnd; i++) {
+		buf[2 * i] = hex[rnd[i] >> 4];
+		buf[2 * i + 1] = hex[rnd[i] & 15];
+	}
+	buf[SESSION_TOKEN_SIZE] = '\0';
+	return 0;
+}
+
+void session_new(struct client_node *c)
+{
+	if(session_token(c->session) < 0)
+		c->session[0] = '\0';
+}
+
+/*
+* compared in full however early they differ, so how long a wrong
+* guess takes tells nothing about how much of it was right
+*/
+int session_match(const char *session, const char *token, size_t len)
+{
+	unsigned char diff = 0;
+	size_t i;
+
+	if(len != SESSION_TOKEN_SIZE || session[0] == '\0')
+		return 0;
+	for(i = 0; i < len; i++)
+		diff |= session[i] ^ token[i];
+	return diff == 0;
+}
+
+void session_detach(struct client_node *c)
+{
+	timer_arm(&c->sess_timer, timer_now + timer_ticks(session_grace_ms),
+		session_expired);
+}
+
+int session_claim(struct client_node *c)
+{
+	return timer_del(&c->sess_timer);
+}
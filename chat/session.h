@@ -0,0 +1,55 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include "registry.h"
+
+/*
+* Sessions let a client whose connection broke pick up where it was.
+*
+* A client that registers is handed a token, a random secret, in an
+* OP_SESSION frame. Should its connection break without an `exit`, the
+* client is not dropped but detached: it keeps its name, its rooms and
+* its queue, and msgs to it are queued all the same, up to its high-water
+* mark. A new connection that says OP_RESUME with the name and the token
+* in time takes the detached client over and gets all that was queued;
+* nobody else, not the other nodes of a cluster either, ever hears it was
+* gone. Once the grace period is over, the client is dropped for good.
+*
+* A detached client's session ends when a timer on the timing wheel
+* (timer.h) fires, unless whoever resumes it stops the timer first.
+* timers_init() must have been called.
+*/
+
+/* how long a detached client waits to be resumed, 0 for no sessions */
+extern int session_grace_ms;
+
+/* what is done with a client whose session expired */
+typedef void (*session_fn)(struct client_node *c);
+
+int session_init(int grace_ms, session_fn expire);
+/* a fresh token for @c, before it is registered */
+void session_new(struct client_node *c);
+/*
+* SESSION_TOKEN_SIZE random hex digits and a '\0' into @buf, a secret
+* nobody can guess. returns 0, or -1 if there is no randomness to be had
+*/
+int session_token(char *buf);
+/*
+* is @token, @len bytes of it, the token @session, an empty one being
+* nobody's: does it resume a client's session, or claim a transfer
+*/
+int session_match(const char *session, const char *token, size_t len);
+/* @c was detached: its session expires in a grace period, unless claimed */
+void session_detach(struct client_node *c);
+/*
+* stop the timer of detached @c, and take over its reference.
+* returns 0 if it fired already, or another claimed it
+*/
+int session_claim(struct client_node *c);
+
+#endif
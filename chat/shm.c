@@ -0,0 +1,273 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "shm.h"
+
+/* the two rings, as mapped by both ends */
+struct shm_area {
+	struct shm_ring up;	/* client to server */
+	struct shm_ring down;	/* server to client */
+};
+
+static struct shm *shm_map(int memfd, int bell, int peer_bell, int server)
+{
+	struct shm_area *area;
+	struct shm *s;
+
+	area = mmap(NULL, sizeof *area, PROT_READ | PROT_WRITE, MAP_SHARED,
+		memfd, 0);
+	if(area == MAP_FAILED)
+		return NULL;
+	s = malloc(sizeof *s);
+	s->area = area;
+	s->rx = server ? &area->up : &area->down;
+	s->tx = server ? &area->down : &area->up;
+	s->bell = bell;
+	s->peer_bell = peer_bell;
+	return s;
+}
+
+struct shm *shm_create(int fds[SHM_NR_FDS])
+{
+	struct shm *s;
+	int memfd, bell, peer_bell;
+
+	memfd = memfd_create("chat-shm", MFD_CLOEXEC);
+	if(memfd < 0)
+		return NULL;
+	/* a fresh memfd reads as zeroes: empty rings, nobody sleeping */
+	if(ftruncate(memfd, sizeof(struct shm_area)) < 0) {
+		close(memfd);
+		return NULL;
+	}
+	bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	peer_bell = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	s = shm_map(memfd, bell, peer_bell, 1);
+	if(s == NULL) {
+		close(memfd);
+		close(bell);
+		close(peer_bell);
+		return NULL;
+	}
+	fds[0] = memfd;
+	fds[1] = peer_bell;
+	fds[2] = bell;
+	return s;
+}
+
+struct shm *shm_attach(const int fds[SHM_NR_FDS])
+{
+	struct shm *s = shm_map(fds[0], fds[1], fds[2], 0);
+
+	/* the mapping holds on to the memory */
+	close(fds[0]);
+	return s;
+}
+
+void shm_free(struct shm *s)
+{
+	munmap(s->area, sizeof(struct shm_area));
+	close(s->bell);
+	close(s->peer_bell);
+	free(s);
+}
+
+void shm_ack(struct shm *s)
+{
+	eventfd_t v;
+
+	eventfd_read(s->bell, &v);
+}
+
+/*
+* We moved our end of a ring, ring the other end's doorbell if it sleeps
+* on that. We moved it before looking at @sleeping, and the other end
+* says it sleeps before looking at our end one last time: one of us is
+* bound to see what the other did, so no wakeup is ever missed.
+*/
+static void wake(struct shm *s, volatile int *sleeping)
+{
+	__sync_synchronize();
+	if(*sleeping) {
+		*sleeping = 0;
+		eventfd_write(s->peer_bell, 1);
+	}
+}
+
+/*
+* bytes in ring @r, or -1 if the other end made a mess of it: it shares
+* the memory, so nothing it wrote there is taken for granted
+*/
+static long ring_used(struct shm_ring *r)
+{
+	unsigned long used = r->prod.tail - r->cons.head;
+
+	return used > SHM_RING_SIZE ? -1 : (long)used;
+}
+
+ssize_t shm_ring_read(struct shm *s, struct ringbuf *rb)
+{
+	struct shm_ring *r = s->rx;
+	unsigned long head = r->cons.head;
+	size_t space = rb->size - (rb->tail - rb->head), n, done, pos, piece;
+	long used = ring_used(r);
+
+	if(used == 0) {
+		/* going to sleep, unless something came in meanwhile */
+		r->cons.sleeping = 1;
+		__sync_synchronize();
+		used = ring_used(r);
+		if(used == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		r->cons.sleeping = 0;
+	}
+	if(used < 0) {
+		errno = EPROTO;
+		return -1;
+	}
+	/* the bytes are there, all of them, now that @tail says so */
+	__sync_synchronize();
+	n = (size_t)used < space ? (size_t)used : space;
+	for(done = 0; done < n; done += piece) {
+		/* a piece that wraps around neither the one ring nor the other */
+		pos = (head + done) & (SHM_RING_SIZE - 1);
+		piece = SHM_RING_SIZE - pos;
+		if(piece > n - done)
+			piece = n - done;
+		if(piece > rb->size - (rb->tail & (rb->size - 1)))
+			piece = rb->size - (rb->tail & (rb->size - 1));
+		memcpy(rb->buf + (rb->tail & (rb->size - 1)), r->buf + pos, piece);
+		rb->tail += piece;
+	}
+	/* done reading, only now may the producer reuse the room */
+	__sync_synchronize();
+	r->cons.head = head + n;
+	wake(s, &r->prod.sleeping);
+	return n;
+}
+
+ssize_t shm_writev(struct shm *s, const struct iovec *iov, int iovcnt)
+{
+	struct shm_ring *r = s->tx;
+	unsigned long tail = r->prod.tail;
+	size_t room, n = 0, take, pos, piece, off;
+	long used = ring_used(r);
+	int i;
+
+	if(used == SHM_RING_SIZE) {
+		r->prod.sleeping = 1;
+		__sync_synchronize();
+		used = ring_used(r);
+		if(used == SHM_RING_SIZE) {
+			errno = EAGAIN;
+			return -1;
+		}
+		r->prod.sleeping = 0;
+	}
+	if(used < 0) {
+		errno = EPROTO;
+		return -1;
+	}
+	/* the consumer is done with the room, now that @head says so */
+	__sync_synchronize();
+	room = SHM_RING_SIZE - used;
+	for(i = 0; i < iovcnt && n < room; i++) {
+		take = iov[i].iov_len < room - n ? iov[i].iov_len : room - n;
+		for(off = 0; off < take; off += piece) {
+			pos = (tail + n + off) & (SHM_RING_SIZE - 1);
+			piece = SHM_RING_SIZE - pos;
+			if(piece > take - off)
+				piece = take - off;
+			memcpy(r->buf + pos, (char *)iov[i].iov_base + off, piece);
+		}
+		n += take;
+	}
+	/* publish the bytes */
+	__sync_synchronize();
+	r->prod.tail = tail + n;
+	wake(s, &r->cons.sleeping);
+	return n;
+}
+
+int send_fds(int fd, const void *buf, size_t len, const int *fds, int nfds)
+{
+	union {
+		char buf[CMSG_SPACE(SHM_NR_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+
+	memset(&mh, 0, sizeof mh);
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if(nfds > 0) {
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cm), fds, nfds * sizeof(int));
+	}
+	return sendmsg(fd, &mh, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+ssize_t recv_fds(int fd, void *buf, size_t len, int *fds, int *nfds)
+{
+	union {
+		char buf[CMSG_SPACE(SHM_NR_FDS * sizeof(int))];
+		struct cmsghdr align;
+	} ctl;
+	struct msghdr mh;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	ssize_t n;
+
+	memset(&mh, 0, sizeof mh);
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = ctl.buf;
+	mh.msg_controllen = sizeof ctl.buf;
+	*nfds = 0;
+	n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	for(cm = CMSG_FIRSTHDR(&mh); n >= 0 && cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if(cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+			*nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cm), *nfds * sizeof(int));
+		}
+	}
+	return n;
+}
+
+struct shm *shm_connect(int fd)
+{
+	unsigned char hdr[FRAME_HDR_SIZE];
+	struct frame_hdr fh;
+	int fds[SHM_NR_FDS], nfds, i;
+
+	if(frame_write(fd, OP_SHM, 0, 0, NULL, 0) < 0
+		|| recv_fds(fd, hdr, sizeof hdr, fds, &nfds) != sizeof hdr)
+		return NULL;
+	frame_unpack(hdr, &fh);
+	if(fh.op == OP_SHM_READY && nfds == SHM_NR_FDS)
+		return shm_attach(fds);
+	for(i = 0; i < nfds; i++)
+		close(fds[i]);
+	return NULL;
+}
@@ -0,0 +1,97 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef SHM_H
+#define SHM_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "proto.h"
+
+/*
+* A transport for clients on the same host as the server, that takes no
+* syscall per frame: two rings of bytes in shared memory, one each way,
+* in place of the socket.
+*
+* A client connected over the server's unix socket asks for it with
+* OP_SHM, before it registers. The server answers with OP_SHM_READY, and
+* along with it (SCM_RIGHTS) a memfd with the rings in it and two
+* eventfds, the doorbells of either end. An OP_SHM_READY without them
+* means no, the client stays on its socket. Otherwise, from then on the
+* frames go through the rings, the very bytes that would have gone
+* through the socket, and are parsed by the same code. The socket carries
+* nothing anymore, it only tells either end the other one is gone.
+*
+* Each ring is a single producer, single consumer one: only the producer
+* moves @tail, only the consumer moves @head, with a barrier in between
+* the bytes and the move. An end with nothing to do, the consumer of an
+* empty ring or the producer of a full one, says so with a flag and then
+* sleeps on its doorbell. The other end rings it only when it sees the
+* flag, so as long as both ends are busy, nobody makes a syscall at all.
+* Both rings share the doorbell of an end: whoever is woken looks at both.
+*
+* Everything here is non-blocking: a ring with nothing in it, or no room,
+* says so with -1 and EAGAIN, as the socket would.
+*/
+
+/* bytes in each ring, a power of two */
+#define SHM_RING_SIZE (256 * 1024)
+
+/* what is handed to the client: the memfd, its doorbell, the server's */
+#define SHM_NR_FDS 3
+
+struct shm_ring {
+	struct {
+		volatile unsigned long head;
+		volatile int sleeping;
+	} cons __attribute__((aligned(64)));
+	struct {
+		volatile unsigned long tail;
+		volatile int sleeping;
+	} prod __attribute__((aligned(64)));
+	char buf[SHM_RING_SIZE] __attribute__((aligned(64)));
+};
+
+/* one end of a transport */
+struct shm {
+	/* both rings, mapped */
+	void *area;
+	/* the one we read and the one we write */
+	struct shm_ring *rx, *tx;
+	/* what we sleep on, and what wakes the other end */
+	int bell, peer_bell;
+};
+
+/*
+* server: a new transport. The fds to hand the client are put in @fds:
+* the memfd is to be closed once they are sent, the doorbells are ours too
+*/
+struct shm *shm_create(int fds[SHM_NR_FDS]);
+/* client: our end of the transport in @fds, from the server */
+struct shm *shm_attach(const int fds[SHM_NR_FDS]);
+/*
+* client: ask the server on the unix socket @fd to move us over, before
+* registering, and wait for the answer. returns NULL if it said no
+*/
+struct shm *shm_connect(int fd);
+void shm_free(struct shm *s);
+
+/*
+* our doorbell rang: clear it. Both rings must be looked at again after,
+* a ring that changed before goes unnoticed otherwise
+*/
+void shm_ack(struct shm *s);
+/* ring_read() and writev(), through @s */
+ssize_t shm_ring_read(struct shm *s, struct ringbuf *rb);
+ssize_t shm_writev(struct shm *s, const struct iovec *iov, int iovcnt);
+
+/* write @len bytes of @buf over the unix socket @fd, with @nfds of @fds */
+int send_fds(int fd, const void *buf, size_t len, const int *fds, int nfds);
+/*
+* read up to @len bytes into @buf, and the fds that came with them into
+* @fds, up to SHM_NR_FDS, their number in @nfds. Like read() otherwise
+*/
+ssize_t recv_fds(int fd, void *buf, size_t len, int *fds, int *nfds);
+
+#endif
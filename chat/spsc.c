@@ -0,0 +1,167 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+
+struct rec {
+	unsigned int len;	/* payload bytes, or REC_FILLER */
+	unsigned char op;
+	unsigned char big;	/* the payload is on the heap, a pointer to it follows */
+	unsigned short id;
+};
+
+#define REC_FILLER 0xffffffffu
+
+/* room a record takes in the ring, header and padding included */
+static size_t rec_size(size_t len, int big)
+{
+	if(big)
+		len = sizeof(char *);
+	return sizeof(struct rec) + ((len + 7) & ~(size_t)7);
+}
+
+int spsc_init(struct spsc *q, size_t size)
+{
+	memset(q, 0, sizeof *q);
+	q->buf = malloc(size);
+	q->size = size;
+	q->cons.waiter.efd = eventfd(0, 0);
+	q->prod.waiter.efd = eventfd(0, 0);
+	if(q->buf == NULL || q->cons.waiter.efd < 0 || q->prod.waiter.efd < 0)
+		return -1;
+	return 0;
+}
+
+/*
+* Sleep until @pos, which the other side moves, is no longer @seen.
+* We say we are sleeping before looking at @pos one last time, and the
+* other side moves @pos before looking at whether we are: one of us is
+* bound to see what the other did, so no wakeup is ever missed.
+* A wakeup meant for an earlier sleep may end this one early,
+* the callers look at @pos again anyway.
+*/
+static void wait_move(struct spsc_waiter *w, volatile size_t *pos, size_t seen)
+{
+	eventfd_t v;
+
+	w->sleeping = 1;
+	__sync_synchronize();
+	if(*pos == seen)
+		eventfd_read(w->efd, &v);
+	w->sleeping = 0;
+}
+
+/* we just moved our end, wake the other side if it waits for that */
+static void wake(struct spsc_waiter *w)
+{
+	__sync_synchronize();
+	if(w->sleeping)
+		eventfd_write(w->efd, 1);
+}
+
+void spsc_push(struct spsc *q, int op, int id, const char *payload, size_t len)
+{
+	struct rec *r;
+	size_t tail = q->prod.tail;
+	size_t pos = tail & (q->size - 1);
+	/* the big ones would hog the ring, or not even fit */
+	int big = len > q->size / 4;
+	size_t need = rec_size(len, big);
+	size_t room = need;
+	size_t head;
+	char *copy;
+
+	/* the record must not wrap, the rest of the ring would be a filler */
+	if(pos + need > q->size)
+		room += q->size - pos;
+	while(q->size - (tail - (head = q->cons.head)) < room) {
+		/* the consumer may not know yet what there is to make room */
+		wake(&q->cons.waiter);
+		wait_move(&q->prod.waiter, &q->cons.head, head);
+	}
+	__sync_synchronize();
+
+	if(pos + need > q->size) {
+		r = (struct rec *)(q->buf + pos);
+		r->len = REC_FILLER;
+		tail += q->size - pos;
+		pos = 0;
+	}
+	r = (struct rec *)(q->buf + pos);
+	r->len = len;
+	r->op = op;
+	r->id = id;
+	r->big = big;
+	if(big) {
+		copy = malloc(len);
+		memcpy(copy, payload, len);
+		memcpy(r + 1, &copy, sizeof copy);
+	} else if(len > 0) {
+		memcpy(r + 1, payload, len);
+	}
+
+	/* publish the record */
+	__sync_synchronize();
+	q->prod.tail = tail + need;
+}
+
+void spsc_wake(struct spsc *q)
+{
+	wake(&q->cons.waiter);
+}
+
+int spsc_peek(struct spsc *q, struct frame_hdr *fh, char **payload, int wait)
+{
+	struct rec *r;
+	size_t head = q->cons.head;
+	size_t pos;
+
+	while(1) {
+		if(head == q->prod.tail) {
+			if(!wait)
+				return 0;
+			wait_move(&q->cons.waiter, &q->prod.tail, head);
+			continue;
+		}
+		/* the record is there, and all of it, now that @tail says so */
+		__sync_synchronize();
+		pos = head & (q->size - 1);
+		r = (struct rec *)(q->buf + pos);
+		if(r->len != REC_FILLER)
+			break;
+		head += q->size - pos;
+		__sync_synchronize();
+		q->cons.head = head;
+		wake(&q->prod.waiter);
+	}
+
+	fh->len = r->len;
+	fh->op = r->op;
+	fh->flags = 0;
+	fh->id = r->id;
+	if(r->big)
+		memcpy(payload, r + 1, sizeof *payload);
+	else
+		*payload = (char *)(r + 1);
+	return 1;
+}
+
+void spsc_pop(struct spsc *q)
+{
+	size_t head = q->cons.head;
+	struct rec *r = (struct rec *)(q->buf + (head & (q->size - 1)));
+	char *copy;
+
+	if(r->big) {
+		memcpy(&copy, r + 1, sizeof copy);
+		free(copy);
+	}
+	/* done reading the record, only now may the producer reuse it */
+	__sync_synchronize();
+	q->cons.head = head + rec_size(r->len, r->big);
+	wake(&q->prod.waiter);
+}
@@ -0,0 +1,64 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+#include "proto.h"
+
+/*
+* A queue of frames from one thread to one other, that takes no lock.
+*
+* Frames are copied into a ring of bytes as records: a header, then the
+* payload, padded to 8 bytes. Only the producer moves @tail, only the
+* consumer moves @head, and they sit on cache lines of their own. The
+* producer writes a record and only then moves @tail past it, the
+* consumer reads it and only then moves @head, with a barrier in between
+* each time, so neither side ever sees a record half written.
+* A record does not wrap around the end of the ring, a filler takes up
+* what is left there. A payload too big for the ring travels on the heap
+* and the record only holds a pointer to it.
+*
+* A side with nothing to do, the consumer of an empty ring or the
+* producer of a full one, sleeps on an eventfd. The other side only
+* writes that eventfd when it sees the flag saying so, so as long as
+* there is work on both sides the queue costs no syscall at all.
+* The producer wakes the consumer once it pushed a batch of frames, not
+* for every one: woken for the first frame, the consumer would only find
+* that one, and go back to sleep right after.
+*/
+struct spsc_waiter {
+	volatile int sleeping;
+	int efd;
+};
+
+struct spsc {
+	char *buf;
+	size_t size;
+	struct {
+		volatile size_t head;
+		struct spsc_waiter waiter;
+	} cons __attribute__((aligned(64)));
+	struct {
+		volatile size_t tail;
+		struct spsc_waiter waiter;
+	} prod __attribute__((aligned(64)));
+};
+
+/* @size is a power of two */
+int spsc_init(struct spsc *q, size_t size);
+/* producer: queue a frame, waiting for room if the ring is full */
+void spsc_push(struct spsc *q, int op, int id, const char *payload, size_t len);
+/* producer: done pushing for now, wake the consumer if it sleeps */
+void spsc_wake(struct spsc *q);
+/*
+* consumer: the frame at the head of the queue, waiting for one if @wait.
+* returns 0 when there is none. The frame stays in the ring, and
+* @payload stays valid, until spsc_pop().
+*/
+int spsc_peek(struct spsc *q, struct frame_hdr *fh, char **payload, int wait);
+void spsc_pop(struct spsc *q);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "hist.h"
+#include "stats.h"
+
+/* enough for the reactors of a big box, threads beyond that share */
+#define STATS_STRIPES 16
+
+/*
+* struct hist, minus what cannot be updated with an atomic add:
+* the sum is in whole ns, and the min is not kept
+*/
+struct lat_hist {
+	unsigned long counts[HIST_BUCKETS];
+	unsigned long total, sum, max;
+};
+
+struct stripe {
+	unsigned long counters[ST_NR];
+	struct lat_hist lat[LAT_NR];
+} __attribute__((aligned(64)));
+
+static struct stripe stripes[STATS_STRIPES];
+static unsigned int next_stripe;
+static __thread struct stripe *my_stripe;
+static unsigned long start_ns;
+
+static const char *stat_names[ST_NR] = {
+	"accepts", "registers", "disconnects", "frames_in", "lookups",
+	"lookup_misses", "enqueued", "enqueue_drops", "parks", "writes",
+	"bytes_out", "stored", "unstored", "forwarded", "forwards_in",
+	"detached", "resumed", "pings", "evicted", "tls_handshakes", "tls_resumed",
+	"ktls", "shm", "intros", "files", "file_bytes", "packed", "pack_saved"
+};
+
+static const char *lat_names[LAT_NR] = {
+	"accept", "register", "lookup", "enqueue", "write"
+};
+
+void stats_init(void)
+{
+	start_ns = stats_now();
+}
+
+unsigned long stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static struct stripe *stripe(void)
+{
+	if(my_stripe == NULL)
+		my_stripe = &stripes[__sync_fetch_and_add(&next_stripe, 1)
+			% STATS_STRIPES];
+	return my_stripe;
+}
+
+void stat_add(enum stat_counter s, unsigned long n)
+{
+	__sync_fetch_and_add(&stripe()->counters[s], n);
+}
+
+void stat_lat(enum stat_lat l, unsigned long start)
+{
+	struct lat_hist *h = &stripe()->lat[l];
+	unsigned long v = stats_now() - start, max;
+
+	__sync_fetch_and_add(&h->counts[hist_bucket(v)], 1);
+	__sync_fetch_and_add(&h->total, 1);
+	__sync_fetch_and_add(&h->sum, v);
+	/* a new max is rare, the loop hardly ever goes round twice */
+	while(v > (max = h->max) && !__sync_bool_compare_and_swap(&h->max, max, v))
+		;
+}
+
+/* sum up histogram @l of every stripe, the way hist_merge() would */
+static void lat_snapshot(enum stat_lat l, struct hist *h)
+{
+	struct lat_hist *src;
+	unsigned int i, j;
+
+	hist_init(h);
+	for(i = 0; i < STATS_STRIPES; i++) {
+		src = &stripes[i].lat[l];
+		for(j = 0; j < HIST_BUCKETS; j++)
+			h->counts[j] += src->counts[j];
+		h->total += src->total;
+		h->sum += src->sum;
+		if(src->max > h->max)
+			h->max = src->max;
+	}
+}
+
+/* printf() at @len into @buf, never past @size */
+static size_t appendf(char *buf, size_t len, size_t size, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if(len >= size)
+		return len;
+	va_start(ap, fmt);
+	n = vsnprintf(buf + len, size - len, fmt, ap);
+	va_end(ap);
+	return n < 0 ? len : len + n;
+}
+
+/*
+* print into @buf what the stripes add up to right now.
+* They keep changing while we read them, so counters read a bit
+* apart may not quite add up, which is fine for a look at a live server.
+* returns the length of the text, it is cut short if @size is too small
+*/
+size_t stats_format(char *buf, size_t size)
+{
+	static struct hist h;
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	unsigned long sum;
+	size_t len = 0;
+	unsigned int i, j;
+
+	len = appendf(buf, len, size, "uptime %.1f secs\n",
+		(stats_now() - start_ns) / 1e9);
+	for(i = 0; i < ST_NR; i++) {
+		for(sum = 0, j = 0; j < STATS_STRIPES; j++)
+			sum += stripes[j].counters[i];
+		len = appendf(buf, len, size, "%-14s %lu\n", stat_names[i], sum);
+	}
+
+	len = appendf(buf, len, size, "%-9s %10s %9s %9s %9s %9s %9s %9s\n",
+		"usecs", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+	/* a struct hist is big, and this is no hot path: share one */
+	pthread_mutex_lock(&lock);
+	for(i = 0; i < LAT_NR; i++) {
+		lat_snapshot(i, &h);
+		len = appendf(buf, len, size,
+			"%-9s %10lu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", lat_names[i],
+			h.total, h.total ? h.sum / h.total / 1e3 : 0,
+			hist_percentile(&h, 50) / 1e3, hist_percentile(&h, 90) / 1e3,
+			hist_percentile(&h, 99) / 1e3, hist_percentile(&h, 99.9) / 1e3,
+			h.max / 1e3);
+	}
+	pthread_mutex_unlock(&lock);
+	return len < size ? len : size - 1;
+}
@@ -0,0 +1,71 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+/*
+* Counters and latency histograms of the server.
+* They are kept in a handful of stripes, each on cache lines of its own.
+* A thread picks a stripe the first time it counts something and sticks
+* to it, so a reactor has one to itself and never shares a cache line
+* with another. In thread mode the client threads take turns on the
+* stripes, which keeps their memory bounded however many there are.
+* Everything is updated with atomic adds, no lock is ever taken,
+* and a reader just sums up the stripes.
+*/
+enum stat_counter {
+	ST_ACCEPTS,		/* connections accepted */
+	ST_REGISTERS,		/* usernames taken */
+	ST_DISCONNECTS,		/* clients dropped, for whatever reason */
+	ST_FRAMES_IN,		/* frames handled */
+	ST_LOOKUPS,		/* usernames looked up by `send` */
+	ST_LOOKUP_MISSES,	/* ... of users not connected */
+	ST_ENQUEUED,		/* frames queued for a client */
+	ST_ENQUEUE_DROPS,	/* ... or not, the queue being full */
+	ST_PARKS,		/* senders stalled on a full queue */
+	ST_WRITES,		/* sendmsg()s of queued frames */
+	ST_BYTES_OUT,		/* bytes they wrote */
+	ST_STORED,		/* msgs kept for users offline, see store.h */
+	ST_UNSTORED,		/* ... and handed to them once they were back */
+	ST_FORWARDED,		/* msgs sent on to the node of their recipient */
+	ST_FORWARDS_IN,		/* ... and those other nodes sent on to us */
+	ST_DETACHES,		/* clients that lost their connection, see session.h */
+	ST_RESUMES,		/* ... and came back in time */
+	ST_PINGS,		/* OP_PINGs to clients gone quiet */
+	ST_EVICTIONS,		/* ... and connections cut for never answering, or idling */
+	ST_TLS_HANDSHAKES,	/* TLS handshakes done, see tls.h */
+	ST_TLS_RESUMED,		/* ... of them with a session ticket */
+	ST_KTLS,		/* ... and those the kernel took over */
+	ST_SHM,			/* local clients moved over to shared memory, see shm.h */
+	ST_INTROS,		/* clients introduced to each other for a direct link */
+	ST_FILES,		/* files relayed from one client to another, see relay.h */
+	ST_FILE_BYTES,		/* ... and their bytes */
+	ST_PACKED,		/* msgs packed, once however many they went to, see lz.h */
+	ST_PACK_SAVED,		/* bytes packing spared the msgs queued */
+	ST_NR
+};
+
+enum stat_lat {
+	LAT_ACCEPT,		/* setting up a client just accepted */
+	LAT_REGISTER,		/* taking its username */
+	LAT_LOOKUP,		/* finding the recipient of a `send` */
+	LAT_ENQUEUE,		/* queueing a frame, waiting for the queue lock too */
+	LAT_WRITE,		/* a sendmsg(), in uring mode until it completes */
+	LAT_NR
+};
+
+void stats_init(void);
+/* a monotonic clock in ns, what latencies are measured with */
+unsigned long stats_now(void);
+void stat_add(enum stat_counter s, unsigned long n);
+#define stat_inc(s) stat_add(s, 1)
+/* record the time since @start, a stats_now() */
+void stat_lat(enum stat_lat l, unsigned long start);
+/* the lot as text, one line per counter and per histogram */
+size_t stats_format(char *buf, size_t size);
+
+#endif
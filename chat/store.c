@@ -0,0 +1,519 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "registry.h"
+#include "hash.h"
+#include "store.h"
+
+/*
+* A segment file is a header (SEG_MAGIC) followed by records, each
+* starting on an 8 byte boundary. A record is a struct rec_hdr, the
+* recipient's name and the payload. A header of zeroes ends the log:
+* the file is zeroes to begin with, and every append zeroes the header
+* after its record too.
+* @sum covers the name and the payload, so a record the machine went down
+* in the middle of writing is told apart from a whole one. The log is
+* read up to the first record that does not add up.
+*/
+#define SEG_SIZE (16UL << 20)
+#define SEG_MAGIC "chatseg1"
+#define SEG_HDR 8
+
+#define REC_DELIVERED 1
+
+struct rec_hdr {
+	unsigned int len;
+	unsigned int sum;
+	unsigned char flags;
+	unsigned char namelen;
+	unsigned short pad;
+};
+
+#define REC_SIZE(namelen, len) \
+	((sizeof(struct rec_hdr) + (namelen) + (len) + 7) & ~7UL)
+
+struct segment {
+	unsigned int no;
+	int fd;
+	char *base;
+	/* where the next record goes */
+	size_t tail;
+	/* records in here not delivered yet */
+	unsigned long live;
+	/* written to since the last fdatasync() */
+	int dirty;
+	struct segment *next;
+};
+
+/* a msg waiting in a mailbox, at @off in @seg */
+struct rec_ref {
+	struct segment *seg;
+	size_t off;
+	struct rec_ref *next;
+};
+
+/*
+* The msgs waiting for one user, oldest first.
+* Those before @unsent were handed to @sent_to, and are waiting to be
+* written to it, @unsent is NULL once all of them were handed over.
+* @owner is the client of that name once it is online and has been
+* handed everything: nothing is stored for it while it is.
+*/
+struct mailbox {
+	char name[USERNAME_MAX_SIZE];
+	struct rec_ref *head, *tail, *unsent;
+	void *sent_to;
+	void *owner;
+	struct mailbox *next;
+};
+
+#define MAILBOXES 4096
+
+/*
+* Everything below is protected by @store_lock. Storing is what happens
+* to msgs that could not be sent, it is never on the way of one that can.
+*/
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char *store_dir;
+static int store_sync_ms;
+/* the segments, oldest first; the last one is appended to */
+static struct segment *segs, *active;
+static struct mailbox *mailboxes[MAILBOXES];
+
+static struct mailbox *mailbox_get(const char *name, int create)
+{
+	struct mailbox **head, *mb;
+
+	head = &mailboxes[fnv1a(name, strlen(name), FNV_SEED) % MAILBOXES];
+	for(mb = *head; mb; mb = mb->next)
+		if(strcmp(mb->name, name) == 0)
+			return mb;
+	if(!create)
+		return NULL;
+	mb = calloc(1, sizeof *mb);
+	strcpy(mb->name, name);
+	mb->next = *head;
+	*head = mb;
+	return mb;
+}
+
+/* a mailbox with nothing in it and nobody online goes */
+static void mailbox_put(struct mailbox *mb)
+{
+	struct mailbox **p;
+
+	if(mb->head || mb->owner)
+		return;
+	p = &mailboxes[fnv1a(mb->name, strlen(mb->name), FNV_SEED) % MAILBOXES];
+	while(*p != mb)
+		p = &(*p)->next;
+	*p = mb->next;
+	free(mb);
+}
+
+static void mailbox_add(struct mailbox *mb, struct segment *seg, size_t off)
+{
+	struct rec_ref *ref = malloc(sizeof *ref);
+
+	ref->seg = seg;
+	ref->off = off;
+	ref->next = NULL;
+	if(mb->tail)
+		mb->tail->next = ref;
+	else
+		mb->head = ref;
+	mb->tail = ref;
+	if(mb->unsent == NULL)
+		mb->unsent = ref;
+	seg->live++;
+}
+
+/* what store_written() is told by, segment number and offset in one */
+static unsigned long long rec_id(const struct rec_ref *ref)
+{
+	return (unsigned long long)ref->seg->no << 32 | ref->off;
+}
+
+static void seg_path(char *path, size_t size, unsigned int no)
+{
+	snprintf(path, size, "%s/%08u.seg", store_dir, no);
+}
+
+/* map segment number @no, a new and empty one if @create */
+static struct segment *seg_map(unsigned int no, int create)
+{
+	struct segment *seg;
+	char path[4096];
+	int fd;
+	char *base;
+
+	seg_path(path, sizeof path, no);
+	fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0),
+		0600);
+	if(fd < 0)
+		return NULL;
+	if(create && ftruncate(fd, SEG_SIZE) < 0) {
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	base = mmap(NULL, SEG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(base == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	if(create)
+		memcpy(base, SEG_MAGIC, SEG_HDR);
+	seg = calloc(1, sizeof *seg);
+	seg->no = no;
+	seg->fd = fd;
+	seg->base = base;
+	seg->tail = SEG_HDR;
+	seg->dirty = create;
+	return seg;
+}
+
+static void seg_append(struct segment *seg)
+{
+	struct segment **p = &segs;
+
+	while(*p)
+		p = &(*p)->next;
+	*p = seg;
+	active = seg;
+}
+
+static int is_whole(struct segment *seg, size_t off)
+{
+	struct rec_hdr *hdr = (struct rec_hdr *)(seg->base + off);
+	char *name = (char *)(hdr + 1);
+
+	if(off + sizeof *hdr > SEG_SIZE || hdr->namelen == 0
+		|| hdr->namelen >= USERNAME_MAX_SIZE
+		|| off + REC_SIZE(hdr->namelen, hdr->len) > SEG_SIZE)
+		return 0;
+	return hdr->sum == fnv1a(name + hdr->namelen, hdr->len,
+		fnv1a(name, hdr->namelen, FNV_SEED));
+}
+
+/* read the records of @seg into the mailboxes */
+static void seg_replay(struct segment *seg)
+{
+	char name[USERNAME_MAX_SIZE];
+	struct rec_hdr *hdr;
+	size_t off = SEG_HDR;
+
+	while(is_whole(seg, off)) {
+		hdr = (struct rec_hdr *)(seg->base + off);
+		if(!(hdr->flags & REC_DELIVERED)) {
+			memcpy(name, hdr + 1, hdr->namelen);
+			name[hdr->namelen] = '\0';
+			mailbox_add(mailbox_get(name, 1), seg, off);
+		}
+		off += REC_SIZE(hdr->namelen, hdr->len);
+	}
+	seg->tail = off;
+}
+
+static int cmp_uint(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a, y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+/* map every segment in the store's dir, oldest first, and replay them */
+static int replay(void)
+{
+	unsigned int *nos = NULL, no;
+	size_t nr = 0, size = 0, i;
+	struct segment *seg;
+	struct dirent *de;
+	DIR *dir;
+	char end;
+
+	if((dir = opendir(store_dir)) == NULL)
+		return -1;
+	while((de = readdir(dir)) != NULL) {
+		if(sscanf(de->d_name, "%u.se%c", &no, &end) != 2 || end != 'g')
+			continue;
+		if(nr == size) {
+			size = size ? 2 * size : 16;
+			nos = realloc(nos, size * sizeof *nos);
+		}
+		nos[nr++] = no;
+	}
+	closedir(dir);
+	qsort(nos, nr, sizeof *nos, cmp_uint);
+
+	for(i = 0; i < nr; i++) {
+		if((seg = seg_map(nos[i], 0)) == NULL)
+			continue;
+		if(memcmp(seg->base, SEG_MAGIC, SEG_HDR) != 0) {
+			fprintf(stderr, "store: segment %u is not one of ours\n", nos[i]);
+			munmap(seg->base, SEG_SIZE);
+			close(seg->fd);
+			free(seg);
+			continue;
+		}
+		seg_replay(seg);
+		seg_append(seg);
+	}
+	free(nos);
+	return 0;
+}
+
+/*
+* Every @store_sync_ms, make what was written to the segments durable,
+* one fdatasync() per segment for however many msgs went in. Then remove
+* the segments everything in which was delivered. Only this thread ever
+* closes a segment, so it may sync without holding the lock.
+*/
+static void *store_sync(void *arg)
+{
+	struct segment *seg, **p;
+	int *fds = NULL;
+	size_t nr, size = 0, i;
+	char path[4096];
+
+	while(1) {
+		usleep(store_sync_ms * 1000);
+
+		pthread_mutex_lock(&store_lock);
+		for(nr = 0, seg = segs; seg; seg = seg->next) {
+			if(!seg->dirty)
+				continue;
+			if(nr == size) {
+				size = size ? 2 * size : 16;
+				fds = realloc(fds, size * sizeof *fds);
+			}
+			fds[nr++] = seg->fd;
+			seg->dirty = 0;
+		}
+		pthread_mutex_unlock(&store_lock);
+		for(i = 0; i < nr; i++)
+			fdatasync(fds[i]);
+
+		pthread_mutex_lock(&store_lock);
+		for(p = &segs; (seg = *p) != NULL; ) {
+			if(seg->live > 0 || seg == active || seg->dirty) {
+				p = &seg->next;
+				continue;
+			}
+			*p = seg->next;
+			munmap(seg->base, SEG_SIZE);
+			close(seg->fd);
+			seg_path(path, sizeof path, seg->no);
+			unlink(path);
+			free(seg);
+		}
+		pthread_mutex_unlock(&store_lock);
+	}
+	return NULL;
+}
+
+/*
+* open the store in @dir, creating it if need be, and read back what
+* is in there. Writes are synced every @sync_ms.
+* returns 0, or -1 with errno set
+*/
+int store_open(const char *dir, int sync_ms)
+{
+	pthread_t thread;
+	struct segment *seg;
+
+	store_dir = dir;
+	store_sync_ms = sync_ms > 0 ? sync_ms : 1;
+	mkdir(dir, 0700);
+	if(replay() < 0)
+		return -1;
+	if(active == NULL) {
+		if((seg = seg_map(1, 1)) == NULL)
+			return -1;
+		seg_append(seg);
+	}
+	pthread_create(&thread, NULL, store_sync, NULL);
+	pthread_detach(thread);
+	return 0;
+}
+
+/*
+* keep the msg @payload for user @name.
+* returns STORE_STORED, STORE_ONLINE if @name has come online meanwhile
+* (look it up again and send it the msg), or STORE_FULL
+*/
+int store_put(const char *name, const char *payload, size_t len)
+{
+	struct mailbox *mb;
+	struct segment *seg;
+	struct rec_hdr *hdr;
+	size_t namelen = strlen(name), size = REC_SIZE(namelen, len);
+	char *p;
+
+	if(namelen == 0 || namelen >= USERNAME_MAX_SIZE
+		|| SEG_HDR + size + sizeof *hdr > SEG_SIZE)
+		return STORE_FULL;
+	pthread_mutex_lock(&store_lock);
+	mb = mailbox_get(name, 1);
+	if(mb->owner) {
+		pthread_mutex_unlock(&store_lock);
+		return STORE_ONLINE;
+	}
+	/* a record and the end of the log after it have to fit */
+	if(active->tail + size + sizeof *hdr > SEG_SIZE) {
+		if((seg = seg_map(active->no + 1, 1)) == NULL) {
+			mailbox_put(mb);
+			pthread_mutex_unlock(&store_lock);
+			return STORE_FULL;
+		}
+		seg_append(seg);
+	}
+
+	seg = active;
+	hdr = (struct rec_hdr *)(seg->base + seg->tail);
+	p = (char *)(hdr + 1);
+	memcpy(p, name, namelen);
+	memcpy(p + namelen, payload, len);
+	memset(seg->base + seg->tail + size, 0, sizeof *hdr);
+	hdr->len = len;
+	hdr->flags = 0;
+	hdr->pad = 0;
+	hdr->namelen = namelen;
+	hdr->sum = fnv1a(payload, len, fnv1a(name, namelen, FNV_SEED));
+	mailbox_add(mb, seg, seg->tail);
+	seg->tail += size;
+	seg->dirty = 1;
+	pthread_mutex_unlock(&store_lock);
+	return STORE_STORED;
+}
+
+/*
+* Hand the msgs kept for @name to @fn, oldest first, for @owner, the
+* client of that name, to write out. They are kept until store_written()
+* says they were. @max caps the payload bytes handed over, one msg always
+* goes however large, and none goes once @fn could not queue one.
+* Once everything was handed over, @owner is the user online: msgs to
+* @name are not stored until store_offline() is called for it.
+* Until then, the ones stored meanwhile queue up after the others,
+* in the order they were sent.
+* returns 1 if there is more left, 0 if that was all of it
+*/
+int store_deliver(const char *name, void *owner, size_t max,
+	store_fn fn, void *arg)
+{
+	struct mailbox *mb;
+	struct rec_ref *ref;
+	struct rec_hdr *hdr;
+	size_t sent = 0;
+	int more;
+
+	pthread_mutex_lock(&store_lock);
+	mb = mailbox_get(name, 1);
+	while((ref = mb->unsent) != NULL) {
+		hdr = (struct rec_hdr *)(ref->seg->base + ref->off);
+		if(sent > 0 && sent + hdr->len > max)
+			break;
+		if(fn(arg, (char *)(hdr + 1) + hdr->namelen, hdr->len,
+			rec_id(ref)) < 0)
+			break;
+		sent += hdr->len;
+		mb->sent_to = owner;
+		mb->unsent = ref->next;
+	}
+	more = mb->unsent != NULL;
+	if(!more)
+		mb->owner = owner;
+	pthread_mutex_unlock(&store_lock);
+	return more;
+}
+
+/*
+* The msgs of @name at @recs, handed out by store_deliver(), were
+* written to the client: flag them delivered, and forget them.
+* One the client was handed again meanwhile is flagged all the same,
+* it would only go out twice.
+*/
+void store_written(const char *name, const unsigned long long *recs, int nr)
+{
+	struct mailbox *mb;
+	struct rec_ref *ref, *prev;
+	struct rec_hdr *hdr;
+	int i;
+
+	pthread_mutex_lock(&store_lock);
+	mb = mailbox_get(name, 0);
+	for(i = 0; mb && i < nr; i++) {
+		/* written in the order they were handed, mostly the first */
+		for(prev = NULL, ref = mb->head; ref && rec_id(ref) != recs[i];
+			prev = ref, ref = ref->next)
+			;
+		if(ref == NULL)
+			continue;
+		hdr = (struct rec_hdr *)(ref->seg->base + ref->off);
+		hdr->flags |= REC_DELIVERED;
+		ref->seg->live--;
+		ref->seg->dirty = 1;
+		if(prev)
+			prev->next = ref->next;
+		else
+			mb->head = ref->next;
+		if(mb->tail == ref)
+			mb->tail = prev;
+		if(mb->unsent == ref)
+			mb->unsent = ref->next;
+		free(ref);
+	}
+	if(mb)
+		mailbox_put(mb);
+	pthread_mutex_unlock(&store_lock);
+}
+
+/*
+* @owner, the user @name, is going offline: store msgs to @name again,
+* and what it was handed but did not write out is to be handed again
+*/
+void store_offline(const char *name, void *owner)
+{
+	struct mailbox *mb;
+
+	pthread_mutex_lock(&store_lock);
+	mb = mailbox_get(name, 0);
+	if(mb && mb->sent_to == owner) {
+		mb->sent_to = NULL;
+		mb->unsent = mb->head;
+	}
+	if(mb && mb->owner == owner) {
+		mb->owner = NULL;
+		mailbox_put(mb);
+	}
+	pthread_mutex_unlock(&store_lock);
+}
+
+/*
+* @owner resumed the session of @old, and took over its queue: what @old
+* was handed is for @owner to write out now. Until it was handed the rest,
+* msgs to @name are stored again
+*/
+void store_handover(const char *name, void *old, void *owner)
+{
+	struct mailbox *mb;
+
+	pthread_mutex_lock(&store_lock);
+	mb = mailbox_get(name, 0);
+	if(mb && mb->sent_to == old)
+		mb->sent_to = owner;
+	if(mb && mb->owner == old) {
+		mb->owner = NULL;
+		mailbox_put(mb);
+	}
+	pthread_mutex_unlock(&store_lock);
+}
@@ -0,0 +1,47 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+/*
+* The offline store: msgs to users who are not online, kept until
+* they come back.
+* It is an append-only log split into segment files of a fixed size,
+* each mapped into memory, so storing a msg is a memcpy() into the
+* current segment. The kernel writes the pages out, and a thread of
+* the store's own fdatasync()s whatever segments were written to every
+* so often: msgs stored in between are made durable together.
+* A msg is only flagged delivered in its record once it was written to
+* its recipient: one handed to a client who is gone before it went out
+* is handed out again, to whoever comes online by that name next.
+* A segment is deleted once everything in it was delivered.
+* In memory, every user with msgs waiting has a mailbox listing them.
+* The log is read back into the mailboxes when the server starts.
+*/
+
+/* what store_put() did with the msg */
+#define STORE_STORED 0
+#define STORE_ONLINE 1	/* nothing, its recipient is online after all */
+#define STORE_FULL   2	/* nothing, there was no room for it */
+
+/*
+* called by store_deliver() with every msg, the payload of an OP_MSG, and
+* @rec, which record it is, for store_written().
+* returns 0 if it queued the msg, -1 if it could not
+*/
+typedef int (*store_fn)(void *arg, const char *payload, size_t len,
+	unsigned long long rec);
+
+int store_open(const char *dir, int sync_ms);
+int store_put(const char *name, const char *payload, size_t len);
+int store_deliver(const char *name, void *owner, size_t max,
+	store_fn fn, void *arg);
+void store_written(const char *name, const unsigned long long *recs, int nr);
+void store_offline(const char *name, void *owner);
+void store_handover(const char *name, void *old, void *owner);
+
+#endif
@@ -0,0 +1,171 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+
+#define TICK_NS (TIMER_TICK_MS * 1000000UL)
+#define SLOT_MASK (TIMER_SLOTS - 1)
+/* the furthest a timer may be from now, later ones are moved closer */
+#define MAX_DELTA ((1UL << (TIMER_BITS * TIMER_LEVELS)) - 1)
+
+volatile unsigned long timer_now;
+
+/*
+* @lock protects the slots, the timers due, and whatever timer is
+* pending. @wheel_now is the tick the wheel is at.
+*/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+static struct timer *due;
+static unsigned long wheel_now;
+
+static unsigned long clock_ticks(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000000UL + ts.tv_nsec) / TICK_NS;
+}
+
+static void list_add(struct timer **head, struct timer *t)
+{
+	t->next = *head;
+	if(*head)
+		(*head)->pprev = &t->next;
+	*head = t;
+	t->pprev = head;
+}
+
+static void list_del(struct timer *t)
+{
+	*t->pprev = t->next;
+	if(t->next)
+		t->next->pprev = t->pprev;
+	t->pprev = NULL;
+}
+
+/* put @t in the slot for its tick, on the lowest level that reaches it */
+static void enqueue(struct timer *t)
+{
+	unsigned long delta = t->expires - wheel_now;
+	int level = 0;
+
+	if(delta > MAX_DELTA) {
+		t->expires = wheel_now + MAX_DELTA;
+		delta = MAX_DELTA;
+	}
+	while(level < TIMER_LEVELS - 1 && delta >= 1UL << (TIMER_BITS * (level + 1)))
+		level++;
+	list_add(&slots[level][(t->expires >> (TIMER_BITS * level)) & SLOT_MASK], t);
+}
+
+/*
+* the wheel is at the start of a new round of the level below @level:
+* move the timers of the slot of @level that begins now down to it
+*/
+static void cascade(int level)
+{
+	struct timer **slot, *t;
+
+	slot = &slots[level][(wheel_now >> (TIMER_BITS * level)) & SLOT_MASK];
+	while((t = *slot) != NULL) {
+		list_del(t);
+		enqueue(t);
+	}
+}
+
+/* one tick on, the timers due then go on the list of those due */
+static void tick(void)
+{
+	struct timer **slot, *t;
+	int level;
+
+	wheel_now++;
+	for(level = 1; level < TIMER_LEVELS; level++) {
+		if(wheel_now & ((1UL << (TIMER_BITS * level)) - 1))
+			break;
+		cascade(level);
+	}
+	slot = &slots[0][wheel_now & SLOT_MASK];
+	while((t = *slot) != NULL) {
+		list_del(t);
+		list_add(&due, t);
+	}
+}
+
+static void *turn_wheel(void *arg)
+{
+	struct timespec next;
+	unsigned long now;
+	struct timer *t;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while(1) {
+		next.tv_nsec += TICK_NS;
+		if(next.tv_nsec >= 1000000000L) {
+			next.tv_sec++;
+			next.tv_nsec -= 1000000000L;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+		/* catch up on every tick there was, should we have slept longer */
+		now = clock_ticks();
+		pthread_mutex_lock(&lock);
+		while(wheel_now < now)
+			tick();
+		timer_now = wheel_now;
+		while((t = due) != NULL) {
+			list_del(t);
+			pthread_mutex_unlock(&lock);
+			t->fn(t);
+			pthread_mutex_lock(&lock);
+		}
+		pthread_mutex_unlock(&lock);
+	}
+	return NULL;
+}
+
+int timers_init(void)
+{
+	pthread_t thread;
+
+	wheel_now = timer_now = clock_ticks();
+	if(pthread_create(&thread, NULL, turn_wheel, NULL) != 0)
+		return -1;
+	pthread_detach(thread);
+	return 0;
+}
+
+unsigned long timer_ticks(unsigned long ms)
+{
+	return (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+}
+
+void timer_arm(struct timer *t, unsigned long expires, timer_fn fn)
+{
+	pthread_mutex_lock(&lock);
+	if(t->pprev)
+		list_del(t);
+	/* the slot of the current tick is done with, the next one is the soonest */
+	if((long)(expires - wheel_now) <= 0)
+		expires = wheel_now + 1;
+	t->expires = expires;
+	t->fn = fn;
+	enqueue(t);
+	pthread_mutex_unlock(&lock);
+}
+
+int timer_del(struct timer *t)
+{
+	int pending;
+
+	pthread_mutex_lock(&lock);
+	pending = t->pprev != NULL;
+	if(pending)
+		list_del(t);
+	pthread_mutex_unlock(&lock);
+	return pending;
+}
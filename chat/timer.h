@@ -0,0 +1,56 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef TIMER_H
+#define TIMER_H
+
+/*
+* A hierarchical timing wheel, for as many timers as there are clients.
+*
+* Time goes by in ticks of TIMER_TICK_MS. The wheel has TIMER_LEVELS
+* levels of TIMER_SLOTS slots: a timer due within TIMER_SLOTS ticks waits
+* in the slot of level 0 for its tick, one due later in a slot of a level
+* above, whose slots span TIMER_SLOTS times as many ticks as those of the
+* level below. Every time a level went round once, the next slot of the
+* level above is emptied into it, so a timer is moved at most once per
+* level on its way down. Arming and disarming a timer is O(1), and a tick
+* only ever looks at the timers due then, however many there are in all.
+*
+* A thread of its own turns the wheel. It takes every timer due off the
+* wheel in one go, and then runs them one after the other, with no lock
+* held: a callback may arm timers, its own as well. A timer is pending
+* until its callback is about to run, timer_del() may still stop it then.
+*/
+#define TIMER_TICK_MS 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 4
+
+struct timer;
+typedef void (*timer_fn)(struct timer *t);
+
+/* embedded in whatever it is the timer of */
+struct timer {
+	/* the tick it is due at */
+	unsigned long expires;
+	timer_fn fn;
+	/* on a list of the wheel while pending, @pprev is NULL otherwise */
+	struct timer *next, **pprev;
+};
+
+/*
+* the current tick, as of the last turn of the wheel: a clock so cheap
+* it may be read on every frame
+*/
+extern volatile unsigned long timer_now;
+
+int timers_init(void);
+/* ticks in @ms, rounded up */
+unsigned long timer_ticks(unsigned long ms);
+/* have @fn called at tick @expires, re-arming @t if it is pending */
+void timer_arm(struct timer *t, unsigned long expires, timer_fn fn);
+/* returns 1 if @t was pending, and will not fire now */
+int timer_del(struct timer *t);
+
+#endif
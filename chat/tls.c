@@ -0,0 +1,382 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <openssl/err.h>
+#include "tls.h"
+
+/* the most plaintext a TLS record carries */
+#define TLS_RECORD_MAX 16384
+
+/* the server's, or the client's */
+static SSL_CTX *ctx;
+
+/* what both ends have in common */
+static void ctx_setup(void)
+{
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	/*
+	* kTLS where the kernel has it, a peer hanging up without a
+	* close_notify is just hanging up, and a write that did not go out
+	* whole may be retried with the queue it came from, wherever the
+	* frames are by then
+	*/
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+		| SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+}
+
+int tls_server_init(const char *pem)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if(ctx == NULL)
+		return -1;
+	if(SSL_CTX_use_certificate_chain_file(ctx, pem) != 1
+		|| SSL_CTX_use_PrivateKey_file(ctx, pem, SSL_FILETYPE_PEM) != 1) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	/* tickets only, no cache for the reactors to share */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+	/* a client resumes one connection at a time, one ticket will do */
+	SSL_CTX_set_num_tickets(ctx, 1);
+	ctx_setup();
+	return 0;
+}
+
+/* a ticket came in for a client: it is the one to resume with next */
+static int new_ticket(SSL *ssl, SSL_SESSION *sess)
+{
+	struct tls *t = (struct tls *)SSL_get_app_data(ssl);
+
+	if(t->ticket)
+		SSL_SESSION_free(t->ticket);
+	t->ticket = sess;
+	/* we keep the reference we were given */
+	return 1;
+}
+
+int tls_client_init(const char *ca)
+{
+	ctx = SSL_CTX_new(TLS_client_method());
+	if(ctx == NULL)
+		return -1;
+	if(SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) {
+		ERR_print_errors_fp(stderr);
+		return -1;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	/* every struct tls keeps its own ticket, OpenSSL keeps none */
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT
+		| SSL_SESS_CACHE_NO_INTERNAL_STORE);
+	SSL_CTX_sess_set_new_cb(ctx, new_ticket);
+	ctx_setup();
+	return 0;
+}
+
+static struct tls *tls_alloc(int fd)
+{
+	struct tls *t = calloc(1, sizeof *t);
+
+	t->fd = fd;
+	t->rx = t->tx = 1;
+	pthread_mutex_init(&t->lock, NULL);
+	return t;
+}
+
+struct tls *tls_accept(int fd)
+{
+	struct tls *t = tls_alloc(fd);
+
+	t->ssl = SSL_new(ctx);
+	SSL_set_fd(t->ssl, fd);
+	SSL_set_accept_state(t->ssl);
+	return t;
+}
+
+struct tls *tls_client(void)
+{
+	return tls_alloc(-1);
+}
+
+/* the handshake is done: see which ways the kernel took over */
+static void tls_up(struct tls *t)
+{
+	t->up = 1;
+	t->tx = !BIO_get_ktls_send(SSL_get_wbio(t->ssl));
+	t->rx = !BIO_get_ktls_recv(SSL_get_rbio(t->ssl));
+}
+
+/*
+* what an SSL call on @t that returned @ret comes to, in the terms
+* of read() and write(): -1 with EAGAIN for an SSL that waits for the
+* socket, 0 for the peer having hung up, -1 with errno for the rest
+*/
+static ssize_t tls_error(struct tls *t, int ret)
+{
+	int err = SSL_get_error(t->ssl, ret), saved_errno = errno;
+
+	ERR_clear_error();
+	t->want_write = err == SSL_ERROR_WANT_WRITE;
+	switch(err) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return -1;
+	case SSL_ERROR_ZERO_RETURN:
+		return 0;
+	case SSL_ERROR_SYSCALL:
+		errno = saved_errno ? saved_errno : ECONNRESET;
+		return -1;
+	}
+	errno = EPROTO;
+	return -1;
+}
+
+/* wait for the socket of @t to be ready for what the SSL waits for */
+static void tls_poll(struct tls *t)
+{
+	struct pollfd pfd;
+
+	pfd.fd = t->fd;
+	pfd.events = t->want_write ? POLLOUT : POLLIN;
+	poll(&pfd, 1, -1);
+}
+
+/* all @len bytes of @buf, with @t locked */
+static int write_locked(struct tls *t, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while(len > 0) {
+		if(t->tx)
+			n = SSL_write(t->ssl, buf, len);
+		else
+			n = send(t->fd, buf, len, MSG_NOSIGNAL);
+		if(n <= 0 && t->tx)
+			n = tls_error(t, n);
+		if(n < 0 && (errno == EAGAIN || errno == EINTR)) {
+			tls_poll(t);
+			continue;
+		}
+		if(n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* let go of the SSL of @t, with @t locked */
+static void close_locked(struct tls *t)
+{
+	if(t->ssl == NULL)
+		return;
+	/* no close_notify, and the session can still be resumed */
+	SSL_set_shutdown(t->ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(t->ssl);
+	t->ssl = NULL;
+	t->up = t->want_write = 0;
+	t->rx = t->tx = 1;
+}
+
+int tls_connect(struct tls *t, int fd, const void *first, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&t->lock);
+	close_locked(t);
+	if(t->fd >= 0 && t->fd != fd) {
+		dup2(fd, t->fd);
+		close(fd);
+		fd = t->fd;
+	}
+	t->fd = fd;
+	t->ssl = SSL_new(ctx);
+	SSL_set_app_data(t->ssl, t);
+	SSL_set_fd(t->ssl, fd);
+	if(t->ticket)
+		SSL_set_session(t->ssl, t->ticket);
+	ret = SSL_connect(t->ssl);
+	if(ret != 1) {
+		tls_error(t, ret);
+		pthread_mutex_unlock(&t->lock);
+		return -1;
+	}
+	tls_up(t);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	ret = write_locked(t, first, len);
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+void tls_close(struct tls *t)
+{
+	pthread_mutex_lock(&t->lock);
+	close_locked(t);
+	t->fd = -1;
+	pthread_mutex_unlock(&t->lock);
+}
+
+void tls_free(struct tls *t)
+{
+	if(t->ssl) {
+		/* a close_notify if the socket takes it, we wait for none back */
+		if(t->up)
+			SSL_shutdown(t->ssl);
+		ERR_clear_error();
+		SSL_free(t->ssl);
+	}
+	if(t->ticket)
+		SSL_SESSION_free(t->ticket);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+int tls_resumed(struct tls *t)
+{
+	return t->ssl && SSL_session_reused(t->ssl);
+}
+
+int tls_pending(struct tls *t)
+{
+	int n;
+
+	pthread_mutex_lock(&t->lock);
+	n = t->ssl && t->rx ? SSL_pending(t->ssl) : 0;
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
+
+ssize_t tls_ring_read(struct tls *t, struct ringbuf *rb)
+{
+	size_t pos, space, piece;
+	ssize_t n = 0;
+	int ret;
+
+	pthread_mutex_lock(&t->lock);
+	if(t->ssl == NULL) {
+		pthread_mutex_unlock(&t->lock);
+		return 0;
+	}
+	if(!t->up) {
+		ret = SSL_do_handshake(t->ssl);
+		if(ret != 1) {
+			n = tls_error(t, ret);
+			pthread_mutex_unlock(&t->lock);
+			return n;
+		}
+		tls_up(t);
+	}
+	if(!t->rx) {
+		pthread_mutex_unlock(&t->lock);
+		return ring_read(t->fd, rb);
+	}
+	/* record by record, until the socket has no more or the ring is full */
+	while((space = rb->size - (rb->tail - rb->head)) > 0) {
+		pos = rb->tail & (rb->size - 1);
+		piece = rb->size - pos;
+		if(piece > space)
+			piece = space;
+		ret = SSL_read(t->ssl, rb->buf + pos, piece);
+		if(ret <= 0) {
+			if(n == 0)
+				n = tls_error(t, ret);
+			else
+				ERR_clear_error();
+			break;
+		}
+		rb->tail += ret;
+		n += ret;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
+
+ssize_t tls_writev(struct tls *t, const struct iovec *iov, int iovcnt)
+{
+	char rec[TLS_RECORD_MAX];
+	const char *p = rec;
+	size_t len = 0, take;
+	struct msghdr mh;
+	ssize_t n;
+	int i;
+
+	pthread_mutex_lock(&t->lock);
+	if(t->ssl == NULL) {
+		pthread_mutex_unlock(&t->lock);
+		errno = EPIPE;
+		return -1;
+	}
+	if(!t->up) {
+		/* the handshake is on, tls_ring_read() sees it through */
+		pthread_mutex_unlock(&t->lock);
+		errno = EAGAIN;
+		return -1;
+	}
+	if(!t->tx) {
+		pthread_mutex_unlock(&t->lock);
+		memset(&mh, 0, sizeof mh);
+		mh.msg_iov = (struct iovec *)iov;
+		mh.msg_iovlen = iovcnt;
+		return sendmsg(t->fd, &mh, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
+	/*
+	* SSL_write() takes one buffer: the frames are gathered into one
+	* record, as much of them as it holds. A frame larger than a record
+	* goes out on its own, as it is. Should the write not go through, the
+	* next one starts with the same bytes, which is all OpenSSL asks for.
+	*/
+	if(iov[0].iov_len >= sizeof rec) {
+		p = iov[0].iov_base;
+		len = iov[0].iov_len;
+	} else {
+		for(i = 0; i < iovcnt && len < sizeof rec; i++) {
+			take = iov[i].iov_len;
+			if(take > sizeof rec - len)
+				take = sizeof rec - len;
+			memcpy(rec + len, iov[i].iov_base, take);
+			len += take;
+		}
+	}
+	n = SSL_write(t->ssl, p, len);
+	if(n <= 0)
+		n = tls_error(t, n);
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
+
+ssize_t tls_read_wait(struct tls *t, struct ringbuf *rb)
+{
+	ssize_t n;
+
+	for(;;) {
+		n = tls_ring_read(t, rb);
+		if(n >= 0 || (errno != EAGAIN && errno != EINTR))
+			return n;
+		tls_poll(t);
+	}
+}
+
+/*
+* the whole of it, with @t locked all along: a frame must not have
+* another written in the middle of it, nor may a write OpenSSL is
+* halfway through be retried with other bytes
+*/
+int tls_write_wait(struct tls *t, const void *buf, size_t len)
+{
+	int ret;
+
+	pthread_mutex_lock(&t->lock);
+	ret = t->ssl ? write_locked(t, buf, len) : -1;
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
@@ -0,0 +1,85 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <openssl/ssl.h>
+#include "proto.h"
+
+/*
+* TLS for the chat, on top of OpenSSL.
+*
+* The server has its certificate and key in one PEM file (-T), a client
+* trusts the certificate in a PEM file of its own: for a self-signed
+* one, the server's certificate itself.
+*
+* Session tickets: once a client is in, the server hands it a ticket,
+* the secrets of the session sealed with a key only the server knows.
+* A client coming back with it resumes the session, with no certificate
+* and no signature, which is most of what a handshake costs. The server
+* keeps nothing for that, whatever reactor the client lands on. A client
+* keeps the last ticket it got in its struct tls, for the next connection.
+*
+* kTLS: once the handshake is done, OpenSSL hands the keys to the kernel
+* where it can (the tls module is loaded). The kernel then encrypts what
+* is written to the socket and decrypts what is read off it, and the
+* socket is written and read like a plain one: the queue of a client goes
+* out in one sendmsg() right from its frames, with no copy into a record
+* of our own. Whichever way the kernel did not take goes through OpenSSL.
+*
+* Nothing here blocks but tls_connect() and the *_wait()s, the socket is
+* non-blocking from the handshake on: an SSL that is not ready for more
+* says so with -1 and EAGAIN, as the socket would. A struct tls may be
+* used by several threads, one read and one write at a time, @lock sees
+* to that.
+*/
+struct tls {
+	SSL *ssl;
+	int fd;
+	pthread_mutex_t lock;
+	/* the handshake is done */
+	int up;
+	/* it is stuck on a full socket */
+	int want_write;
+	/* reading, writing go through @ssl: there is no kTLS that way */
+	int rx, tx;
+	/* a client's ticket to resume its next connection with */
+	SSL_SESSION *ticket;
+};
+
+int tls_server_init(const char *pem);
+int tls_client_init(const char *ca);
+
+/* the server end of @fd, just accepted. Its handshake is read by tls_ring_read() */
+struct tls *tls_accept(int fd);
+/* the client end of no connection yet, see tls_connect() */
+struct tls *tls_client(void);
+/*
+* the handshake of client @t over @fd, blocking, resuming with the last
+* ticket if there is one. @len bytes of @first are written right after
+* it, before anybody else writes. A connection @t was on before is
+* replaced, and @fd is moved to its fd: whoever knew it knows the new one.
+* returns 0, or -1 if the handshake failed
+*/
+int tls_connect(struct tls *t, int fd, const void *first, size_t len);
+/* @t is done with its connection, which is not closed; the ticket stays */
+void tls_close(struct tls *t);
+void tls_free(struct tls *t);
+/* did the handshake resume a session */
+int tls_resumed(struct tls *t);
+/* bytes read off the socket and decrypted, that a poll() knows nothing of */
+int tls_pending(struct tls *t);
+
+/* ring_read() and sendmsg(), through @t */
+ssize_t tls_ring_read(struct tls *t, struct ringbuf *rb);
+ssize_t tls_writev(struct tls *t, const struct iovec *iov, int iovcnt);
+/* and the ones that wait, for clients */
+ssize_t tls_read_wait(struct tls *t, struct ringbuf *rb);
+int tls_write_wait(struct tls *t, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,223 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+/*
+* The kernel reads what we write to the rings, and we read what it
+* writes, on other cpus: ring indexes are published with release stores
+* and read with acquire loads, so the entries they cover are seen too.
+*/
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static int sys_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/*
+* set up a ring of @entries SQEs for the calling thread.
+* returns 0, or -1 with errno set if io_uring is not to be had
+*/
+int uring_init(struct uring *r, unsigned int entries)
+{
+	struct io_uring_params p;
+	unsigned int *array, i;
+	char *sq, *cq;
+
+	memset(r, 0, sizeof *r);
+	memset(&p, 0, sizeof p);
+	/*
+	* Only this thread submits, and completions need only be processed
+	* when it asks for them, rather than interrupting it at any time
+	*/
+	p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+	r->fd = sys_setup(entries, &p);
+	if(r->fd < 0 && errno == EINVAL) {
+		/* a kernel older than 6.1 */
+		memset(&p, 0, sizeof p);
+		r->fd = sys_setup(entries, &p);
+	}
+	if(r->fd < 0)
+		return -1;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	/* both rings may live in one mapping */
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(r->cq_ring_size > r->sq_ring_size)
+			r->sq_ring_size = r->cq_ring_size;
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if(r->sq_ring == MAP_FAILED)
+		goto fail;
+	r->cq_ring = r->sq_ring;
+	if(!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if(r->cq_ring == MAP_FAILED)
+			goto fail;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if(r->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = r->sq_ring;
+	r->sq_head = (unsigned int *)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	r->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	r->sq_entries = p.sq_entries;
+	/*
+	* The submission ring holds indexes into sqes[]. We use the SQEs
+	* in order, so slot i always points at SQE i.
+	*/
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for(i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+	r->sqe_tail = r->sqe_submitted = *r->sq_tail;
+
+	cq = r->cq_ring;
+	r->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	r->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	return 0;
+fail:
+	close(r->fd);
+	return -1;
+}
+
+/* how many more SQEs uring_sqe() can hand out before a submit */
+unsigned int uring_sq_space(struct uring *r)
+{
+	return r->sq_entries - (r->sqe_tail - load_acquire(r->sq_head));
+}
+
+/*
+* a blank SQE to fill in, it goes to the kernel with the next
+* uring_submit(). Submits what is pending first if the ring is full.
+*/
+struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+	struct io_uring_sqe *sqe;
+
+	if(uring_sq_space(r) == 0)
+		uring_submit(r, 0);
+	sqe = &r->sqes[r->sqe_tail & r->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	r->sqe_tail++;
+	return sqe;
+}
+
+/*
+* hand the kernel every SQE filled in since the last call,
+* and wait until there are at least @wait_nr completions
+*/
+int uring_submit(struct uring *r, unsigned int wait_nr)
+{
+	unsigned int to_submit;
+	int ret;
+
+	store_release(r->sq_tail, r->sqe_tail);
+	to_submit = r->sqe_tail - r->sqe_submitted;
+	do {
+		r->enters++;
+		ret = sys_enter(r->fd, to_submit, wait_nr,
+			wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while(ret < 0 && errno == EINTR);
+	if(ret > 0)
+		r->sqe_submitted += ret;
+	return ret;
+}
+
+/* the oldest completion not yet seen, NULL if there is none */
+struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+	unsigned int head = *r->cq_head;
+
+	if(head == load_acquire(r->cq_tail))
+		return NULL;
+	return &r->cqes[head & r->cq_mask];
+}
+
+/* done with what uring_cqe() returned, the kernel may reuse the slot */
+void uring_cqe_seen(struct uring *r)
+{
+	r->completions++;
+	store_release(r->cq_head, *r->cq_head + 1);
+}
+
+/*
+* register @entries buffers of @size bytes each as buffer group @bgid.
+* @entries has to be a power of two.
+*/
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, unsigned short bgid,
+	unsigned int entries, unsigned int size)
+{
+	struct io_uring_buf_reg reg;
+	unsigned short i;
+
+	/* the kernel wants the ring page aligned, mmap() gives us that */
+	b->br = mmap(NULL, entries * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(b->br == MAP_FAILED)
+		return -1;
+	b->base = mmap(NULL, (size_t)entries * size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(b->base == MAP_FAILED)
+		return -1;
+	b->entries = entries;
+	b->size = size;
+	b->bgid = bgid;
+	b->tail = 0;
+
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (unsigned long)b->br;
+	reg.ring_entries = entries;
+	reg.bgid = bgid;
+	if(sys_register(r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+		return -1;
+	for(i = 0; i < entries; i++)
+		uring_buf_recycle(b, i);
+	return 0;
+}
+
+char *uring_buf(struct uring_bufs *b, unsigned short bid)
+{
+	return b->base + (size_t)bid * b->size;
+}
+
+/* give buffer @bid back to the kernel */
+void uring_buf_recycle(struct uring_bufs *b, unsigned short bid)
+{
+	struct io_uring_buf *buf = &b->br->bufs[b->tail & (b->entries - 1)];
+
+	buf->addr = (unsigned long)uring_buf(b, bid);
+	buf->len = b->size;
+	buf->bid = bid;
+	b->tail++;
+	/* the ring's tail sits where the first buffer's resv field is */
+	store_release(&b->br->tail, b->tail);
+}
@@ -0,0 +1,62 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+/*
+* Just enough io_uring, straight on top of the syscalls.
+*
+* An io_uring is a pair of rings shared with the kernel: we put requests
+* (SQEs) on the submission ring and the kernel puts their results (CQEs)
+* on the completion ring. One io_uring_enter() both hands the kernel any
+* number of new requests and waits for results, so a reactor makes one
+* syscall per round however many sockets it reads and writes.
+*
+* A ring belongs to the thread that set it up, nobody else touches it.
+*/
+struct uring {
+	int fd;
+	/* submission ring, shared with the kernel */
+	unsigned int *sq_head, *sq_tail, sq_mask, sq_entries;
+	struct io_uring_sqe *sqes;
+	/* SQEs handed out by uring_sqe(), and how many of them were submitted */
+	unsigned int sqe_tail, sqe_submitted;
+	/* completion ring, shared with the kernel */
+	unsigned int *cq_head, *cq_tail, cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	/* io_uring_enter() calls and completions seen, for the stats */
+	unsigned long enters, completions;
+};
+
+/*
+* A ring of buffers provided to the kernel for a buffer group.
+* A recv that says "pick a buffer from group @bgid" is handed one of these
+* when data arrives, rather than pinning a buffer of its own while it waits.
+* The CQE tells which buffer was picked, it is given back once consumed.
+*/
+struct uring_bufs {
+	struct io_uring_buf_ring *br;
+	char *base;
+	unsigned int entries, size;
+	unsigned short bgid, tail;
+};
+
+int uring_init(struct uring *r, unsigned int entries);
+struct io_uring_sqe *uring_sqe(struct uring *r);
+unsigned int uring_sq_space(struct uring *r);
+int uring_submit(struct uring *r, unsigned int wait_nr);
+struct io_uring_cqe *uring_cqe(struct uring *r);
+void uring_cqe_seen(struct uring *r);
+
+int uring_bufs_init(struct uring *r, struct uring_bufs *b, unsigned short bgid,
+	unsigned int entries, unsigned int size);
+char *uring_buf(struct uring_bufs *b, unsigned short bid);
+void uring_buf_recycle(struct uring_bufs *b, unsigned short bid);
+
+#endif
@@ -0,0 +1,319 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "p2p.h"
+
+int p2p_init(struct p2p *p, unsigned short port)
+{
+	struct sockaddr_in addr;
+	struct epoll_event ev;
+	socklen_t len = sizeof addr;
+	int one = 1, i;
+
+	memset(p, 0, sizeof *p);
+	for(i = 0; i < P2P_HELLOS; i++)
+		p->hellos[i].fd = -1;
+	p->listenfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(p->listenfd < 0)
+		return -1;
+	setsockopt(p->listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	if(bind(p->listenfd, (struct sockaddr *)&addr, sizeof addr) < 0
+		|| listen(p->listenfd, SOMAXCONN) < 0
+		|| getsockname(p->listenfd, (struct sockaddr *)&addr, &len) < 0) {
+		close(p->listenfd);
+		return -1;
+	}
+	/* with a port of 0, the kernel picked one */
+	p->port = ntohs(addr.sin_port);
+	p->fd = epoll_create1(EPOLL_CLOEXEC);
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(p->fd, EPOLL_CTL_ADD, p->listenfd, &ev);
+	return 0;
+}
+
+void p2p_free(struct p2p *p)
+{
+	int i;
+
+	for(i = 0; i < P2P_WAITING; i++)
+		if(p->waiting[i].used && p->waiting[i].fd >= 0)
+			close(p->waiting[i].fd);
+	for(i = 0; i < P2P_HELLOS; i++)
+		if(p->hellos[i].fd >= 0)
+			close(p->hellos[i].fd);
+	close(p->listenfd);
+	close(p->fd);
+}
+
+int p2p_addr(const char *s, struct sockaddr_in *addr)
+{
+	char ip[INET_ADDRSTRLEN];
+	const char *colon = strchr(s, ':');
+
+	if(colon == NULL || colon - s >= (int)sizeof ip)
+		return -1;
+	memcpy(ip, s, colon - s);
+	ip[colon - s] = '\0';
+	memset(addr, 0, sizeof *addr);
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(atoi(colon + 1));
+	return inet_pton(AF_INET, ip, &addr->sin_addr) == 1 ? 0 : -1;
+}
+
+/*
+* the nonce a peer says against the one the server gave us for it.
+* Whoever can reach our port may knock: no early return, so the time
+* a knock takes does not give away the right nonce a byte at a time
+*/
+static int nonce_match(const char *a, const char *b)
+{
+	unsigned char diff = 0;
+	int i;
+
+	for(i = 0; i < P2P_NONCE_MAX; i++)
+		diff |= a[i] ^ b[i];
+	return diff == 0;
+}
+
+/* the name and the nonce, each padded out, into @hello */
+static void pad(char *hello, const char *name, const char *nonce)
+{
+	memset(hello, 0, P2P_HELLO_SIZE);
+	strncpy(hello, name, P2P_NAME_MAX - 1);
+	strncpy(hello + P2P_NAME_MAX, nonce, P2P_NONCE_MAX);
+}
+
+/* a free slot, or else the oldest taken, and whatever link it held is gone */
+static struct p2p_waiting *take_slot(struct p2p *p)
+{
+	struct p2p_waiting *w = NULL;
+	int i;
+
+	for(i = 0; i < P2P_WAITING; i++) {
+		if(!p->waiting[i].used)
+			break;
+		if(w == NULL || p->waiting[i].seq < w->seq)
+			w = &p->waiting[i];
+	}
+	if(i < P2P_WAITING)
+		w = &p->waiting[i];
+	else if(w->fd >= 0)
+		close(w->fd);
+	w->used = 1;
+	w->seq = p->seq++;
+	return w;
+}
+
+/*
+* the slot of @hello's name and nonce, holding a link with @link set,
+* else an introduction. NULL if there is none
+*/
+static struct p2p_waiting *find_slot(struct p2p *p, const char *hello, int link)
+{
+	struct p2p_waiting *w;
+	int i;
+
+	for(i = 0; i < P2P_WAITING; i++) {
+		w = &p->waiting[i];
+		if(w->used && (w->fd >= 0) == link
+			&& strncmp(w->name, hello, P2P_NAME_MAX) == 0
+			&& nonce_match(w->nonce, hello + P2P_NAME_MAX))
+			return w;
+	}
+	return NULL;
+}
+
+static void set_nodelay(int fd)
+{
+	int one = 1;
+
+	/* chat msgs are small, and nobody is to wait for the next one */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+}
+
+int p2p_dial(const struct sockaddr_in *addr, const char *me, const char *nonce)
+{
+	char hello[P2P_HELLO_SIZE];
+	struct pollfd pfd;
+	socklen_t len;
+	int fd, err = 0;
+
+	fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0)
+		return -1;
+	/*
+	* a blocking connect() to somebody behind a firewall that drops
+	* the SYN waits minutes, we would rather go through the server
+	*/
+	if(connect(fd, (struct sockaddr *)addr, sizeof *addr) < 0) {
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		len = sizeof err;
+		if(errno != EINPROGRESS || poll(&pfd, 1, P2P_DIAL_MS) != 1
+			|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+			close(fd);
+			return -1;
+		}
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	set_nodelay(fd);
+	pad(hello, me, nonce);
+	if(send(fd, hello, sizeof hello, MSG_NOSIGNAL) != sizeof hello) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* hang up on a link whose hello did not come, or not in time */
+static void hello_drop(struct p2p *p, struct p2p_hello *h)
+{
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, h->fd, NULL);
+	close(h->fd);
+	h->fd = -1;
+}
+
+/* take in every link waiting, a free slot for each, or the oldest's */
+static void hello_accept(struct p2p *p)
+{
+	struct p2p_hello *h;
+	struct epoll_event ev;
+	int fd, i;
+
+	while((fd = accept4(p->listenfd, NULL, NULL,
+		SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		for(h = NULL, i = 0; i < P2P_HELLOS; i++) {
+			if(p->hellos[i].fd < 0) {
+				h = &p->hellos[i];
+				break;
+			}
+			if(h == NULL || p->hellos[i].deadline < h->deadline)
+				h = &p->hellos[i];
+		}
+		if(h->fd >= 0)
+			hello_drop(p, h);
+		h->fd = fd;
+		h->got = 0;
+		/* the hello follows the connect right away, or never */
+		h->deadline = now_ms() + P2P_HELLO_MS;
+		ev.events = EPOLLIN;
+		ev.data.ptr = h;
+		epoll_ctl(p->fd, EPOLL_CTL_ADD, fd, &ev);
+	}
+}
+
+/*
+* read what there is of the hello of @h.
+* returns the link once all of it is in, as blocking as a dialed one,
+* -1 while it is not, or if it is no hello
+*/
+static int hello_read(struct p2p *p, struct p2p_hello *h)
+{
+	ssize_t n;
+	int fd;
+
+	n = recv(h->fd, h->hello + h->got, P2P_HELLO_SIZE - h->got, 0);
+	if(n < 0 && (errno == EAGAIN || errno == EINTR))
+		return -1;
+	if(n <= 0) {
+		hello_drop(p, h);
+		return -1;
+	}
+	h->got += n;
+	if(h->got < P2P_HELLO_SIZE)
+		return -1;
+	fd = h->fd;
+	epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, NULL);
+	h->fd = -1;
+	if(memchr(h->hello, '\0', P2P_NAME_MAX) == NULL) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	set_nodelay(fd);
+	return fd;
+}
+
+int p2p_accept(struct p2p *p, char *name)
+{
+	struct p2p_waiting *w;
+	struct p2p_hello *h;
+	struct epoll_event ev;
+	char *hello;
+	long now = now_ms();
+	int fd = -1, i;
+
+	for(i = 0; i < P2P_HELLOS; i++)
+		if(p->hellos[i].fd >= 0 && p->hellos[i].deadline <= now)
+			hello_drop(p, &p->hellos[i]);
+	while(fd < 0 && epoll_wait(p->fd, &ev, 1, 0) == 1) {
+		if(ev.data.ptr == NULL) {
+			hello_accept(p);
+			continue;
+		}
+		h = ev.data.ptr;
+		fd = hello_read(p, h);
+	}
+	if(fd < 0)
+		return -1;
+	hello = h->hello;
+
+	w = find_slot(p, hello, 0);
+	if(w) {
+		w->used = 0;
+		strcpy(name, hello);
+		return fd;
+	}
+	/* the server has not told us about it yet */
+	w = take_slot(p);
+	memcpy(w->name, hello, P2P_NAME_MAX);
+	memcpy(w->nonce, hello + P2P_NAME_MAX, P2P_NONCE_MAX);
+	w->fd = fd;
+	return -1;
+}
+
+int p2p_expect(struct p2p *p, const char *name, const char *nonce)
+{
+	char hello[P2P_HELLO_SIZE];
+	struct p2p_waiting *w;
+
+	pad(hello, name, nonce);
+	w = find_slot(p, hello, 1);
+	if(w) {
+		w->used = 0;
+		return w->fd;
+	}
+	w = take_slot(p);
+	memcpy(w->name, hello, P2P_NAME_MAX);
+	memcpy(w->nonce, hello + P2P_NAME_MAX, P2P_NONCE_MAX);
+	w->fd = -1;
+	return -1;
+}
@@ -0,0 +1,104 @@
+/*
+* Author:  Arjun Sreedharan
+* License: GPL version 2 or higher http://www.gnu.org/licenses/gpl.html
+*/
+#ifndef P2P_H
+#define P2P_H
+
+#include <netinet/in.h>
+
+/*
+* Direct links between two clients of a server that introduced them.
+*
+* A client that takes direct links listens on a port of its own and tells
+* the server. When another client wants to talk to it directly, it asks
+* the server, which makes up a nonce, a random secret, and hands it to
+* both: to the one that asked along with the address to dial, and to the
+* other with the name of who is going to dial. The dialer then starts the
+* link with a hello of its name and the nonce; the other end only takes
+* a link whose hello matches an introduction of the server's. Nobody
+* can pass for somebody else that way, without having been introduced.
+*
+* The introduction and the link come over different connections, so
+* either may come first: a link whose introduction is not in yet is held
+* until it is, and the introduction is kept until the link comes.
+* Whatever goes over a link once it is up is the business of the clients.
+*
+* Links are taken in by the thread that reads the server's connection,
+* so nothing here ever waits for a hello: it is read as it comes in,
+* bit by bit if need be, and one that does not come in time is hung up on.
+*/
+
+/* the hello is the name and the nonce, each '\0' padded to these */
+#define P2P_NAME_MAX 20
+#define P2P_NONCE_MAX 32
+#define P2P_HELLO_SIZE (P2P_NAME_MAX + P2P_NONCE_MAX)
+/* introductions and links waiting for each other, the oldest go first */
+#define P2P_WAITING 32
+/* how long to wait for a dial to go through, and for a hello to come in */
+#define P2P_DIAL_MS 1000
+#define P2P_HELLO_MS 1000
+/* msgs to somebody through the server before asking for a direct link */
+#define P2P_HEAVY 16
+/* links accepted whose hello is still coming in, the oldest go first */
+#define P2P_HELLOS 16
+
+struct p2p_waiting {
+	char name[P2P_NAME_MAX];
+	char nonce[P2P_NONCE_MAX];
+	/* a link that said hello, -1 for an introduction without one yet */
+	int fd;
+	/* the slot is taken, and since when, to tell the oldest */
+	int used;
+	unsigned long seq;
+};
+
+/* a link accepted, @got bytes of its hello in, -1 for a free slot */
+struct p2p_hello {
+	int fd;
+	size_t got;
+	char hello[P2P_HELLO_SIZE];
+	/* the CLOCK_MONOTONIC ms it is hung up on at, if it is not in yet */
+	long deadline;
+};
+
+struct p2p {
+	/*
+	* an epoll instance of the listening socket and of the links whose
+	* hello is coming in: readable when there is something for
+	* p2p_accept() to do
+	*/
+	int fd;
+	int listenfd;
+	unsigned short port;
+	struct p2p_waiting waiting[P2P_WAITING];
+	unsigned long seq;
+	struct p2p_hello hellos[P2P_HELLOS];
+};
+
+/* listen on @port, 0 for any. returns 0, or -1 */
+int p2p_init(struct p2p *p, unsigned short port);
+void p2p_free(struct p2p *p);
+/* "<ip>:<port>" into @addr. returns 0, or -1 if it is no such thing */
+int p2p_addr(const char *s, struct sockaddr_in *addr);
+/*
+* dial the client at @addr as @me, introduced with @nonce.
+* returns the link, a blocking socket, or -1
+*/
+int p2p_dial(const struct sockaddr_in *addr, const char *me, const char *nonce);
+/*
+* take in links off the listening socket, and whatever came of their
+* hellos, without waiting for any. Call it whenever @p->fd is readable,
+* until it returns -1.
+* returns a link whose hello is in, with the name of who is at the
+* other end in @name, or -1 once there is none: the others have to wait
+* for their hello or their introduction yet, or are none of ours
+*/
+int p2p_accept(struct p2p *p, char *name);
+/*
+* the server introduced us to @name, with @nonce. returns the link if
+* it came already, else -1 and it is waited for
+*/
+int p2p_expect(struct p2p *p, const char *name, const char *nonce);
+
+#endif